@@ -0,0 +1,243 @@
+//**************************************************
+// db_bench: Database microbenchmarks on generated data
+//
+//   db_bench --sizes 10000,100000,1000000 --library 100000 --dir /tmp
+//
+//   For each size: a scratch db (on disk, in --dir) whose one user has that many
+//   highlights, half of them on one book, built through Database itself. Then, timed:
+//
+//     since/full      every page of listUserHighlightsSince from 0 (--page rows each)
+//     since/mid       one page from a cursor half way through
+//     since/legacy    one page from a bare "since" timestamp half way through
+//     since/tail      from the end cursor: nothing new (the high-water mark answers)
+//     deleteAll/heavy softDeleteUserHighlightAll on the annotated book (rolled back each time)
+//     lookup/hit      lookupFileIdByHashSize of books in the library
+//     lookup/miss     ... of content the library doesn't have
+//
+//   and prints n, mean, p50, p99 and max per operation, in microseconds.
+//**************************************************
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include <sqlite3.h>
+#include <sodium.h>
+
+#include "Database.h"
+#include "JsonWriter.h"
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    std::vector<long long> sizes = { 10000, 100000, 1000000 };
+    long long   library = 100000;       // rows in "books"
+    std::string dir     = "/tmp";
+    int         page    = 1000;         // /getSince limit (its ceiling)
+    int         reps    = 20;
+    bool        keep    = false;        // leave the scratch dbs behind
+};
+
+const char* const USER   = "bench";
+const int         BOOKS  = 20;          // the user's books: "book0" carries half the highlights
+const long long   T0     = 1700000000000LL;
+
+[[noreturn]] void die(const std::string& msg) {
+    std::fprintf(stderr, "db_bench: %s\n", msg.c_str());
+    std::exit(1);
+}
+
+Options parseArgs(int argc, char* argv[]) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (a == "--keep") { o.keep = true; continue; }
+        if (i + 1 >= argc) die("missing value for " + a);
+        const std::string v = argv[++i];
+        if (a == "--sizes") {
+            o.sizes.clear();
+            size_t pos = 0;
+            while (pos < v.size()) {
+                size_t comma = v.find(',', pos);
+                if (comma == std::string::npos) comma = v.size();
+                o.sizes.push_back(std::max(1LL, std::atoll(v.substr(pos, comma - pos).c_str())));
+                pos = comma + 1;
+            }
+        }
+        else if (a == "--library") o.library = std::max(1LL, std::atoll(v.c_str()));
+        else if (a == "--dir")     o.dir = v;
+        else if (a == "--page")    o.page = std::max(1, std::atoi(v.c_str()));
+        else if (a == "--reps")    o.reps = std::max(1, std::atoi(v.c_str()));
+        else die("unknown option " + a);
+    }
+    return o;
+}
+
+struct Stats {
+    std::vector<double> us;
+
+    template <typename Fn> void time(Fn&& fn) {
+        const auto start = Clock::now();
+        fn();
+        us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+
+    void print(const char* op, long long size) {
+        if (us.empty()) return;
+        std::sort(us.begin(), us.end());
+        double sum = 0;
+        for (double v : us) sum += v;
+        auto at = [&](double p) { return us[std::min(us.size() - 1, static_cast<size_t>(p * us.size()))]; };
+        std::printf("%-16s %9lld %7zu %11.1f %11.1f %11.1f %11.1f\n", op, size, us.size(),
+                    sum / us.size(), at(0.50), at(0.99), us.back());
+    }
+};
+
+std::string hexOf(uint64_t a, uint64_t b) {
+    unsigned char bin[32];
+    for (int i = 0; i < 8; ++i) { bin[i] = static_cast<unsigned char>(a >> (8 * i)); bin[8 + i] = static_cast<unsigned char>(b >> (8 * i)); }
+    for (int i = 16; i < 32; ++i) bin[i] = static_cast<unsigned char>(i);
+    char hex[65];
+    sodium_bin2hex(hex, sizeof hex, bin, sizeof bin);
+    return hex;
+}
+
+// the users row (Database doesn't write users: tools/add_user does)
+void addUser(const std::string& path) {
+    sqlite3* db = nullptr;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) die("sqlite open failed");
+    sqlite3_busy_timeout(db, 5000);
+    char* err = nullptr;
+    if (sqlite3_exec(db, "INSERT OR REPLACE INTO users(username, pwd_hash, created_at) "
+                         "VALUES('bench', 'x', strftime('%s','now'))", nullptr, nullptr, &err) != SQLITE_OK)
+        die(std::string("insert user: ") + (err ? err : "?"));
+    sqlite3_close(db);
+}
+
+struct Library {
+    std::vector<std::pair<std::string, long long>> content;     // (sha256, size) of every book
+};
+
+// books rows, then `n` highlights for USER (ids 1..n), committed in large batches
+Library populate(Database& db, const Options& o, long long n) {
+    Library lib;
+    std::mt19937_64 rng(42);
+
+    const long long BATCH = 50000;
+    for (long long i = 0; i < o.library; i += BATCH) {
+        Database::WriteTxn txn(db);
+        for (long long k = i; k < std::min(o.library, i + BATCH); ++k) {
+            const std::string fileId = (k < BOOKS) ? "book" + std::to_string(k) : "lib" + std::to_string(k);
+            const std::string sha = hexOf(rng(), rng());
+            const long long size = 100000 + static_cast<long long>(rng() % 10000000);
+            db.insertBookRecord(fileId, sha, size, "/nonexistent/" + fileId, fileId + ".epub", T0);
+            lib.content.emplace_back(sha, size);
+        }
+        txn.commit();
+    }
+
+    const std::string sel = "{\"start\":1200,\"end\":1290,\"text\":\"a highlighted passage of a typical length\"}";
+    for (long long i = 0; i < n; i += BATCH) {
+        Database::WriteTxn txn(db);
+        for (long long k = i; k < std::min(n, i + BATCH); ++k) {
+            const int book = (k % 2 == 0) ? 0 : 1 + static_cast<int>(rng() % (BOOKS - 1));
+            db.insertUserHighlight(USER, "book" + std::to_string(book), k + 1, sel, "", "yellow", true, T0 + k);
+        }
+        txn.commit();
+    }
+    return lib;
+}
+
+void runSize(const Options& o, long long n) {
+    const std::string path = o.dir + "/db_bench_" + std::to_string(::getpid()) + "_" + std::to_string(n) + ".db";
+    auto dbp = Database::create();
+    Database& db = *dbp;
+    db.open(path, 2);
+    addUser(path);
+
+    const auto t0 = Clock::now();
+    const Library lib = populate(db, o, n);
+    std::fprintf(stderr, "  %lld highlights + %lld books generated in %.1fs\n", n, o.library,
+                 std::chrono::duration<double>(Clock::now() - t0).count());
+
+    auto page = [&](const Database::Cursor& after, Database::Cursor& next) {
+        JsonWriter w;
+        w.beginArray();
+        long long nextSince = after.ts;
+        const bool more = db.listUserHighlightsSince(USER, after, o.page, w, next, nextSince);
+        w.endArray();
+        return more;
+    };
+
+    // since/full: every page, as a new device's first sync
+    Stats full;
+    Database::Cursor cur, end, mid;
+    long long pages = 0;
+    for (bool more = true; more; ++pages) {
+        Database::Cursor next;
+        full.time([&]{ more = page(cur, next); });
+        cur = next;
+        if (pages == n / o.page / 2) mid = cur;
+    }
+    end = cur;
+    full.print("since/full", n);
+
+    Stats midS, legacy, tail;
+    for (int r = 0; r < o.reps; ++r) {
+        Database::Cursor next;
+        midS.time([&]{ page(mid, next); });
+        Database::Cursor since;
+        since.ts = T0 + n / 2;
+        legacy.time([&]{ page(since, next); });
+        tail.time([&]{ page(end, next); });
+    }
+    midS.print("since/mid", n);
+    legacy.print("since/legacy", n);
+    tail.print("since/tail", n);
+
+    // deleteAll/heavy: half the rows are on book0
+    Stats del;
+    for (int r = 0; r < std::max(1, o.reps / 4); ++r) {
+        Database::WriteTxn txn(db);
+        del.time([&]{ db.softDeleteUserHighlightAll(USER, "book0", T0 + n + r); });
+        // no commit: rolled back, so every rep deletes the same rows
+    }
+    del.print("deleteAll/heavy", n);
+
+    Stats hit, miss;
+    std::mt19937_64 rng(7);
+    for (int r = 0; r < o.reps * 500; ++r) {
+        const auto& c = lib.content[rng() % lib.content.size()];
+        hit.time([&]{ if (db.lookupFileIdByHashSize(c.first, c.second).empty()) die("lookup missed a stored book"); });
+        const std::string sha = hexOf(rng(), rng());
+        miss.time([&]{ db.lookupFileIdByHashSize(sha, 12345); });
+    }
+    hit.print("lookup/hit", o.library);
+    miss.print("lookup/miss", o.library);
+
+    db.close();
+    if (!o.keep) {
+        for (const char* suffix : { "", "-wal", "-shm" })
+            std::remove((path + suffix).c_str());
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const Options o = parseArgs(argc, argv);
+    if (sodium_init() < 0) die("libsodium init failed");
+
+    std::printf("%-16s %9s %7s %11s %11s %11s %11s\n", "op", "size", "n", "mean us", "p50 us", "p99 us", "max us");
+    for (long long n : o.sizes) {
+        std::fprintf(stderr, "size %lld\n", n);
+        runSize(o, n);
+    }
+    return 0;
+}
@@ -0,0 +1,423 @@
+//**************************************************
+// sync_load: end-to-end load generator for a running simplereaderd
+//
+//   sync_load --db /var/lib/simplereader/app.db --url http://127.0.0.1:9000 \
+//             --users 50 --threads 8 --seconds 60 \
+//             --mix update=40,getSince=30,check=15,delete=2,upload=3,book=10
+//
+//   1. provisions users bench_0 .. bench_<N-1> straight into the daemon's db
+//      (the same "users" row tools/add_user writes)
+//   2. logs each one in, uploads a book for it and opens it (/update "books")
+//   3. each thread is one device: a keep-alive connection replaying the mix
+//      against its share of the users, for --seconds
+//   4. prints, per endpoint: requests, errors, requests/s and p50/p99/p999 latency
+//
+//   Ops:  update    a burst of highlight rows in one /update batch (--burst rows)
+//         getSince  one page of highlights from this device's cursor; now and then
+//                   it starts again from 0 and pages through everything
+//         check     a batched /check of rows it wrote
+//         delete    /delete of the user's book: tombstones every annotation in it
+//         upload    /uploadBook of a new --upload-kb book
+//         book      GET /book/{fileId} of the user's book
+//**************************************************
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include <drogon/drogon.h>
+#include <trantor/net/EventLoopThread.h>
+#include <sqlite3.h>
+#include <sodium.h>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+enum Op { Update, GetSince, Check, Delete, Upload, Book, OP_COUNT };
+const char* const kOpNames[OP_COUNT] = { "update", "getSince", "check", "delete", "upload", "book" };
+
+struct Options {
+    std::string db       = "/var/lib/simplereader/app.db";
+    std::string url      = "http://127.0.0.1:9000";
+    std::string password = "bench-password";
+    std::string compat   = "2.0.0";         // must match the daemon's compat=
+    std::string tmpDir   = "/tmp";
+    int users     = 20;
+    int threads   = 4;
+    int seconds   = 30;
+    int burst     = 20;                     // rows per /update
+    int pageSize  = 100;                    // /getSince limit
+    int checkKeys = 50;
+    int bookKb    = 256;                    // each user's book
+    int uploadKb  = 64;                     // each "upload" op
+    int mix[OP_COUNT] = { 40, 30, 15, 2, 3, 10 };
+};
+
+struct User {
+    std::string name;
+    std::string token;
+    std::string fileId;
+    long long   nextId = 1;                 // next highlight id
+    Json::Value cursor;                     // this device's /getSince cursor (null: from 0)
+};
+
+// per thread: latencies in microseconds, by op
+struct Samples {
+    std::vector<uint32_t> us[OP_COUNT];
+    size_t errors[OP_COUNT] = {};
+};
+
+[[noreturn]] void die(const std::string& msg) {
+    std::fprintf(stderr, "sync_load: %s\n", msg.c_str());
+    std::exit(1);
+}
+
+bool parseMix(const std::string& s, int mix[OP_COUNT]) {
+    std::fill(mix, mix + OP_COUNT, 0);
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        const std::string item = s.substr(pos, comma - pos);
+        const size_t eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        const std::string name = item.substr(0, eq);
+        int i = 0;
+        while (i < OP_COUNT && name != kOpNames[i]) ++i;
+        if (i == OP_COUNT) return false;
+        mix[i] = std::max(0, std::atoi(item.c_str() + eq + 1));
+        pos = comma + 1;
+    }
+    return std::any_of(mix, mix + OP_COUNT, [](int w){ return w > 0; });
+}
+
+Options parseArgs(int argc, char* argv[]) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (i + 1 >= argc) die("missing value for " + a);
+        const std::string v = argv[++i];
+        if      (a == "--db")         o.db = v;
+        else if (a == "--url")        o.url = v;
+        else if (a == "--password")   o.password = v;
+        else if (a == "--compat")     o.compat = v;
+        else if (a == "--tmp")        o.tmpDir = v;
+        else if (a == "--users")      o.users = std::max(1, std::atoi(v.c_str()));
+        else if (a == "--threads")    o.threads = std::max(1, std::atoi(v.c_str()));
+        else if (a == "--seconds")    o.seconds = std::max(1, std::atoi(v.c_str()));
+        else if (a == "--burst")      o.burst = std::max(1, std::atoi(v.c_str()));
+        else if (a == "--page")       o.pageSize = std::max(1, std::atoi(v.c_str()));
+        else if (a == "--check-keys") o.checkKeys = std::max(1, std::atoi(v.c_str()));
+        else if (a == "--book-kb")    o.bookKb = std::max(1, std::atoi(v.c_str()));
+        else if (a == "--upload-kb")  o.uploadKb = std::max(1, std::atoi(v.c_str()));
+        else if (a == "--mix") { if (!parseMix(v, o.mix)) die("bad --mix " + v); }
+        else die("unknown option " + a);
+    }
+    return o;
+}
+
+long long nowMs(void) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// the users rows, as tools/add_user writes them. All share one password hash:
+// Argon2id per user would make provisioning the slow part of the run.
+void provisionUsers(const Options& o) {
+    char hash[crypto_pwhash_STRBYTES];
+    if (crypto_pwhash_str(hash, o.password.c_str(), o.password.size(),
+                          crypto_pwhash_OPSLIMIT_INTERACTIVE, crypto_pwhash_MEMLIMIT_INTERACTIVE) != 0)
+        die("crypto_pwhash_str failed");
+
+    sqlite3* db = nullptr;
+    if (sqlite3_open(o.db.c_str(), &db) != SQLITE_OK)
+        die(std::string("sqlite open failed: ") + sqlite3_errmsg(db));
+    sqlite3_busy_timeout(db, 5000);
+    sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS users ("
+                     "  username   TEXT PRIMARY KEY,"
+                     "  pwd_hash   TEXT NOT NULL,"
+                     "  created_at INTEGER NOT NULL);", nullptr, nullptr, nullptr);
+
+    sqlite3_stmt* st = nullptr;
+    sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO users(username, pwd_hash, created_at) "
+                           "VALUES(?, ?, strftime('%s','now'))", -1, &st, nullptr);
+    sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
+    for (int i = 0; i < o.users; ++i) {
+        const std::string name = "bench_" + std::to_string(i);
+        sqlite3_bind_text(st, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(st, 2, hash, -1, SQLITE_STATIC);
+        if (sqlite3_step(st) != SQLITE_DONE)
+            die(std::string("insert failed: ") + sqlite3_errmsg(db));
+        sqlite3_reset(st);
+    }
+    sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
+    sqlite3_finalize(st);
+    sqlite3_close(db);
+}
+
+// one device: a keep-alive connection, driven synchronously from the calling thread
+class Device {
+public:
+    explicit Device(const std::string& url) {
+        loop_.run();
+        client_ = drogon::HttpClient::newHttpClient(url, loop_.getLoop());
+    }
+
+    // nullptr on a transport error
+    drogon::HttpResponsePtr send(const drogon::HttpRequestPtr& req) {
+        auto [res, resp] = client_->sendRequest(req, 60.0);
+        return (res == drogon::ReqResult::Ok) ? resp : nullptr;
+    }
+
+    // POST json; true if it came back 200 with "ok":true
+    bool post(const std::string& path, const std::string& token, const Json::Value& body, Json::Value* out = nullptr) {
+        auto req = drogon::HttpRequest::newHttpJsonRequest(body);
+        req->setMethod(drogon::Post);
+        req->setPath(path);
+        if (!token.empty()) req->addHeader("Authorization", "Bearer " + token);
+        auto resp = send(req);
+        if (!resp || resp->getStatusCode() != drogon::k200OK) return false;
+        auto j = resp->getJsonObject();
+        if (!j || !(*j)["ok"].asBool()) return false;
+        if (out) *out = *j;
+        return true;
+    }
+
+private:
+    trantor::EventLoopThread  loop_;
+    drogon::HttpClientPtr     client_;
+};
+
+// a file of random bytes (unique content: a new book to the server); returns its sha256
+std::string makeBook(const std::string& path, size_t bytes, std::mt19937_64& rng) {
+    std::vector<unsigned char> buf(bytes);
+    for (size_t i = 0; i < bytes; i += 8) {
+        const uint64_t r = rng();
+        std::memcpy(&buf[i], &r, std::min<size_t>(8, bytes - i));
+    }
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(buf.data()), buf.size());
+
+    unsigned char h[crypto_hash_sha256_BYTES];
+    crypto_hash_sha256(h, buf.data(), buf.size());
+    char hex[crypto_hash_sha256_BYTES * 2 + 1];
+    sodium_bin2hex(hex, sizeof hex, h, sizeof h);
+    return hex;
+}
+
+// /uploadBook a fresh book; its fileId, or "" on failure
+std::string uploadBook(Device& dev, const User& u, const Options& o, size_t kb, std::mt19937_64& rng) {
+    const std::string path = o.tmpDir + "/sync_load_" + std::to_string(::getpid()) + "_" +
+                             std::to_string(rng()) + ".epub";
+    const size_t bytes = kb * 1024;
+    const std::string sha = makeBook(path, bytes, rng);
+
+    auto req = drogon::HttpRequest::newFileUploadRequest({drogon::UploadFile(path, "book.epub", "file")});
+    req->setMethod(drogon::Post);
+    req->setPath("/uploadBook");
+    req->addHeader("Authorization", "Bearer " + u.token);
+    req->setParameter("fileId", "0");
+    req->setParameter("sha256", sha);
+    req->setParameter("size", std::to_string(bytes));
+    req->setParameter("fileName", "book.epub");
+    auto resp = dev.send(req);
+    std::remove(path.c_str());
+
+    if (!resp || resp->getStatusCode() != drogon::k200OK) return "";
+    auto j = resp->getJsonObject();
+    return (j && (*j)["ok"].asBool()) ? (*j)["fileId"].asString() : "";
+}
+
+bool openBook(Device& dev, const User& u) {
+    Json::Value b;
+    b["table"] = "books";
+    b["row"]["fileId"] = u.fileId;
+    b["row"]["updatedAt"] = static_cast<Json::Int64>(nowMs());
+    b["row"]["progress"] = "{\"page\":1}";
+    return dev.post("/update", u.token, b);
+}
+
+void setUp(Device& dev, User& u, const Options& o, std::mt19937_64& rng) {
+    Json::Value login;
+    login["username"] = u.name;
+    login["password"] = o.password;
+    login["version"]  = o.compat;
+    login["device"]   = "sync_load";
+    Json::Value j;
+    if (!dev.post("/login", "", login, &j)) die("login failed for " + u.name + " (is --compat right?)");
+    u.token = j["token"].asString();
+
+    u.fileId = uploadBook(dev, u, o, static_cast<size_t>(o.bookKb), rng);
+    if (u.fileId.empty()) die("uploadBook failed for " + u.name);
+    if (!openBook(dev, u)) die("update (books) failed for " + u.name);
+}
+
+// one op against one user; false if it failed
+bool runOp(Op op, Device& dev, User& u, const Options& o, std::mt19937_64& rng) {
+    switch (op) {
+        case Update: {
+            Json::Value b;
+            Json::Value& rows = b["rows"];
+            rows = Json::Value(Json::arrayValue);
+            const long long ts = nowMs();
+            for (int i = 0; i < o.burst; ++i) {
+                Json::Value r;
+                r["table"] = "highlight";
+                r["row"]["fileId"]    = u.fileId;
+                // mostly new rows, some edits of earlier ones
+                r["row"]["id"]        = static_cast<Json::Int64>((rng() % 4 == 0 && u.nextId > 1)
+                                                                ? 1 + static_cast<long long>(rng() % u.nextId)
+                                                                : u.nextId++);
+                r["row"]["selection"] = "{\"start\":120,\"end\":180,\"text\":\"a highlighted passage of the book\"}";
+                r["row"]["label"]     = "bench";
+                r["row"]["colour"]    = "yellow";
+                r["row"]["updatedAt"] = static_cast<Json::Int64>(ts);
+                rows.append(r);
+            }
+            b["force"] = true;
+            return dev.post("/update", u.token, b);
+        }
+
+        case GetSince: {
+            if (rng() % 50 == 0) u.cursor = Json::Value();     // a full resync now and then
+            Json::Value b;
+            b["table"] = "highlight";
+            b["limit"] = o.pageSize;
+            if (u.cursor.isNull()) b["since"] = 0;
+            else                   b["cursor"] = u.cursor;
+            Json::Value j;
+            if (!dev.post("/getSince", u.token, b, &j)) return false;
+            u.cursor = j["cursor"];
+            return true;
+        }
+
+        case Check: {
+            Json::Value b;
+            Json::Value& keys = b["keys"];
+            keys = Json::Value(Json::arrayValue);
+            for (int i = 0; i < o.checkKeys; ++i) {
+                Json::Value k;
+                k["table"]  = "highlight";
+                k["fileId"] = u.fileId;
+                k["id"]     = static_cast<Json::Int64>(1 + static_cast<long long>(rng() % std::max(1LL, u.nextId)));
+                keys.append(k);
+            }
+            return dev.post("/check", u.token, b);
+        }
+
+        case Delete: {
+            Json::Value b;
+            b["table"]  = "books";
+            b["fileId"] = u.fileId;
+            return dev.post("/delete", u.token, b);     // main loop opens it again, untimed
+        }
+
+        case Upload:
+            return !uploadBook(dev, u, o, static_cast<size_t>(o.uploadKb), rng).empty();
+
+        case Book: {
+            auto req = drogon::HttpRequest::newHttpRequest();
+            req->setMethod(drogon::Get);
+            req->setPath("/book/" + u.fileId);
+            req->addHeader("Authorization", "Bearer " + u.token);
+            auto resp = dev.send(req);
+            return resp && resp->getStatusCode() == drogon::k200OK &&
+                   resp->getBody().size() == static_cast<size_t>(o.bookKb) * 1024;
+        }
+
+        case OP_COUNT:
+            break;
+    }
+    return false;
+}
+
+double percentileMs(std::vector<uint32_t>& v, double p) {
+    if (v.empty()) return 0.0;
+    const size_t k = std::min(v.size() - 1, static_cast<size_t>(p * static_cast<double>(v.size())));
+    std::nth_element(v.begin(), v.begin() + static_cast<std::ptrdiff_t>(k), v.end());
+    return v[k] / 1000.0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const Options o = parseArgs(argc, argv);
+    if (sodium_init() < 0) die("libsodium init failed");
+
+    std::printf("provisioning %d users in %s\n", o.users, o.db.c_str());
+    provisionUsers(o);
+
+    // users are split between the threads: each thread is the one device of its users
+    std::vector<std::vector<User>> usersOf(static_cast<size_t>(o.threads));
+    for (int i = 0; i < o.users; ++i)
+        usersOf[static_cast<size_t>(i % o.threads)].push_back(User{"bench_" + std::to_string(i), "", "", 1, Json::Value()});
+
+    int totalWeight = 0;
+    for (int w : o.mix) totalWeight += w;
+
+    std::vector<Samples> samples(static_cast<size_t>(o.threads));
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < o.threads; ++t) {
+        threads.emplace_back([&, t] {
+            std::mt19937_64 rng(0x5eed + static_cast<uint64_t>(t));
+            Device dev(o.url);
+            auto& users = usersOf[static_cast<size_t>(t)];
+            for (auto& u : users) setUp(dev, u, o, rng);
+            ++ready;
+            while (!go) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (users.empty()) return;
+
+            Samples& s = samples[static_cast<size_t>(t)];
+            const auto end = Clock::now() + std::chrono::seconds(o.seconds);
+            while (Clock::now() < end) {
+                int pick = static_cast<int>(rng() % static_cast<uint64_t>(totalWeight));
+                int op = 0;
+                while (pick >= o.mix[op]) pick -= o.mix[op++];
+                User& u = users[rng() % users.size()];
+
+                const auto start = Clock::now();
+                const bool ok = runOp(static_cast<Op>(op), dev, u, o, rng);
+                const auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+                s.us[op].push_back(static_cast<uint32_t>(std::min<long long>(us, UINT32_MAX)));
+                if (!ok) ++s.errors[op];
+                if (op == Delete) openBook(dev, u);     // as a device would, after re-downloading it
+            }
+        });
+    }
+
+    while (ready < o.threads) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::printf("running %d threads for %ds\n", o.threads, o.seconds);
+    const auto start = Clock::now();
+    go = true;
+    for (auto& th : threads) th.join();
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::printf("\n%-10s %10s %8s %10s %10s %10s %10s\n", "endpoint", "requests", "errors", "req/s", "p50 ms", "p99 ms", "p999 ms");
+    size_t total = 0;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        std::vector<uint32_t> all;
+        size_t errors = 0;
+        for (auto& s : samples) {
+            all.insert(all.end(), s.us[op].begin(), s.us[op].end());
+            errors += s.errors[op];
+        }
+        if (all.empty()) continue;
+        total += all.size();
+        const size_t n = all.size();
+        std::printf("%-10s %10zu %8zu %10.1f %10.2f %10.2f %10.2f\n", kOpNames[op], n, errors,
+                    static_cast<double>(n) / elapsed,
+                    percentileMs(all, 0.50), percentileMs(all, 0.99), percentileMs(all, 0.999));
+    }
+    std::printf("%-10s %10zu %8s %10.1f\n", "total", total, "", static_cast<double>(total) / elapsed);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef SIMPLEREADER_ADMISSION_H
+#define SIMPLEREADER_ADMISSION_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+//
+// Admission:  per-user rate limits and load shedding (Drogon pre/post-handling advice)
+//
+//   Routes fall in classes: read (/check, /get, /getSince, /sync, /bootstrap, /resolve, /watch,
+//   /bookMeta, /bookCover), write (/update, /delete, /upload*) and book (GET /book). Each
+//   user has a token bucket per class holding <class>burst requests and refilled at
+//   <class>rate a second; a request finding its bucket empty is answered 429 with
+//   Retry-After (when the next token is due), before its handler runs. Requests without a
+//   valid session pass: the handler refuses them. /login has its own queue (loginqueue),
+//   and /, /ruOK, /metrics and /backup aren't limited.
+//
+//   Besides, for everyone: while the WriteQueue holds more than shedqueue jobs, new writes
+//   get 429; once the p99 latency of a SHED_WINDOW_SECS window of reads and writes
+//   (uploads, /bootstrap and long polls left out) is over shedp99ms, so do new reads and
+//   writes, but for one in PROBE_EVERY let through to measure by. Shedding stops when a
+//   window of those shows a p99 under RECOVER_PCT% of shedp99ms, or when so few requests
+//   came (429s included) that there's no load left to shed.
+//
+//   Every limit is read per request, so a reload takes effect at once (0 lifts it).
+//
+class Admission {
+public:
+    static Admission& get();
+
+    // register the advices, and the latency window on the main loop (before app().run())
+    void start(void);
+
+    // the route classes (None: not limited)
+    enum class Kind : int { Read, Write, Book, Count, None = Count };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t SHARDS           = 16;
+    static constexpr int    SHED_WINDOW_SECS = 1;
+    static constexpr size_t SAMPLES          = 4096;   // latencies kept per window (the latest)
+    static constexpr size_t MIN_SAMPLES      = 50;     // fewer in a window: too few to judge by
+    static constexpr int    PROBE_EVERY      = 8;      // while shedding, requests let through
+    static constexpr int    RECOVER_PCT      = 75;     // of shedp99ms, to stop shedding
+    static constexpr int    IDLE_SECS        = 300;    // buckets untouched this long are dropped
+
+    struct Bucket {
+        double            tokens = -1;     // < 0: not used yet (starts full)
+        Clock::time_point last;
+    };
+    using Buckets = std::array<Bucket, static_cast<size_t>(Kind::Count)>;
+
+    struct Shard {
+        std::mutex                               mu;
+        std::unordered_map<std::string, Buckets> users;
+    };
+
+    // seconds until `username` may make a `k` request (0: now, and it's counted)
+    double take(const std::string& username, Kind k);
+
+    // why everyone's `k` requests are turned away right now (nullptr if they aren't)
+    const char* shedding(Kind k);
+
+    void record(long long micros);         // one request's latency, into this window
+    void closeWindow(void);                 // main loop: the window's p99, then a new window
+    void dropIdle(void);                    // main loop: forget users who went away
+
+    std::array<Shard, SHARDS>              shards_;
+    std::array<std::atomic<uint32_t>, SAMPLES> samples_{};     // microseconds, capped
+    std::atomic<uint64_t>                  recorded_{0};       // in this window
+    std::atomic<uint64_t>                  shed_{0};           // overloaded 429s, in this window
+    std::atomic<uint64_t>                  probes_{0};         // requests that could have been shed
+    std::atomic<long long>                 p99Micros_{0};      // of the last window judged
+    std::atomic<bool>                      overloaded_{false};
+
+    Admission() = default;
+    Admission(const Admission&) = delete;
+    Admission& operator=(const Admission&) = delete;
+};
+
+#endif // SIMPLEREADER_ADMISSION_H
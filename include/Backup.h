@@ -0,0 +1,63 @@
+#ifndef SIMPLEREADER_BACKUP_H
+#define SIMPLEREADER_BACKUP_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+//
+// Backup:  online copies of the database, while it keeps serving
+//
+//   Every backuphours (and whenever POST /backup asks) a thread of its own copies app.db
+//   with Database::backupTo: backuppages pages a step, backuppausems between steps, all
+//   from one read snapshot, so /update writers aren't held up and the copy is consistent.
+//   It lands in backupdir as app-<UTC time>.db (written as .part, renamed when complete),
+//   with a sharded db's shards beside it as app-<UTC time>.shard-NN.db; the newest
+//   backupkeep are kept.
+//
+//   Progress, duration and outcome are exported as metrics, and by GET /backup.
+//
+class Backup {
+public:
+    static Backup& get();
+
+    // metrics, and the schedule on the main loop (after Database::open)
+    void start(void);
+
+    // abandon a running backup and wait for its thread (before Database::close)
+    void stop(void);
+
+    // start a backup now; false (and why) if one is running already
+    bool trigger(std::string& reason);
+
+    struct Status {
+        bool        running = false;
+        int         pagesDone = 0;
+        int         pagesTotal = 0;
+        long long   lastOkAt = 0;           // epoch millis of the last success (0: none yet)
+        double      lastSeconds = 0;        // how long it took
+        std::string lastFile;
+        std::string lastError;              // of the last attempt ("" if it succeeded)
+    };
+    Status status(void);
+
+private:
+    Backup() = default;
+    ~Backup() { stop(); }
+    Backup(const Backup&) = delete;
+    Backup& operator=(const Backup&) = delete;
+
+    void run(void);                 // backup thread
+    void prune(const std::string& dir, int keep);
+
+    std::mutex        mu_;          // the strings and times in status_, thread_
+    Status            status_;
+    std::thread       thread_;
+    std::atomic<bool> running_{false};
+    std::atomic<bool> abandon_{false};
+    std::atomic<int>  pagesDone_{0};
+    std::atomic<int>  pagesTotal_{0};
+};
+
+#endif // SIMPLEREADER_BACKUP_H
@@ -0,0 +1,80 @@
+#ifndef SIMPLEREADER_BOOKCACHE_H
+#define SIMPLEREADER_BOOKCACHE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+//
+// BookCache:  the books this node served (or took in) lately, on local disk
+//
+//   A flat directory of files named by fileId, kept under bookcachemb by evicting the
+//   least recently used. A file's mtime is its last use, so the order survives a restart.
+//
+//   A book used in the last PIN_SECS isn't evicted (its response may still be going out
+//   with sendfile), nor is one pinned by adopt() or pin() until unpin() (an upload in progress,
+//   a book being read):
+//   the cache can run over its limit for a while rather than pull a file from under a reader.
+//
+class BookCache {
+public:
+    // scans `dir` (throws std::runtime_error if it can't be created)
+    explicit BookCache(const std::filesystem::path& dir);
+
+    BookCache(const BookCache&) = delete;
+    BookCache& operator=(const BookCache&) = delete;
+
+    const std::filesystem::path& dir() const { return dir_; }
+    std::filesystem::path pathOf(const std::string& name) const { return dir_ / name; }
+
+    // the cached copy of `name` if it holds `size` bytes (and marks it used), else ""
+    std::string find(const std::string& name, long long size);
+
+    // fetch `name` into the cache with `download(tmp)`, which writes the whole book to `tmp`.
+    // One download per name at a time: everyone else asking waits for it. Throws what download does.
+    std::string fill(const std::string& name, long long size,
+                     const std::function<void(const std::filesystem::path& tmp)>& download);
+
+    // a book already written at pathOf(name): now part of the cache (pinned until unpin)
+    void adopt(const std::string& name, long long size);
+
+    // one more pin on `name`, false if the cache doesn't hold it. Every adopt() and pin() needs its unpin().
+    bool pin(const std::string& name);
+    void unpin(const std::string& name);
+
+    // forget `name` and remove its file
+    void drop(const std::string& name);
+
+    long long bytes(void);
+
+private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr int PIN_SECS = 60;
+
+    struct Entry {
+        std::string                     name;
+        long long                       size = 0;
+        Clock::time_point               used;
+        int                             pins = 0;     // adopt()s and pin()s not unpinned yet
+    };
+    using Lru = std::list<Entry>;           // most recently used first
+
+    void insertLocked(const std::string& name, long long size, int pins);
+    void evictLocked(void);
+
+    const std::filesystem::path             dir_;
+    std::mutex                              mu_;
+    std::condition_variable                 filled_;
+    Lru                                     lru_;
+    std::unordered_map<std::string, Lru::iterator> index_;
+    std::unordered_set<std::string>         filling_;
+    long long                               bytes_ = 0;
+};
+
+#endif // SIMPLEREADER_BOOKCACHE_H
@@ -0,0 +1,71 @@
+#ifndef SIMPLEREADER_BOOKMETA_H
+#define SIMPLEREADER_BOOKMETA_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+#include "Database.h"
+#include "WorkerPool.h"
+
+//
+// BookMeta:  title, author, page count and cover, read out of each book once
+//
+//   After an upload's books row is committed, the book (still on local disk, whatever the
+//   BookStorage: an object store's cache is held from evicting it) is opened on a thread of
+//   BookMeta's own: an EPUB's OPF gives its title, creators and cover image, with the page
+//   count estimated the way reading systems do (a page per 1024 compressed bytes of its spine); a PDF gives its page count and its Info
+//   dictionary's /Title and /Author, objects in compressed object streams included. The
+//   results go into book_meta (through the WriteQueue), the cover into thumbdir/<fileId>.
+//
+//   Covers are kept as the book has them (JPEG, PNG, GIF or WebP; SVG is refused) and only
+//   up to covermaxkb: there is no image library here to scale them down with. PDFs have
+//   no cover without a renderer.
+//
+//   Books uploaded before book_meta existed are read when /bookMeta first asks about
+//   them, if this node has them locally.
+//
+class BookMeta {
+public:
+    static BookMeta& get();
+
+    // the thumb directory, the metrics and the threads (after Database::open)
+    void start(void);
+
+    // drop what's queued, and wait for the book being read (before WriteQueue::stop)
+    void stop(void);
+
+    // read the book at `path` (a local file) in the background, and record what it holds.
+    // `held` is kept until it's been read (BookStorage::hold: the file isn't evicted meanwhile).
+    void extract(const std::string& fileId, const std::string& path, std::shared_ptr<void> held = nullptr);
+
+    // /bookMeta found no row: read the book if it's local and hasn't been tried already.
+    // False if it won't be (there'll be no metadata for it from this node).
+    bool want(const std::string& fileId);
+
+    // where a book's cover is kept
+    std::string coverPath(const std::string& fileId) const;
+
+    // read a book now, on the calling thread (extract()'s work); throws if it can't be opened
+    static Database::BookMetaRow read(const std::string& path, long long coverMaxBytes, std::string& coverOut);
+
+private:
+    static constexpr size_t QUEUE = 1024;
+
+    void run(const std::string& fileId, const std::string& path);     // on the pool
+
+    std::unique_ptr<WorkerPool>     pool_;
+    std::string                     thumbDir_;
+    std::mutex                      mu_;
+    std::unordered_set<std::string> queued_;      // being read, or its row being written
+    std::unordered_set<std::string> failed_;      // couldn't be read since startup
+    std::atomic<bool>               stopping_{false};
+
+    BookMeta() = default;
+    BookMeta(const BookMeta&) = delete;
+    BookMeta& operator=(const BookMeta&) = delete;
+};
+
+#endif // SIMPLEREADER_BOOKMETA_H
@@ -0,0 +1,70 @@
+#ifndef SIMPLEREADER_BOOKSTORAGE_H
+#define SIMPLEREADER_BOOKSTORAGE_H
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+
+//
+// BookStorage:  where the library's books are kept (bookstore= in simplereader.conf)
+//
+//   local:  a directory (librarydir); books.location is the file's absolute path.
+//   s3:     an S3-compatible bucket; books.location is "s3://bucket/key". Uploads are staged
+//           and verified on local disk, then sent to the bucket (multipart for big books) and
+//           kept in the local BookCache, where downloads are served from too. A book the cache
+//           doesn't hold is fetched into it (ranged GETs), or with s3presignsecs the client is
+//           redirected to a presigned URL and gets it from the bucket directly.
+//
+//   Books recorded with a local path stay readable after switching to s3, so an existing
+//   library can be moved over at leisure.
+//
+class BookStorage {
+public:
+    static BookStorage& get();
+
+    // at startup, before the handlers are registered (the default is local, /var/lib/simplereader/library)
+    static void install(std::unique_ptr<BookStorage> storage);
+
+    // finish the transfers under way and let go of the storage (before WriteQueue::stop:
+    // a finished upload still records its book)
+    static void close(void);
+
+    virtual ~BookStorage() = default;
+
+    virtual const char* name(void) const = 0;
+
+    // the local directory a new book is written into before put(). Its ".staging" subdirectory
+    // holds uploads in progress, on the same filesystem, so each step is a rename.
+    virtual std::filesystem::path incomingDir(void) const = 0;
+    std::filesystem::path incoming(const std::string& fileId) const { return incomingDir() / fileId; }
+
+    // the verified book at incoming(fileId) joins the library. `done` gets what to record as
+    // books.location ("" and why, if it failed): once, maybe on another thread.
+    using Stored = std::function<void(const std::string& location, const std::string& error)>;
+    virtual void put(const std::string& fileId, long long size, Stored done) = 0;
+
+    // keep the book at incoming(fileId) there while the handle lives, put() or not (null: it
+    // stays anyway). Taken in put()'s `done`, it holds what storing it might otherwise let go.
+    virtual std::shared_ptr<void> hold(const std::string&) { return nullptr; }
+
+    // whether the book recorded at `location` is still there (cheap: no round trips)
+    virtual bool holds(const std::string& location, long long size) = 0;
+
+    // how to send the book recorded at `location`: a local file, or a URL to redirect to.
+    // `done` is called once, maybe on another thread.
+    struct Source {
+        std::string path;
+        std::string url;
+        std::string error;      // neither: why not
+    };
+    using Found = std::function<void(Source)>;
+    virtual void fetch(const std::string& location, long long size, const std::string& fileName, Found done) = 0;
+};
+
+std::unique_ptr<BookStorage> makeLocalBookStorage(const std::filesystem::path& libraryDir);
+
+// reads the s3* and bookcache* keys from Config (throws std::runtime_error if they're incomplete)
+std::unique_ptr<BookStorage> makeS3BookStorage(void);
+
+#endif // SIMPLEREADER_BOOKSTORAGE_H
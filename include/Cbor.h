@@ -0,0 +1,54 @@
+#ifndef SIMPLEREADER_CBOR_H
+#define SIMPLEREADER_CBOR_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <jsoncpp/json/value.h>
+
+#include "RowWriter.h"
+
+//
+// CBOR (RFC 8949): the opt-in binary encoding of the sync endpoints.
+//
+//   CborWriter emits indefinite-length maps and arrays, so rows can be streamed
+//   without knowing their count up front, the same way JsonWriter does.
+//   cborToJson() decodes a request body into the Json::Value the handlers already
+//   validate, so CBOR and JSON requests go through exactly the same checks.
+//
+class CborWriter final : public RowWriter {
+public:
+    explicit CborWriter(size_t reserveBytes = 4096) { out_.reserve(reserveBytes); }
+
+    CborWriter& beginObject(void) override { out_ += '\xbf'; return *this; }
+    CborWriter& endObject(void)   override { out_ += '\xff'; return *this; }
+    CborWriter& beginArray(void)  override { out_ += '\x9f'; return *this; }
+    CborWriter& endArray(void)    override { out_ += '\xff'; return *this; }
+
+    using RowWriter::value;
+    CborWriter& key(std::string_view k) override   { return value(k); }
+    CborWriter& value(std::string_view s) override { head(3, s.size()); out_.append(s.data(), s.size()); return *this; }
+    CborWriter& value(long long v) override;
+    CborWriter& value(double v) override;
+    CborWriter& value(bool b) override { out_ += b ? '\xf5' : '\xf4'; return *this; }
+    CborWriter& null(void)    override { out_ += '\xf6'; return *this; }
+
+    const std::string& str() const override { return out_; }
+    std::string take(void) override { return std::move(out_); }
+    void drainTo(std::string& dest) override { dest += out_; out_.clear(); }
+
+    const char* mimeType() const override { return "application/cbor"; }
+
+private:
+    void head(unsigned major, unsigned long long arg);
+
+    std::string out_;
+};
+
+// decode one CBOR data item (the whole of `in`) into `out`.
+// Maps need text (or integer) keys; byte strings become strings; tags are ignored.
+// false if malformed, truncated, nested too deeply or followed by trailing bytes.
+bool cborToJson(std::string_view in, Json::Value& out);
+
+#endif // SIMPLEREADER_CBOR_H
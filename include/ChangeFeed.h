@@ -0,0 +1,64 @@
+#ifndef SIMPLEREADER_CHANGEFEED_H
+#define SIMPLEREADER_CHANGEFEED_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//
+// ChangeFeed:  per-user change versions, and the long-polls waiting on them (/watch).
+//
+//   Database tells us (after commit) whenever a user's rows change; we bump that
+//   user's version and answer every /watch parked on it. An idle device holds one
+//   parked request and costs nothing until something changes or the poll times out.
+//
+//   Versions start from the wall clock, so they keep increasing across restarts and a
+//   client never mistakes a new process's count for the one it saw.
+//
+class ChangeFeed {
+public:
+    // (version now, whether it moved past the one the client knew)
+    using Wake = std::function<void(long long version, bool changed)>;
+
+    static ChangeFeed& get();
+
+    // hook into Database's change listener (call once, before WriteQueue::start)
+    void start(void);
+
+    // user's rows changed: bump the version, wake the waiters
+    void notify(const std::string& username);
+
+    long long version(const std::string& username);
+
+    // answer at once if `known` is stale, else park `wake` until a change or `timeoutSecs`
+    void wait(const std::string& username, long long known, double timeoutSecs, Wake wake);
+
+private:
+    struct Waiter {
+        Wake       wake;
+        std::mutex mu;
+        bool       fired = false;
+        bool fire(long long version, bool changed);     // once only; false if already fired
+    };
+    using WaiterPtr = std::shared_ptr<Waiter>;
+
+    struct User {
+        long long              version;
+        std::vector<WaiterPtr> waiters;
+    };
+
+    User& userLocked(const std::string& username);     // mu_ held
+
+    std::mutex mu_;
+    std::unordered_map<std::string, User> users_;
+    const long long epoch_;     // first version of every user, this run
+
+    ChangeFeed();
+    ChangeFeed(const ChangeFeed&) = delete;
+    ChangeFeed& operator=(const ChangeFeed&) = delete;
+};
+
+#endif // SIMPLEREADER_CHANGEFEED_H
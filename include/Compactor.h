@@ -0,0 +1,79 @@
+#ifndef SIMPLEREADER_COMPACTOR_H
+#define SIMPLEREADER_COMPACTOR_H
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Database.h"
+
+//
+// Compactor:  hard-deletes tombstones once every device that syncs has been sent them.
+//
+//   Each /getSince or /sync says how far that (user, device) has got: its cursor covers
+//   every row changed before cursor.ts. We keep those watermarks in memory, write the
+//   ones that moved to device_sync every pass, and purge each user's tombstones below the
+//   lowest watermark among their active devices.
+//
+//   Purges go through the WriteQueue a small batch at a time, one batch in the queue at
+//   once, so requests' writes are never stuck behind a long delete. A purge's horizon is
+//   saved before its deletes (they may be in a shard, apart from device_sync's app.db).
+//
+//   A device idle for longer than ACTIVE_DAYS stops holding purges back. If it comes
+//   back with a cursor from before a purge, needsResync() says so: it may still hold
+//   rows whose tombstones it never saw, and has to sync that table again from scratch.
+//
+class Compactor {
+public:
+    static Compactor& get();
+
+    // load the watermarks and purge horizons (after Database::open),
+    // and run a pass every PASS_SECS on the main loop
+    void start(void);
+
+    // the device has been sent every row of `t` changed before `ts`
+    void ack(const std::string& username, const std::string& device, Database::Tbl t, long long ts);
+
+    // whether a cursor at `afterTs` has missed tombstones that are gone now
+    bool needsResync(const std::string& username, Database::Tbl t, long long afterTs);
+
+private:
+    struct Device {
+        Database::TblTimes acked{};
+        long long          seenAt = 0;
+        bool               dirty  = false;     // moved since it was last written
+    };
+    struct User {
+        std::unordered_map<std::string, Device> devices;
+        Database::TblTimes                      purgedTs{};
+        std::array<bool, static_cast<size_t>(Database::Tbl::Count)> retry{};  // a purge failed part way
+    };
+    struct Purge {
+        std::string   username;
+        Database::Tbl table;
+        long long     beforeTs;
+    };
+    using PurgeList = std::shared_ptr<std::vector<Purge>>;
+
+    static constexpr int       PASS_SECS   = 600;
+    static constexpr long long ACTIVE_DAYS = 90;
+    static constexpr int       BATCH_ROWS  = 500;      // per write job
+
+    void pass(void);                                    // main loop
+    void purgeNext(PurgeList list, size_t i);           // chained from the writer threads
+    void purgeBatch(PurgeList list, size_t i);
+    void purgeFailed(PurgeList list, size_t i);         // the rest waits for the next pass
+
+    std::mutex mu_;
+    std::unordered_map<std::string, User> users_;
+    bool busy_ = false;         // a pass's writes are still queued
+
+    Compactor() = default;
+    Compactor(const Compactor&) = delete;
+    Compactor& operator=(const Compactor&) = delete;
+};
+
+#endif // SIMPLEREADER_COMPACTOR_H
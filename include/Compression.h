@@ -0,0 +1,39 @@
+#ifndef SIMPLEREADER_COMPRESSION_H
+#define SIMPLEREADER_COMPRESSION_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+//
+// Compression:  Accept-Encoding negotiation for JSON responses (a Drogon post-handling advice).
+//
+//   JSON bodies of at least compressminbytes go out as br (when built with brotli) or gzip,
+//   whichever the client prefers.  File downloads are left alone: they are sent with
+//   sendfile and are compressed already (epub, pdf).  The threshold is read per response,
+//   so a reload takes effect at once (0 turns compression off).
+//
+//   Encoder state and output buffers are kept per IO thread and reused across responses.
+//
+void enableResponseCompression(void);
+
+//
+// StreamEncoder:  the same negotiation for a body produced a piece at a time (a stream
+// response, which the advice can't see): one compression stream across all its pieces.
+//
+class StreamEncoder {
+public:
+    virtual ~StreamEncoder() = default;
+
+    virtual const char* name(void) const = 0;     // for Content-Encoding
+
+    // compress the next piece of the body onto the end of `out` (which may stay empty until
+    // enough has come in); `last`: the body ends here. Throws std::runtime_error.
+    virtual void write(std::string_view in, bool last, std::string& out) = 0;
+};
+
+// the encoder for a request's Accept-Encoding, or nullptr to send the body as is
+// (nothing acceptable, or compression turned off)
+std::unique_ptr<StreamEncoder> makeStreamEncoder(const std::string& acceptEncoding);
+
+#endif
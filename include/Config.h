@@ -1,4 +1,6 @@
 #pragma once
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 
@@ -10,17 +12,90 @@ public:
     // Load once from file
     void load(const std::string& overridePath = "");
 
+    // Re-read the same file (SIGHUP): the keys marked "reloadable" below take the new
+    // values straight away; any other key that changed is logged and waits for a restart.
+    // Returns false (and changes nothing) if the file can't be read.
+    bool reload(void);
+
     // Getters
     const std::string& host() const { return host_; }
     int port() const { return port_; }
-    const std::string& compat() const { return compat_; }
+    std::string compat() const;                                         // reloadable
     int maxFileSize() const   { return maxFileSizeMB_ * 1024 * 1024; } // returns in bytes
     int maxFileSizeMB() const { return maxFileSizeMB_; }               // returns in MB
-    int tokenTimeout() const  { return tokenTimeout_; }                // returns in mins
+    int tokenTimeout() const  { return tokenTimeout_; }                // returns in mins (reloadable)
+    bool persistSessions() const { return persistSessions_ != 0; }     // keep login sessions across restarts
+    int compressMinBytes() const { return compressMinBytes_; }         // compress JSON responses this big (0: never, reloadable)
+    std::string logLevel() const;                                       // err, info or debug (reloadable)
+
+    // performance: fixed at startup
+    int ioThreads() const       { return ioThreads_; }                 // Drogon IO threads (0: one per core)
+    int dbReaders() const       { return dbReaders_; }                 // read-only sqlite connections (0: one per IO thread)
+    int dbShards() const        { return dbShards_; }                  // files the user_* tables are split across (0: app.db)
+    int memoryBodyBytes() const { return memoryBodyKB_ * 1024; }       // request bodies kept in RAM, beyond this spooled to disk
+    int loginThreads() const    { return loginThreads_; }              // password hashing threads
+    int loginQueue() const      { return loginQueue_; }                // logins allowed to wait for one
+
+    // performance: reloadable
+    int pageLimit() const       { return pageLimit_; }                 // ceiling on /getSince and /sync "limit"
+    int maxBatch() const        { return maxBatch_; }                  // keys in one /check or /get, rows in one /update
+    long long maxChunkBytes() const { return static_cast<long long>(maxChunkMB_) << 20; }  // one /upload chunk
+    int uploadBufferBytes() const { return uploadBufferKB_ * 1024; }   // /uploadBook copies the upload in slices this big
+    int dbCacheKB() const       { return dbCacheMB_ * 1024; }          // sqlite page cache, per connection
+    long long dbMmapBytes() const { return static_cast<long long>(dbMmapMB_) << 20; }      // sqlite mmap window, per connection
+    int writeWindowMs() const   { return writeWindowMs_; }             // WriteQueue: how long a batch waits for company
+    int writeMaxBatch() const   { return writeMaxBatch_; }             // WriteQueue: jobs in one commit
+    int watchWaiters() const    { return watchWaiters_; }              // /watch requests parked per user
+
+    // where sessions are kept (see SessionBackend): "local" or "redis"
+    const std::string& sessionStore() const { return sessionStore_; }
+    const std::string& redisHost() const { return redisHost_; }
+    int redisPort() const { return redisPort_; }
+    const std::string& redisPassword() const { return redisPassword_; }
+
+    // the book library (see BookStorage): "local" (librarydir) or "s3"
+    const std::string& bookStore() const { return bookStore_; }
+    const std::string& libraryDir() const { return libraryDir_; }
+    const std::string& s3Endpoint() const { return s3Endpoint_; }
+    const std::string& s3Region() const { return s3Region_; }
+    const std::string& s3Bucket() const { return s3Bucket_; }
+    const std::string& s3Prefix() const { return s3Prefix_; }
+    const std::string& s3AccessKey() const { return s3AccessKey_; }
+    const std::string& s3SecretKey() const { return s3SecretKey_; }
+    long long s3PartBytes() const { return static_cast<long long>(s3PartMB_) << 20; }   // multipart part / ranged GET size (reloadable)
+    int s3PresignSecs() const   { return s3PresignSecs_; }             // redirect downloads to presigned URLs valid this long (0: proxy, reloadable)
+    const std::string& bookCacheDir() const { return bookCacheDir_; }
+    long long bookCacheBytes() const { return static_cast<long long>(bookCacheMB_) << 20; }  // local copies of s3 books (reloadable)
+    int storageThreads() const  { return storageThreads_; }            // s3 transfers at once
+    const std::string& thumbDir() const { return thumbDir_; }          // book covers read out by BookMeta
+    long long coverMaxBytes() const { return static_cast<long long>(coverMaxKB_) << 10; }   // larger covers aren't kept (reloadable)
+
+    // online backups (see Backup)
+    const std::string& backupDir() const { return backupDir_; }
+    int backupHours() const     { return backupHours_; }               // between scheduled backups (0: only on request)
+    int backupKeep() const      { return backupKeep_; }                // backups kept (reloadable)
+    int backupPages() const     { return backupPages_; }               // pages copied per step (reloadable)
+    int backupPauseMs() const   { return backupPauseMs_; }             // pause between steps (reloadable)
+
+    // library integrity scrubber (see Scrubber), reloadable
+    int scrubMBps() const       { return scrubMBps_; }                 // books read back at most this fast (0: paused)
+    int scrubHours() const      { return scrubHours_; }                // between the starts of full passes
+
+    // admission control (see Admission), all reloadable: per user and class of route, a bucket
+    // of <class>burst requests refilled at <class>rate a second (rate 0: unlimited)
+    int readRate() const        { return readRate_; }
+    int readBurst() const       { return readBurst_; }
+    int writeRate() const       { return writeRate_; }
+    int writeBurst() const      { return writeBurst_; }
+    int bookRate() const        { return bookRate_; }
+    int bookBurst() const       { return bookBurst_; }
+    int shedQueue() const       { return shedQueue_; }                 // queued writes beyond which writes get 429 (0: never)
+    int shedP99Ms() const       { return shedP99Ms_; }                 // p99 beyond which reads and writes get 429 (0: never)
 
     // string
     std::string toString() const;
-    std::string toShortString() const;    // just compat,maxfilesize,tokentimeout
+    std::string toShortString() const;    // just compat,maxfilesize,tokentimeout,persistsessions,compressminbytes,loglevel
+    std::string toPerfString() const;     // the performance keys
 
 private:
     // Private constructor
@@ -30,14 +105,79 @@ private:
     Config(const Config&) = delete;
     Config& operator=(const Config&) = delete;
 
+    // apply a parsed file: everything at startup, then only the reloadable keys
+    void apply(const std::unordered_map<std::string, std::string>& cfg, bool startup);
+
+    std::string path_;
+    mutable std::mutex strMu_;  // the reloadable strings (ints are atomic)
+
     // Values
     std::string host_ = "127.0.0.1";
     int port_ = 9000;
     std::string compat_ = "0.0.0";
     int maxFileSizeMB_ = 200;   // MB
-    int tokenTimeout_ = 60;     // mins
+    std::atomic<int> tokenTimeout_{60};     // mins
+    int persistSessions_ = 0;   // 0 or 1
+    std::atomic<int> compressMinBytes_{1024};   // bytes
+    std::string logLevel_ = "info";
+
+    int ioThreads_ = 0;
+    int dbReaders_ = 0;
+    int dbShards_ = 0;
+    int memoryBodyKB_ = 2048;
+    int loginThreads_ = 2;
+    int loginQueue_ = 64;
+
+    std::atomic<int> pageLimit_{1000};
+    std::atomic<int> maxBatch_{1000};
+    std::atomic<int> maxChunkMB_{32};
+    std::atomic<int> uploadBufferKB_{1024};
+    std::atomic<int> dbCacheMB_{16};
+    std::atomic<int> dbMmapMB_{256};
+    std::atomic<int> writeWindowMs_{2};
+    std::atomic<int> writeMaxBatch_{256};
+    std::atomic<int> watchWaiters_{16};
+
+    std::string sessionStore_ = "local";
+    std::string redisHost_ = "127.0.0.1";
+    int redisPort_ = 6379;
+    std::string redisPassword_;
+
+    std::string bookStore_ = "local";
+    std::string libraryDir_ = "/var/lib/simplereader/library";
+    std::string s3Endpoint_;
+    std::string s3Region_ = "us-east-1";
+    std::string s3Bucket_;
+    std::string s3Prefix_ = "library/";
+    std::string s3AccessKey_;
+    std::string s3SecretKey_;
+    std::atomic<int> s3PartMB_{8};
+    std::atomic<int> s3PresignSecs_{0};
+    std::string bookCacheDir_ = "/var/lib/simplereader/cache";
+    std::atomic<int> bookCacheMB_{10240};
+    int storageThreads_ = 4;
+    std::string thumbDir_ = "/var/lib/simplereader/thumbs";
+    std::atomic<int> coverMaxKB_{512};
+
+    std::string backupDir_ = "/var/lib/simplereader/backup";
+    int backupHours_ = 24;
+    std::atomic<int> backupKeep_{7};
+    std::atomic<int> backupPages_{256};
+    std::atomic<int> backupPauseMs_{20};
+
+    std::atomic<int> scrubMBps_{8};
+    std::atomic<int> scrubHours_{24};
+
+    std::atomic<int> readRate_{20};
+    std::atomic<int> readBurst_{100};
+    std::atomic<int> writeRate_{20};
+    std::atomic<int> writeBurst_{100};
+    std::atomic<int> bookRate_{2};
+    std::atomic<int> bookBurst_{20};
+    std::atomic<int> shedQueue_{4096};
+    std::atomic<int> shedP99Ms_{2000};
 };
 
 inline std::ostream& operator<<(std::ostream& os, const Config& c) {
     return os << c.toString();
-}
\ No newline at end of file
+}
@@ -1,10 +1,25 @@
 #ifndef SIMPLEREADER_DATABASE_H
 #define SIMPLEREADER_DATABASE_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <sqlite3.h>
-#include <json/value.h>
+#include <jsoncpp/json/value.h>
+
+#include "Metrics.h"
+
+class RowWriter;
 
 class Database {
     public:
@@ -15,11 +30,125 @@ class Database {
             long long deletedAt = 0;       // valid when deleted==true
         };
 
+        // keyset cursor for /getSince: the (changed_at, file_id, id) of the last row a client has seen.
+        // Pages return rows strictly after it, so rows sharing one timestamp are never re-sent.
+        struct Cursor {
+            long long   ts     = 0;            // changed_at
+            std::string fileId;                // "" sorts before every fileId
+            long long   id     = LLONG_MIN;    // sorts before every id (unused for books)
+        };
+
+        // one key of a batched /check or /get
+        struct ItemKey {
+            std::string fileId;
+            long long   id = -1;        // unused for books; for /get, < 0 means every item for fileId
+        };
+
+        // the four synced tables (user_books, user_bookmarks, user_highlights, user_notes)
+        enum class Tbl : int { Books, Bookmarks, Highlights, Notes, Count };
+        using TblTimes = std::array<long long, static_cast<size_t>(Tbl::Count)>;   // one timestamp per Tbl
+
+        // how far one device has synced (see Compactor): per table, the changed_at
+        // below which it has been sent every row, tombstones included
+        struct DeviceSyncRow {
+            std::string username;
+            std::string device;
+            TblTimes    ackedTs{};
+            long long   seenAt = 0;        // epoch millis of its last /getSince or /sync
+        };
+
+        // a persisted login session (see SessionManager)
+        struct SessionRow {
+            std::string tokenHash;
+            std::string username;
+            std::string device;
+            long long   expiresAt = 0;     // epoch millis
+        };
+
+        // a book in the library, as the integrity scrubber walks it
+        struct LibraryBook {
+            std::string fileId;
+            std::string location;
+            long long   filesize = 0;
+            std::string sha256;
+        };
+
+        // what BookMeta read out of a book (see book_meta)
+        struct BookMetaRow {
+            std::string fileId;
+            std::string format;            // "epub", "pdf", or "" (not a format we read)
+            std::string title;             // "" if unknown
+            std::string author;
+            int         pages = -1;        // < 0: unknown
+            std::string coverType;         // media type of its cover in thumbdir ("": none)
+            long long   coverBytes = 0;
+            long long   extractedAt = 0;   // epoch millis
+        };
+
         static Database& get();     // singleton instance
-        sqlite3* handle() { return db_; }
 
-        void open(const std::string& path);
-        void close(void);
+        // an instance of its own, apart from the daemon's (benchmarks: a scratch db per run).
+        // WriteTxn/ReadSnapshot state is per thread, not per instance: on any one thread,
+        // have a transaction open on only one Database at a time.
+        static std::unique_ptr<Database> create(void);
+
+        // pins one reader connection to the calling thread inside a read transaction, so every
+        // read made on this thread until it goes out of scope sees the same snapshot of the db.
+        // Nested snapshots on the same thread share the outer one. It covers one file: for a
+        // user's rows, take it on forUser(username).
+        class ReadSnapshot;
+
+        // one BEGIN IMMEDIATE transaction on the writer, held by the calling thread until commit()
+        // or destruction (rollback). Every read and write made on this thread meanwhile runs inside
+        // it, so a batch of check-then-write rows costs one lock and one commit.
+        class WriteTxn;
+
+        // a SAVEPOINT inside the calling thread's WriteTxn: rolled back on destruction unless released,
+        // so one failed unit of work (a request) doesn't take the rest of the transaction with it
+        class Savepoint;
+
+        // for /bootstrap: every live row of one user (tombstones left out), a row at a time, from
+        // one snapshot of their shard. The snapshot is a read transaction on a connection of the
+        // Dump's own, kept while it lives: it can be read a piece at a time, from any thread,
+        // while the pool and the writers carry on.
+        class Dump;
+
+        // opens one writer connection plus `readers` read-only connections (all WAL).
+        // shards > 0: the user_* tables are split across that many more files next to `path`
+        // (app.shard-00.db, ...), each with connections of its own, so writes to users in
+        // different shards don't wait on one lock. A user's shard is a hash of the username.
+        // An unsharded db is moved over on the first open with shards; the count can't
+        // change after that (throws std::runtime_error).
+        void open(const std::string& path, int readers = 1, int shards = 0);
+        void close(void);       // and the shards
+
+        // the sharded layout: users, books, sessions and sync watermarks stay here, and every
+        // per-user call (select*, listUser*, insertUser*, softDelete*, purgeTombstones) is
+        // passed on to the user's shard. forUser() is that shard (*this when not sharded),
+        // for a ReadSnapshot or a WriteTxn over one user's rows.
+        size_t    shardCount(void) const { return shards_.size(); }
+        size_t    shardIndex(const std::string& username) const;      // needs shardCount() > 0
+        Database& shard(size_t i) { return *shards_[i]; }
+        Database& forUser(const std::string& username) {
+            return shards_.empty() ? *this : *shards_[shardIndex(username)];
+        }
+
+        // page cache (KB) and mmap window (bytes) of every connection (shards' too); callable while
+        // open: each connection picks the new sizes up the next time it's leased
+        void setCacheSizes(int cacheKB, long long mmapBytes);
+
+        // other processes write this file too (several instances on one app.db): the change
+        // marks this one keeps can't see their writes, so listUser*Since always asks sqlite.
+        // Set before open.
+        void setSharedWriters(bool shared) { sharedWriters_ = shared; }
+
+        // online backup into a new file `dest`, `pagesPerStep` pages at a time with `pause` between
+        // steps. It reads on a connection of its own, inside one read transaction: the copy is a
+        // single consistent snapshot, and (WAL) writers carry on meanwhile. This file only: a
+        // sharded db backs each shard up with shard(i).backupTo. `progress(remaining, total)`
+        // runs after each step; returning false abandons the backup. Throws std::runtime_error.
+        void backupTo(const std::string& dest, int pagesPerStep, std::chrono::milliseconds pause,
+                      const std::function<bool(int remaining, int total)>& progress);
 
         // helpers
         bool bookExists(const std::string& fileId);
@@ -33,31 +162,57 @@ class Database {
                                             const std::string& fileId,
                                             long long itemId);        
 
+        // batched /check: one RowState per key, in key order, from a single query
+        //   table: user_books, user_bookmarks, user_highlights or user_notes
+        void selectRowStates(const std::string& table, const std::string& username,
+                             const std::vector<ItemKey>& keys, std::vector<RowState>& statesOut);
+
+        // for /login: stored password hash, or empty string if user unknown
+        std::string selectPasswordHash(const std::string& username);
+
         // check for book by sha256+filesize in "books"
         std::string lookupFileIdByHashSize(const std::string& sha256, long long filesize);
 
+        // listUser*: rows are written straight into `rowsOut`, an open JSON array
+
         // Books: append 0 or 1 row: {fileId, progress, updatedAt, deleted}
-        void listUserBook(const std::string& username, const std::string& fileId, Json::Value& rowsOut);
+        void listUserBook(const std::string& username, const std::string& fileId, RowWriter& rowsOut);
 
         // Bookmarks: append rows: {fileId, id, locator, label, updatedAt, deleted}
-        void listUserBookmarks(const std::string& username, const std::string& fileId, const int& id, Json::Value& rowsOut);
+        void listUserBookmarks(const std::string& username, const std::string& fileId, const int& id, RowWriter& rowsOut);
 
         // Highlights: append rows: {fileId, id, selection, label, colour, updatedAt, deleted}
-        void listUserHighlights(const std::string& username, const std::string& fileId, const int& id, Json::Value& rowsOut);
+        void listUserHighlights(const std::string& username, const std::string& fileId, const int& id, RowWriter& rowsOut);
 
         // Notes: append rows: {fileId, id, locator, content, updatedAt, deleted}
-        void listUserNotes(const std::string& username, const std::string& fileId, const int& id, Json::Value& rowsOut);
+        void listUserNotes(const std::string& username, const std::string& fileId, const int& id, RowWriter& rowsOut);
+
+        // batched /get: rows for every key from a single query, as above plus "fileId"
+        void listUserBooksByKeys(const std::string& username, const std::vector<ItemKey>& keys, RowWriter& rowsOut);
+        void listUserBookmarksByKeys(const std::string& username, const std::vector<ItemKey>& keys, RowWriter& rowsOut);
+        void listUserHighlightsByKeys(const std::string& username, const std::vector<ItemKey>& keys, RowWriter& rowsOut);
+        void listUserNotesByKeys(const std::string& username, const std::vector<ItemKey>& keys, RowWriter& rowsOut);
 
         // for /getSince
-        void listUserBooksSince(const std::string& username, long long since, int limit,
-                                Json::Value& rowsOut, long long& nextSinceOut);
-        void listUserBookmarksSince(const std::string& username, long long since, int limit,
-                                    Json::Value& rowsOut, long long& nextSinceOut);
-        void listUserHighlightsSince(const std::string& username, long long since, int limit,
-                                    Json::Value& rowsOut, long long& nextSinceOut);
-        void listUserNotesSince(const std::string& username, long long since, int limit,
-                                    Json::Value& rowsOut, long long& nextSinceOut);
-                                    
+        //   rows strictly after `after`, ordered by (changed_at, file_id, id), at most `limit` of them.
+        //   nextOut:      cursor of the last row returned (== after if none)
+        //   nextSinceOut: legacy timestamp cursor for clients that only send "since"
+        //   returns:      true if more rows follow this page
+        bool listUserBooksSince(const std::string& username, const Cursor& after, int limit,
+                                RowWriter& rowsOut, Cursor& nextOut, long long& nextSinceOut);
+        bool listUserBookmarksSince(const std::string& username, const Cursor& after, int limit,
+                                    RowWriter& rowsOut, Cursor& nextOut, long long& nextSinceOut);
+        bool listUserHighlightsSince(const std::string& username, const Cursor& after, int limit,
+                                     RowWriter& rowsOut, Cursor& nextOut, long long& nextSinceOut);
+        bool listUserNotesSince(const std::string& username, const Cursor& after, int limit,
+                                RowWriter& rowsOut, Cursor& nextOut, long long& nextSinceOut);
+
+        // the changed_at for a write to `user`'s rows in `t`: nowMs, or just past their latest
+        // changed_at there if that's not behind it (two writes in one millisecond, the clock
+        // stepped back). A /getSince cursor is then never passed by a later write. Call on the
+        // WriteQueue thread, in the transaction that makes the write.
+        long long changeStamp(const std::string& user, Tbl t, long long nowMs);
+
         // for /update
         void insertUserBook(const std::string& user, const std::string& fileId,
                             const std::string& progress, bool resurrect, long long nowMs);
@@ -92,17 +247,329 @@ class Database {
         void insertBookRecord(const std::string& fileId, const std::string& sha256, long long filesize,
                               const std::string& location, const std::string& clientFileName, long long updatedAt);
 
+        // change notification (ChangeFeed): called with the username once a write to that
+        // user's rows is committed, on the committing thread. Set before any writes start.
+        using ChangeListener = std::function<void(const std::string& username)>;
+        void setChangeListener(ChangeListener fn);     // and the shards'
+
+
+        // for Scrubber: every committed book (from the books cache: no sqlite)
+        void listLibrary(std::vector<LibraryBook>& rowsOut);
+
+        // for BookMeta and /bookMeta: one row per book it has read (false if none yet)
+        void upsertBookMeta(const BookMetaRow& row);
+        bool getBookMeta(const std::string& fileId, BookMetaRow& out);
+
+        // for SessionManager persistence
+        void insertSession(const std::string& tokenHash, const std::string& username,
+                           const std::string& device, long long expiresAtMs);
+        void deleteExpiredSessions(long long nowMs);
+        void listLiveSessions(long long nowMs, std::vector<SessionRow>& rowsOut);
+
+        // for Compactor: device watermarks, and how far each user's tombstones have been purged.
+        // Upserts only ever move a timestamp forward.
+        void upsertDeviceSync(const DeviceSyncRow& row);
+        void deleteDeviceSyncBefore(long long seenBeforeMs);
+        void listDeviceSync(std::vector<DeviceSyncRow>& rowsOut);
+        void upsertPurgedThrough(const std::string& username, const TblTimes& purgedTs);
+        void listPurgedThrough(std::vector<std::pair<std::string, TblTimes>>& rowsOut);
+
+        // hard-delete up to `limit` of the user's tombstones in `t` with changed_at < beforeTs.
+        // Returns how many went; fewer than `limit` means there are none left.
+        int purgeTombstones(const std::string& username, Tbl t, long long beforeTs, int limit);
+
     private:
-        sqlite3* db_ = nullptr;
+        // compile-time ids for the prepared statement cache (SQL lives in Database.cpp)
+        enum class Stmt : int {
+            BookExists,
+            SelectUserBook,
+            SelectUserBookmark,
+            SelectUserHighlight,
+            SelectUserNote,
+            SelectUserBooksByKeys,
+            SelectUserBookmarksByKeys,
+            SelectUserHighlightsByKeys,
+            SelectUserNotesByKeys,
+            SelectPasswordHash,
+            LookupFileIdByHashSize,
+            ListUserBook,
+            ListUserBookmarksAll,
+            ListUserBookmarksOne,
+            ListUserHighlightsAll,
+            ListUserHighlightsOne,
+            ListUserNotesAll,
+            ListUserNotesOne,
+            ListUserBooksByKeys,
+            ListUserBookmarksByKeys,
+            ListUserHighlightsByKeys,
+            ListUserNotesByKeys,
+            ListUserBooksSince,
+            ListUserBookmarksSince,
+            ListUserHighlightsSince,
+            ListUserNotesSince,
+            LastUserBook,
+            LastUserBookmark,
+            LastUserHighlight,
+            LastUserNote,
+            InsertUserBook,
+            InsertUserBookmark,
+            InsertUserHighlight,
+            InsertUserNote,
+            SoftDeleteUserBook,
+            SoftDeleteUserBookmark,
+            SoftDeleteUserHighlight,
+            SoftDeleteUserNote,
+            SoftDeleteUserBookmarkAll,
+            SoftDeleteUserHighlightAll,
+            SoftDeleteUserNoteAll,
+            InsertSession,
+            DeleteExpiredSessions,
+            ListLiveSessions,
+            UpsertDeviceSync,
+            DeleteDeviceSyncBefore,
+            ListDeviceSync,
+            UpsertPurgedThrough,
+            ListPurgedThrough,
+            PurgeUserBooks,
+            PurgeUserBookmarks,
+            PurgeUserHighlights,
+            PurgeUserNotes,
+            GetBookForDownload,
+            InsertBookRecord,
+            ListAllBooks,
+            UpsertBookMeta,
+            GetBookMeta,
+            Count
+        };
+        static constexpr size_t STMT_COUNT = static_cast<size_t>(Stmt::Count);
+
+        // one sqlite connection plus its statement cache
+        struct Connection {
+            sqlite3* db = nullptr;
+            std::array<sqlite3_stmt*, STMT_COUNT> stmts{};  // prepared on first use, finalized on close
+            unsigned tuned = 0;                             // the tuning_ generation its pragmas match
+        };
+
+        // exclusive use of a reader connection, checked out of the pool for one call
+        class ReadLease {
+            public:
+                explicit ReadLease(Database& owner);
+                ~ReadLease();
+                ReadLease(const ReadLease&) = delete;
+                ReadLease& operator=(const ReadLease&) = delete;
+
+                Connection& operator*()  const { return *conn_; }
+                Connection* operator->() const { return conn_; }
+
+            private:
+                Database&   owner_;
+                Connection* conn_ = nullptr;
+                bool        pinned_ = false;    // borrowed from this thread's ReadSnapshot: don't return it
+        };
+
+        static thread_local Connection* snapshotConn_;     // this thread's ReadSnapshot connection, if any
+        static thread_local Database*   snapshotDb_;       // ... and the Database it belongs to
+        static thread_local Connection* txnConn_;          // the writer, while this thread holds a WriteTxn
+
+        // exclusive use of the (single) writer connection for one call
+        // (already ours if this thread holds a WriteTxn)
+        class WriteLease {
+            public:
+                explicit WriteLease(Database& owner) : conn_(&owner.writer_) {
+                    if (txnConn_ != conn_) {
+                        lock_ = std::unique_lock<std::mutex>(owner.writerMu_);
+                        owner.tune(*conn_);
+                    }
+                }
+
+                Connection& operator*()  const { return *conn_; }
+                Connection* operator->() const { return conn_; }
+
+            private:
+                std::unique_lock<std::mutex> lock_;
+                Connection* conn_;
+        };
+
+        // a cached statement, checked out for the duration of one call.
+        // On destruction it is reset and its bindings cleared, ready for the next caller.
+        // The caller must hold a lease on the connection.
+        class CachedStmt {
+            public:
+                CachedStmt(Connection& conn, Stmt id);
+                ~CachedStmt();
+                CachedStmt(const CachedStmt&) = delete;
+                CachedStmt& operator=(const CachedStmt&) = delete;
+
+                operator sqlite3_stmt*() const { return stmt_; }
+
+            private:
+                sqlite3_stmt*          stmt_ = nullptr;
+                Stmt                   id_;
+                Metrics::Clock::time_point start_;     // for queryLatency_: bind, steps and reading the rows
+        };
+
+        // /metrics: per statement, from CachedStmt checkout to reset; plus prepares, commits
+        // and waits for a reader connection
+        static std::array<Metrics::Histogram, STMT_COUNT> queryLatency_;
+        static Metrics::Histogram prepareLatency_;
+        static Metrics::Histogram commitLatency_;
+        static Metrics::Histogram readerWaitLatency_;
+        static void registerMetrics(void);
+
+        static const char* stmtSql(Stmt id);    // SQL text for a statement id
+        static const char* stmtName(Stmt id);   // for error messages
+
+        // connection pool: one writer, N readers
+        std::string path_;
+        Connection writer_;
+        std::mutex writerMu_;
+
+        std::vector<std::unique_ptr<Connection>> readers_;
+        std::vector<Connection*> freeReaders_;
+        std::mutex readersMu_;
+        std::condition_variable readersCv_;
+
+        void openConnection(Connection& conn, const std::string& path, bool readOnly);
+        size_t prepareAll(Connection& conn);            // fill the statement cache; returns how many were prepared
+        static bool userStmt(Stmt id);                  // only touches user_* tables (so a shard has it)
+
+        // sharded layout: the shards, in hash order (empty if not sharded). A shard is a
+        // Database of its own holding only the user_* tables, without foreign keys: the
+        // users and books they refer to are in this one.
+        std::vector<std::unique_ptr<Database>> shards_;
+        bool isShard_ = false;
+        bool sharedWriters_ = false;
+        Database* route(const std::string& username) {  // the shard to pass a per-user call on to, if any
+            return shards_.empty() ? nullptr : shards_[shardIndex(username)].get();
+        }
+        int  shardLayout(void);                         // shards recorded in app.db (0: not sharded)
+        void moveToShards(void);                        // copy the user_* rows over, then drop them here
+
+        std::atomic<int>       cacheKB_{16384};         // 16 MB
+        std::atomic<long long> mmapBytes_{256LL << 20};
+        std::atomic<unsigned>  tuning_{1};              // bumped by setCacheSizes
+        void tune(Connection& conn);                    // (re)apply the size pragmas if they're stale
+
+        // read-through cache of the "books" table (small, and rows are never updated).
+        // Only committed rows go in: rows inserted under a WriteTxn wait in
+        // pendingBooks_ until it commits (a Savepoint rollback drops its own).
+        struct BookInfo {
+            std::string location;
+            long long   filesize = 0;
+            std::string sha256;
+            std::string filename;
+        };
+        static thread_local std::vector<std::pair<std::string, BookInfo>> pendingBooks_;
+
+        // users whose rows changed under this thread's WriteTxn, announced when it commits
+        ChangeListener changeListener_;
+        static thread_local std::vector<std::string> pendingChanges_;
+        void noteChange(const std::string& username);
+        std::unordered_map<std::string, BookInfo>    bookCache_;       // fileId -> row
+        std::unordered_map<std::string, std::string> bookByHashSize_;  // hashSizeKey() -> fileId
+        std::shared_mutex bookCacheMu_;
+
+        static std::string hashSizeKey(const std::string& sha256, long long filesize) {
+            return sha256 + ':' + std::to_string(filesize);
+        }
+        bool findCachedBook(const std::string& fileId, BookInfo& out);
+        void cacheBook(const std::string& fileId, BookInfo info);
+        void loadBookCache(void);
+
+        // per-user, per-table high-water mark: the greatest (changed_at, file_id, id) written.
+        // A listUser*Since whose cursor is at or past it has nothing to return, so it
+        // doesn't touch sqlite. Bumped as each write is made (before commit: a mark that
+        // runs ahead of the data only costs a scan, one that lags would hide rows), and
+        // read from the db (an index seek per table) the first time a user is asked about.
+        struct Marks {
+            std::array<Cursor, static_cast<size_t>(Tbl::Count)> at;     // Cursor{}: no rows
+            bool loaded = false;        // `at` has what was in the db, not only later writes
+        };
+        std::unordered_map<std::string, Marks> marks_;
+        std::shared_mutex marksMu_;
+
+        void  bumpMark(const std::string& username, Tbl t, long long ts, const std::string& fileId, long long id);
+        bool  nothingAfter(const std::string& username, Tbl t, const Cursor& after);
+        Marks loadMarks(const std::string& username);
+        Cursor lastRow(Connection& conn, const std::string& username, Tbl t);   // Cursor{}: no rows
+        static void closeConnection(Connection& conn);
 
         // restrict construction/destruction/copy/equality
         Database() = default;
         ~Database() = default;
+        friend struct std::default_delete<Database>;   // create()
         Database(const Database&) = delete;
         Database& operator=(const Database&) = delete;
 
-        void initSchema(void);  // build the db schema, if it doesn't exist
+        void initSchema(sqlite3* db);   // run the schema migrations this db (or shard) hasn't had (PRAGMA user_version)
+
+    public:
+        class ReadSnapshot {
+            public:
+                explicit ReadSnapshot(Database& db);
+                ~ReadSnapshot();
+                ReadSnapshot(const ReadSnapshot&) = delete;
+                ReadSnapshot& operator=(const ReadSnapshot&) = delete;
 
+            private:
+                std::unique_ptr<ReadLease> lease_;      // null when nested inside another snapshot
+        };
+
+        class WriteTxn {
+            public:
+                explicit WriteTxn(Database& db);
+                ~WriteTxn();                            // rolls back unless committed
+                WriteTxn(const WriteTxn&) = delete;
+                WriteTxn& operator=(const WriteTxn&) = delete;
+
+                void commit(void);
+
+            private:
+                Database&   db_;
+                std::unique_lock<std::mutex> lock_;
+                Connection* conn_;
+                bool        done_ = false;
+        };
+
+        class Savepoint {
+            public:
+                Savepoint();                            // throws unless this thread holds a WriteTxn
+                ~Savepoint();
+                Savepoint(const Savepoint&) = delete;
+                Savepoint& operator=(const Savepoint&) = delete;
+
+                void release(void);                     // keep its changes (as part of the outer txn)
+
+            private:
+                Connection* conn_;
+                size_t      pendingMark_;               // pendingBooks_ entries that predate us
+                size_t      changesMark_;               // ditto pendingChanges_
+                bool        done_ = false;
+        };
+
+        class Dump {
+            public:
+                Dump(Database& db, const std::string& username);     // throws std::runtime_error
+                ~Dump();
+                Dump(const Dump&) = delete;
+                Dump& operator=(const Dump&) = delete;
+
+                // write the next live row of `t` (in key order, as a batched /get writes it);
+                // false once there are no more
+                bool next(Tbl t, RowWriter& out);
+
+                // where /getSince and /sync carry on from for `t`: its last change in this
+                // snapshot, tombstones included (Cursor{} if it has no rows at all)
+                Cursor cursor(Tbl t);
+
+            private:
+                static constexpr size_t TBLS = static_cast<size_t>(Tbl::Count);
+
+                Connection  conn_;
+                std::string username_;
+                std::array<sqlite3_stmt*, TBLS> scans_{};      // prepared on first next()
+                std::array<bool, TBLS>          done_{};
+        };
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#ifndef SIMPLEREADER_JSONWRITER_H
+#define SIMPLEREADER_JSONWRITER_H
+
+#include "RowWriter.h"
+
+//
+// JsonWriter:  appends JSON text straight into one growing buffer.
+//
+//   For the row lists (/get, /getSince, /sync): column text goes from sqlite
+//   to the response body with one escaping pass, and no Json::Value tree in between.
+//   Commas are inserted for you; nesting is the caller's business.
+//
+//     JsonWriter w(4096);
+//     w.beginObject().key("ok").value(true).key("rows").beginArray();
+//     ...
+//     w.endArray().endObject();
+//
+class JsonWriter final : public RowWriter {
+public:
+    explicit JsonWriter(size_t reserveBytes = 4096) { out_.reserve(reserveBytes); }
+
+    JsonWriter& beginObject(void) override { sep(); out_ += '{'; comma_ = false; return *this; }
+    JsonWriter& endObject(void)   override { out_ += '}'; comma_ = true; return *this; }
+    JsonWriter& beginArray(void)  override { sep(); out_ += '['; comma_ = false; return *this; }
+    JsonWriter& endArray(void)    override { out_ += ']'; comma_ = true; return *this; }
+
+    using RowWriter::value;
+    JsonWriter& key(std::string_view k) override;
+    JsonWriter& value(std::string_view s) override;
+    JsonWriter& value(long long v) override;
+    JsonWriter& value(double v) override;
+    JsonWriter& value(bool b) override { sep(); out_ += b ? "true" : "false"; comma_ = true; return *this; }
+    JsonWriter& null(void)    override { sep(); out_ += "null"; comma_ = true; return *this; }
+
+    const std::string& str() const override { return out_; }
+    std::string take(void) override { comma_ = false; return std::move(out_); }
+    void drainTo(std::string& dest) override { dest += out_; out_.clear(); }
+
+    const char* mimeType() const override { return "application/json"; }
+
+private:
+    void sep(void) { if (comma_) out_ += ','; }
+    void quoted(std::string_view s);
+
+    std::string out_;
+    bool        comma_ = false;   // a value precedes: next key/value needs a ','
+};
+
+#endif // SIMPLEREADER_JSONWRITER_H
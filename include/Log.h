@@ -0,0 +1,105 @@
+#ifndef SIMPLEREADER_LOG_H
+#define SIMPLEREADER_LOG_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// Log:  syslog, off the request path
+//
+//   logMsg() is called like syslog(3). A message below the configured level returns before
+//   anything is formatted. Otherwise it is formatted straight into a slot of the calling
+//   thread's own ring (single producer, single consumer: no lock) and one background thread
+//   hands the slots to syslog. A full ring drops the message and counts it; the drain
+//   thread reports the count. When a thread exits its ring is kept, still drained, for the
+//   next thread that logs: short-lived threads (backups, scrub passes) don't add rings.
+//
+//   The same call site (format string) logging more than BURST times in a WINDOW_MS window
+//   on one thread is suppressed for the rest of that window, then summarised in one line.
+//
+//   Before start() and after stop() messages go straight to syslog, as they always did.
+//
+class Log {
+public:
+    static Log& get();
+
+    void start(void);
+    void stop(void);            // drains what's queued, then joins
+
+    void setLevel(int level) { level_.store(level, std::memory_order_relaxed); }
+    bool enabled(int level) const { return level <= level_.load(std::memory_order_relaxed); }
+
+    void write(int level, const char* fmt, va_list ap);
+
+    // "err", "info" or "debug" (anything else: info)
+    static int levelFromString(const std::string& s);
+
+private:
+    Log() = default;
+    ~Log();
+    Log(const Log&) = delete;
+    Log& operator=(const Log&) = delete;
+
+    static constexpr size_t    MAX_LINE  = 512;     // longer messages are truncated
+    static constexpr uint32_t  RING_SIZE = 256;     // slots per thread (power of two)
+    static constexpr int       BURST     = 20;      // per call site, per thread, per window
+    static constexpr long long WINDOW_MS = 10000;
+    static constexpr int       DRAIN_MS  = 20;      // how long the drain thread sleeps when idle
+
+    struct Entry {
+        int  level;
+        char text[MAX_LINE];
+    };
+
+    struct Ring {
+        std::array<Entry, RING_SIZE> slots;
+        std::atomic<uint32_t> head{0};              // written by the owning thread
+        std::atomic<uint32_t> tail{0};              // written by the drain thread
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    // repeat suppression, per thread: nothing is shared
+    struct Repeat {
+        const char* fmt = nullptr;
+        long long   windowStart = 0;
+        int         count = 0;
+        int         suppressed = 0;
+    };
+    static constexpr size_t REPEAT_SITES = 16;
+    struct ThreadState {
+        Ring* ring = nullptr;
+        std::array<Repeat, REPEAT_SITES> repeats;
+        ~ThreadState();             // thread exit: its ring goes on the free list
+    };
+    static ThreadState& local(void);
+
+    Ring* ringForThisThread(void);
+    void  releaseRing(Ring* ring);
+    bool  push(Ring* ring, int level, const char* fmt, va_list ap);
+    bool  pushf(Ring* ring, int level, const char* fmt, ...) __attribute__((format(printf, 4, 5)));
+    bool  drainOnce(void);          // true if anything was written
+    void  run(void);
+
+    std::atomic<int>  level_{6};    // LOG_INFO
+    std::atomic<bool> running_{false};
+
+    std::mutex              ringsMtx_;  // registration only
+    std::vector<Ring*>      rings_;     // all of them: as many as threads have logged at once
+    std::vector<Ring*>      free_;      // of those, the ones whose thread has exited
+    std::mutex              wakeMtx_;
+    std::condition_variable wake_;
+    bool                    stopping_ = false;
+    std::thread             thread_;
+};
+
+// like syslog(3), but queued (see Log)
+void logMsg(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif // SIMPLEREADER_LOG_H
@@ -0,0 +1,112 @@
+#ifndef SIMPLEREADER_METRICS_H
+#define SIMPLEREADER_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//
+// Metrics:  counters, latency histograms and gauges, scraped as Prometheus text at /metrics
+//
+//   Every thread that records gets its own shard of slots, so recording is a relaxed
+//   load and store on memory no other thread writes: no lock, no shared cache line.
+//   A scrape adds the shards up. Gauges are callbacks, read at scrape time.
+//
+//   Counters and histograms are registered once (at startup, or in a function-local
+//   static) and handed out as small handles. A default constructed handle records
+//   into a scratch area nobody reads, so code may record before registration runs.
+//
+class Metrics {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    class Counter {
+        public:
+            void inc(uint64_t n = 1) const;
+        private:
+            friend class Metrics;
+            uint32_t slot_ = 0;
+    };
+
+    // latency, in seconds: the same buckets for every histogram (100us .. 10s)
+    class Histogram {
+        public:
+            void observe(Clock::duration d) const;
+            void since(Clock::time_point start) const { observe(Clock::now() - start); }
+        private:
+            friend class Metrics;
+            uint32_t slot_ = 0;     // BUCKETS + 1 counts (the last is +Inf), then the sum in ns
+    };
+
+    // observes the time from construction to destruction
+    class Timer {
+        public:
+            explicit Timer(const Histogram& h) : h_(h), start_(Clock::now()) {}
+            ~Timer() { h_.since(start_); }
+            Timer(const Timer&) = delete;
+            Timer& operator=(const Timer&) = delete;
+        private:
+            Histogram         h_;
+            Clock::time_point start_;
+    };
+
+    static Metrics& get();
+
+    // `labels` is the inside of the braces, e.g.  route="/sync"  (or "" for none).
+    // One family per name; registering the same name and labels twice returns the same handle.
+    // A counter scrapes as value * scale (e.g. 1e-9 to count nanoseconds and show seconds).
+    Counter   counter  (const std::string& name, const std::string& help, const std::string& labels = "",
+                        double scale = 1.0);
+    Histogram histogram(const std::string& name, const std::string& help, const std::string& labels = "");
+    void      gauge    (const std::string& name, const std::string& help, std::function<double()> read,
+                        const std::string& labels = "");
+
+    // the text exposition format (version 0.0.4)
+    std::string scrape(void);
+
+private:
+    static constexpr size_t   BUCKETS         = 16;
+    static constexpr uint32_t HISTOGRAM_SLOTS = BUCKETS + 2;
+    static constexpr uint32_t MAX_SLOTS       = 4096;   // per shard: 32 KB a thread
+    static const double       BOUNDS[BUCKETS];           // upper bounds, seconds
+    static const int64_t      BOUNDS_NS[BUCKETS];
+
+    enum class Type { Counter, Histogram, Gauge };
+    struct Series {
+        std::string            labels;
+        uint32_t               slot = 0;
+        double                 scale = 1.0;
+        std::function<double()> read;       // gauges
+    };
+    struct Family {
+        std::string         name;
+        std::string         help;
+        Type                type;
+        std::vector<Series> series;
+    };
+    struct Shard {
+        std::unique_ptr<std::atomic<uint64_t>[]> v{new std::atomic<uint64_t>[MAX_SLOTS]()};
+    };
+
+    static void add(uint32_t slot, uint64_t n);     // into the calling thread's shard
+    Shard& localShard(void);
+    Family& familyLocked(const std::string& name, const std::string& help, Type type);   // mu_ held
+    uint64_t sumLocked(uint32_t slot) const;                                             // mu_ held
+    uint32_t allocLocked(uint32_t n);                                                    // mu_ held
+
+    std::mutex mu_;
+    std::vector<Family>                 families_;
+    std::vector<std::unique_ptr<Shard>> shards_;     // never freed: a thread's counts outlive it
+    uint32_t                            nextSlot_ = HISTOGRAM_SLOTS;   // [0, HISTOGRAM_SLOTS) is scratch
+
+    Metrics() = default;
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+};
+
+#endif // SIMPLEREADER_METRICS_H
@@ -0,0 +1,44 @@
+#ifndef SIMPLEREADER_ROWWRITER_H
+#define SIMPLEREADER_ROWWRITER_H
+
+#include <string>
+#include <string_view>
+
+//
+// RowWriter:  the wire encoding of a response body, written front to back.
+//
+//   Database list functions and the sync handlers write through this, so the same
+//   code produces JSON (JsonWriter, the default) or CBOR (CborWriter) for clients
+//   that ask for it with "Accept: application/cbor".
+//
+class RowWriter {
+public:
+    virtual ~RowWriter() = default;
+
+    virtual RowWriter& beginObject(void) = 0;
+    virtual RowWriter& endObject(void)   = 0;
+    virtual RowWriter& beginArray(void)  = 0;
+    virtual RowWriter& endArray(void)    = 0;
+
+    virtual RowWriter& key(std::string_view k)   = 0;
+    virtual RowWriter& value(std::string_view s) = 0;
+    virtual RowWriter& value(long long v)        = 0;
+    virtual RowWriter& value(double v)           = 0;
+    virtual RowWriter& value(bool b)             = 0;
+    virtual RowWriter& null(void)                = 0;
+
+    RowWriter& value(const char* s) { return value(std::string_view(s ? s : "")); }   // null column -> ""
+    RowWriter& value(const std::string& s) { return value(std::string_view(s)); }
+
+    // the encoded body so far; take() leaves the writer empty
+    virtual const std::string& str() const = 0;
+    virtual std::string take(void) = 0;
+
+    // a body sent in pieces: append what's written so far to `dest` and carry on from
+    // where it stopped (unlike take(), the document stays open)
+    virtual void drainTo(std::string& dest) = 0;
+
+    virtual const char* mimeType() const = 0;
+};
+
+#endif // SIMPLEREADER_ROWWRITER_H
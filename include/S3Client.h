@@ -0,0 +1,57 @@
+#ifndef SIMPLEREADER_S3CLIENT_H
+#define SIMPLEREADER_S3CLIENT_H
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <drogon/drogon.h>
+
+//
+// S3Client:  the few S3 calls the library needs, signed with AWS Signature V4
+//
+//   Path-style requests (endpoint/bucket/key), so AWS, MinIO, Ceph RGW, R2... all work
+//   from just an endpoint URL. Every call is synchronous and throws std::runtime_error:
+//   call them from a worker thread, never from a Drogon IO loop.
+//
+class S3Client {
+public:
+    struct Options {
+        std::string endpoint;       // https://s3.eu-west-1.amazonaws.com, http://127.0.0.1:9100 ...
+        std::string region;         // as signed (MinIO accepts any, usually us-east-1)
+        std::string bucket;
+        std::string accessKey;
+        std::string secretKey;
+    };
+
+    explicit S3Client(Options o);
+
+    // upload a local file as `key`: one PUT if it fits in a part, else a multipart upload
+    // of `partBytes` parts (aborted if any part fails, so no orphaned parts are left billed)
+    void putFile(const std::string& key, const std::filesystem::path& file, long long size, long long partBytes);
+
+    // download `key` (`size` bytes) into `dst`, in ranged GETs of `partBytes`
+    void getFile(const std::string& key, long long size, const std::filesystem::path& dst, long long partBytes);
+
+    // a GET URL anyone can use for `seconds`, answered as an attachment named `fileName`
+    std::string presign(const std::string& key, int seconds, const std::string& fileName) const;
+
+private:
+    using Query = std::map<std::string, std::string>;   // sorted: as canonical requests want them
+
+    // sign and send one request; throws on a transport error, or a status outside 2xx
+    drogon::HttpResponsePtr send(drogon::HttpMethod method, const std::string& key, const Query& query,
+                                 std::string body, const std::map<std::string, std::string>& headers = {});
+
+    std::string objectPath(const std::string& key) const;
+
+    // hex signature of a string to sign, with the key derived for that day
+    std::string signature(const std::string& dateStamp, const std::string& toSign) const;
+
+    const Options                       o_;
+    std::string                         host_;      // the Host header (and signed as such)
+    std::shared_ptr<drogon::HttpClient> client_;
+};
+
+#endif // SIMPLEREADER_S3CLIENT_H
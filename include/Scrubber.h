@@ -0,0 +1,86 @@
+#ifndef SIMPLEREADER_SCRUBBER_H
+#define SIMPLEREADER_SCRUBBER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+//
+// Scrubber:  keeps the library honest, in the background
+//
+//   A thread of its own walks the books table (from Database's books cache), reading each
+//   local book back and checking its size and sha256 against its row, at most scrubmbps
+//   MB a second so downloads keep the disk. The outcome goes into a table in memory, and
+//   GET /book and the upload dedupe ask that instead of the filesystem: a book found ok is
+//   served without a stat, one found missing or damaged is refused until a later pass finds
+//   it mended, or someone uploads it again (mend()).
+//
+//   The first pass starts with a sweep of stats, so every book has a state within seconds
+//   of startup; books it hasn't got to yet (and books in an object store, which this node
+//   only holds copies of) are checked per request, as before. A full pass runs every
+//   scrubhours; both keys are reloadable, and scrubmbps=0 pauses it.
+//
+//   How many books are in each state, and the bytes read, are exported as metrics.
+//
+class Scrubber {
+public:
+    static Scrubber& get();
+
+    enum class State : int {
+        Unknown,        // not checked yet (or not ours to check): look for yourself
+        Present,        // there, and the right size; not re-hashed yet
+        Ok,             // its sha256 matched
+        Missing,
+        WrongSize,
+        Corrupt,        // the right size, but not the bytes that were uploaded
+        Count
+    };
+    static const char* name(State s);
+
+    // metrics, and the scrub thread (after Database::open)
+    void start(void);
+
+    // stop the scrub thread, mid-book if need be (before Database::close)
+    void stop(void);
+
+    State state(const std::string& fileId);
+
+    // a book just written and hashed by an upload (books not under a local path are ignored)
+    void verified(const std::string& fileId, const std::string& location);
+
+    // an upload of a book we already have, now verified at `fresh`: if the copy at the
+    // book's own location was found missing or damaged, put this one in its place
+    void mend(const std::string& fileId, const std::string& fresh);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t READ_BYTES = 1 << 20;     // per read(2), and per throttle step
+    static constexpr int    PAUSED_SECS = 10;         // rechecks scrubmbps this often while it's 0
+
+    void   run(void);                                  // scrub thread
+    State  check(const std::string& location, long long size, const std::string& sha256, Clock::time_point& due);
+    void   record(const std::string& fileId, const std::string& location, State s);
+    bool   sleepUntil(Clock::time_point t);            // false if stopping
+
+    std::shared_mutex                      mu_;        // states_
+    std::unordered_map<std::string, State> states_;
+    std::atomic<long long>                 counts_[static_cast<size_t>(State::Count)] = {};
+
+    std::mutex              stopMu_;
+    std::condition_variable stopCv_;
+    bool                    stopping_ = false;
+    std::thread             thread_;
+
+    Scrubber() = default;
+    ~Scrubber() { stop(); }
+    Scrubber(const Scrubber&) = delete;
+    Scrubber& operator=(const Scrubber&) = delete;
+};
+
+#endif // SIMPLEREADER_SCRUBBER_H
@@ -0,0 +1,55 @@
+#ifndef SIMPLEREADER_SESSIONBACKEND_H
+#define SIMPLEREADER_SESSIONBACKEND_H
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+//
+// SessionBackend:  where sessions live, beyond SessionManager's in-process cache
+//
+//   local:  this process is the only one issuing and checking tokens, so its cache is the
+//           whole truth (a miss means "no such session"). Optionally persisted to the db
+//           (persistsessions=1) so a restart doesn't log everyone out.
+//   redis:  shared by every instance behind the balancer. A token issued by one instance
+//           is found by the others on their first miss (one round trip); after that they
+//           answer from their own cache until it expires.
+//
+//   Keys are SessionManager's token hashes: neither backend ever sees a token.
+//
+class SessionBackend {
+public:
+    struct Record {
+        std::string username;
+        std::string device;
+        long long   expiresAt = 0;      // epoch millis (UTC)
+    };
+
+    virtual ~SessionBackend() = default;
+
+    virtual const char* name(void) const = 0;
+
+    // whether a cache miss is final (nothing to fetch)
+    virtual bool authoritative(void) const = 0;
+
+    // a new session: once this returns, every instance can find it. Throws std::runtime_error.
+    virtual void store(const std::string& key, const Record& r) = 0;
+
+    // a session the cache doesn't hold (never called when authoritative); false if there isn't one.
+    // May block for a round trip (bounded: it's called on an IO loop) on a cache miss.
+    virtual bool fetch(const std::string& key, Record& out) = 0;
+
+    // sessions to put straight into the cache at startup
+    virtual void preload(std::vector<std::pair<std::string, Record>>& out) { (void)out; }
+
+    // the cache has just dropped sessions that expired by `nowMs`
+    virtual void expired(long long nowMs) { (void)nowMs; }
+};
+
+std::unique_ptr<SessionBackend> makeLocalSessionBackend(bool persist);
+
+// throws std::runtime_error if built without Redis support
+std::unique_ptr<SessionBackend> makeRedisSessionBackend(const std::string& host, int port, const std::string& password);
+
+#endif // SIMPLEREADER_SESSIONBACKEND_H
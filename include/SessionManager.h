@@ -1,16 +1,36 @@
 #ifndef SIMPLEREADER_SESSIONMANAGER_H
 #define SIMPLEREADER_SESSIONMANAGER_H
 
+#include <array>
+#include <atomic>
 #include <unordered_map>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <vector>
 #include <chrono>
 
 #include <drogon/drogon.h>
 
+#include "SessionBackend.h"
+
 //
 // SessionManager:  handles authorisation tokens
 //
+//   Sessions are spread over SHARDS independently locked maps (by token hash), so
+//   validating a token takes one shared lock on one shard and never contends with logins.
+//   Expiry is driven by a hashed timer wheel ticked from a Drogon timer: each tick
+//   only visits the tokens filed under that slot, never the whole map.
+//
+//   Sessions are keyed by a hash of the token, never the token itself, so that with
+//   persistence on (persistsessions=1) the db only ever holds hashes.
+//
+//   The maps are a cache in front of a SessionBackend. With the local one they hold every
+//   session there is. With a shared one (several instances) a miss is fetched once and
+//   cached until the session expires; an unknown token is remembered as such for
+//   NEGATIVE_SECS, so a client retrying a stale token doesn't cost a round trip each time.
+//
 class SessionManager {
 public:
     using Clock = std::chrono::system_clock;
@@ -19,6 +39,13 @@ public:
         const std::chrono::time_point<Clock> expiry;
     };
 
+    // who a valid token belongs to; shared by every request that presents the token
+    struct Identity {
+        std::string username;
+        std::string device;
+    };
+    using IdentityPtr = std::shared_ptr<const Identity>;
+
     // robust singleton - no copying or assignment
     SessionManager(const SessionManager&) = delete;
     SessionManager& operator=(const SessionManager&) = delete;
@@ -27,31 +54,62 @@ public:
 
     static SessionManager& instance();  // singleton instance
 
-    // add a session for this user and return token/expiry
+    // add a session for this user and return token/expiry.
+    // Throws std::runtime_error if the backend can't store it.
     SessionToken add(const std::string& username,
                      const std::string& device);
 
+    // returns the session's identity if token valid, else nullptr. No copies, one shard lock.
+    IdentityPtr identify(const drogon::HttpRequestPtr& req);
+    IdentityPtr identify(const std::string& token);
+
     // returns username if token valid (non-empty), else empty string.
     std::string usernameIfValid(const drogon::HttpRequestPtr& req);
     std::string usernameIfValid(const std::string& token);
     
-    bool isValid(const std::string& token) { return !usernameIfValid(token).empty(); }
+    bool isValid(const std::string& token) { return identify(token) != nullptr; }
+
+    // start the expiry timer on Drogon's main loop (call once, before app().run())
+    void startExpiryTimer(void);
+
+    // sessions held right now, across every shard (for /metrics)
+    size_t liveSessions(void);
+
+    // where sessions are kept beyond this cache, and whatever it has to preload
+    // (call once, after Database::open and WriteQueue::start, before serving)
+    void setBackend(std::unique_ptr<SessionBackend> backend);
 
 private:
     struct Session {
-        std::string username;
-        std::string device;
+        IdentityPtr who;                        // nullptr: a token the backend doesn't know
         std::chrono::time_point<Clock> expires;
     };
 
-    SessionManager() = default; // singleton
+    static constexpr size_t SHARDS       = 16;
+    static constexpr size_t WHEEL_SLOTS  = 512;    // one lap = WHEEL_SLOTS * TICK_SECS (~85 mins)
+    static constexpr int    TICK_SECS    = 10;
+    static constexpr int    NEGATIVE_SECS = 5;     // how long an unknown token stays unknown
+
+    struct Shard {
+        std::shared_mutex mu;
+        std::unordered_map<std::string, Session> sessions;
+        std::array<std::vector<std::string>, WHEEL_SLOTS> wheel;   // tokens, filed by expiry tick
+    };
+
+    SessionManager(); // singleton
 
     std::string bearerToken(const drogon::HttpRequestPtr& req);
     std::string makeToken(size_t bytes = 32);   // create a token
-    void pruneExpired();                        // deletes old tokens
+    static std::string tokenKey(const std::string& token);    // what we store: hex hash of the token
+    Shard& shardFor(const std::string& key);
+    void insert(const std::string& key, IdentityPtr who, std::chrono::time_point<Clock> expires);
+    static long long tickOf(std::chrono::time_point<Clock> t);
+    void expireTick(void);                      // timer: drop tokens due in the current slot
+    IdentityPtr fetch(const std::string& key);  // a cache miss, from a shared backend
 
-    std::unordered_map<std::string, Session> sessions_;
-    std::mutex mu_;
+    std::array<Shard, SHARDS> shards_;
+    long long lastTick_ = -1;                   // last tick processed (timer thread only)
+    std::unique_ptr<SessionBackend> backend_;
 };
 
-#endif // SIMPLEREADER_SESSIONMANAGER_H
\ No newline at end of file
+#endif // SIMPLEREADER_SESSIONMANAGER_H
@@ -0,0 +1,51 @@
+#ifndef SIMPLEREADER_STAGEDFILE_H
+#define SIMPLEREADER_STAGEDFILE_H
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+#include <sodium.h>
+
+//
+// StagedFile:  an incoming book, written once and hashed as it is written.
+//
+//   The staging file lives in a ".staging" directory inside the destination directory,
+//   so commit() is always a same-filesystem rename: no second copy, no re-read to hash.
+//   Destroying an uncommitted StagedFile removes it.
+//
+class StagedFile {
+public:
+    // create a new, empty staging file under `dir`/.staging (throws std::runtime_error)
+    explicit StagedFile(const std::filesystem::path& dir);
+    ~StagedFile();
+
+    StagedFile(const StagedFile&) = delete;
+    StagedFile& operator=(const StagedFile&) = delete;
+
+    // write `len` bytes at the end of the file and add them to the running SHA-256
+    void append(const char* data, size_t len);
+
+    long long size() const { return size_; }
+
+    // time spent hashing so far (for upload metrics)
+    std::chrono::nanoseconds hashTime() const { return hashTime_; }
+
+    // lowercase hex SHA-256 of everything appended (ends hashing: call once, after the last append)
+    std::string sha256Hex(void);
+
+    // fsync and rename into place as `dst` (same filesystem as the staging dir)
+    void commit(const std::filesystem::path& dst);
+
+    const std::filesystem::path& path() const { return path_; }
+
+private:
+    std::filesystem::path    path_;
+    int                      fd_   = -1;
+    long long                size_ = 0;
+    crypto_hash_sha256_state sha_;
+    bool                     committed_ = false;
+    std::chrono::nanoseconds hashTime_{0};
+};
+
+#endif // SIMPLEREADER_STAGEDFILE_H
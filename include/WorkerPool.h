@@ -0,0 +1,46 @@
+#ifndef SIMPLEREADER_WORKERPOOL_H
+#define SIMPLEREADER_WORKERPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// WorkerPool:  a fixed number of threads for slow, CPU-bound work (eg argon2),
+//              so it never runs on a Drogon IO loop.
+//
+//   `threads` caps how many tasks run at once; `maxQueued` caps how many may wait.
+//   Beyond that trySubmit() refuses, and the caller sheds the request.
+//
+class WorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    WorkerPool(const std::string& name, size_t threads, size_t maxQueued);
+    ~WorkerPool();                      // finishes queued tasks, then joins
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // queue a task; false if the queue is full (task not run)
+    bool trySubmit(Task task);
+
+    size_t queued(void);                // tasks waiting (not yet running)
+
+private:
+    void run(void);                     // worker thread
+
+    const std::string        name_;
+    const size_t             maxQueued_;
+    std::deque<Task>         queue_;
+    std::mutex               mu_;
+    std::condition_variable  cv_;
+    std::vector<std::thread> threads_;
+    bool                     stopping_ = false;
+};
+
+#endif // SIMPLEREADER_WORKERPOOL_H
@@ -0,0 +1,93 @@
+#ifndef SIMPLEREADER_WRITEQUEUE_H
+#define SIMPLEREADER_WRITEQUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Database;
+
+//
+// WriteQueue:  group commit for every mutating request
+//
+//   Handlers submit a job (the db work for one request) and return.  A single writer
+//   thread collects whatever jobs arrive within a short window, runs them back to back
+//   in one Database::WriteTxn (each under its own Savepoint) and commits once.  Only
+//   then is each job's `done` called, so a client never sees an ack for an uncommitted write.
+//
+//   jobs run on the writer thread with the transaction held: Database reads there see
+//   the batch's own writes, and must not block on anything else.
+//
+//   With a sharded Database there is one writer thread (a lane) per shard besides the one
+//   for app.db: a job that writes a user's rows goes in with submitFor(username), and
+//   commits alongside other jobs for that shard only. Its reads of app.db (bookExists)
+//   still work, outside the transaction.
+//
+class WriteQueue {
+public:
+    using Job  = std::function<void()>;             // throws to roll back just this job
+    using Done = std::function<void(bool ok)>;      // ok: job ran and its changes are committed
+
+    // robust singleton - no copying or assignment
+    WriteQueue(const WriteQueue&) = delete;
+    WriteQueue& operator=(const WriteQueue&) = delete;
+
+    static WriteQueue& get();   // singleton instance
+
+    // start the writer threads (after Database::open). Batches close after `windowMs`
+    // or `maxBatch` jobs, whichever comes first.
+    void start(int windowMs = 2, size_t maxBatch = 256);
+
+    // change the batch window and size while running (from the next batch on)
+    void tune(int windowMs, size_t maxBatch);
+
+    // run what's queued, then stop the writer threads (before Database::close)
+    void stop(void);
+
+    // queue a job writing app.db's own tables; `done` runs on the writer thread after the
+    // commit (or failure)
+    void submit(Job job, Done done);
+
+    // ditto, for a job writing `username`'s rows: on that user's shard's lane
+    void submitFor(const std::string& username, Job job, Done done);
+
+    // jobs waiting for a batch, across the lanes (see Admission)
+    size_t depth(void) const { return queued_.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        Job  job;
+        Done done;
+    };
+
+    // one writer thread and its queue, committing to one Database (app.db or a shard)
+    struct Lane {
+        Database*               db = nullptr;
+        std::deque<Entry>       queue;
+        std::mutex              mu;
+        std::condition_variable cv;
+        std::thread             thread;
+        bool                    stopping = false;
+        bool                    running  = false;
+    };
+
+    WriteQueue() = default;     // singleton
+
+    void enqueue(Lane& lane, Job job, Done done);
+    void run(Lane& lane);               // writer thread
+    void commitBatch(Lane& lane, std::deque<Entry>& batch);
+
+    std::mutex                         mu_;        // start/stop
+    std::vector<std::unique_ptr<Lane>> lanes_;     // [0]: app.db, [1 + i]: shard i
+    std::atomic<int>                   windowMs_{2};
+    std::atomic<size_t>                maxBatch_{256};
+    std::atomic<size_t>                queued_{0};
+};
+
+#endif // SIMPLEREADER_WRITEQUEUE_H
@@ -0,0 +1,6 @@
+#ifndef SIMPLEREADER_BACKUP_HANDLER_H
+#define SIMPLEREADER_BACKUP_HANDLER_H
+
+int registerBackupHandler(void);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef SIMPLEREADER_BOOKMETA_HANDLER_H
+#define SIMPLEREADER_BOOKMETA_HANDLER_H
+
+int registerBookMetaHandlers(void);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef SIMPLEREADER_BOOTSTRAP_H
+#define SIMPLEREADER_BOOTSTRAP_H
+
+int registerBootstrapHandler(void);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef SIMPLEREADER_METRICS_HANDLER_H
+#define SIMPLEREADER_METRICS_HANDLER_H
+
+int registerMetricsHandler(void);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef SIMPLEREADER_SYNC_H
+#define SIMPLEREADER_SYNC_H
+
+int registerSyncHandler(void);
+
+#endif
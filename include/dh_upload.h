@@ -0,0 +1,6 @@
+#ifndef SIMPLEREADER_UPLOAD_H
+#define SIMPLEREADER_UPLOAD_H
+
+int registerUploadHandlers(void);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef SIMPLEREADER_WATCH_H
+#define SIMPLEREADER_WATCH_H
+
+int registerWatchHandler(void);
+
+#endif
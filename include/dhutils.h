@@ -1,9 +1,56 @@
 #ifndef SIMPLEREADER_DHUTILS_H
 #define SIMPLEREADER_DHUTILS_H
 
+#include <memory>
 #include <string>
 #include <drogon/drogon.h>
 
+#include "Database.h"
+#include "Metrics.h"
+#include "RowWriter.h"
+
 bool parseItemId(const Json::Value& v, long long& out);
 
-#endif // SIMPLEREADER_UTILS_H
\ No newline at end of file
+// /getSince keyset cursor <-> JSON {"ts":..., "fileId":"...", "id":...}
+bool parseCursor(const Json::Value& v, Database::Cursor& out);
+void writeCursor(RowWriter& out, const Database::Cursor& c);
+
+// wire encoding of the sync endpoints: JSON by default, CBOR on request
+//   request body:  CBOR if "Content-Type: application/cbor", else JSON (nullptr if unparseable)
+//   response:      CBOR if "Accept: application/cbor"
+bool wantsCbor(const drogon::HttpRequestPtr& req);
+std::shared_ptr<Json::Value> requestBody(const drogon::HttpRequestPtr& req);
+std::unique_ptr<RowWriter> makeRowWriter(bool cbor, size_t reserveBytes);
+
+// a 200 response whose body is already written (takes the writer's buffer)
+drogon::HttpResponsePtr rowResponse(RowWriter& out);
+
+// a 200 response of a (small) Json::Value document, in either encoding
+void writeValue(RowWriter& out, const Json::Value& v);
+drogon::HttpResponsePtr valueResponse(bool cbor, const Json::Value& j);
+
+// uploads: an existing book (row + file) for this content, or ""
+std::string findStoredBook(const std::string& sha256, long long size);
+
+// uploads: put the book now at BookStorage's incoming(newId) into the library, then submitBookRecord()
+void storeBook(const std::string& newId, const std::string& sha256, long long size,
+               const std::string& clientFileName,
+               std::function<void (const drogon::HttpResponsePtr &)> &&cb);
+
+// uploads: insert the "books" row via the WriteQueue, then answer the client. `held`
+// (BookStorage::hold) is let go of once BookMeta has read the book.
+void submitBookRecord(const std::string& newId, const std::string& sha256, long long size,
+                      const std::string& location, const std::string& clientFileName,
+                      std::shared_ptr<void> held,
+                      std::function<void (const drogon::HttpResponsePtr &)> &&cb);
+
+// /metrics: latency of one route, from the handler being called until its response is sent.
+// timeResponse() wraps `cb` to do the recording, wherever (and on whatever thread) it is answered.
+Metrics::Histogram routeLatency(const char* route);
+void timeResponse(const Metrics::Histogram& latency, std::function<void (const drogon::HttpResponsePtr &)>& cb);
+
+// admin endpoints: sent from this host, and not forwarded by the reverse proxy
+// (which connects from loopback too, but adds X-Forwarded-For)
+bool fromLocalAdmin(const drogon::HttpRequestPtr& req);
+
+#endif // SIMPLEREADER_UTILS_H
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+#include <drogon/drogon.h>
+
+#include "Admission.h"
+#include "SessionManager.h"
+#include "WriteQueue.h"
+#include "Config.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "utils.h"
+
+static const Metrics::Counter limitedCount = Metrics::get().counter(
+    "simplereader_admission_rejected_total", "Requests answered 429 before their handler ran, by why.", "reason=\"rate_limit\"");
+static const Metrics::Counter shedCount = Metrics::get().counter(
+    "simplereader_admission_rejected_total", "Requests answered 429 before their handler ran, by why.", "reason=\"overloaded\"");
+
+Admission& Admission::get() {
+    static Admission instance;
+    return instance;
+}
+
+static Admission::Kind kindOf(const std::string& path) {
+    using Kind = Admission::Kind;
+    if (path == "/update" || path == "/delete" || path.rfind("/upload", 0) == 0)
+        return Kind::Write;
+    if (path == "/check" || path == "/get" || path == "/getSince" || path == "/sync" ||
+        path == "/bootstrap" || path == "/resolve" || path == "/watch" ||
+        path.rfind("/bookMeta", 0) == 0 || path.rfind("/bookCover/", 0) == 0)
+        return Kind::Read;
+    if (path.rfind("/book/", 0) == 0)
+        return Kind::Book;
+    return Kind::None;
+}
+
+// what the p99 is taken over: requests whose time is the server's, not the client's
+// (a /watch parks until something changes; uploads and /bootstrap go at the client's pace)
+static bool timed(Admission::Kind k, const std::string& path) {
+    return (k == Admission::Kind::Read && path != "/watch" && path != "/bootstrap") ||
+           path == "/update" || path == "/delete";
+}
+
+static void reject(drogon::AdviceCallback& acb, const char* reason, double waitSecs) {
+    Json::Value j;
+    j["ok"]     = false;
+    j["error"]  = "busy";
+    j["reason"] = reason;
+    auto resp = drogon::HttpResponse::newHttpJsonResponse(j);
+    resp->setStatusCode(drogon::k429TooManyRequests);
+    resp->addHeader("Retry-After", std::to_string(std::max(1LL, static_cast<long long>(std::ceil(waitSecs)))));
+    acb(resp);
+}
+
+void Admission::start(void) {
+    drogon::app().registerPreHandlingAdvice(
+        [this](const drogon::HttpRequestPtr& req, drogon::AdviceCallback&& acb, drogon::AdviceChainCallback&& accb) {
+            const Kind k = kindOf(req->path());
+            if (k == Kind::None) return accb();
+
+            if (const char* why = shedding(k)) {
+                shedCount.inc();
+                return reject(acb, why, SHED_WINDOW_SECS);
+            }
+
+            const auto who = SessionManager::instance().identify(req);
+            if (who) {
+                const double wait = take(who->username, k);
+                if (wait > 0) {
+                    limitedCount.inc();
+                    logMsg(SYSLOG_DEBUG, "Admission: rate limit for user [%s] on %s", who->username.c_str(), req->path().c_str());
+                    return reject(acb, "rate limit", wait);
+                }
+            }
+            accb();
+        });
+
+    drogon::app().registerPostHandlingAdvice(
+        [this](const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr&) {
+            const Kind k = kindOf(req->path());
+            if (k == Kind::None || !timed(k, req->path())) return;
+            record(trantor::Date::now().microSecondsSinceEpoch() - req->creationDate().microSecondsSinceEpoch());
+        });
+
+    drogon::app().getLoop()->runEvery(SHED_WINDOW_SECS, [this]{ closeWindow(); });
+    drogon::app().getLoop()->runEvery(IDLE_SECS, [this]{ dropIdle(); });
+
+    Metrics::get().gauge("simplereader_admission_p99_seconds",
+                         "p99 latency of reads and writes over the last admission window (0: too few to tell).",
+                         [this]{ return p99Micros_.load() / 1e6; });
+}
+
+double Admission::take(const std::string& username, Kind k) {
+    const Config& cfg = Config::get();
+    int rate = 0, burst = 0;
+    switch (k) {
+        case Kind::Read:  rate = cfg.readRate();  burst = cfg.readBurst();  break;
+        case Kind::Write: rate = cfg.writeRate(); burst = cfg.writeBurst(); break;
+        case Kind::Book:  rate = cfg.bookRate();  burst = cfg.bookBurst();  break;
+        default:          return 0;
+    }
+    if (rate <= 0) return 0;
+    burst = std::max(burst, 1);
+
+    const auto now = Clock::now();
+    Shard& sh = shards_[std::hash<std::string>{}(username) % SHARDS];
+    std::lock_guard<std::mutex> lk(sh.mu);
+    Bucket& b = sh.users[username][static_cast<size_t>(k)];
+    if (b.tokens < 0)
+        b.tokens = burst;
+    else
+        b.tokens = std::min<double>(burst, b.tokens + std::chrono::duration<double>(now - b.last).count() * rate);
+    b.last = now;
+
+    if (b.tokens >= 1) {
+        b.tokens -= 1;
+        return 0;
+    }
+    return (1 - b.tokens) / rate;
+}
+
+const char* Admission::shedding(Kind k) {
+    const Config& cfg = Config::get();
+    if (k == Kind::Write) {
+        const int maxQueued = cfg.shedQueue();
+        if (maxQueued > 0 && WriteQueue::get().depth() > static_cast<size_t>(maxQueued))
+            return "write queue full";
+    }
+    if ((k == Kind::Read || k == Kind::Write) && cfg.shedP99Ms() > 0 && overloaded_.load()) {
+        if (probes_.fetch_add(1, std::memory_order_relaxed) % PROBE_EVERY == 0)
+            return nullptr;         // its latency tells closeWindow whether we've recovered
+        shed_.fetch_add(1, std::memory_order_relaxed);
+        return "overloaded";
+    }
+    return nullptr;
+}
+
+// a sample per request, overwriting the oldest: the window's latest SAMPLES
+void Admission::record(long long micros) {
+    const uint64_t n = recorded_.fetch_add(1, std::memory_order_relaxed);
+    samples_[n % SAMPLES].store(static_cast<uint32_t>(std::clamp(micros, 0LL, 0xffffffffLL)), std::memory_order_relaxed);
+}
+
+// a window of latencies: start shedding once its p99 is over shedp99ms, stop once it's well
+// under. While shedding only the probes are timed, so fewer of them will do (their p99 is
+// then near their worst). A window with too few latencies but many 429s says nothing either
+// way: we stay as we were. One with few of both is quiet: whatever the load was, it's gone.
+void Admission::closeWindow(void) {
+    const uint64_t recorded = recorded_.exchange(0);
+    const uint64_t shed     = shed_.exchange(0);
+    const long long maxP99  = Config::get().shedP99Ms() * 1000LL;
+    const bool wasOver = overloaded_.load();
+
+    const size_t n = static_cast<size_t>(std::min<uint64_t>(recorded, SAMPLES));
+    long long p99 = 0;
+    bool isOver = false;
+    if (n >= (wasOver ? MIN_SAMPLES / PROBE_EVERY : MIN_SAMPLES)) {
+        std::vector<uint32_t> v(n);
+        for (size_t i = 0; i < n; ++i)
+            v[i] = samples_[i].load(std::memory_order_relaxed);
+        const size_t at = n - 1 - n / 100;
+        std::nth_element(v.begin(), v.begin() + at, v.end());
+        p99 = v[at];
+        isOver = maxP99 > 0 && (wasOver ? p99 * 100 >= maxP99 * RECOVER_PCT : p99 > maxP99);
+    } else if (recorded + shed >= MIN_SAMPLES) {
+        p99 = p99Micros_.load();        // busy, but too few let through to tell: as we were
+        isOver = maxP99 > 0 && wasOver;
+    }
+    p99Micros_ = p99;
+    overloaded_ = isOver;
+    if (isOver != wasOver)
+        logMsg(isOver ? SYSLOG_ERR : SYSLOG_INFO, "Admission: p99 %lld ms, %s", p99 / 1000,
+               isOver ? "shedding reads and writes" : "no longer shedding");
+}
+
+void Admission::dropIdle(void) {
+    const auto before = Clock::now() - std::chrono::seconds(IDLE_SECS);
+    for (auto& sh : shards_) {
+        std::lock_guard<std::mutex> lk(sh.mu);
+        for (auto it = sh.users.begin(); it != sh.users.end(); ) {
+            const bool idle = std::all_of(it->second.begin(), it->second.end(),
+                                          [&](const Bucket& b){ return b.tokens < 0 || b.last < before; });
+            it = idle ? sh.users.erase(it) : std::next(it);
+        }
+    }
+}
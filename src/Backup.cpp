@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <vector>
+
+#include <drogon/drogon.h>
+
+#include "Backup.h"
+#include "Config.h"
+#include "Database.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+static const Metrics::Counter backupsOk = Metrics::get().counter(
+    "simplereader_backups_total", "Online backups finished, by outcome.", "result=\"ok\"");
+static const Metrics::Counter backupsFailed = Metrics::get().counter(
+    "simplereader_backups_total", "Online backups finished, by outcome.", "result=\"failed\"");
+
+Backup& Backup::get() {
+    static Backup instance;
+    return instance;
+}
+
+void Backup::start(void) {
+    Metrics& m = Metrics::get();
+    m.gauge("simplereader_backup_running", "1 while an online backup is being taken.",
+            [this]{ return running_.load() ? 1.0 : 0.0; });
+    m.gauge("simplereader_backup_progress_ratio", "Pages copied out of the database's pages, by the running (or last) backup.",
+            [this]{ const int total = pagesTotal_.load(); return total > 0 ? static_cast<double>(pagesDone_.load()) / total : 0.0; });
+    m.gauge("simplereader_backup_last_success_timestamp_seconds", "When the last successful backup finished (0: none yet).",
+            [this]{ std::lock_guard<std::mutex> lk(mu_); return status_.lastOkAt / 1000.0; });
+    m.gauge("simplereader_backup_last_duration_seconds", "How long the last successful backup took.",
+            [this]{ std::lock_guard<std::mutex> lk(mu_); return status_.lastSeconds; });
+
+    const int hours = Config::get().backupHours();
+    if (hours == 0) {
+        logMsg(SYSLOG_INFO, "Backup: on request only, into %s", Config::get().backupDir().c_str());
+        return;
+    }
+    drogon::app().getLoop()->runEvery(hours * 3600.0, [this]{
+        std::string reason;
+        if (!trigger(reason))
+            logMsg(SYSLOG_INFO, "Backup: scheduled backup skipped: %s", reason.c_str());
+    });
+    logMsg(SYSLOG_INFO, "Backup: every %d hour(s), into %s", hours, Config::get().backupDir().c_str());
+}
+
+void Backup::stop(void) {
+    abandon_ = true;
+    std::thread t;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        t = std::move(thread_);
+    }
+    if (t.joinable()) t.join();     // outside mu_: run() takes it to record the outcome
+}
+
+bool Backup::trigger(std::string& reason) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (running_) {
+        reason = "a backup is already running";
+        return false;
+    }
+    if (thread_.joinable()) thread_.join();     // the last one: finished
+    abandon_    = false;
+    running_    = true;
+    pagesDone_  = 0;
+    pagesTotal_ = 0;
+    thread_ = std::thread([this]{ run(); });
+    return true;
+}
+
+Backup::Status Backup::status(void) {
+    std::lock_guard<std::mutex> lk(mu_);
+    Status s = status_;
+    s.running    = running_;
+    s.pagesDone  = pagesDone_;
+    s.pagesTotal = pagesTotal_;
+    return s;
+}
+
+void Backup::run(void) {
+    const Config& cfg = Config::get();
+    const std::string dir = cfg.backupDir();
+    const auto start = std::chrono::steady_clock::now();
+
+    char stamp[32];
+    const std::time_t now = std::time(nullptr);
+    std::tm tm{};
+    gmtime_r(&now, &tm);
+    std::strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S", &tm);
+    const std::string file = dir + "/app-" + stamp + ".db";
+
+    // each shard as app-<time>.shard-03.db, then app.db: one after the other, each consistent
+    // on its own. The shards' rows refer to users and books in app.db, so app.db is copied
+    // last: everything a shard's copy refers to was in app.db before its copy started, and
+    // neither is ever removed, so it's in app.db's copy too.
+    Database& db = Database::get();
+    std::vector<std::pair<Database*, std::string>> copies;
+    for (size_t i = 0; i < db.shardCount(); ++i) {
+        char tag[32];
+        std::snprintf(tag, sizeof tag, ".shard-%02zu.db", i);
+        copies.emplace_back(&db.shard(i), dir + "/app-" + stamp + tag);
+    }
+    copies.emplace_back(&db, file);
+
+    std::string error;
+    try {
+        fs::create_directories(dir);
+        int before = 0;     // pages of the files already copied
+        for (const auto& [from, to] : copies) {
+            const std::string part = to + ".part";
+            fs::remove(part);
+            from->backupTo(part, cfg.backupPages(), std::chrono::milliseconds(cfg.backupPauseMs()),
+                [this, before](int remaining, int total) {
+                    pagesTotal_ = before + total;
+                    pagesDone_  = before + total - remaining;
+                    return !abandon_.load();
+                });
+            before = pagesTotal_;
+        }
+        // only a complete copy gets the .db names (app.db's last: prune goes by it)
+        for (const auto& c : copies)
+            fs::rename(c.second + ".part", c.second);
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        std::error_code ec;
+        for (const auto& c : copies) {
+            fs::remove(c.second + ".part", ec);
+            fs::remove(c.second, ec);
+        }
+    }
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        status_.lastError = error;
+        if (error.empty()) {
+            status_.lastOkAt    = nowMs();
+            status_.lastSeconds = secs;
+            status_.lastFile    = file;
+        }
+    }
+    if (error.empty()) {
+        backupsOk.inc();
+        logMsg(SYSLOG_INFO, "Backup: %s, %d pages in %.1fs", file.c_str(), pagesTotal_.load(), secs);
+        prune(dir, cfg.backupKeep());
+    } else {
+        backupsFailed.inc();
+        logMsg(SYSLOG_ERR, "Backup: failed after %.1fs: %s", secs, error.c_str());
+    }
+    running_ = false;
+}
+
+// keep the newest `keep` backups (their names sort by time)
+void Backup::prune(const std::string& dir, int keep) {
+    std::vector<fs::path> backups;      // app-<time>.db: one per backup
+    std::vector<fs::path> shards;       // app-<time>.shard-NN.db, alongside
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.rfind("app-", 0) != 0 || entry.path().extension() != ".db") continue;
+        (name.find(".shard-") != std::string::npos ? shards : backups).push_back(entry.path());
+    }
+    if (backups.size() <= static_cast<size_t>(keep)) return;
+
+    std::sort(backups.begin(), backups.end());
+    for (size_t i = 0; i + keep < backups.size(); ++i) {
+        if (!fs::remove(backups[i], ec))
+            logMsg(SYSLOG_ERR, "Backup: can't remove %s", backups[i].c_str());
+        const std::string prefix = backups[i].stem().string() + ".shard-";
+        for (const auto& s : shards)
+            if (s.filename().string().rfind(prefix, 0) == 0 && !fs::remove(s, ec))
+                logMsg(SYSLOG_ERR, "Backup: can't remove %s", s.c_str());
+    }
+}
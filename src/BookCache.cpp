@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "BookCache.h"
+#include "Config.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+static const Metrics::Counter cacheHits = Metrics::get().counter(
+    "simplereader_book_cache_requests_total", "Books looked up in the local book cache, by outcome.", "result=\"hit\"");
+static const Metrics::Counter cacheMisses = Metrics::get().counter(
+    "simplereader_book_cache_requests_total", "Books looked up in the local book cache, by outcome.", "result=\"miss\"");
+static const Metrics::Counter cacheEvictions = Metrics::get().counter(
+    "simplereader_book_cache_evictions_total", "Books evicted from the local book cache.");
+
+BookCache::BookCache(const fs::path& dir) : dir_(dir) {
+    std::error_code ec;
+    fs::create_directories(dir_ / ".fill", ec);
+    if (ec)
+        throw std::runtime_error("BookCache: " + dir_.string() + ": " + ec.message());
+
+    // downloads cut short by the last shutdown
+    for (const auto& e : fs::directory_iterator(dir_ / ".fill", ec)) {
+        std::error_code ec2;
+        fs::remove(e.path(), ec2);
+    }
+
+    // oldest use first, so the newest end up at the front
+    std::vector<std::pair<fs::file_time_type, fs::directory_entry>> found;
+    for (const auto& e : fs::directory_iterator(dir_, ec)) {
+        std::error_code ec2;
+        if (e.is_regular_file(ec2))
+            found.emplace_back(e.last_write_time(ec2), e);
+    }
+    std::sort(found.begin(), found.end(), [](const auto& a, const auto& b){ return a.first < b.first; });
+
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const auto& [when, e] : found) {
+        std::error_code ec2;
+        insertLocked(e.path().filename().string(), static_cast<long long>(e.file_size(ec2)), 0);
+        lru_.front().used = Clock::time_point{};    // not in use: evictable straight away
+    }
+    evictLocked();
+    logMsg(SYSLOG_INFO, "BookCache: %zu book(s), %lld MB in %s", lru_.size(), bytes_ >> 20, dir_.c_str());
+
+    Metrics::get().gauge("simplereader_book_cache_bytes", "Bytes of books held in the local book cache.",
+                         [this]{ return static_cast<double>(bytes()); });
+}
+
+std::string BookCache::find(const std::string& name, long long size) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = index_.find(name);
+        if (it == index_.end()) {
+            cacheMisses.inc();
+            return "";
+        }
+        if (it->second->size != size) {     // not the book we know by that name: refetch
+            cacheMisses.inc();
+            bytes_ -= it->second->size;
+            lru_.erase(it->second);
+            index_.erase(it);
+            return "";
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        it->second->used = Clock::now();
+    }
+    cacheHits.inc();
+
+    // its mtime is the last use: keeps the order across restarts
+    const fs::path p = pathOf(name);
+    std::error_code ec;
+    fs::last_write_time(p, fs::file_time_type::clock::now(), ec);
+    return p.string();
+}
+
+std::string BookCache::fill(const std::string& name, long long size,
+                            const std::function<void(const fs::path& tmp)>& download) {
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        for (;;) {
+            auto it = index_.find(name);
+            if (it != index_.end() && it->second->size == size) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                it->second->used = Clock::now();
+                return pathOf(name).string();
+            }
+            if (filling_.count(name) == 0) break;
+            filled_.wait(lk);               // someone is already fetching it
+        }
+        filling_.insert(name);
+    }
+
+    const fs::path tmp = dir_ / ".fill" / (name + ".part");
+    try {
+        download(tmp);
+        fs::rename(tmp, pathOf(name));
+    } catch (...) {
+        std::error_code ec;
+        fs::remove(tmp, ec);
+        std::lock_guard<std::mutex> lk(mu_);
+        filling_.erase(name);
+        filled_.notify_all();
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lk(mu_);
+    filling_.erase(name);
+    insertLocked(name, size, 0);
+    evictLocked();
+    filled_.notify_all();
+    return pathOf(name).string();
+}
+
+void BookCache::adopt(const std::string& name, long long size) {
+    std::lock_guard<std::mutex> lk(mu_);
+    insertLocked(name, size, 1);
+    evictLocked();
+}
+
+bool BookCache::pin(const std::string& name) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = index_.find(name);
+    if (it == index_.end()) return false;
+    ++it->second->pins;
+    return true;
+}
+
+void BookCache::unpin(const std::string& name) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = index_.find(name);
+    if (it == index_.end() || it->second->pins == 0) return;
+    if (--it->second->pins == 0)
+        evictLocked();
+}
+
+void BookCache::drop(const std::string& name) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = index_.find(name);
+        if (it != index_.end()) {
+            bytes_ -= it->second->size;
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+    }
+    std::error_code ec;
+    fs::remove(pathOf(name), ec);
+}
+
+long long BookCache::bytes(void) {
+    std::lock_guard<std::mutex> lk(mu_);
+    return bytes_;
+}
+
+void BookCache::insertLocked(const std::string& name, long long size, int pins) {
+    auto it = index_.find(name);
+    if (it != index_.end()) {
+        bytes_ -= it->second->size;
+        lru_.erase(it->second);
+    }
+    lru_.push_front(Entry{name, size, Clock::now(), pins});
+    index_[name] = lru_.begin();
+    bytes_ += size;
+}
+
+// least recently used first, skipping what's pinned or in use
+void BookCache::evictLocked(void) {
+    const long long limit = Config::get().bookCacheBytes();
+    const auto busySince = Clock::now() - std::chrono::seconds(PIN_SECS);
+    for (auto it = lru_.end(); it != lru_.begin() && bytes_ > limit; ) {
+        --it;
+        if (it->pins > 0 || it->used > busySince) continue;
+
+        std::error_code ec;
+        fs::remove(pathOf(it->name), ec);
+        if (ec)
+            logMsg(SYSLOG_ERR, "BookCache: can't remove %s: %s", it->name.c_str(), ec.message().c_str());
+        cacheEvictions.inc();
+        bytes_ -= it->size;
+        index_.erase(it->name);
+        it = lru_.erase(it);
+    }
+}
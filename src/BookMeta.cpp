@@ -0,0 +1,858 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "BookMeta.h"
+#include "Scrubber.h"
+#include "WriteQueue.h"
+#include "Config.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+static const Metrics::Counter readOk = Metrics::get().counter(
+    "simplereader_book_meta_reads_total", "Books read for their title, author, pages and cover, by outcome.", "result=\"ok\"");
+static const Metrics::Counter readFailed = Metrics::get().counter(
+    "simplereader_book_meta_reads_total", "Books read for their title, author, pages and cover, by outcome.", "result=\"failed\"");
+
+namespace {
+
+constexpr size_t MAX_XML_BYTES      = 4 << 20;    // container.xml, the OPF
+constexpr size_t MAX_STREAM_BYTES   = 16 << 20;   // one inflated PDF object stream
+constexpr size_t MAX_INFLATED_BYTES = 32 << 20;   // all of one PDF's object streams, inflated
+constexpr size_t MAX_OBJSTMS        = 64;         // object streams opened in one PDF
+constexpr size_t MAX_TEXT           = 512;        // titles and authors are cut to this
+constexpr size_t EPUB_PAGE_BYTES    = 1024;       // compressed bytes of spine a page
+
+/////////////////////////////////////////////////////////////
+// a book on disk, mapped read-only
+//
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ == -1)
+            throw std::runtime_error("open " + path + ": " + std::strerror(errno));
+        struct stat sb;
+        if (::fstat(fd_, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+            ::close(fd_);
+            throw std::runtime_error("not a file: " + path);
+        }
+        size_ = static_cast<size_t>(sb.st_size);
+        if (size_ > 0) {
+            void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd_);
+                throw std::runtime_error("mmap " + path + ": " + std::strerror(errno));
+            }
+            data_ = static_cast<const char*>(p);
+        }
+    }
+    ~MappedFile() {
+        if (data_) ::munmap(const_cast<char*>(data_), size_);
+        ::close(fd_);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view all(void) const { return std::string_view(data_ ? data_ : "", size_); }
+
+private:
+    int         fd_   = -1;
+    const char* data_ = nullptr;
+    size_t      size_ = 0;
+};
+
+// deflate data (raw: windowBits < 0, zlib wrapped: 15), at most `max` bytes of it
+std::string inflateBytes(std::string_view in, int windowBits, size_t max, size_t sizeHint) {
+    z_stream zs{};
+    if (inflateInit2(&zs, windowBits) != Z_OK)
+        throw std::runtime_error("inflateInit2 failed");
+    std::string out;
+    out.resize(std::min(max, std::max<size_t>(sizeHint, 4096)));
+    zs.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    zs.avail_in = static_cast<uInt>(in.size());
+    int rc = Z_OK;
+    size_t have = 0;
+    while (rc != Z_STREAM_END) {
+        if (have == out.size()) {
+            if (out.size() >= max) { inflateEnd(&zs); throw std::runtime_error("inflated data too large"); }
+            out.resize(std::min(max, out.size() * 2));
+        }
+        zs.next_out  = reinterpret_cast<Bytef*>(&out[have]);
+        zs.avail_out = static_cast<uInt>(out.size() - have);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        have = out.size() - zs.avail_out;
+        if (rc == Z_BUF_ERROR && zs.avail_in == 0) break;     // truncated: keep what there is
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            inflateEnd(&zs);
+            throw std::runtime_error("corrupt deflate data");
+        }
+    }
+    inflateEnd(&zs);
+    out.resize(have);
+    return out;
+}
+
+/////////////////////////////////////////////////////////////
+// text
+//
+// a surrogate on its own (one of a pair is joined before it gets here) becomes U+FFFD
+void appendUtf8(std::string& out, unsigned cp) {
+    if (cp >= 0xd800 && cp < 0xe000)
+        cp = 0xfffd;
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xc0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xe0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x110000) {
+        out += static_cast<char>(0xf0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+}
+
+// whitespace runs as one space, no control characters, trimmed, at most MAX_TEXT bytes
+// (cut on a character boundary)
+std::string tidy(const std::string& s) {
+    std::string out;
+    bool space = false;
+    for (unsigned char c : s) {
+        if (c <= ' ' || c == 0x7f) { space = !out.empty(); continue; }
+        if (space) out += ' ';
+        space = false;
+        out += static_cast<char>(c);
+    }
+    if (out.size() > MAX_TEXT) {
+        size_t n = MAX_TEXT;
+        while (n > 0 && (static_cast<unsigned char>(out[n]) & 0xc0) == 0x80) --n;
+        out.resize(n);
+    }
+    return out;
+}
+
+/////////////////////////////////////////////////////////////
+// EPUB: a zip holding META-INF/container.xml, which names the OPF
+//
+uint16_t le16(const char* p) { return static_cast<uint16_t>(static_cast<unsigned char>(p[0]) | static_cast<unsigned char>(p[1]) << 8); }
+uint32_t le32(const char* p) { return static_cast<uint32_t>(le16(p)) | static_cast<uint32_t>(le16(p + 2)) << 16; }
+
+struct ZipEntry {
+    uint16_t method   = 0;
+    uint32_t compSize = 0;
+    uint32_t size     = 0;
+    uint32_t offset   = 0;      // of its local header
+};
+
+class Zip {
+public:
+    explicit Zip(std::string_view file) : file_(file) {
+        // the end of central directory record: in the last 64K + 22 bytes
+        const size_t tail = std::min<size_t>(file.size(), 0xffff + 22);
+        size_t eocd = std::string_view::npos;
+        for (size_t i = file.size() - tail; i + 22 <= file.size(); ++i)
+            if (file.compare(i, 4, "PK\x05\x06") == 0) eocd = i;    // the last one
+        if (eocd == std::string_view::npos)
+            throw std::runtime_error("not a zip");
+        const uint16_t count  = le16(&file[eocd + 10]);
+        const uint32_t cdSize = le32(&file[eocd + 12]);
+        const uint32_t cdAt   = le32(&file[eocd + 16]);
+        if (static_cast<size_t>(cdAt) + cdSize > file.size())
+            throw std::runtime_error("zip central directory out of bounds");
+
+        size_t p = cdAt;
+        for (uint16_t i = 0; i < count; ++i) {
+            if (p + 46 > file.size() || file.compare(p, 4, "PK\x01\x02") != 0)
+                throw std::runtime_error("bad zip central directory");
+            ZipEntry e;
+            e.method   = le16(&file[p + 10]);
+            e.compSize = le32(&file[p + 20]);
+            e.size     = le32(&file[p + 24]);
+            const uint16_t nameLen = le16(&file[p + 28]), extraLen = le16(&file[p + 30]), commentLen = le16(&file[p + 32]);
+            e.offset   = le32(&file[p + 42]);
+            if (p + 46 + nameLen > file.size())
+                throw std::runtime_error("bad zip central directory");
+            entries_.emplace(std::string(file.substr(p + 46, nameLen)), e);
+            p += 46 + nameLen + extraLen + commentLen;
+        }
+    }
+
+    const ZipEntry* find(const std::string& name) const {
+        auto it = entries_.find(name);
+        return it == entries_.end() ? nullptr : &it->second;
+    }
+
+    std::string read(const ZipEntry& e, size_t max) const {
+        if (e.size > max)
+            throw std::runtime_error("zip member too large");
+        if (e.method == 0 && e.compSize != e.size)     // stored: what's read is what's returned
+            throw std::runtime_error("zip member sizes disagree");
+        if (static_cast<size_t>(e.offset) + 30 > file_.size() || file_.compare(e.offset, 4, "PK\x03\x04") != 0)
+            throw std::runtime_error("bad zip local header");
+        const size_t at = static_cast<size_t>(e.offset) + 30 + le16(&file_[e.offset + 26]) + le16(&file_[e.offset + 28]);
+        if (at + e.compSize > file_.size())
+            throw std::runtime_error("zip member out of bounds");
+        const std::string_view data = file_.substr(at, e.compSize);
+        if (e.method == 0)
+            return std::string(data);
+        if (e.method == 8)
+            return inflateBytes(data, -MAX_WBITS, max, e.size);
+        throw std::runtime_error("unsupported zip compression method " + std::to_string(e.method));
+    }
+
+private:
+    std::string_view                          file_;
+    std::unordered_map<std::string, ZipEntry> entries_;
+};
+
+std::string decodeEntities(std::string_view s) {
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] != '&') { out += s[i]; continue; }
+        const size_t semi = s.find(';', i);
+        if (semi == std::string_view::npos || semi - i > 10) { out += '&'; continue; }
+        const std::string_view ent = s.substr(i + 1, semi - i - 1);
+        if      (ent == "amp")  out += '&';
+        else if (ent == "lt")   out += '<';
+        else if (ent == "gt")   out += '>';
+        else if (ent == "quot") out += '"';
+        else if (ent == "apos") out += '\'';
+        else if (ent.size() > 1 && ent[0] == '#') {
+            const bool hex = ent[1] == 'x' || ent[1] == 'X';
+            const std::string digits(ent.substr(hex ? 2 : 1));
+            char* end = nullptr;
+            const unsigned long cp = std::strtoul(digits.c_str(), &end, hex ? 16 : 10);
+            if (digits.empty() || *end) { out += '&'; continue; }
+            appendUtf8(out, static_cast<unsigned>(cp));
+        } else {
+            out += '&';
+            continue;
+        }
+        i = semi;
+    }
+    return out;
+}
+
+// the element name of a tag's text (between < and >), without its namespace prefix
+std::string_view localName(std::string_view tag) {
+    const size_t end = tag.find_first_of(" \t\r\n/");
+    std::string_view n = tag.substr(0, end);
+    const size_t colon = n.find(':');
+    return colon == std::string_view::npos ? n : n.substr(colon + 1);
+}
+
+// an attribute's value (entities decoded), "" if it has none
+std::string attr(std::string_view tag, std::string_view name) {
+    for (size_t p = tag.find(name); p != std::string_view::npos; p = tag.find(name, p + 1)) {
+        if (p == 0 || !std::isspace(static_cast<unsigned char>(tag[p - 1]))) continue;
+        size_t q = p + name.size();
+        while (q < tag.size() && std::isspace(static_cast<unsigned char>(tag[q]))) ++q;
+        if (q >= tag.size() || tag[q] != '=') continue;
+        ++q;
+        while (q < tag.size() && std::isspace(static_cast<unsigned char>(tag[q]))) ++q;
+        if (q >= tag.size() || (tag[q] != '"' && tag[q] != '\'')) continue;
+        const size_t close = tag.find(tag[q], q + 1);
+        if (close == std::string_view::npos) return "";
+        return decodeEntities(tag.substr(q + 1, close - q - 1));
+    }
+    return "";
+}
+
+// f(tag, after) for every start (or empty) element tag: its text between < and >, and
+// the offset just past it. Comments, declarations and end tags are skipped.
+template <typename F>
+void forEachTag(const std::string& xml, F f) {
+    size_t p = 0;
+    while ((p = xml.find('<', p)) != std::string::npos) {
+        if (xml.compare(p, 4, "<!--") == 0) {
+            p = xml.find("-->", p);
+            if (p == std::string::npos) return;
+            continue;
+        }
+        const size_t end = xml.find('>', p);
+        if (end == std::string::npos) return;
+        const char c = p + 1 < xml.size() ? xml[p + 1] : '/';
+        if (c != '/' && c != '?' && c != '!')
+            f(std::string_view(xml).substr(p + 1, end - p - 1), end + 1);
+        p = end + 1;
+    }
+}
+
+// an element's text, from just past its start tag (CDATA kept, markup dropped)
+std::string textOf(const std::string& xml, size_t at, std::string_view name) {
+    std::string out;
+    for (size_t p = at; p < xml.size(); ) {
+        if (xml.compare(p, 9, "<![CDATA[") == 0) {
+            const size_t end = xml.find("]]>", p);
+            if (end == std::string::npos) break;
+            out += xml.substr(p + 9, end - p - 9);
+            p = end + 3;
+            continue;
+        }
+        if (xml[p] == '<') {
+            const size_t end = xml.find('>', p);
+            if (end == std::string::npos) break;
+            if (xml[p + 1] == '/' && localName(std::string_view(xml).substr(p + 2, end - p - 2)) == name) break;
+            p = end + 1;
+            continue;
+        }
+        const size_t next = xml.find('<', p);
+        out += decodeEntities(std::string_view(xml).substr(p, next - p));
+        p = next;
+    }
+    return tidy(out);
+}
+
+// an OPF href (relative to the OPF, %-escaped, maybe with a #fragment) as a zip member name
+std::string resolveHref(const std::string& opfDir, const std::string& href) {
+    std::string h = href.substr(0, href.find('#'));
+    std::string decoded;
+    for (size_t i = 0; i < h.size(); ++i) {
+        if (h[i] == '%' && i + 2 < h.size() && std::isxdigit(static_cast<unsigned char>(h[i + 1])) &&
+            std::isxdigit(static_cast<unsigned char>(h[i + 2]))) {
+            decoded += static_cast<char>(std::stoi(h.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        } else {
+            decoded += h[i];
+        }
+    }
+    std::vector<std::string> parts;
+    std::string path = (!decoded.empty() && decoded[0] == '/') ? decoded.substr(1) : opfDir + decoded;
+    size_t p = 0;
+    while (p <= path.size()) {
+        const size_t slash = std::min(path.find('/', p), path.size());
+        const std::string seg = path.substr(p, slash - p);
+        if (seg == "..") { if (!parts.empty()) parts.pop_back(); }
+        else if (!seg.empty() && seg != ".") parts.push_back(seg);
+        p = slash + 1;
+    }
+    std::string out;
+    for (const auto& s : parts) out += (out.empty() ? "" : "/") + s;
+    return out;
+}
+
+// the media type of a cover we're willing to serve (its bytes, not its manifest entry, say so)
+const char* imageType(const std::string& data) {
+    if (data.compare(0, 3, "\xff\xd8\xff") == 0)                                    return "image/jpeg";
+    if (data.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0)                               return "image/png";
+    if (data.compare(0, 6, "GIF87a") == 0 || data.compare(0, 6, "GIF89a") == 0)     return "image/gif";
+    if (data.size() >= 12 && data.compare(0, 4, "RIFF") == 0 && data.compare(8, 4, "WEBP") == 0) return "image/webp";
+    return nullptr;
+}
+
+void readEpub(std::string_view file, long long coverMaxBytes, Database::BookMetaRow& row, std::string& cover) {
+    const Zip zip(file);
+    const ZipEntry* container = zip.find("META-INF/container.xml");
+    if (!container)
+        throw std::runtime_error("no META-INF/container.xml");
+    std::string opfPath;
+    forEachTag(zip.read(*container, MAX_XML_BYTES), [&](std::string_view tag, size_t) {
+        if (opfPath.empty() && localName(tag) == "rootfile")
+            opfPath = attr(tag, "full-path");
+    });
+    const ZipEntry* opfEntry = zip.find(opfPath);
+    if (!opfEntry)
+        throw std::runtime_error("no OPF at [" + opfPath + "]");
+    const std::string opf = zip.read(*opfEntry, MAX_XML_BYTES);
+    const size_t slash = opfPath.rfind('/');
+    const std::string opfDir = slash == std::string::npos ? "" : opfPath.substr(0, slash + 1);
+
+    struct Item { std::string href, type, properties; };
+    std::unordered_map<std::string, Item> manifest;
+    std::vector<std::string> spine, authors;
+    std::string coverId, coverItem;
+    forEachTag(opf, [&](std::string_view tag, size_t after) {
+        const std::string_view name = localName(tag);
+        if (name == "title" && row.title.empty()) {
+            row.title = textOf(opf, after, name);
+        } else if (name == "creator") {
+            const std::string a = textOf(opf, after, name);
+            if (!a.empty()) authors.push_back(a);
+        } else if (name == "meta" && attr(tag, "name") == "cover") {
+            coverId = attr(tag, "content");                 // EPUB 2
+        } else if (name == "item") {
+            Item it{attr(tag, "href"), attr(tag, "media-type"), attr(tag, "properties")};
+            const std::string id = attr(tag, "id");
+            if (coverItem.empty() && (" " + it.properties + " ").find(" cover-image ") != std::string::npos)
+                coverItem = id;                             // EPUB 3
+            manifest.emplace(id, std::move(it));
+        } else if (name == "itemref") {
+            spine.push_back(attr(tag, "idref"));
+        }
+    });
+
+    std::string joined;
+    for (const auto& a : authors) joined += (joined.empty() ? "" : ", ") + a;
+    row.author = tidy(joined);
+
+    long long spineBytes = 0;
+    for (const auto& id : spine) {
+        auto it = manifest.find(id);
+        if (it == manifest.end()) continue;
+        if (const ZipEntry* e = zip.find(resolveHref(opfDir, it->second.href)))
+            spineBytes += e->compSize;
+    }
+    if (!spine.empty())
+        row.pages = static_cast<int>(std::max<long long>(1, (spineBytes + EPUB_PAGE_BYTES - 1) / EPUB_PAGE_BYTES));
+
+    if (coverItem.empty()) coverItem = coverId;
+    if (coverItem.empty()) {        // neither says: an image whose id says it's the cover
+        for (const auto& [id, it] : manifest)
+            if (it.type.rfind("image/", 0) == 0 && id.find("cover") != std::string::npos) { coverItem = id; break; }
+    }
+    auto it = manifest.find(coverItem);
+    if (it == manifest.end()) return;
+    const ZipEntry* e = zip.find(resolveHref(opfDir, it->second.href));
+    if (!e || static_cast<long long>(e->size) > coverMaxBytes) return;
+    std::string data = zip.read(*e, static_cast<size_t>(coverMaxBytes));
+    if (const char* type = imageType(data)) {
+        row.coverType  = type;
+        row.coverBytes = static_cast<long long>(data.size());
+        cover = std::move(data);
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// PDF: the /Count of the catalog's /Pages, and the trailer's /Info
+//
+bool isDelimiter(char c) {
+    return std::isspace(static_cast<unsigned char>(c)) || std::strchr("()<>[]{}/%", c) != nullptr;
+}
+
+size_t skipSpace(std::string_view s, size_t p) {
+    while (p < s.size() && std::isspace(static_cast<unsigned char>(s[p]))) ++p;
+    return p;
+}
+
+// a dictionary's text: up to its stream data, if it has any
+std::string_view dictOf(std::string_view obj) {
+    const size_t p = obj.find("stream");
+    return p == std::string_view::npos ? obj : obj.substr(0, p);
+}
+
+// the offset just past `key` followed by a delimiter, from `from` on (npos if it's not there)
+size_t findKey(std::string_view s, std::string_view key, size_t from = 0) {
+    for (size_t p = s.find(key, from); p != std::string_view::npos; p = s.find(key, p + 1)) {
+        const size_t end = p + key.size();
+        if (end >= s.size() || isDelimiter(s[end])) return end;
+    }
+    return std::string_view::npos;
+}
+
+bool hasName(std::string_view dict, std::string_view key, std::string_view value) {
+    for (size_t p = findKey(dict, key); p != std::string_view::npos; p = findKey(dict, key, p)) {
+        const size_t v = skipSpace(dict, p);
+        if (dict.compare(v, value.size(), value) == 0 &&
+            (v + value.size() >= dict.size() || isDelimiter(dict[v + value.size()])))
+            return true;
+    }
+    return false;
+}
+
+long long intAfter(std::string_view dict, std::string_view key) {
+    const size_t p = findKey(dict, key);
+    if (p == std::string_view::npos) return -1;
+    size_t v = skipSpace(dict, p), e = v;
+    while (e < dict.size() && std::isdigit(static_cast<unsigned char>(dict[e]))) ++e;
+    if (e == v || e - v > 12) return -1;
+    return std::stoll(std::string(dict.substr(v, e - v)));
+}
+
+// "N G R" at p: N (else -1)
+long long refAt(std::string_view s, size_t p) {
+    p = skipSpace(s, p);
+    size_t e = p;
+    while (e < s.size() && std::isdigit(static_cast<unsigned char>(s[e]))) ++e;
+    if (e == p || e - p > 9) return -1;
+    const long long n = std::stoll(std::string(s.substr(p, e - p)));
+    size_t g = skipSpace(s, e), ge = g;
+    while (ge < s.size() && std::isdigit(static_cast<unsigned char>(s[ge]))) ++ge;
+    if (ge == g) return -1;
+    const size_t r = skipSpace(s, ge);
+    return (r < s.size() && s[r] == 'R') ? n : -1;
+}
+
+// a PDF text string as UTF-8: UTF-16BE with its BOM, UTF-8 with its BOM, else PDFDocEncoding
+// (read as Latin-1, which it matches but for a few punctuation marks)
+std::string pdfText(const std::string& raw) {
+    std::string out;
+    if (raw.size() >= 2 && static_cast<unsigned char>(raw[0]) == 0xfe && static_cast<unsigned char>(raw[1]) == 0xff) {
+        for (size_t i = 2; i + 1 < raw.size(); i += 2) {
+            unsigned cp = static_cast<unsigned char>(raw[i]) << 8 | static_cast<unsigned char>(raw[i + 1]);
+            if (cp >= 0xd800 && cp < 0xdc00 && i + 3 < raw.size()) {
+                const unsigned lo = static_cast<unsigned char>(raw[i + 2]) << 8 | static_cast<unsigned char>(raw[i + 3]);
+                if (lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    i += 2;
+                }
+            }
+            appendUtf8(out, cp);
+        }
+    } else if (raw.compare(0, 3, "\xef\xbb\xbf") == 0) {
+        out = raw.substr(3);
+    } else {
+        for (unsigned char c : raw) appendUtf8(out, c);
+    }
+    return tidy(out);
+}
+
+// the string object at p: (literal) or <hex>; "" if there's none
+std::string pdfString(std::string_view s, size_t p) {
+    p = skipSpace(s, p);
+    std::string raw;
+    if (p < s.size() && s[p] == '(') {
+        int depth = 1;
+        for (size_t i = p + 1; i < s.size() && depth > 0; ++i) {
+            char c = s[i];
+            if (c == '\\' && i + 1 < s.size()) {
+                c = s[++i];
+                switch (c) {
+                    case 'n': raw += '\n'; break;
+                    case 'r': raw += '\r'; break;
+                    case 't': raw += '\t'; break;
+                    case 'b': raw += '\b'; break;
+                    case 'f': raw += '\f'; break;
+                    case '\r': if (i + 1 < s.size() && s[i + 1] == '\n') ++i; break;    // line continuation
+                    case '\n': break;
+                    default:
+                        if (c >= '0' && c <= '7') {
+                            int v = c - '0';
+                            for (int k = 0; k < 2 && i + 1 < s.size() && s[i + 1] >= '0' && s[i + 1] <= '7'; ++k)
+                                v = v * 8 + (s[++i] - '0');
+                            raw += static_cast<char>(v);
+                        } else {
+                            raw += c;
+                        }
+                }
+                continue;
+            }
+            if (c == '(') ++depth;
+            if (c == ')' && --depth == 0) break;
+            raw += c;
+        }
+    } else if (p + 1 < s.size() && s[p] == '<' && s[p + 1] != '<') {
+        std::string hex;
+        for (size_t i = p + 1; i < s.size() && s[i] != '>'; ++i)
+            if (std::isxdigit(static_cast<unsigned char>(s[i]))) hex += s[i];
+        if (hex.size() % 2) hex += '0';
+        for (size_t i = 0; i < hex.size(); i += 2)
+            raw += static_cast<char>(std::stoi(hex.substr(i, 2), nullptr, 16));
+    } else {
+        return "";
+    }
+    return pdfText(raw);
+}
+
+class PdfObjects {
+public:
+    explicit PdfObjects(std::string_view file) {
+        // "N G obj" ... "endobj"; a later definition (an incremental update) replaces an earlier.
+        // The next "endobj" is only looked for again once p has passed it: one pass over the file.
+        size_t end = 0;
+        for (size_t p = file.find("obj"); p != std::string_view::npos; p = file.find("obj", p + 3)) {
+            if (p + 3 < file.size() && !isDelimiter(file[p + 3])) continue;
+            size_t b = p;
+            if (b == 0 || !std::isspace(static_cast<unsigned char>(file[b - 1]))) continue;
+            while (b > 0 && std::isspace(static_cast<unsigned char>(file[b - 1]))) --b;
+            size_t g = b;
+            while (g > 0 && std::isdigit(static_cast<unsigned char>(file[g - 1]))) --g;
+            if (g == b || g == 0 || !std::isspace(static_cast<unsigned char>(file[g - 1]))) continue;
+            size_t n = g;
+            while (n > 0 && std::isspace(static_cast<unsigned char>(file[n - 1]))) --n;
+            size_t ns = n;
+            while (ns > 0 && std::isdigit(static_cast<unsigned char>(file[ns - 1]))) --ns;
+            if (ns == n || n - ns > 9) continue;
+            if (end < p) end = file.find("endobj", p);
+            if (end == std::string_view::npos) break;
+            objects_[std::stol(std::string(file.substr(ns, n - ns)))] = file.substr(p + 3, end - p - 3);
+        }
+
+        // PDF 1.5 object streams: more objects, deflated; only opened when looked for
+        for (const auto& [num, obj] : objects_)
+            if (hasName(dictOf(obj), "/Type", "/ObjStm")) packed_.push_back(obj);
+        std::sort(packed_.begin(), packed_.end(),       // in file order
+                  [](std::string_view a, std::string_view b){ return a.data() < b.data(); });
+    }
+
+    // object `num`. One that isn't in the file as it stands is looked for in the object
+    // streams not opened yet, in turn, until it turns up or the budget for them is spent.
+    std::string_view find(long long num) {
+        for (;;) {
+            auto it = objects_.find(num);
+            if (it != objects_.end()) return it->second;
+            if (next_ == packed_.size() || next_ >= MAX_OBJSTMS || inflated_ >= MAX_INFLATED_BYTES)
+                return std::string_view();
+            try {
+                unpack(packed_[next_]);
+            } catch (const std::exception&) {
+                // an object stream we can't read: its objects stay unknown
+            }
+            ++next_;
+        }
+    }
+
+    // the objects found so far (no more object streams are opened for this)
+    template <typename F> void forEach(F f) const {
+        for (const auto& [num, obj] : objects_) f(obj);
+    }
+
+private:
+    void unpack(std::string_view obj) {
+        const std::string_view dict = dictOf(obj);
+        if (!hasName(dict, "/Filter", "/FlateDecode") || findKey(dict, "/DecodeParms") != std::string_view::npos)
+            return;
+        const long long count = intAfter(dict, "/N"), first = intAfter(dict, "/First");
+        size_t s = obj.find("stream");
+        if (count <= 0 || first < 0 || s == std::string_view::npos) return;
+        s += 6;
+        if (s < obj.size() && obj[s] == '\r') ++s;
+        if (s < obj.size() && obj[s] == '\n') ++s;
+        const size_t e = obj.rfind("endstream");
+        if (e == std::string_view::npos || e < s) return;
+
+        // charged up front, so a stream that blows up takes all it was allowed with it
+        const size_t allowed = std::min(MAX_STREAM_BYTES, MAX_INFLATED_BYTES - inflated_);
+        inflated_ += allowed;
+        streams_.push_back(inflateBytes(obj.substr(s, e - s), MAX_WBITS, allowed, 0));
+        const std::string_view data = streams_.back();
+        inflated_ -= allowed - data.size();
+
+        // a header of N (object number, offset from First) pairs, then the objects
+        std::vector<std::pair<long long, size_t>> index;
+        size_t p = 0;
+        for (long long i = 0; i < count; ++i) {
+            long long v[2];
+            for (long long& x : v) {
+                p = skipSpace(data, p);
+                size_t d = p;
+                while (d < data.size() && std::isdigit(static_cast<unsigned char>(data[d]))) ++d;
+                if (d == p || d - p > 12) return;
+                x = std::stoll(std::string(data.substr(p, d - p)));
+                p = d;
+            }
+            index.emplace_back(v[0], static_cast<size_t>(first + v[1]));
+        }
+        for (size_t i = 0; i < index.size(); ++i) {
+            const size_t from = index[i].second;
+            const size_t to   = i + 1 < index.size() ? index[i + 1].second : data.size();
+            if (from >= to || to > data.size()) continue;
+            objects_.emplace(index[i].first, data.substr(from, to - from));    // the file's own win
+        }
+    }
+
+    std::unordered_map<long long, std::string_view> objects_;
+    std::vector<std::string_view> packed_;  // the object streams, in file order
+    size_t                  next_     = 0;  // the first of packed_ not opened yet
+    size_t                  inflated_ = 0;  // bytes inflated out of them so far
+    std::deque<std::string> streams_;       // what the object stream objects point into
+};
+
+// the last "key N G R" in the file: the newest trailer's (or cross-reference stream's); -1 if none
+long long lastRef(std::string_view file, std::string_view key) {
+    long long ref = -1;
+    for (size_t p = findKey(file, key); p != std::string_view::npos; p = findKey(file, key, p)) {
+        const long long r = refAt(file, p);
+        if (r >= 0) ref = r;
+    }
+    return ref;
+}
+
+// a dictionary entry's string, directly or through a reference
+std::string pdfEntry(PdfObjects& objs, std::string_view dict, std::string_view key) {
+    const size_t p = findKey(dict, key);
+    if (p == std::string_view::npos) return "";
+    const long long ref = refAt(dict, p);
+    if (ref >= 0) return pdfString(objs.find(ref), 0);
+    return pdfString(dict, p);
+}
+
+void readPdf(std::string_view file, Database::BookMetaRow& row) {
+    PdfObjects objs(file);
+
+    // the catalog's page tree root has the count
+    long long pages = -1;
+    const long long root = lastRef(file, "/Root");
+    if (root >= 0) {
+        const std::string_view catalog = dictOf(objs.find(root));
+        const size_t p = findKey(catalog, "/Pages");
+        const long long tree = p == std::string_view::npos ? -1 : refAt(catalog, p);
+        if (tree >= 0)
+            pages = intAfter(dictOf(objs.find(tree)), "/Count");
+    }
+    if (pages < 0) {
+        // a broken catalog: the largest /Count of the page tree nodes to hand, else the pages
+        long long leaves = 0;
+        objs.forEach([&](std::string_view obj) {
+            const std::string_view dict = dictOf(obj);
+            if (hasName(dict, "/Type", "/Pages"))
+                pages = std::max(pages, intAfter(dict, "/Count"));
+            else if (hasName(dict, "/Type", "/Page"))
+                ++leaves;
+        });
+        if (pages < 0 && leaves > 0) pages = leaves;
+    }
+    if (pages >= 0) row.pages = static_cast<int>(std::min<long long>(pages, 1 << 30));
+
+    const long long info = lastRef(file, "/Info");
+    if (findKey(file, "/Encrypt") != std::string_view::npos || info < 0)
+        return;         // an encrypted file's strings are encrypted too
+    const std::string_view dict = dictOf(objs.find(info));
+    row.title  = pdfEntry(objs, dict, "/Title");
+    row.author = pdfEntry(objs, dict, "/Author");
+}
+
+} // namespace
+
+/////////////////////////////////////////////////////////////
+// BookMeta
+//
+BookMeta& BookMeta::get() {
+    static BookMeta instance;
+    return instance;
+}
+
+void BookMeta::start(void) {
+    thumbDir_ = Config::get().thumbDir();
+    std::error_code ec;
+    fs::create_directories(thumbDir_, ec);
+    if (ec)
+        logMsg(SYSLOG_ERR, "BookMeta: %s: %s (covers won't be kept)", thumbDir_.c_str(), ec.message().c_str());
+
+    stopping_ = false;
+    pool_ = std::make_unique<WorkerPool>("bookmeta", 1, QUEUE);
+    Metrics::get().gauge("simplereader_book_meta_pending", "Books queued or being read for their metadata.",
+                         [this]{ std::lock_guard<std::mutex> lk(mu_); return static_cast<double>(queued_.size()); });
+}
+
+void BookMeta::stop(void) {
+    stopping_ = true;
+    pool_.reset();      // queued books return at once; the one being read finishes
+}
+
+std::string BookMeta::coverPath(const std::string& fileId) const {
+    return (fs::path(thumbDir_) / fileId).string();
+}
+
+void BookMeta::extract(const std::string& fileId, const std::string& path, std::shared_ptr<void> held) {
+    if (!pool_) return;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (!queued_.insert(fileId).second) return;     // already on its way
+        failed_.erase(fileId);
+    }
+    if (!pool_->trySubmit([this, fileId, path, held]{ run(fileId, path); })) {
+        logMsg(SYSLOG_ERR, "BookMeta: queue full, book %s not read", fileId.c_str());
+        std::lock_guard<std::mutex> lk(mu_);
+        queued_.erase(fileId);
+    }
+}
+
+bool BookMeta::want(const std::string& fileId) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (queued_.count(fileId)) return true;
+        if (failed_.count(fileId)) return false;
+    }
+    std::string location, sha256;
+    long long   size = 0;
+    if (Database::get().getBookForDownload(fileId, location, size, sha256).empty())
+        return false;
+    const Scrubber::State s = Scrubber::get().state(fileId);
+    if (location.rfind("s3://", 0) == 0 || s == Scrubber::State::Missing ||
+        s == Scrubber::State::WrongSize || s == Scrubber::State::Corrupt) {
+        std::lock_guard<std::mutex> lk(mu_);
+        failed_.insert(fileId);
+        return false;
+    }
+    extract(fileId, location);
+    return true;
+}
+
+Database::BookMetaRow BookMeta::read(const std::string& path, long long coverMaxBytes, std::string& coverOut) {
+    const MappedFile f(path);
+    const std::string_view file = f.all();
+
+    Database::BookMetaRow row;
+    try {
+        if (file.compare(0, 4, "PK\x03\x04") == 0) {
+            row.format = "epub";
+            readEpub(file, coverMaxBytes, row, coverOut);
+        } else if (file.substr(0, 1024).find("%PDF-") != std::string_view::npos) {
+            row.format = "pdf";
+            readPdf(file, row);
+        }
+    } catch (const std::exception& ex) {
+        // not what it looks like: what we have so far is all there is
+        logMsg(SYSLOG_INFO, "BookMeta: %s: %s", path.c_str(), ex.what());
+    }
+    return row;
+}
+
+void BookMeta::run(const std::string& fileId, const std::string& path) {
+    auto forget = [this, fileId](bool failed) {
+        std::lock_guard<std::mutex> lk(mu_);
+        queued_.erase(fileId);
+        if (failed) failed_.insert(fileId);
+    };
+    if (stopping_) return forget(false);
+
+    Database::BookMetaRow row;
+    std::string cover;
+    try {
+        row = read(path, Config::get().coverMaxBytes(), cover);
+    } catch (const std::exception& ex) {
+        readFailed.inc();
+        logMsg(SYSLOG_ERR, "BookMeta: book %s: %s", fileId.c_str(), ex.what());
+        return forget(true);
+    }
+    row.fileId      = fileId;
+    row.extractedAt = nowMs();
+
+    if (!cover.empty()) {
+        const std::string dst = coverPath(fileId), tmp = dst + ".part";
+        std::error_code ec;
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            out.write(cover.data(), static_cast<std::streamsize>(cover.size()));
+            if (!out) ec = std::make_error_code(std::errc::io_error);
+        }
+        if (!ec) fs::rename(tmp, dst, ec);
+        if (ec) {
+            logMsg(SYSLOG_ERR, "BookMeta: can't keep the cover of book %s: %s", fileId.c_str(), ec.message().c_str());
+            fs::remove(tmp, ec);
+            row.coverType.clear();
+            row.coverBytes = 0;
+        }
+    }
+    readOk.inc();
+
+    WriteQueue::get().submit(
+        [row] { Database::get().upsertBookMeta(row); },
+        [forget, fileId](bool committed) {
+            if (!committed)
+                logMsg(SYSLOG_ERR, "BookMeta: book_meta row for %s not written", fileId.c_str());
+            forget(!committed);
+        });
+}
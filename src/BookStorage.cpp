@@ -0,0 +1,160 @@
+#include <stdexcept>
+
+#include "BookStorage.h"
+#include "BookCache.h"
+#include "S3Client.h"
+#include "WorkerPool.h"
+#include "Config.h"
+#include "Log.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+static std::unique_ptr<BookStorage>& installed() {
+    static std::unique_ptr<BookStorage> storage;
+    return storage;
+}
+
+BookStorage& BookStorage::get() {
+    auto& s = installed();
+    if (!s) s = makeLocalBookStorage("/var/lib/simplereader/library");
+    return *s;
+}
+
+void BookStorage::install(std::unique_ptr<BookStorage> storage) {
+    installed() = std::move(storage);
+    logMsg(SYSLOG_INFO, "BookStorage: %s, new books via %s", installed()->name(), installed()->incomingDir().c_str());
+}
+
+void BookStorage::close(void) {
+    installed().reset();
+}
+
+namespace {
+
+bool isRegularFile(const std::string& path, long long size) {
+    std::error_code ec;
+    if (path.empty() || !fs::is_regular_file(path, ec)) return false;
+    return size < 0 || static_cast<long long>(fs::file_size(path, ec)) == size;
+}
+
+// the library is a directory: every book is already where it's served from
+class LocalBookStorage : public BookStorage {
+public:
+    explicit LocalBookStorage(const fs::path& dir) : dir_(dir) {}
+
+    const char* name(void) const override { return "local"; }
+    fs::path incomingDir(void) const override { return dir_; }
+
+    void put(const std::string& fileId, long long, Stored done) override {
+        done(incoming(fileId).string(), "");
+    }
+
+    bool holds(const std::string& location, long long size) override {
+        return isRegularFile(location, size);
+    }
+
+    void fetch(const std::string& location, long long, const std::string&, Found done) override {
+        done(Source{location, "", ""});
+    }
+
+private:
+    const fs::path dir_;
+};
+
+// the library is a bucket; this node keeps the books it uses in a BookCache
+class S3BookStorage : public BookStorage {
+public:
+    S3BookStorage(S3Client::Options o, const std::string& prefix, const fs::path& cacheDir, size_t threads)
+        : bucket_(o.bucket), prefix_(prefix), s3_(std::move(o)), cache_(std::make_shared<BookCache>(cacheDir)),
+          pool_("bookstore", threads, QUEUE) {}
+
+    const char* name(void) const override { return "s3"; }
+    fs::path incomingDir(void) const override { return cache_->dir(); }
+
+    void put(const std::string& fileId, long long size, Stored done) override {
+        cache_->adopt(fileId, size);     // it's in the cache already; pinned until it's in the bucket too
+        const bool queued = pool_.trySubmit([this, fileId, size, done]{
+            const std::string key = prefix_ + fileId;
+            try {
+                s3_.putFile(key, cache_->pathOf(fileId), size, partBytes());
+            } catch (const std::exception& ex) {
+                logMsg(SYSLOG_ERR, "BookStorage: upload of %s failed: %s", fileId.c_str(), ex.what());
+                cache_->drop(fileId);
+                return done("", ex.what());
+            }
+            done("s3://" + bucket_ + "/" + key, "");
+            cache_->unpin(fileId);      // after `done`, which may hold() it for longer
+        });
+        if (!queued) {
+            cache_->drop(fileId);
+            done("", "book store busy");
+        }
+    }
+
+    // a pin on the cached copy, let go of by the last owner (which may outlive this storage)
+    std::shared_ptr<void> hold(const std::string& fileId) override {
+        if (!cache_->pin(fileId)) return nullptr;
+        auto cache = cache_;
+        return std::shared_ptr<void>(cache.get(), [cache, fileId](void*){ cache->unpin(fileId); });
+    }
+
+    // the row is only written once the object is complete, so an s3 location is trusted as is
+    bool holds(const std::string& location, long long size) override {
+        return isS3(location) || isRegularFile(location, size);
+    }
+
+    void fetch(const std::string& location, long long size, const std::string& fileName, Found done) override {
+        if (!isS3(location))
+            return done(Source{location, "", ""});      // recorded before the move to s3
+
+        const std::string key  = location.substr(5 + bucket_.size() + 1);
+        const std::string name = fs::path(key).filename().string();
+        const std::string hit  = cache_->find(name, size);
+        if (!hit.empty())
+            return done(Source{hit, "", ""});
+
+        const int presignSecs = Config::get().s3PresignSecs();
+        if (presignSecs > 0)
+            return done(Source{"", s3_.presign(key, presignSecs, fileName), ""});
+
+        const bool queued = pool_.trySubmit([this, key, name, size, done]{
+            try {
+                const long long part = partBytes();
+                done(Source{cache_->fill(name, size, [&](const fs::path& tmp){ s3_.getFile(key, size, tmp, part); }), "", ""});
+            } catch (const std::exception& ex) {
+                logMsg(SYSLOG_ERR, "BookStorage: fetch of %s failed: %s", key.c_str(), ex.what());
+                done(Source{"", "", ex.what()});
+            }
+        });
+        if (!queued)
+            done(Source{"", "", "book store busy"});
+    }
+
+private:
+    static constexpr size_t QUEUE = 256;
+
+    bool isS3(const std::string& location) const {
+        return location.rfind("s3://" + bucket_ + "/", 0) == 0;
+    }
+    static long long partBytes(void) { return Config::get().s3PartBytes(); }
+
+    const std::string          bucket_;
+    const std::string          prefix_;
+    S3Client                   s3_;
+    std::shared_ptr<BookCache> cache_;      // shared with hold()'s handles
+    WorkerPool                 pool_;
+};
+
+} // namespace
+
+std::unique_ptr<BookStorage> makeLocalBookStorage(const fs::path& libraryDir) {
+    return std::make_unique<LocalBookStorage>(libraryDir);
+}
+
+std::unique_ptr<BookStorage> makeS3BookStorage(void) {
+    const Config& cfg = Config::get();
+    S3Client::Options o{cfg.s3Endpoint(), cfg.s3Region(), cfg.s3Bucket(), cfg.s3AccessKey(), cfg.s3SecretKey()};
+    return std::make_unique<S3BookStorage>(std::move(o), cfg.s3Prefix(), cfg.bookCacheDir(),
+                                           static_cast<size_t>(cfg.storageThreads()));
+}
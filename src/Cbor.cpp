@@ -0,0 +1,226 @@
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "Cbor.h"
+
+//****************************************************************
+// CborWriter
+//
+void CborWriter::head(unsigned major, unsigned long long arg) {
+    const char m = static_cast<char>(major << 5);
+    if (arg < 24) {
+        out_ += static_cast<char>(m | static_cast<char>(arg));
+        return;
+    }
+    int bytes;
+    if      (arg <= 0xff)       { out_ += static_cast<char>(m | 24); bytes = 1; }
+    else if (arg <= 0xffff)     { out_ += static_cast<char>(m | 25); bytes = 2; }
+    else if (arg <= 0xffffffff) { out_ += static_cast<char>(m | 26); bytes = 4; }
+    else                        { out_ += static_cast<char>(m | 27); bytes = 8; }
+    for (int i = bytes - 1; i >= 0; --i)    // big-endian
+        out_ += static_cast<char>((arg >> (8 * i)) & 0xff);
+}
+
+CborWriter& CborWriter::value(long long v) {
+    if (v >= 0)
+        head(0, static_cast<unsigned long long>(v));
+    else
+        head(1, static_cast<unsigned long long>(-(v + 1)));     // -1 - n, without overflow at LLONG_MIN
+    return *this;
+}
+
+CborWriter& CborWriter::value(double v) {
+    unsigned long long bits;
+    std::memcpy(&bits, &v, sizeof bits);
+    out_ += '\xfb';     // always double: exact, and the decoders handle it
+    for (int i = 7; i >= 0; --i)
+        out_ += static_cast<char>((bits >> (8 * i)) & 0xff);
+    return *this;
+}
+
+//****************************************************************
+// decoder
+//
+namespace {
+    const int MAX_DEPTH = 64;
+
+    class Reader {
+        public:
+            explicit Reader(std::string_view in) : p_(reinterpret_cast<const unsigned char*>(in.data())),
+                                                   end_(p_ + in.size()) {}
+
+            bool item(Json::Value& out, int depth);
+            bool atEnd() const { return p_ == end_; }
+
+        private:
+            size_t left() const { return static_cast<size_t>(end_ - p_); }
+
+            // initial byte's argument: false if truncated or reserved (28..30)
+            bool arg(unsigned ai, unsigned long long& v) {
+                if (ai < 24) { v = ai; return true; }
+                int n;
+                switch (ai) {
+                    case 24: n = 1; break;
+                    case 25: n = 2; break;
+                    case 26: n = 4; break;
+                    case 27: n = 8; break;
+                    default: return false;
+                }
+                if (left() < static_cast<size_t>(n)) return false;
+                v = 0;
+                for (int i = 0; i < n; ++i) v = (v << 8) | *p_++;
+                return true;
+            }
+
+            bool string(unsigned major, unsigned ai, std::string& out);
+
+            const unsigned char* p_;
+            const unsigned char* end_;
+    };
+
+    double halfToDouble(unsigned h) {
+        const int exp  = (h >> 10) & 0x1f;
+        const int mant = h & 0x3ff;
+        double v;
+        if (exp == 0)       v = std::ldexp(mant, -24);
+        else if (exp != 31) v = std::ldexp(mant + 1024, exp - 25);
+        else                v = mant == 0 ? INFINITY : NAN;
+        return (h & 0x8000) ? -v : v;
+    }
+}
+
+bool Reader::string(unsigned major, unsigned ai, std::string& out) {
+    if (ai != 31) {
+        unsigned long long n;
+        if (!arg(ai, n) || n > left()) return false;
+        out.assign(reinterpret_cast<const char*>(p_), static_cast<size_t>(n));
+        p_ += n;
+        return true;
+    }
+    // indefinite: definite chunks of the same major type, up to a break
+    out.clear();
+    for (;;) {
+        if (!left()) return false;
+        const unsigned char b = *p_++;
+        if (b == 0xff) return true;
+        if ((b >> 5) != major || (b & 31) == 31) return false;
+        unsigned long long n;
+        if (!arg(b & 31, n) || n > left()) return false;
+        out.append(reinterpret_cast<const char*>(p_), static_cast<size_t>(n));
+        p_ += n;
+    }
+}
+
+bool Reader::item(Json::Value& out, int depth) {
+    if (depth > MAX_DEPTH || !left()) return false;
+    const unsigned char b = *p_++;
+    const unsigned major = b >> 5, ai = b & 31;
+    unsigned long long v = 0;
+
+    switch (major) {
+        case 0:     // unsigned
+            if (!arg(ai, v)) return false;
+            out = (v <= static_cast<unsigned long long>(LLONG_MAX)) ? Json::Value(static_cast<Json::Int64>(v))
+                                                                    : Json::Value(static_cast<Json::UInt64>(v));
+            return true;
+
+        case 1:     // negative: -1 - v
+            if (!arg(ai, v) || v > static_cast<unsigned long long>(LLONG_MAX)) return false;
+            out = Json::Value(static_cast<Json::Int64>(-1 - static_cast<long long>(v)));
+            return true;
+
+        case 2:     // bytes: as a string (we never send or expect binary)
+        case 3: {   // text
+            std::string s;
+            if (!string(major, ai, s)) return false;
+            out = Json::Value(s);
+            return true;
+        }
+
+        case 4: {   // array
+            out = Json::Value(Json::arrayValue);
+            if (ai == 31) {
+                while (left() && *p_ != 0xff) {
+                    Json::Value e;
+                    if (!item(e, depth + 1)) return false;
+                    out.append(std::move(e));
+                }
+                if (!left()) return false;
+                ++p_;   // break
+                return true;
+            }
+            if (!arg(ai, v) || v > left()) return false;    // every element is at least one byte
+            for (unsigned long long i = 0; i < v; ++i) {
+                Json::Value e;
+                if (!item(e, depth + 1)) return false;
+                out.append(std::move(e));
+            }
+            return true;
+        }
+
+        case 5: {   // map
+            out = Json::Value(Json::objectValue);
+            const bool indefinite = (ai == 31);
+            if (!indefinite && (!arg(ai, v) || v > left() / 2)) return false;
+            for (unsigned long long i = 0; indefinite || i < v; ++i) {
+                if (indefinite) {
+                    if (!left()) return false;
+                    if (*p_ == 0xff) { ++p_; break; }
+                }
+                Json::Value k, e;
+                if (!item(k, depth + 1)) return false;
+                if (k.isString())          {}
+                else if (k.isIntegral())   k = Json::Value(k.asString());
+                else                       return false;
+                if (!item(e, depth + 1)) return false;
+                out[k.asString()] = std::move(e);
+            }
+            return true;
+        }
+
+        case 6:     // tag: the content is what matters
+            if (!arg(ai, v)) return false;
+            return item(out, depth + 1);
+
+        default:    // 7: simple values and floats
+            switch (ai) {
+                case 20: out = Json::Value(false); return true;
+                case 21: out = Json::Value(true);  return true;
+                case 22:
+                case 23: out = Json::Value(Json::nullValue); return true;
+                case 24: if (!left()) return false; ++p_; out = Json::Value(Json::nullValue); return true;
+                case 25: {
+                    if (!arg(ai, v)) return false;
+                    out = Json::Value(halfToDouble(static_cast<unsigned>(v)));
+                    return true;
+                }
+                case 26: {
+                    if (!arg(ai, v)) return false;
+                    const uint32_t bits = static_cast<uint32_t>(v);
+                    float f; std::memcpy(&f, &bits, sizeof f);
+                    out = Json::Value(static_cast<double>(f));
+                    return true;
+                }
+                case 27: {
+                    if (!arg(ai, v)) return false;
+                    double d; std::memcpy(&d, &v, sizeof d);
+                    out = Json::Value(d);
+                    return true;
+                }
+                default:
+                    if (ai < 20) { out = Json::Value(Json::nullValue); return true; }   // unassigned simple
+                    return false;   // reserved, or a break outside an indefinite item
+            }
+    }
+}
+
+bool cborToJson(std::string_view in, Json::Value& out) {
+    Reader r(in);
+    Json::Value v;
+    if (!r.item(v, 0) || !r.atEnd())
+        return false;
+    out = std::move(v);
+    return true;
+}
@@ -0,0 +1,102 @@
+#include <syslog.h>
+#include <algorithm>
+
+#include <drogon/drogon.h>
+
+#include "ChangeFeed.h"
+#include "Config.h"
+#include "Database.h"
+#include "utils.h"
+
+ChangeFeed& ChangeFeed::get() {
+    static ChangeFeed instance;
+    return instance;
+}
+
+ChangeFeed::ChangeFeed() : epoch_(nowMs()) {}
+
+void ChangeFeed::start(void) {
+    Database::get().setChangeListener([this](const std::string& username) { notify(username); });
+}
+
+bool ChangeFeed::Waiter::fire(long long version, bool changed) {
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        if (fired) return false;
+        fired = true;
+    }
+    wake(version, changed);     // Drogon callbacks may be called from any thread
+    return true;
+}
+
+ChangeFeed::User& ChangeFeed::userLocked(const std::string& username) {
+    auto it = users_.find(username);
+    if (it == users_.end())
+        it = users_.emplace(username, User{epoch_, {}}).first;
+    return it->second;
+}
+
+long long ChangeFeed::version(const std::string& username) {
+    std::lock_guard<std::mutex> lk(mu_);
+    return userLocked(username).version;
+}
+
+void ChangeFeed::notify(const std::string& username) {
+    std::vector<WaiterPtr> woken;
+    long long v;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        User& u = userLocked(username);
+        u.version = std::max(u.version + 1, nowMs());
+        v = u.version;
+        woken.swap(u.waiters);
+    }
+    // answer outside the lock: the writer thread is waiting on us
+    for (auto& w : woken)
+        w->fire(v, true);
+}
+
+void ChangeFeed::wait(const std::string& username, long long known, double timeoutSecs, Wake wake) {
+    auto w = std::make_shared<Waiter>();
+    w->wake = std::move(wake);
+
+    long long v;
+    WaiterPtr evicted;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        User& u = userLocked(username);
+        v = u.version;
+        if (known == v) {
+            auto& ws = u.waiters;
+            ws.erase(std::remove_if(ws.begin(), ws.end(),
+                                    [](const WaiterPtr& p){ std::lock_guard<std::mutex> l(p->mu); return p->fired; }),
+                     ws.end());
+            if (ws.size() >= static_cast<size_t>(Config::get().watchWaiters())) {   // the oldest is let go
+                evicted = ws.front();
+                ws.erase(ws.begin());
+            }
+            ws.push_back(w);
+        }
+    }
+
+    if (known != v) {
+        w->fire(v, true);
+        return;
+    }
+    if (evicted)
+        evicted->fire(v, false);
+
+    // the poll's deadline: answered "no change" unless notify() got there first
+    std::weak_ptr<Waiter> weak = w;
+    drogon::app().getLoop()->runAfter(timeoutSecs, [this, weak, username] {
+        auto p = weak.lock();
+        if (!p) return;
+        p->fire(version(username), false);
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = users_.find(username);
+        if (it != users_.end()) {
+            auto& ws = it->second.waiters;
+            ws.erase(std::remove(ws.begin(), ws.end(), p), ws.end());
+        }
+    });
+}
@@ -0,0 +1,151 @@
+#include <algorithm>
+
+#include <drogon/drogon.h>
+
+#include "Compactor.h"
+#include "WriteQueue.h"
+#include "Log.h"
+#include "utils.h"
+
+Compactor& Compactor::get() {
+    static Compactor instance;
+    return instance;
+}
+
+void Compactor::start(void) {
+    Database& db = Database::get();
+    std::vector<Database::DeviceSyncRow> devices;
+    std::vector<std::pair<std::string, Database::TblTimes>> purged;
+    db.listDeviceSync(devices);
+    db.listPurgedThrough(purged);
+
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto& row : devices) {
+            Device& d = users_[row.username].devices[row.device];
+            d.acked  = row.ackedTs;
+            d.seenAt = row.seenAt;
+        }
+        for (auto& [username, ts] : purged)
+            users_[username].purgedTs = ts;
+    }
+    logMsg(SYSLOG_INFO, "Compactor: %zu device watermarks loaded", devices.size());
+
+    drogon::app().getLoop()->runEvery(PASS_SECS, [this]{ pass(); });
+}
+
+void Compactor::ack(const std::string& username, const std::string& device, Database::Tbl t, long long ts) {
+    const long long now = nowMs();
+    ts = std::min(ts, now);     // a cursor from the future can't have seen anything yet to come
+
+    std::lock_guard<std::mutex> lk(mu_);
+    Device& d = users_[username].devices[device];
+    long long& acked = d.acked[static_cast<size_t>(t)];
+    if (ts > acked) acked = ts;
+    d.seenAt = now;
+    d.dirty  = true;
+}
+
+bool Compactor::needsResync(const std::string& username, Database::Tbl t, long long afterTs) {
+    if (afterTs <= 0) return false;     // starting from scratch anyway
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = users_.find(username);
+    return it != users_.end() && afterTs < it->second.purgedTs[static_cast<size_t>(t)];
+}
+
+// main loop, every PASS_SECS: save the watermarks that moved, forget idle devices,
+// then purge below each user's lowest active watermark
+void Compactor::pass(void) {
+    const long long activeSince = nowMs() - ACTIVE_DAYS * 24 * 3600 * 1000;
+    auto dirty = std::make_shared<std::vector<Database::DeviceSyncRow>>();
+    auto list  = std::make_shared<std::vector<Purge>>();
+
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (busy_) return;      // the last pass is still working through its batches
+
+        for (auto& [username, u] : users_) {
+            for (auto it = u.devices.begin(); it != u.devices.end(); ) {
+                Device& d = it->second;
+                if (d.seenAt < activeSince) { it = u.devices.erase(it); continue; }
+                if (d.dirty) {
+                    dirty->push_back(Database::DeviceSyncRow{username, it->first, d.acked, d.seenAt});
+                    d.dirty = false;
+                }
+                ++it;
+            }
+            if (u.devices.empty()) continue;    // nobody syncing: nothing to be sure of
+
+            for (size_t t = 0; t < u.purgedTs.size(); ++t) {
+                long long safe = LLONG_MAX;
+                for (const auto& dev : u.devices)
+                    safe = std::min(safe, dev.second.acked[t]);
+                if (safe <= u.purgedTs[t] && !u.retry[t]) continue;
+                safe = std::max(safe, u.purgedTs[t]);
+                list->push_back(Purge{username, static_cast<Database::Tbl>(t), safe});
+                u.purgedTs[t] = safe;   // cursors below it get told to resync from now on
+                u.retry[t]    = false;
+            }
+        }
+        busy_ = true;
+    }
+
+    WriteQueue::get().submit(
+        [dirty, activeSince] {
+            Database& db = Database::get();
+            db.deleteDeviceSyncBefore(activeSince);
+            for (const auto& row : *dirty)
+                db.upsertDeviceSync(row);
+        },
+        [this, list](bool ok) {
+            if (!ok) logMsg(SYSLOG_ERR, "Compactor: device watermarks not saved");
+            purgeNext(list, 0);
+        });
+}
+
+// the i'th purge: record how far it goes first (app.db), then delete (the user's shard,
+// if sharded), so a crash in between only makes devices resync needlessly, never keeps
+// from them that rows were deleted
+void Compactor::purgeNext(PurgeList list, size_t i) {
+    if (i >= list->size()) {
+        std::lock_guard<std::mutex> lk(mu_);
+        busy_ = false;
+        return;
+    }
+
+    const Purge& p = (*list)[i];
+    WriteQueue::get().submit(
+        [p] {
+            Database::TblTimes ts{};
+            ts[static_cast<size_t>(p.table)] = p.beforeTs;
+            Database::get().upsertPurgedThrough(p.username, ts);
+        },
+        [this, list, i](bool ok) {
+            if (!ok) return purgeFailed(list, i);
+            purgeBatch(list, i);
+        });
+}
+
+// one batch of the i'th purge's deletes; the next is queued once it commits, so there is
+// never more than one in the queue. A full batch means there may be more: go again.
+void Compactor::purgeBatch(PurgeList list, size_t i) {
+    const Purge& p = (*list)[i];
+    auto purged = std::make_shared<int>(0);
+    WriteQueue::get().submitFor(p.username,
+        [p, purged] {
+            *purged = Database::get().purgeTombstones(p.username, p.table, p.beforeTs, BATCH_ROWS);
+        },
+        [this, list, i, purged](bool ok) {
+            if (!ok) return purgeFailed(list, i);
+            if (*purged == BATCH_ROWS) purgeBatch(list, i);
+            else                       purgeNext(list, i + 1);
+        });
+}
+
+void Compactor::purgeFailed(PurgeList list, size_t i) {
+    logMsg(SYSLOG_ERR, "Compactor: tombstone purge failed, retrying next pass");
+    std::lock_guard<std::mutex> lk(mu_);
+    for (size_t j = i; j < list->size(); ++j)
+        users_[(*list)[j].username].retry[static_cast<size_t>((*list)[j].table)] = true;
+    busy_ = false;
+}
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <zlib.h>
+#ifdef SIMPLEREADER_WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+#include <drogon/drogon.h>
+
+#include "Compression.h"
+#include "Config.h"
+#include "Log.h"
+#include "utils.h"
+
+enum class Encoding { Identity, Gzip, Brotli };
+
+// quality of the encoding in an Accept-Encoding header: -1 if not listed, else 0..1
+static double acceptQuality(std::string_view header, std::string_view coding) {
+    double q = -1.0, star = -1.0;
+    while (!header.empty()) {
+        size_t comma = header.find(',');
+        std::string_view item = header.substr(0, comma);
+        header = (comma == std::string_view::npos) ? std::string_view() : header.substr(comma + 1);
+
+        double iq = 1.0;
+        const size_t semi = item.find(';');
+        if (semi != std::string_view::npos) {
+            const size_t eq = item.find("q=", semi);
+            if (eq != std::string_view::npos)
+                iq = std::atof(std::string(item.substr(eq + 2)).c_str());
+            item = item.substr(0, semi);
+        }
+        const size_t b = item.find_first_not_of(" \t");
+        const size_t e = item.find_last_not_of(" \t");
+        if (b == std::string_view::npos) continue;
+        item = item.substr(b, e - b + 1);
+
+        if (item.size() == coding.size() &&
+            std::equal(item.begin(), item.end(), coding.begin(),
+                       [](char x, char y){ return std::tolower((unsigned char)x) == y; }))
+            q = iq;
+        else if (item == "*")
+            star = iq;
+    }
+    return (q >= 0) ? q : star;
+}
+
+static Encoding negotiate(const std::string& acceptEncoding) {
+    if (acceptEncoding.empty()) return Encoding::Identity;
+    const double gz = acceptQuality(acceptEncoding, "gzip");
+#ifdef SIMPLEREADER_WITH_BROTLI
+    const double br = acceptQuality(acceptEncoding, "br");
+    if (br > 0 && br >= gz) return Encoding::Brotli;
+#endif
+    if (gz > 0) return Encoding::Gzip;
+    return Encoding::Identity;
+}
+
+// one deflate stream per thread, reset between responses (deflateInit allocates ~256KB)
+struct GzipEncoder {
+    z_stream zs{};
+    bool     ok = false;
+    std::vector<unsigned char> out;
+
+    GzipEncoder() {
+        // 15+16: gzip wrapper; level 5 is most of level 9's ratio on JSON, at a fraction of the cost
+        ok = (deflateInit2(&zs, 5, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    }
+    ~GzipEncoder() { if (ok) deflateEnd(&zs); }
+
+    // false: leave the body as is
+    bool encode(std::string_view in, std::string& result) {
+        if (!ok || deflateReset(&zs) != Z_OK) return false;
+        const uLong bound = deflateBound(&zs, static_cast<uLong>(in.size()));
+        if (out.size() < bound) out.resize(bound);
+
+        zs.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        zs.avail_in  = static_cast<uInt>(in.size());
+        zs.next_out  = out.data();
+        zs.avail_out = static_cast<uInt>(out.size());
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END) return false;
+
+        result.assign(reinterpret_cast<const char*>(out.data()), zs.total_out);
+        return true;
+    }
+};
+
+#ifdef SIMPLEREADER_WITH_BROTLI
+// brotli encoders can't be reset, so per thread we keep only the output buffer
+struct BrotliEncoder {
+    std::vector<uint8_t> out;
+
+    bool encode(std::string_view in, std::string& result) {
+        size_t n = BrotliEncoderMaxCompressedSize(in.size());
+        if (n == 0) return false;
+        if (out.size() < n) out.resize(n);
+        // quality 4: fast enough for interactive responses, still well ahead of gzip on JSON
+        if (!BrotliEncoderCompress(4, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                   in.size(), reinterpret_cast<const uint8_t*>(in.data()), &n, out.data()))
+            return false;
+        result.assign(reinterpret_cast<const char*>(out.data()), n);
+        return true;
+    }
+};
+#endif
+
+void enableResponseCompression(void) {
+    drogon::app().registerPostHandlingAdvice(
+        [](const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp) {
+            const size_t minBytes = static_cast<size_t>(Config::get().compressMinBytes());
+            if (minBytes == 0) return;
+            if (resp->contentType() != drogon::CT_APPLICATION_JSON) return;
+            if (!resp->getHeader("content-encoding").empty()) return;
+
+            const std::string_view body = resp->getBody();
+            if (body.size() < minBytes) return;
+
+            // the answer now depends on the request's Accept-Encoding (for any cache on the way)
+            resp->addHeader("Vary", "Accept-Encoding");
+
+            const Encoding enc = negotiate(req->getHeader("accept-encoding"));
+            if (enc == Encoding::Identity) return;
+
+            std::string packed;
+            bool ok = false;
+#ifdef SIMPLEREADER_WITH_BROTLI
+            if (enc == Encoding::Brotli) {
+                thread_local BrotliEncoder br;
+                ok = br.encode(body, packed);
+            }
+#endif
+            if (enc == Encoding::Gzip) {
+                thread_local GzipEncoder gz;
+                ok = gz.encode(body, packed);
+            }
+            if (!ok || packed.size() >= body.size()) return;
+
+            resp->setBody(std::move(packed));
+            resp->addHeader("Content-Encoding", enc == Encoding::Brotli ? "br" : "gzip");
+        });
+
+    logMsg(SYSLOG_INFO, "compressing JSON responses of %d bytes or more", Config::get().compressMinBytes());
+}
+
+namespace {
+
+class GzipStream final : public StreamEncoder {
+public:
+    GzipStream() {
+        if (deflateInit2(&zs_, 5, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+    }
+    ~GzipStream() override { deflateEnd(&zs_); }
+
+    const char* name(void) const override { return "gzip"; }
+
+    void write(std::string_view in, bool last, std::string& out) override {
+        zs_.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        zs_.avail_in = static_cast<uInt>(in.size());
+        const int flush = last ? Z_FINISH : Z_NO_FLUSH;
+        for (;;) {
+            zs_.next_out  = buf_;
+            zs_.avail_out = sizeof(buf_);
+            const int rc = deflate(&zs_, flush);
+            if (rc == Z_STREAM_ERROR)
+                throw std::runtime_error("deflate failed");
+            out.append(reinterpret_cast<const char*>(buf_), sizeof(buf_) - zs_.avail_out);
+            if (last ? rc == Z_STREAM_END : (zs_.avail_in == 0 && zs_.avail_out != 0)) break;
+        }
+    }
+
+private:
+    z_stream      zs_{};
+    unsigned char buf_[16384];
+};
+
+#ifdef SIMPLEREADER_WITH_BROTLI
+class BrotliStream final : public StreamEncoder {
+public:
+    BrotliStream() : enc_(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr)) {
+        if (!enc_)
+            throw std::runtime_error("BrotliEncoderCreateInstance failed");
+        BrotliEncoderSetParameter(enc_, BROTLI_PARAM_QUALITY, 4);     // as for whole bodies
+        BrotliEncoderSetParameter(enc_, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+    }
+    ~BrotliStream() override { BrotliEncoderDestroyInstance(enc_); }
+
+    const char* name(void) const override { return "br"; }
+
+    void write(std::string_view in, bool last, std::string& out) override {
+        size_t         availIn = in.size();
+        const uint8_t* nextIn  = reinterpret_cast<const uint8_t*>(in.data());
+        const BrotliEncoderOperation op = last ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+        for (;;) {
+            size_t   availOut = 0;
+            uint8_t* nextOut  = nullptr;
+            if (!BrotliEncoderCompressStream(enc_, op, &availIn, &nextIn, &availOut, &nextOut, nullptr))
+                throw std::runtime_error("BrotliEncoderCompressStream failed");
+            size_t n = 0;
+            const uint8_t* got = BrotliEncoderTakeOutput(enc_, &n);
+            out.append(reinterpret_cast<const char*>(got), n);
+            if (last ? BrotliEncoderIsFinished(enc_) : (availIn == 0 && !BrotliEncoderHasMoreOutput(enc_))) break;
+        }
+    }
+
+private:
+    BrotliEncoderState* enc_;
+};
+#endif
+
+} // namespace
+
+std::unique_ptr<StreamEncoder> makeStreamEncoder(const std::string& acceptEncoding) {
+    if (Config::get().compressMinBytes() == 0) return nullptr;
+    switch (negotiate(acceptEncoding)) {
+#ifdef SIMPLEREADER_WITH_BROTLI
+        case Encoding::Brotli: return std::make_unique<BrotliStream>();
+#endif
+        case Encoding::Gzip:   return std::make_unique<GzipStream>();
+        default:               return nullptr;
+    }
+}
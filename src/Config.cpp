@@ -5,6 +5,8 @@
 #include <string>
 
 #include "Config.h"
+#include "Log.h"
+#include "utils.h"
 #include "version.h"
 
 // loads simplereader.conf file into a map <key, value>
@@ -67,13 +69,25 @@ void Config::load(const std::string& overridePath) {
     }
 
     auto cfg = loadConfig(path);
-    auto assignStr = [&](const char* key, std::string& out) {
-        auto it = cfg.find(key);
-        if ( it != cfg.end() && !it->second.empty())
-            out = it->second; // only assign if present and non-empty
-    };
+    path_ = path;
+    apply(cfg, true);
+}
 
-    auto assignInt = [&](const char* key, int& out, auto validate) {
+bool Config::reload(void) {
+    std::unordered_map<std::string, std::string> cfg;
+    try {
+        cfg = loadConfig(path_);
+    } catch (const std::exception& ex) {
+        logMsg(SYSLOG_ERR, "Config: reload failed: %s", ex.what());
+        return false;
+    }
+    apply(cfg, false);
+    logMsg(SYSLOG_INFO, "Config: reloaded %s (%s; %s)", path_.c_str(), toShortString().c_str(), toPerfString().c_str());
+    return true;
+}
+
+void Config::apply(const std::unordered_map<std::string, std::string>& cfg, bool startup) {
+    auto parseInt = [&](const char* key, int& out, auto validate) {
         auto it = cfg.find(key);
         if (it != cfg.end()) {
             try {
@@ -88,19 +102,152 @@ void Config::load(const std::string& overridePath) {
         }
     };
 
+    // fixed at startup: on a reload, a changed value is only reported
+    auto assignStr = [&](const char* key, std::string& out) {
+        auto it = cfg.find(key);
+        if ( it != cfg.end() && !it->second.empty() && it->second != out) {
+            if (startup) out = it->second; // only assign if present and non-empty
+            else logMsg(SYSLOG_INFO, "Config: %s changed, takes effect after a restart", key);
+        }
+    };
+    auto assignInt = [&](const char* key, int& out, auto validate) {
+        int v = out;
+        parseInt(key, v, validate);
+        if (v == out) return;
+        if (startup) out = v;
+        else logMsg(SYSLOG_INFO, "Config: %s changed, takes effect after a restart", key);
+    };
+
+    // reloadable
+    auto assignHot = [&](const char* key, std::atomic<int>& out, auto validate) {
+        int v = out.load();
+        parseInt(key, v, validate);
+        out.store(v);
+    };
+    auto assignHotStr = [&](const char* key, std::string& out) {
+        auto it = cfg.find(key);
+        if (it != cfg.end() && !it->second.empty()) {
+            std::lock_guard<std::mutex> lk(strMu_);
+            out = it->second;
+        }
+    };
+
+    auto positive    = [](int v){ return v > 0; };
+    auto nonNegative = [](int v){ return v >= 0; };
+
     assignStr("host",           host_);
-    assignStr("compat",         compat_);
+    assignHotStr("compat",      compat_);
+    assignHotStr("loglevel",    logLevel_);
     assignInt("port",           port_,          [](int v){ return v > 0 && v <= 65535; });
-    assignInt("maxfilesize",    maxFileSizeMB_, [](int v){ return v > 0; });
-    assignInt("tokentimeout",   tokenTimeout_,  [](int v){ return v > 0; });
+    assignInt("maxfilesize",    maxFileSizeMB_, positive);
+    assignHot("tokentimeout",   tokenTimeout_,  positive);
+    assignInt("persistsessions",persistSessions_,[](int v){ return v == 0 || v == 1; });
+    assignHot("compressminbytes",compressMinBytes_,nonNegative);
+
+    assignInt("iothreads",      ioThreads_,     nonNegative);
+    assignInt("dbreaders",      dbReaders_,     nonNegative);
+    assignInt("dbshards",       dbShards_,      [](int v){ return v >= 0 && v <= 64; });
+    assignInt("memorybodykb",   memoryBodyKB_,  positive);
+    assignInt("loginthreads",   loginThreads_,  positive);
+    assignInt("loginqueue",     loginQueue_,    positive);
+
+    assignHot("pagelimit",      pageLimit_,     positive);
+    assignHot("maxbatch",       maxBatch_,      positive);
+    assignHot("maxchunkmb",     maxChunkMB_,    [](int v){ return v > 0 && v <= 1024; });
+    assignHot("uploadbufferkb", uploadBufferKB_,[](int v){ return v > 0 && v <= 65536; });
+    assignHot("dbcachemb",      dbCacheMB_,     positive);
+    assignHot("dbmmapmb",       dbMmapMB_,      nonNegative);
+    assignHot("writewindowms",  writeWindowMs_, [](int v){ return v >= 0 && v <= 1000; });
+    assignHot("writemaxbatch",  writeMaxBatch_, positive);
+    assignHot("watchwaiters",   watchWaiters_,  positive);
+
+    assignStr("sessionstore",   sessionStore_);
+    assignStr("redishost",      redisHost_);
+    assignInt("redisport",      redisPort_,     [](int v){ return v > 0 && v <= 65535; });
+    assignStr("redispassword",  redisPassword_);
+
+    assignStr("bookstore",      bookStore_);
+    assignStr("librarydir",     libraryDir_);
+    assignStr("s3endpoint",     s3Endpoint_);
+    assignStr("s3region",       s3Region_);
+    assignStr("s3bucket",       s3Bucket_);
+    assignStr("s3prefix",       s3Prefix_);
+    assignStr("s3accesskey",    s3AccessKey_);
+    assignStr("s3secretkey",    s3SecretKey_);
+    assignHot("s3partmb",       s3PartMB_,      [](int v){ return v >= 5 && v <= 128; });      // S3 takes 5 MB+; each part is read into memory
+    assignHot("s3presignsecs",  s3PresignSecs_, [](int v){ return v >= 0 && v <= 604800; });   // at most 7 days
+    assignStr("bookcachedir",   bookCacheDir_);
+    assignHot("bookcachemb",    bookCacheMB_,   positive);
+    assignInt("storagethreads", storageThreads_,positive);
+    assignStr("thumbdir",       thumbDir_);
+    assignHot("covermaxkb",     coverMaxKB_,    positive);
+
+    assignStr("backupdir",      backupDir_);
+    assignInt("backuphours",    backupHours_,   nonNegative);
+    assignHot("backupkeep",     backupKeep_,    positive);
+    assignHot("backuppages",    backupPages_,   positive);
+    assignHot("backuppausems",  backupPauseMs_, nonNegative);
+
+    assignHot("scrubmbps",      scrubMBps_,     nonNegative);
+    assignHot("scrubhours",     scrubHours_,    positive);
+
+    assignHot("readrate",       readRate_,      nonNegative);
+    assignHot("readburst",      readBurst_,     positive);
+    assignHot("writerate",      writeRate_,     nonNegative);
+    assignHot("writeburst",     writeBurst_,    positive);
+    assignHot("bookrate",       bookRate_,      nonNegative);
+    assignHot("bookburst",      bookBurst_,     positive);
+    assignHot("shedqueue",      shedQueue_,     nonNegative);
+    assignHot("shedp99ms",      shedP99Ms_,     nonNegative);
+}
+
+std::string Config::compat() const {
+    std::lock_guard<std::mutex> lk(strMu_);
+    return compat_;
+}
+
+std::string Config::logLevel() const {
+    std::lock_guard<std::mutex> lk(strMu_);
+    return logLevel_;
 }
 
 std::string Config::toShortString() const {
     std::ostringstream oss;
 
-    oss << "compat=" << compat_ << ", "
+    oss << "compat=" << compat() << ", "
         << "maxFileSize=" << maxFileSizeMB_ << "MB, "
-        << "tokenTimeout=" << tokenTimeout_ << "mins";
+        << "tokenTimeout=" << tokenTimeout_ << "mins, "
+        << "persistSessions=" << persistSessions_ << ", "
+        << "compressMinBytes=" << compressMinBytes_ << ", "
+        << "logLevel=" << logLevel();
+
+    return oss.str();
+}
+
+std::string Config::toPerfString() const {
+    std::ostringstream oss;
+
+    oss << "ioThreads=" << ioThreads_ << ", "
+        << "dbReaders=" << dbReaders_ << ", "
+        << "dbShards=" << dbShards_ << ", "
+        << "memoryBody=" << memoryBodyKB_ << "KB, "
+        << "loginThreads=" << loginThreads_ << ", "
+        << "loginQueue=" << loginQueue_ << ", "
+        << "pageLimit=" << pageLimit_ << ", "
+        << "maxBatch=" << maxBatch_ << ", "
+        << "maxChunk=" << maxChunkMB_ << "MB, "
+        << "uploadBuffer=" << uploadBufferKB_ << "KB, "
+        << "dbCache=" << dbCacheMB_ << "MB, "
+        << "dbMmap=" << dbMmapMB_ << "MB, "
+        << "writeWindow=" << writeWindowMs_ << "ms, "
+        << "writeMaxBatch=" << writeMaxBatch_ << ", "
+        << "watchWaiters=" << watchWaiters_ << ", "
+        << "read=" << readRate_ << "/s (burst " << readBurst_ << "), "
+        << "write=" << writeRate_ << "/s (burst " << writeBurst_ << "), "
+        << "book=" << bookRate_ << "/s (burst " << bookBurst_ << "), "
+        << "shedQueue=" << shedQueue_ << ", "
+        << "shedP99=" << shedP99Ms_ << "ms, "
+        << "scrub=" << scrubMBps_ << "MB/s every " << scrubHours_ << "h";
 
     return oss.str();
 }
@@ -110,7 +257,8 @@ std::string Config::toString() const {
 
     oss << "v" << SIMPLEREADERD_VERSION << " on "
         << host_ << ":" << port_ << " ("
-        << toShortString() << ")";
+        << toShortString() << "; "
+        << toPerfString() << ")";
 
         return oss.str();
 }
\ No newline at end of file
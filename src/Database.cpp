@@ -1,9 +1,17 @@
-#include <syslog.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
 #include <stdexcept>
+#include <thread>
 
 #include <sodium.h>
+#include <jsoncpp/json/writer.h>
 
 #include "Database.h"
+#include "RowWriter.h"
+#include "Log.h"
 #include "utils.h"
 
 Database& Database::get() {
@@ -11,28 +19,360 @@ Database& Database::get() {
     return instance;
 }
 
-void Database::open(const std::string& path) {
+std::unique_ptr<Database> Database::create(void) {
+    return std::unique_ptr<Database>(new Database());
+}
 
-    if (db_) {
-        return; // db already open
+//****************************************************************
+// connection pool
+//
+// All connections run in WAL mode, so readers see a consistent snapshot and
+// never wait on the writer (nor the writer on them).  There is exactly one
+// writer connection (SQLite allows only one writer at a time anyway) and a
+// pool of read-only connections, normally one per Drogon IO thread.
+//
+//****************************************************************
+static void execOrThrow(sqlite3* db, const char* sql);
+static std::string shardPath(const std::string& path, int i);
+
+void Database::openConnection(Connection& conn, const std::string& path, bool readOnly) {
+    const int flags = (readOnly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE))
+                      | SQLITE_OPEN_NOMUTEX;    // leases already guarantee one thread per connection
+
+    if (sqlite3_open_v2(path.c_str(), &conn.db, flags, nullptr) != SQLITE_OK) {
+        std::string msg = "sqlite open failed: " + std::string(sqlite3_errmsg(conn.db));
+        sqlite3_close(conn.db);
+        conn.db = nullptr;
+        throw std::runtime_error(msg);
+    }
+
+    // wait (rather than fail with SQLITE_BUSY) if another connection holds a lock, e.g. add_user or a checkpoint
+    sqlite3_busy_timeout(conn.db, 5000);
+
+    if (!readOnly) {
+        execOrThrow(conn.db, "PRAGMA journal_mode = WAL;");   // persistent: stored in the db file
+        execOrThrow(conn.db, "PRAGMA synchronous = NORMAL;"); // WAL + NORMAL is durable against app crashes
+        execOrThrow(conn.db, "PRAGMA foreign_keys = ON;");
+    }
+    execOrThrow(conn.db, "PRAGMA temp_store = MEMORY;");
+    tune(conn);     // page cache and mmap window
+}
+
+void Database::setCacheSizes(int cacheKB, long long mmapBytes) {
+    cacheKB_.store(cacheKB);
+    mmapBytes_.store(mmapBytes);
+    tuning_.fetch_add(1);
+    for (auto& s : shards_)
+        s->setCacheSizes(cacheKB, mmapBytes);
+}
+
+// called with the connection leased (nobody else is using it)
+void Database::tune(Connection& conn) {
+    const unsigned gen = tuning_.load();
+    if (conn.tuned == gen) return;
+    conn.tuned = gen;
+
+    const std::string sql = "PRAGMA cache_size = -" + std::to_string(cacheKB_.load()) + ";"   // negative: KB, not pages
+                          + "PRAGMA mmap_size = " + std::to_string(mmapBytes_.load()) + ";"; // read through mmap
+    char* err = nullptr;
+    if (sqlite3_exec(conn.db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+        logMsg(SYSLOG_ERR, "tune() %s", err ? err : "failed");
+        sqlite3_free(err);
     }
+}
 
-    // open the database
-    if (sqlite3_open(path.c_str(), &db_) != SQLITE_OK) {
-        throw std::runtime_error("sqlite open failed: " + std::string(sqlite3_errmsg(db_)));
+void Database::closeConnection(Connection& conn) {
+    for (auto& s : conn.stmts) {
+        sqlite3_finalize(s);    // no-op on nullptr
+        s = nullptr;
+    }
+    if (conn.db) {
+        sqlite3_close(conn.db);
+        conn.db = nullptr;
     }
+}
+
+void Database::open(const std::string& path, int readers, int shards) {
+
+    if (writer_.db) {
+        return; // db already open
+    }
+
+    registerMetrics();
+    path_ = path;
+
+    // open the writer first: it creates the file and switches it to WAL
+    openConnection(writer_, path, false);
 
     //
     // setup schema (if it doesn't already exist)
     //
-    initSchema();
+    initSchema(writer_.db);
+
+    const int recorded = isShard_ ? 0 : shardLayout();
+    if (recorded != shards && !(recorded == 0 && shards > 0))
+        throw std::runtime_error(path + " is laid out in " + std::to_string(recorded) + " shard(s), not " +
+                                 std::to_string(shards) + ": the shard count can't be changed");
+
+    // then the readers
+    {
+        std::lock_guard<std::mutex> lk(readersMu_);
+        for (int i = 0; i < std::max(1, readers); ++i) {
+            auto conn = std::make_unique<Connection>();
+            openConnection(*conn, path, true);
+            freeReaders_.push_back(conn.get());
+            readers_.push_back(std::move(conn));
+        }
+    }
+
+    // then the shards, each a Database of its own with as many readers
+    for (int i = 0; i < shards; ++i) {
+        std::unique_ptr<Database> s(new Database());
+        s->isShard_ = true;
+        s->sharedWriters_ = sharedWriters_;
+        s->cacheKB_.store(cacheKB_.load());
+        s->mmapBytes_.store(mmapBytes_.load());
+        s->changeListener_ = changeListener_;
+        s->open(shardPath(path, i), readers);
+        shards_.push_back(std::move(s));
+    }
+    if (shards > 0 && recorded == 0)
+        moveToShards();
+
+    // warm up, so the first requests after a restart aren't cold:
+    // the books cache, and every statement prepared on every connection
+    const auto start = Metrics::Clock::now();
+    if (!isShard_)
+        loadBookCache();
+    size_t prepared = prepareAll(writer_);
+    for (auto& conn : readers_)
+        prepared += prepareAll(*conn);      // not leased yet: nobody else can be using them
+    logMsg(SYSLOG_INFO, "warm-up%s%s: %zu statements prepared on %zu connections, %lld ms",
+           isShard_ ? " " : "", isShard_ ? path.c_str() : "", prepared, readers_.size() + 1,
+           static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(Metrics::Clock::now() - start).count()));
+}
+
+void Database::backupTo(const std::string& dest, int pagesPerStep, std::chrono::milliseconds pause,
+                        const std::function<bool(int remaining, int total)>& progress) {
+    if (path_.empty())
+        throw std::runtime_error("database not open");
+
+    // closes whatever got opened, however we leave
+    struct Handles {
+        Connection      src;
+        sqlite3*        out = nullptr;
+        sqlite3_backup* job = nullptr;
+        ~Handles() {
+            if (job) sqlite3_backup_finish(job);
+            if (out) sqlite3_close(out);
+            if (src.db) sqlite3_exec(src.db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            closeConnection(src);
+        }
+    } h;
+
+    openConnection(h.src, path_, true);
+    // pin one snapshot for the whole copy: without it, every commit in between restarts the backup
+    execOrThrow(h.src.db, "BEGIN; SELECT count(*) FROM sqlite_master;");
+
+    if (sqlite3_open_v2(dest.c_str(), &h.out, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
+        throw std::runtime_error("backup: can't create " + dest + ": " + sqlite3_errmsg(h.out));
+    h.job = sqlite3_backup_init(h.out, "main", h.src.db, "main");
+    if (!h.job)
+        throw std::runtime_error(std::string("backup: ") + sqlite3_errmsg(h.out));
+
+    int rc;
+    for (;;) {
+        rc = sqlite3_backup_step(h.job, pagesPerStep);
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) break;
+        if (!progress(sqlite3_backup_remaining(h.job), sqlite3_backup_pagecount(h.job)))
+            throw std::runtime_error("backup: abandoned");
+        std::this_thread::sleep_for(pause);
+    }
+    progress(0, sqlite3_backup_pagecount(h.job));
+    rc = sqlite3_backup_finish(h.job);
+    h.job = nullptr;
+    if (rc != SQLITE_OK)
+        throw std::runtime_error(std::string("backup: ") + sqlite3_errmsg(h.out));
+    if (sqlite3_close(h.out) != SQLITE_OK)
+        throw std::runtime_error("backup: close failed");
+    h.out = nullptr;
+}
+
+size_t Database::prepareAll(Connection& conn) {
+    size_t n = 0;
+    for (size_t i = 0; i < STMT_COUNT; ++i) {
+        sqlite3_stmt*& slot = conn.stmts[i];
+        if (slot) continue;
+        if (isShard_ && !userStmt(static_cast<Stmt>(i))) continue;     // its tables aren't in a shard
+        if (sqlite3_prepare_v3(conn.db, stmtSql(static_cast<Stmt>(i)), -1, SQLITE_PREPARE_PERSISTENT, &slot, nullptr) != SQLITE_OK) {
+            // left for CachedStmt to retry (and report) on first use
+            logMsg(SYSLOG_ERR, "prepareAll() %s: %s", stmtName(static_cast<Stmt>(i)), sqlite3_errmsg(conn.db));
+            slot = nullptr;
+            continue;
+        }
+        ++n;
+    }
+    return n;
 }
 
 void Database::close(void) {
-    if (db_) {
-        sqlite3_close(db_);
-        db_ = nullptr;
+    for (auto& s : shards_)
+        s->close();
+    shards_.clear();
+
+    {
+        std::unique_lock<std::mutex> lk(readersMu_);
+        // wait for any readers still checked out
+        readersCv_.wait(lk, [this]{ return freeReaders_.size() == readers_.size(); });
+        for (auto& conn : readers_)
+            closeConnection(*conn);
+        readers_.clear();
+        freeReaders_.clear();
     }
+
+    std::lock_guard<std::mutex> lk(writerMu_);
+    closeConnection(writer_);
+}
+
+thread_local Database::Connection* Database::snapshotConn_ = nullptr;
+thread_local Database*             Database::snapshotDb_   = nullptr;
+thread_local Database::Connection* Database::txnConn_      = nullptr;
+
+// (a WriteTxn or ReadSnapshot on a shard says nothing about reads of app.db, nor the other way round)
+Database::ReadLease::ReadLease(Database& owner) : owner_(owner) {
+    if (txnConn_ == &owner.writer_) {   // inside a WriteTxn: read our own uncommitted writes
+        conn_   = txnConn_;
+        pinned_ = true;
+        return;
+    }
+    if (snapshotConn_ && snapshotDb_ == &owner) {   // inside a ReadSnapshot: read from its connection
+        conn_   = snapshotConn_;
+        pinned_ = true;
+        return;
+    }
+
+    std::unique_lock<std::mutex> lk(owner_.readersMu_);
+    if (owner_.readers_.empty())
+        throw std::runtime_error("database not open");
+    if (owner_.freeReaders_.empty()) {      // all checked out: time the wait
+        const auto start = Metrics::Clock::now();
+        owner_.readersCv_.wait(lk, [this]{ return !owner_.freeReaders_.empty(); });
+        readerWaitLatency_.since(start);
+    }
+    conn_ = owner_.freeReaders_.back();
+    owner_.freeReaders_.pop_back();
+    lk.unlock();
+    owner_.tune(*conn_);
+}
+
+Database::ReadLease::~ReadLease() {
+    if (pinned_) return;
+    {
+        std::lock_guard<std::mutex> lk(owner_.readersMu_);
+        owner_.freeReaders_.push_back(conn_);
+    }
+    owner_.readersCv_.notify_one();
+}
+
+// The snapshot itself is taken by the first SELECT after BEGIN (WAL read mark) and
+// held until COMMIT, so writes committed in between are invisible to this thread.
+Database::ReadSnapshot::ReadSnapshot(Database& db) {
+    if (snapshotConn_) return;      // nested: the outer snapshot already covers us (one Database per thread)
+
+    lease_.reset(new ReadLease(db));
+    int rc = sqlite3_exec((*lease_)->db, "BEGIN", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK) {
+        std::string msg = sqlite3_errmsg((*lease_)->db);
+        lease_.reset();
+        throw std::runtime_error("ReadSnapshot: BEGIN failed: " + msg);
+    }
+    snapshotConn_ = &**lease_;
+    snapshotDb_   = &db;
+}
+
+Database::ReadSnapshot::~ReadSnapshot() {
+    if (!lease_) return;
+    snapshotConn_ = nullptr;
+    snapshotDb_   = nullptr;
+    // read-only transaction: nothing to keep, and COMMIT can't fail in a way worth reporting
+    if (sqlite3_exec((*lease_)->db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK)
+        sqlite3_exec((*lease_)->db, "ROLLBACK", nullptr, nullptr, nullptr);
+}
+
+thread_local std::vector<std::pair<std::string, Database::BookInfo>> Database::pendingBooks_;
+thread_local std::vector<std::string> Database::pendingChanges_;
+
+Database::WriteTxn::WriteTxn(Database& db) : db_(db), conn_(&db.writer_) {
+    if (txnConn_)
+        throw std::runtime_error("WriteTxn: already in a transaction");
+    lock_ = std::unique_lock<std::mutex>(db.writerMu_);
+    if (!conn_->db)
+        throw std::runtime_error("database not open");
+
+    int rc = sqlite3_exec(conn_->db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK)
+        throw std::runtime_error(std::string("WriteTxn: BEGIN failed: ") + sqlite3_errmsg(conn_->db));
+    txnConn_ = conn_;
+    pendingBooks_.clear();
+    pendingChanges_.clear();
+}
+
+void Database::WriteTxn::commit(void) {
+    if (done_) return;
+    const auto start = Metrics::Clock::now();
+    int rc = sqlite3_exec(conn_->db, "COMMIT", nullptr, nullptr, nullptr);
+    commitLatency_.since(start);
+    if (rc != SQLITE_OK)
+        throw std::runtime_error(std::string("WriteTxn: COMMIT failed: ") + sqlite3_errmsg(conn_->db));
+    done_    = true;
+    txnConn_ = nullptr;
+
+    for (auto& [fileId, info] : pendingBooks_)
+        db_.cacheBook(fileId, std::move(info));
+    pendingBooks_.clear();
+
+    // one announcement per user, however many of their rows the batch touched
+    std::vector<std::string> changed;
+    changed.swap(pendingChanges_);
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    if (db_.changeListener_)
+        for (const auto& user : changed)
+            db_.changeListener_(user);
+}
+
+Database::WriteTxn::~WriteTxn() {
+    if (!done_)
+        sqlite3_exec(conn_->db, "ROLLBACK", nullptr, nullptr, nullptr);
+    txnConn_ = nullptr;
+    pendingBooks_.clear();
+    pendingChanges_.clear();
+}
+
+Database::Savepoint::Savepoint()
+    : conn_(txnConn_), pendingMark_(pendingBooks_.size()), changesMark_(pendingChanges_.size()) {
+    if (!conn_)
+        throw std::runtime_error("Savepoint: no WriteTxn on this thread");
+    int rc = sqlite3_exec(conn_->db, "SAVEPOINT sp", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK)
+        throw std::runtime_error(std::string("Savepoint: SAVEPOINT failed: ") + sqlite3_errmsg(conn_->db));
+}
+
+void Database::Savepoint::release(void) {
+    if (done_) return;
+    int rc = sqlite3_exec(conn_->db, "RELEASE sp", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK)
+        throw std::runtime_error(std::string("Savepoint: RELEASE failed: ") + sqlite3_errmsg(conn_->db));
+    done_ = true;
+}
+
+Database::Savepoint::~Savepoint() {
+    if (done_) return;
+    // undo this unit of work, then pop the savepoint; the outer transaction carries on
+    sqlite3_exec(conn_->db, "ROLLBACK TO sp", nullptr, nullptr, nullptr);
+    sqlite3_exec(conn_->db, "RELEASE sp", nullptr, nullptr, nullptr);
+    pendingBooks_.resize(std::min(pendingBooks_.size(), pendingMark_));
+    pendingChanges_.resize(std::min(pendingChanges_.size(), changesMark_));
 }
 
 //****************************************************************
@@ -56,246 +396,1135 @@ static void execOrThrow(sqlite3* db, const char* sql) {
     }
 }
 
-void Database::initSchema(void) {
-    execOrThrow(db_, "PRAGMA foreign_keys = ON;");
+// add the changed_at column to a table created by an older version, and backfill it
+// BACKFILL_ROWS rows per transaction, so no one statement holds the write lock for long.
+// The backfill only touches rows still at the column's default: if it is cut short,
+// the next start carries on where it stopped.
+static const long long BACKFILL_ROWS = 10000;
+
+static void addChangedAtColumn(sqlite3* db, const std::string& table) {
+    const std::string pragma = "PRAGMA table_info(" + table + ");";
+    sqlite3_stmt* s = nullptr;
+    if (sqlite3_prepare_v2(db, pragma.c_str(), -1, &s, nullptr) != SQLITE_OK)
+        throw std::runtime_error("prepare failed (table_info " + table + ")");
+
+    bool found = false;
+    while (sqlite3_step(s) == SQLITE_ROW) {
+        const char* name = reinterpret_cast<const char*>(sqlite3_column_text(s, 1));
+        if (name && std::string(name) == "changed_at") { found = true; break; }
+    }
+    sqlite3_finalize(s);
+    if (!found) {
+        logMsg(SYSLOG_INFO, "adding changed_at to %s", table.c_str());
+        const std::string alter = "ALTER TABLE " + table + " ADD COLUMN changed_at INTEGER NOT NULL DEFAULT 0;";
+        execOrThrow(db, alter.c_str());
+    }
+
+    long long maxRowid = 0;
+    const std::string top = "SELECT COALESCE(max(rowid), 0) FROM " + table + ";";
+    if (sqlite3_prepare_v2(db, top.c_str(), -1, &s, nullptr) != SQLITE_OK)
+        throw std::runtime_error("prepare failed (max rowid " + table + ")");
+    if (sqlite3_step(s) == SQLITE_ROW) maxRowid = sqlite3_column_int64(s, 0);
+    sqlite3_finalize(s);
+
+    const std::string fill = "UPDATE " + table + " SET changed_at = COALESCE(deleted_at, updated_at) "
+                             "WHERE rowid > ?1 AND rowid <= ?2 AND changed_at = 0;";
+    if (sqlite3_prepare_v2(db, fill.c_str(), -1, &s, nullptr) != SQLITE_OK)
+        throw std::runtime_error("prepare failed (backfill " + table + ")");
+    long long filled = 0;
+    for (long long lo = 0; lo < maxRowid; lo += BACKFILL_ROWS) {
+        sqlite3_bind_int64(s, 1, lo);
+        sqlite3_bind_int64(s, 2, lo + BACKFILL_ROWS);
+        const int rc = sqlite3_step(s);     // autocommit: one transaction per batch
+        sqlite3_reset(s);
+        if (rc != SQLITE_DONE) {
+            const std::string msg = sqlite3_errmsg(db);
+            sqlite3_finalize(s);
+            throw std::runtime_error("backfill " + table + ": " + msg);
+        }
+        filled += sqlite3_changes(db);
+    }
+    sqlite3_finalize(s);
+    if (filled > 0)
+        logMsg(SYSLOG_INFO, "backfilled changed_at on %lld %s row(s)", filled, table.c_str());
+}
+
+// v1
+static void schemaV1(sqlite3* db) {
+    //
+    //****************************************************************
+    //  users:  list of all valid users and their (hashed) passwords
+    //
+    //  CREATE TABLE IF NOT EXISTS users (
+    //    username   TEXT PRIMARY KEY,      // a unique username
+    //    pwd_hash   TEXT NOT NULL,         // hashed password
+    //    created_at INTEGER NOT NULL )     // when the user was added
+    //
+    //****************************************************************
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS users (
+          username   TEXT PRIMARY KEY,
+          pwd_hash   TEXT NOT NULL,
+          created_at INTEGER NOT NULL
+        );
+    )SQL");
+
+    //
+    //****************************************************************
+    //  books:  list of all epub/pdf books we have in our library
+    //          note: "sha256" should be enough to identify the same physical book (epub/pdf),
+    //                and use "filesize" as a sanity check
+    //
+    // CREATE TABLE IF NOT EXISTS books (
+    //    file_id    TEXT PRIMARY KEY,                          // server UUID
+    //    sha256     TEXT NOT NULL CHECK (length(sha256) = 64), // checksum of file
+    //    filesize   INTEGER NOT NULL CHECK (filesize >= 0),    // size of the file
+    //    location   TEXT NOT NULL,                             // physical location on server (/var/lib/simplereader/library/...)
+    //    filename   TEXT NOT NULL,                             // filename used by the client (not by the server).  
+    //                                                          // Used when downloading to tell client what to call the file.
+    //    updated_at INTEGER NOT NULL );                        // UTC time when book was added to the library
+    //
+    //****************************************************************
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS books (
+          file_id    TEXT PRIMARY KEY,
+          sha256     TEXT NOT NULL CHECK (length(sha256) = 64),
+          filesize   INTEGER NOT NULL CHECK (filesize >= 0),
+          location   TEXT NOT NULL,
+          filename   TEXT NOT NULL,
+          updated_at INTEGER NOT NULL,
+          UNIQUE (sha256, filesize)
+        );
+    )SQL");
+
+    //
+    //****************************************************************
+    //  user_books: list of all books that a username has ever had (including deleted ones)
+    //
+    // CREATE TABLE IF NOT EXISTS user_books (
+    //    username    TEXT NOT NULL,            // primary key
+    //    file_id     TEXT NOT NULL,            // primary key
+    //    progress    TEXT,                     // client-only:  JSON blob
+    //
+    //    updated_at  INTEGER NOT NULL,         // UTC timestamp this record last updated
+    //    deleted_at  INTEGER,                  // zero means still active, non-zero is UTC tombstone
+    //    changed_at  INTEGER NOT NULL,         // UTC timestamp of the last insert/update/delete (the /getSince cursor)
+    //
+    //    PRIMARY KEY (username, file_id),
+    //
+    //    FOREIGN KEY (username)                // username must link to a user in "users"
+    //      REFERENCES users(username)
+    //      ON DELETE CASCADE                   // when username is deleted from "users", delete their records from "user_books" too
+    //      ON UPDATE NO ACTION,
+    //
+    //    FOREIGN KEY (file_id)                 // file_id must link to a book in "books"
+    //      REFERENCES books(file_id)
+    //      ON DELETE RESTRICT
+    //      ON UPDATE NO ACTION );
+    //
+    //  CREATE INDEX IF NOT EXISTS idx_user_books_user_updated ON user_books (username, updated_at);
+    //  CREATE INDEX IF NOT EXISTS idx_user_books_user_deleted ON user_books (username, deleted_at);
+    //  CREATE INDEX IF NOT EXISTS idx_user_books_user_changed ON user_books (username, changed_at, file_id);
+    //
+    //****************************************************************
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS user_books (
+          username    TEXT NOT NULL,
+          file_id     TEXT NOT NULL,
+          progress    TEXT,
+          updated_at  INTEGER NOT NULL,
+          deleted_at  INTEGER,
+          changed_at  INTEGER NOT NULL DEFAULT 0,
+          PRIMARY KEY (username, file_id),
+          FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION,
+          FOREIGN KEY (file_id)  REFERENCES books(file_id)  ON DELETE RESTRICT ON UPDATE NO ACTION
+        );
+        CREATE INDEX IF NOT EXISTS idx_user_books_user_updated ON user_books (username, updated_at);
+        CREATE INDEX IF NOT EXISTS idx_user_books_user_deleted ON user_books (username, deleted_at);
+    )SQL");
+
+
+    //
+    //****************************************************************
+    //  user_highlights: list of all highlights that a username has ever had (including deleted ones)
+    //
+    // CREATE TABLE IF NOT EXISTS user_highlights (
+    //   username    TEXT NOT NULL,
+    //   file_id     TEXT NOT NULL,                 -- -> books.file_id
+    //   id          INTEGER NOT NULL,              -- unique sequential number of this highlight
+    //   selection   TEXT NOT NULL,                 -- JSON-serialized position
+    //   label       TEXT,                          -- user label
+    //   colour      TEXT,                          
+    //   updated_at  INTEGER NOT NULL,              -- epoch millis (UTC)
+    //   deleted_at  INTEGER,                       -- NULL = active; non-NULL = tombstone
+    //   changed_at  INTEGER NOT NULL,              -- epoch millis of last insert/update/delete (/getSince cursor)
+    //
+    //   PRIMARY KEY (username, file_id, id),
+    //
+    //   FOREIGN KEY (username)
+    //     REFERENCES users(username)
+    //     ON DELETE CASCADE
+    //     ON UPDATE NO ACTION,
+    //
+    //   FOREIGN KEY (file_id)
+    //     REFERENCES books(file_id)
+    //     ON DELETE RESTRICT
+    //     ON UPDATE NO ACTION
+    // );
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS user_highlights (
+            username    TEXT NOT NULL,
+            file_id     TEXT NOT NULL,
+            id          INTEGER NOT NULL,
+            selection   TEXT NOT NULL,
+            label       TEXT,
+            colour      TEXT,
+            updated_at  INTEGER NOT NULL,
+            deleted_at  INTEGER,
+            changed_at  INTEGER NOT NULL DEFAULT 0,
+            PRIMARY KEY (username, file_id, id),
+            FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION,
+            FOREIGN KEY (file_id) REFERENCES books(file_id) ON DELETE RESTRICT ON UPDATE NO ACTION
+        );
+        CREATE INDEX IF NOT EXISTS idx_user_highlights_user_updated ON user_highlights (username, updated_at);
+        CREATE INDEX IF NOT EXISTS idx_user_highlights_user_deleted ON user_highlights (username, deleted_at);
+    )SQL");
+
+    //
+    //****************************************************************
+    //  user_bookmarks: list of all bookmarks that a username has ever had (including deleted ones)
+    //
+    // CREATE TABLE IF NOT EXISTS user_bookmarks (
+    //   username    TEXT NOT NULL,
+    //   file_id     TEXT NOT NULL,                 -- -> books.file_id
+    //   id          INTEGER NOT NULL,              -- unique sequential index for bookmark
+    //   locator     TEXT NOT NULL,                 -- JSON-serialized position (string)
+    //   label       TEXT,                          -- user label
+    //   updated_at  INTEGER NOT NULL,              -- epoch millis (UTC)
+    //   deleted_at  INTEGER,                       -- NULL = active; non-NULL = tombstone
+    //   changed_at  INTEGER NOT NULL,              -- epoch millis of last insert/update/delete (/getSince cursor)
+    //
+    //   PRIMARY KEY (username, file_id, id),
+    //
+    //   FOREIGN KEY (username)
+    //     REFERENCES users(username)
+    //     ON DELETE CASCADE
+    //     ON UPDATE NO ACTION,
+    //
+    //   FOREIGN KEY (file_id)
+    //     REFERENCES books(file_id)
+    //     ON DELETE RESTRICT
+    //     ON UPDATE NO ACTION );
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS user_bookmarks (
+            username    TEXT NOT NULL,
+            file_id     TEXT NOT NULL,
+            id          INTEGER NOT NULL,
+            locator     TEXT NOT NULL,
+            label       TEXT,
+            updated_at  INTEGER NOT NULL,
+            deleted_at  INTEGER,
+            changed_at  INTEGER NOT NULL DEFAULT 0,
+            PRIMARY KEY (username, file_id, id),
+            FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION,
+            FOREIGN KEY (file_id) REFERENCES books(file_id) ON DELETE RESTRICT ON UPDATE NO ACTION
+        );
+        CREATE INDEX IF NOT EXISTS idx_user_bookmarks_user_updated ON user_bookmarks (username, updated_at);
+        CREATE INDEX IF NOT EXISTS idx_user_bookmarks_user_deleted ON user_bookmarks (username, deleted_at);
+    )SQL");
+
+    //
+    //****************************************************************
+    //  user_notes: list of all notes that a username has ever had (including deleted ones)
+    //
+    // CREATE TABLE IF NOT EXISTS user_notes (
+    //   username    TEXT NOT NULL,
+    //   file_id     TEXT NOT NULL,                 -- -> books.file_id
+    //   id          INTEGER NOT NULL,              -- unique sequential index for note
+    //   locator     TEXT NOT NULL,                 -- JSON-serialized position (string)
+    //   content     TEXT NOT NULL,                 -- text of the note
+    //   updated_at  INTEGER NOT NULL,              -- epoch millis (UTC)
+    //   deleted_at  INTEGER,                       -- NULL = active; non-NULL = tombstone
+    //   changed_at  INTEGER NOT NULL,              -- epoch millis of last insert/update/delete (/getSince cursor)
+    //
+    //   PRIMARY KEY (username, file_id, id),
+    //
+    //   FOREIGN KEY (username)
+    //     REFERENCES users(username)
+    //     ON DELETE CASCADE
+    //     ON UPDATE NO ACTION,
+    //
+    //   FOREIGN KEY (file_id)
+    //     REFERENCES books(file_id)
+    //     ON DELETE RESTRICT
+    //     ON UPDATE NO ACTION );
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS user_notes (
+            username    TEXT NOT NULL,
+            file_id     TEXT NOT NULL,
+            id          INTEGER NOT NULL,
+            locator     TEXT NOT NULL,
+            content     TEXT NOT NULL,
+            updated_at  INTEGER NOT NULL,
+            deleted_at  INTEGER,
+            changed_at  INTEGER NOT NULL DEFAULT 0,
+            PRIMARY KEY (username, file_id, id),
+            FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION,
+            FOREIGN KEY (file_id) REFERENCES books(file_id) ON DELETE RESTRICT ON UPDATE NO ACTION
+        );
+        CREATE INDEX IF NOT EXISTS idx_user_notes_user_updated ON user_notes (username, updated_at);
+        CREATE INDEX IF NOT EXISTS idx_user_notes_user_deleted ON user_notes (username, deleted_at);
+    )SQL");
+}
+
+// v2
+static void schemaV2(sqlite3* db) {
+    //
+    //****************************************************************
+    //  sessions: login tokens, so a restart doesn't log every device out
+    //            (only used when persistsessions=1)
+    //
+    // CREATE TABLE IF NOT EXISTS sessions (
+    //   token_hash  TEXT PRIMARY KEY,              -- hex BLAKE2b of the token; the token itself is never stored
+    //   username    TEXT NOT NULL,                 -- -> users.username
+    //   device      TEXT NOT NULL,
+    //   expires_at  INTEGER NOT NULL,              -- epoch millis (UTC)
+    //
+    //   FOREIGN KEY (username)
+    //     REFERENCES users(username)
+    //     ON DELETE CASCADE
+    //     ON UPDATE NO ACTION );
+    //****************************************************************
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS sessions (
+            token_hash  TEXT PRIMARY KEY,
+            username    TEXT NOT NULL,
+            device      TEXT NOT NULL,
+            expires_at  INTEGER NOT NULL,
+            FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION
+        ) WITHOUT ROWID;
+        CREATE INDEX IF NOT EXISTS idx_sessions_expires ON sessions (expires_at);
+    )SQL");
+}
+
+// v3
+static void schemaV3(sqlite3* db) {
+    //
+    //****************************************************************
+    //  device_sync: per (user, device), how far it has synced each table (see Compactor)
+    //  tombstone_purges: per user, the changed_at below which each table's tombstones are gone
+    //
+    // CREATE TABLE IF NOT EXISTS device_sync (
+    //   username       TEXT NOT NULL,              -- -> users.username
+    //   device         TEXT NOT NULL,              -- as given at /login
+    //   books_ts       INTEGER NOT NULL,           -- epoch millis: every row changed before it has been sent
+    //   bookmarks_ts   INTEGER NOT NULL,
+    //   highlights_ts  INTEGER NOT NULL,
+    //   notes_ts       INTEGER NOT NULL,
+    //   seen_at        INTEGER NOT NULL,           -- epoch millis of its last /getSince or /sync
+    //
+    //   PRIMARY KEY (username, device),
+    //   FOREIGN KEY (username)
+    //     REFERENCES users(username)
+    //     ON DELETE CASCADE
+    //     ON UPDATE NO ACTION );
+    //
+    // CREATE TABLE IF NOT EXISTS tombstone_purges (   -- same columns, minus device and seen_at
+    //   username  TEXT PRIMARY KEY,  books_ts, bookmarks_ts, highlights_ts, notes_ts ... );
+    //****************************************************************
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS device_sync (
+            username       TEXT NOT NULL,
+            device         TEXT NOT NULL,
+            books_ts       INTEGER NOT NULL,
+            bookmarks_ts   INTEGER NOT NULL,
+            highlights_ts  INTEGER NOT NULL,
+            notes_ts       INTEGER NOT NULL,
+            seen_at        INTEGER NOT NULL,
+            PRIMARY KEY (username, device),
+            FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION
+        ) WITHOUT ROWID;
+        CREATE TABLE IF NOT EXISTS tombstone_purges (
+            username       TEXT PRIMARY KEY,
+            books_ts       INTEGER NOT NULL,
+            bookmarks_ts   INTEGER NOT NULL,
+            highlights_ts  INTEGER NOT NULL,
+            notes_ts       INTEGER NOT NULL,
+            FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION
+        ) WITHOUT ROWID;
+    )SQL");
+}
+
+// v4 (after backfillV4, in batches outside the step's transaction)
+static void backfillV4(sqlite3* db) {
+    for (const char* table : {"user_books", "user_bookmarks", "user_highlights", "user_notes"})
+        addChangedAtColumn(db, table);
+}
+
+static void schemaV4(sqlite3* db) {
+    //
+    //****************************************************************
+    //  changed_at: the /getSince keyset cursor is (changed_at, file_id, id).
+    //      Databases created before it existed get the column added and
+    //      backfilled from COALESCE(deleted_at, updated_at), the value /getSince used to sort on.
+    //
+    //****************************************************************
+    execOrThrow(db, R"SQL(
+        CREATE INDEX IF NOT EXISTS idx_user_books_user_changed     ON user_books     (username, changed_at, file_id);
+        CREATE INDEX IF NOT EXISTS idx_user_bookmarks_user_changed ON user_bookmarks (username, changed_at, file_id, id);
+        CREATE INDEX IF NOT EXISTS idx_user_highlights_user_changed ON user_highlights (username, changed_at, file_id, id);
+        CREATE INDEX IF NOT EXISTS idx_user_notes_user_changed     ON user_notes     (username, changed_at, file_id, id);
+    )SQL");
+}
+
+// v5
+static void schemaV5(sqlite3* db) {
+    //
+    //****************************************************************
+    //  shard_layout: how many shard files hold the user_* tables (see Database::open).
+    //      No row: they're here, in app.db. Written once, when the rows have been moved.
+    //
+    // CREATE TABLE IF NOT EXISTS shard_layout (
+    //   id      INTEGER PRIMARY KEY CHECK (id = 1),   -- one row
+    //   shards  INTEGER NOT NULL );
+    //****************************************************************
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS shard_layout (
+            id      INTEGER PRIMARY KEY CHECK (id = 1),
+            shards  INTEGER NOT NULL
+        );
+    )SQL");
+}
+
+// a shard's v1: the user_* tables as they are in app.db by v4, minus the foreign keys
+// (users and books live in app.db; /update checks the fileId, and usernames come from a login)
+static void shardSchemaV1(sqlite3* db) {
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS user_books (
+          username    TEXT NOT NULL,
+          file_id     TEXT NOT NULL,
+          progress    TEXT,
+          updated_at  INTEGER NOT NULL,
+          deleted_at  INTEGER,
+          changed_at  INTEGER NOT NULL DEFAULT 0,
+          PRIMARY KEY (username, file_id)
+        );
+        CREATE TABLE IF NOT EXISTS user_highlights (
+            username    TEXT NOT NULL,
+            file_id     TEXT NOT NULL,
+            id          INTEGER NOT NULL,
+            selection   TEXT NOT NULL,
+            label       TEXT,
+            colour      TEXT,
+            updated_at  INTEGER NOT NULL,
+            deleted_at  INTEGER,
+            changed_at  INTEGER NOT NULL DEFAULT 0,
+            PRIMARY KEY (username, file_id, id)
+        );
+        CREATE TABLE IF NOT EXISTS user_bookmarks (
+            username    TEXT NOT NULL,
+            file_id     TEXT NOT NULL,
+            id          INTEGER NOT NULL,
+            locator     TEXT NOT NULL,
+            label       TEXT,
+            updated_at  INTEGER NOT NULL,
+            deleted_at  INTEGER,
+            changed_at  INTEGER NOT NULL DEFAULT 0,
+            PRIMARY KEY (username, file_id, id)
+        );
+        CREATE TABLE IF NOT EXISTS user_notes (
+            username    TEXT NOT NULL,
+            file_id     TEXT NOT NULL,
+            id          INTEGER NOT NULL,
+            locator     TEXT NOT NULL,
+            content     TEXT NOT NULL,
+            updated_at  INTEGER NOT NULL,
+            deleted_at  INTEGER,
+            changed_at  INTEGER NOT NULL DEFAULT 0,
+            PRIMARY KEY (username, file_id, id)
+        );
+        CREATE INDEX IF NOT EXISTS idx_user_books_user_updated      ON user_books      (username, updated_at);
+        CREATE INDEX IF NOT EXISTS idx_user_books_user_deleted      ON user_books      (username, deleted_at);
+        CREATE INDEX IF NOT EXISTS idx_user_highlights_user_updated ON user_highlights (username, updated_at);
+        CREATE INDEX IF NOT EXISTS idx_user_highlights_user_deleted ON user_highlights (username, deleted_at);
+        CREATE INDEX IF NOT EXISTS idx_user_bookmarks_user_updated  ON user_bookmarks  (username, updated_at);
+        CREATE INDEX IF NOT EXISTS idx_user_bookmarks_user_deleted  ON user_bookmarks  (username, deleted_at);
+        CREATE INDEX IF NOT EXISTS idx_user_notes_user_updated      ON user_notes      (username, updated_at);
+        CREATE INDEX IF NOT EXISTS idx_user_notes_user_deleted      ON user_notes      (username, deleted_at);
+        CREATE INDEX IF NOT EXISTS idx_user_books_user_changed      ON user_books      (username, changed_at, file_id);
+        CREATE INDEX IF NOT EXISTS idx_user_bookmarks_user_changed  ON user_bookmarks  (username, changed_at, file_id, id);
+        CREATE INDEX IF NOT EXISTS idx_user_highlights_user_changed ON user_highlights (username, changed_at, file_id, id);
+        CREATE INDEX IF NOT EXISTS idx_user_notes_user_changed      ON user_notes      (username, changed_at, file_id, id);
+    )SQL");
+}
+
+// v6
+static void schemaV6(sqlite3* db) {
+    //
+    //****************************************************************
+    //  book_meta: what was read out of each book after its upload (see BookMeta), so
+    //      clients can show a library without downloading it. Covers are files in thumbdir.
+    //
+    // CREATE TABLE IF NOT EXISTS book_meta (
+    //   file_id      TEXT PRIMARY KEY,     -- books.file_id
+    //   format       TEXT NOT NULL,        -- "epub", "pdf", or "" (not one we read)
+    //   title        TEXT,                 -- NULL: unknown
+    //   author       TEXT,
+    //   pages        INTEGER,              -- pdf: its page count; epub: an estimate
+    //   cover_type   TEXT,                 -- media type of thumbdir/<file_id>, NULL if no cover
+    //   cover_bytes  INTEGER NOT NULL,
+    //   extracted_at INTEGER NOT NULL );   -- when it was read (epoch millis)
+    //****************************************************************
+    execOrThrow(db, R"SQL(
+        CREATE TABLE IF NOT EXISTS book_meta (
+            file_id      TEXT PRIMARY KEY,
+            format       TEXT NOT NULL,
+            title        TEXT,
+            author       TEXT,
+            pages        INTEGER,
+            cover_type   TEXT,
+            cover_bytes  INTEGER NOT NULL,
+            extracted_at INTEGER NOT NULL,
+            FOREIGN KEY (file_id) REFERENCES books(file_id) ON DELETE CASCADE ON UPDATE NO ACTION
+        ) WITHOUT ROWID;
+    )SQL");
+}
+
+//****************************************************************
+// schema migrations
+//
+// PRAGMA user_version is the last step applied.  On open, the steps after it run
+// in order, each once: its `batches` (if any) first, committing as they go, then its
+// `apply` and the version bump in one transaction.  A database already at the latest
+// version costs one PRAGMA read.  Steps must be safe to run again (a crash before
+// the bump repeats it), which is also what brings a database from before
+// user_version existed (version 0, tables already there) up to date.
+//
+// New schema goes in a new step at the end; a released step is never edited.
+// Shard files have steps of their own, versioned apart from app.db's.
+//
+//****************************************************************
+struct Migration {
+    int         version;
+    const char* what;
+    void      (*batches)(sqlite3* db);   // or nullptr
+    void      (*apply)(sqlite3* db);
+};
+
+static const Migration kMigrations[] = {
+    { 1, "books and annotations",               nullptr,    schemaV1 },
+    { 2, "sessions",                            nullptr,    schemaV2 },
+    { 3, "device sync watermarks",              nullptr,    schemaV3 },
+    { 4, "changed_at cursor and its indexes",   backfillV4, schemaV4 },
+    { 5, "shard layout",                        nullptr,    schemaV5 },
+    { 6, "book metadata",                       nullptr,    schemaV6 },
+};
+
+static const Migration kShardMigrations[] = {
+    { 1, "shard: annotations",                  nullptr,    shardSchemaV1 },
+};
+
+static int userVersion(sqlite3* db) {
+    sqlite3_stmt* s = nullptr;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &s, nullptr) != SQLITE_OK)
+        throw std::runtime_error(std::string("prepare failed (user_version): ") + sqlite3_errmsg(db));
+    const int v = (sqlite3_step(s) == SQLITE_ROW) ? sqlite3_column_int(s, 0) : 0;
+    sqlite3_finalize(s);
+    return v;
+}
+
+void Database::initSchema(sqlite3* db) {
+    const Migration* first = isShard_ ? std::begin(kShardMigrations) : std::begin(kMigrations);
+    const Migration* last  = isShard_ ? std::end(kShardMigrations)   : std::end(kMigrations);
+    const int latest  = (last - 1)->version;
+    const int current = userVersion(db);
+    if (current == latest)
+        return;
+    if (current > latest)
+        throw std::runtime_error("database schema v" + std::to_string(current) +
+                                 " is newer than this daemon's (v" + std::to_string(latest) + ")");
+
+    for (const Migration* it = first; it != last; ++it) {
+        const Migration& m = *it;
+        if (m.version <= current) continue;
+        logMsg(SYSLOG_INFO, "schema v%d: %s", m.version, m.what);
+
+        if (m.batches) m.batches(db);
+        try {
+            execOrThrow(db, "BEGIN IMMEDIATE;");
+            m.apply(db);
+            execOrThrow(db, ("PRAGMA user_version = " + std::to_string(m.version) + ";").c_str());
+            execOrThrow(db, "COMMIT;");
+        } catch (...) {
+            // Only needed because we started a transaction above.
+            // Safe to call even if no tx is open; SQLite will no-op/return OK.
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            throw;
+        }
+    }
+}
+
+//****************************************************************
+// sharded layout
+//
+// A user's rows live in shard FNV-1a(username) % shards: a fixed handful of files
+// (rather than one per user), each open for the daemon's whole life with its
+// writer, readers and statements warm, so routing a call costs a hash.
+//
+// Moving an unsharded app.db over happens once, before anything is served: each
+// shard copies its users' rows out of app.db (INSERT OR REPLACE: until the layout
+// is recorded app.db's rows are the real ones, so a move cut short just runs again
+// on the next start), then app.db drops its copies and records the layout in the
+// same transaction.
+//
+//****************************************************************
+static size_t shardOf(const char* username, size_t len, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= static_cast<unsigned char>(username[i]);
+        h *= 16777619u;
+    }
+    return h % n;
+}
+
+size_t Database::shardIndex(const std::string& username) const {
+    return shardOf(username.data(), username.size(), shards_.size());
+}
+
+// app.db -> app.shard-03.db
+static std::string shardPath(const std::string& path, int i) {
+    char tag[32];
+    std::snprintf(tag, sizeof tag, ".shard-%02d", i);
+    const size_t slash = path.find_last_of('/');
+    const size_t dot   = path.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + tag;
+    return path.substr(0, dot) + tag + path.substr(dot);
+}
+
+bool Database::userStmt(Stmt id) {
+    switch (id) {
+        case Stmt::BookExists:
+        case Stmt::SelectPasswordHash:
+        case Stmt::LookupFileIdByHashSize:
+        case Stmt::InsertSession:
+        case Stmt::DeleteExpiredSessions:
+        case Stmt::ListLiveSessions:
+        case Stmt::UpsertDeviceSync:
+        case Stmt::DeleteDeviceSyncBefore:
+        case Stmt::ListDeviceSync:
+        case Stmt::UpsertPurgedThrough:
+        case Stmt::ListPurgedThrough:
+        case Stmt::GetBookForDownload:
+        case Stmt::InsertBookRecord:
+        case Stmt::ListAllBooks:
+        case Stmt::UpsertBookMeta:
+        case Stmt::GetBookMeta:
+        case Stmt::Count:
+            return false;
+        default:
+            return true;
+    }
+}
+
+void Database::setChangeListener(ChangeListener fn) {
+    for (auto& s : shards_)
+        s->setChangeListener(fn);
+    changeListener_ = std::move(fn);
+}
+
+int Database::shardLayout(void) {
+    sqlite3_stmt* s = nullptr;
+    if (sqlite3_prepare_v2(writer_.db, "SELECT shards FROM shard_layout WHERE id = 1;", -1, &s, nullptr) != SQLITE_OK)
+        throw std::runtime_error(std::string("prepare failed (shard_layout): ") + sqlite3_errmsg(writer_.db));
+    const int n = (sqlite3_step(s) == SQLITE_ROW) ? sqlite3_column_int(s, 0) : 0;
+    sqlite3_finalize(s);
+    return n;
+}
+
+// sr_shard(username, shards): the shard a row belongs in
+static void sqlShardOf(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    const char* user = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+    const long long n = sqlite3_value_int64(argv[1]);
+    if (!user || n <= 0) { sqlite3_result_null(ctx); return; }
+    sqlite3_result_int64(ctx, static_cast<sqlite3_int64>(
+        shardOf(user, static_cast<size_t>(sqlite3_value_bytes(argv[0])), static_cast<size_t>(n))));
+}
 
+void Database::moveToShards(void) {
+    static const char* const kCopy[] = {
+        "INSERT OR REPLACE INTO main.user_books (username, file_id, progress, updated_at, deleted_at, changed_at) "
+        "SELECT username, file_id, progress, updated_at, deleted_at, changed_at "
+        "FROM app.user_books WHERE sr_shard(username, ?1) = ?2",
+        "INSERT OR REPLACE INTO main.user_bookmarks (username, file_id, id, locator, label, updated_at, deleted_at, changed_at) "
+        "SELECT username, file_id, id, locator, label, updated_at, deleted_at, changed_at "
+        "FROM app.user_bookmarks WHERE sr_shard(username, ?1) = ?2",
+        "INSERT OR REPLACE INTO main.user_highlights (username, file_id, id, selection, label, colour, updated_at, deleted_at, changed_at) "
+        "SELECT username, file_id, id, selection, label, colour, updated_at, deleted_at, changed_at "
+        "FROM app.user_highlights WHERE sr_shard(username, ?1) = ?2",
+        "INSERT OR REPLACE INTO main.user_notes (username, file_id, id, locator, content, updated_at, deleted_at, changed_at) "
+        "SELECT username, file_id, id, locator, content, updated_at, deleted_at, changed_at "
+        "FROM app.user_notes WHERE sr_shard(username, ?1) = ?2",
+    };
+    const auto start = Metrics::Clock::now();
+    logMsg(SYSLOG_INFO, "moving annotations from %s into %zu shards", path_.c_str(), shards_.size());
+
+    long long moved = 0;
+    for (size_t k = 0; k < shards_.size(); ++k) {
+        sqlite3* db = shards_[k]->writer_.db;      // not serving yet: nobody else is using it
+        if (sqlite3_create_function(db, "sr_shard", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                    nullptr, sqlShardOf, nullptr, nullptr) != SQLITE_OK)
+            throw std::runtime_error(std::string("moveToShards: ") + sqlite3_errmsg(db));
+
+        sqlite3_stmt* attach = nullptr;
+        int rc = sqlite3_prepare_v2(db, "ATTACH DATABASE ?1 AS app;", -1, &attach, nullptr);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_text(attach, 1, path_.c_str(), -1, SQLITE_STATIC);
+            rc = sqlite3_step(attach);
+        }
+        sqlite3_finalize(attach);
+        if (rc != SQLITE_DONE)
+            throw std::runtime_error(std::string("moveToShards: attach: ") + sqlite3_errmsg(db));
+        try {
+            execOrThrow(db, "BEGIN IMMEDIATE;");
+            for (const char* sql : kCopy) {
+                sqlite3_stmt* s = nullptr;
+                if (sqlite3_prepare_v2(db, sql, -1, &s, nullptr) != SQLITE_OK)
+                    throw std::runtime_error(std::string("moveToShards: ") + sqlite3_errmsg(db));
+                sqlite3_bind_int64(s, 1, static_cast<sqlite3_int64>(shards_.size()));
+                sqlite3_bind_int64(s, 2, static_cast<sqlite3_int64>(k));
+                const int rc = sqlite3_step(s);
+                sqlite3_finalize(s);
+                if (rc != SQLITE_DONE)
+                    throw std::runtime_error(std::string("moveToShards: ") + sqlite3_errmsg(db));
+                moved += sqlite3_changes(db);
+            }
+            execOrThrow(db, "COMMIT;");
+        } catch (...) {
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            sqlite3_exec(db, "DETACH DATABASE app;", nullptr, nullptr, nullptr);
+            throw;
+        }
+        execOrThrow(db, "DETACH DATABASE app;");
+    }
+
+    // every row is in its shard now: drop them here, and don't do this again
+    const std::string record = "INSERT OR REPLACE INTO shard_layout (id, shards) VALUES (1, " +
+                               std::to_string(shards_.size()) + ");";
     try {
-        execOrThrow(db_, "BEGIN IMMEDIATE;");
-
-        //
-        //****************************************************************
-        //  users:  list of all valid users and their (hashed) passwords
-        //
-        //  CREATE TABLE IF NOT EXISTS users (
-        //    username   TEXT PRIMARY KEY,      // a unique username
-        //    pwd_hash   TEXT NOT NULL,         // hashed password
-        //    created_at INTEGER NOT NULL )     // when the user was added
-        //
-        //****************************************************************
-        execOrThrow(db_, R"SQL(
-            CREATE TABLE IF NOT EXISTS users (
-              username   TEXT PRIMARY KEY,
-              pwd_hash   TEXT NOT NULL,
-              created_at INTEGER NOT NULL
-            );
-        )SQL");
-
-        //
-        //****************************************************************
-        //  books:  list of all epub/pdf books we have in our library
-        //          note: "sha256" should be enough to identify the same physical book (epub/pdf),
-        //                and use "filesize" as a sanity check
-        //
-        // CREATE TABLE IF NOT EXISTS books (
-        //    file_id    TEXT PRIMARY KEY,                          // server UUID
-        //    sha256     TEXT NOT NULL CHECK (length(sha256) = 64), // checksum of file
-        //    filesize   INTEGER NOT NULL CHECK (filesize >= 0),    // size of the file
-        //    location   TEXT NOT NULL,                             // physical location on server (/var/lib/simplereader/library/...)
-        //    filename   TEXT NOT NULL,                             // filename used by the client (not by the server).  
-        //                                                          // Used when downloading to tell client what to call the file.
-        //    updated_at INTEGER NOT NULL );                        // UTC time when book was added to the library
-        //
-        //****************************************************************
-        execOrThrow(db_, R"SQL(
-            CREATE TABLE IF NOT EXISTS books (
-              file_id    TEXT PRIMARY KEY,
-              sha256     TEXT NOT NULL CHECK (length(sha256) = 64),
-              filesize   INTEGER NOT NULL CHECK (filesize >= 0),
-              location   TEXT NOT NULL,
-              filename   TEXT NOT NULL,
-              updated_at INTEGER NOT NULL,
-              UNIQUE (sha256, filesize)
-            );
-        )SQL");
-
-        //
-        //****************************************************************
-        //  user_books: list of all books that a username has ever had (including deleted ones)
-        //
-        // CREATE TABLE IF NOT EXISTS user_books (
-        //    username    TEXT NOT NULL,            // primary key
-        //    file_id     TEXT NOT NULL,            // primary key
-        //    progress    TEXT,                     // client-only:  JSON blob
-        //
-        //    updated_at  INTEGER NOT NULL,         // UTC timestamp this record last updated
-        //    deleted_at  INTEGER,                  // zero means still active, non-zero is UTC tombstone
-        //
-        //    PRIMARY KEY (username, file_id),
-        //
-        //    FOREIGN KEY (username)                // username must link to a user in "users"
-        //      REFERENCES users(username)
-        //      ON DELETE CASCADE                   // when username is deleted from "users", delete their records from "user_books" too
-        //      ON UPDATE NO ACTION,
-        //
-        //    FOREIGN KEY (file_id)                 // file_id must link to a book in "books"
-        //      REFERENCES books(file_id)
-        //      ON DELETE RESTRICT
-        //      ON UPDATE NO ACTION );
-        //
-        //  CREATE INDEX IF NOT EXISTS idx_user_books_user_updated ON user_books (username, updated_at);
-        //  CREATE INDEX IF NOT EXISTS idx_user_books_user_deleted ON user_books (username, deleted_at);
-        //
-        //****************************************************************
-        execOrThrow(db_, R"SQL(
-            CREATE TABLE IF NOT EXISTS user_books (
-              username    TEXT NOT NULL,
-              file_id     TEXT NOT NULL,
-              progress    TEXT,
-              updated_at  INTEGER NOT NULL,
-              deleted_at  INTEGER,
-              PRIMARY KEY (username, file_id),
-              FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION,
-              FOREIGN KEY (file_id)  REFERENCES books(file_id)  ON DELETE RESTRICT ON UPDATE NO ACTION
-            );
-            CREATE INDEX IF NOT EXISTS idx_user_books_user_updated ON user_books (username, updated_at);
-            CREATE INDEX IF NOT EXISTS idx_user_books_user_deleted ON user_books (username, deleted_at);
-        )SQL");
-
-
-        //
-        //****************************************************************
-        //  user_highlights: list of all highlights that a username has ever had (including deleted ones)
-        //
-        // CREATE TABLE IF NOT EXISTS user_highlights (
-        //   username    TEXT NOT NULL,
-        //   file_id     TEXT NOT NULL,                 -- -> books.file_id
-        //   id          INTEGER NOT NULL,              -- unique sequential number of this highlight
-        //   selection   TEXT NOT NULL,                 -- JSON-serialized position
-        //   label       TEXT,                          -- user label
-        //   colour      TEXT,                          
-        //   updated_at  INTEGER NOT NULL,              -- epoch millis (UTC)
-        //   deleted_at  INTEGER,                       -- NULL = active; non-NULL = tombstone
-        //
-        //   PRIMARY KEY (username, file_id, id),
-        //
-        //   FOREIGN KEY (username)
-        //     REFERENCES users(username)
-        //     ON DELETE CASCADE
-        //     ON UPDATE NO ACTION,
-        //
-        //   FOREIGN KEY (file_id)
-        //     REFERENCES books(file_id)
-        //     ON DELETE RESTRICT
-        //     ON UPDATE NO ACTION
-        // );
-        execOrThrow(db_, R"SQL(
-            CREATE TABLE IF NOT EXISTS user_highlights (
-                username    TEXT NOT NULL,
-                file_id     TEXT NOT NULL,
-                id          INTEGER NOT NULL,
-                selection   TEXT NOT NULL,
-                label       TEXT,
-                colour      TEXT,
-                updated_at  INTEGER NOT NULL,
-                deleted_at  INTEGER,
-                PRIMARY KEY (username, file_id, id),
-                FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION,
-                FOREIGN KEY (file_id) REFERENCES books(file_id) ON DELETE RESTRICT ON UPDATE NO ACTION
-            );
-            CREATE INDEX IF NOT EXISTS idx_user_highlights_user_updated ON user_highlights (username, updated_at);
-            CREATE INDEX IF NOT EXISTS idx_user_highlights_user_deleted ON user_highlights (username, deleted_at);
-        )SQL");
-
-        //
-        //****************************************************************
-        //  user_bookmarks: list of all bookmarks that a username has ever had (including deleted ones)
-        //
-        // CREATE TABLE IF NOT EXISTS user_bookmarks (
-        //   username    TEXT NOT NULL,
-        //   file_id     TEXT NOT NULL,                 -- -> books.file_id
-        //   id          INTEGER NOT NULL,              -- unique sequential index for bookmark
-        //   locator     TEXT NOT NULL,                 -- JSON-serialized position (string)
-        //   label       TEXT,                          -- user label
-        //   updated_at  INTEGER NOT NULL,              -- epoch millis (UTC)
-        //   deleted_at  INTEGER,                       -- NULL = active; non-NULL = tombstone
-        //
-        //   PRIMARY KEY (username, file_id, id),
-        //
-        //   FOREIGN KEY (username)
-        //     REFERENCES users(username)
-        //     ON DELETE CASCADE
-        //     ON UPDATE NO ACTION,
-        //
-        //   FOREIGN KEY (file_id)
-        //     REFERENCES books(file_id)
-        //     ON DELETE RESTRICT
-        //     ON UPDATE NO ACTION );
-        execOrThrow(db_, R"SQL(
-            CREATE TABLE IF NOT EXISTS user_bookmarks (
-                username    TEXT NOT NULL,
-                file_id     TEXT NOT NULL,
-                id          INTEGER NOT NULL,
-                locator     TEXT NOT NULL,
-                label       TEXT,
-                updated_at  INTEGER NOT NULL,
-                deleted_at  INTEGER,
-                PRIMARY KEY (username, file_id, id),
-                FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION,
-                FOREIGN KEY (file_id) REFERENCES books(file_id) ON DELETE RESTRICT ON UPDATE NO ACTION
-            );
-            CREATE INDEX IF NOT EXISTS idx_user_bookmarks_user_updated ON user_bookmarks (username, updated_at);
-            CREATE INDEX IF NOT EXISTS idx_user_bookmarks_user_deleted ON user_bookmarks (username, deleted_at);
-        )SQL");
-
-        //
-        //****************************************************************
-        //  user_notes: list of all notes that a username has ever had (including deleted ones)
-        //
-        // CREATE TABLE IF NOT EXISTS user_notes (
-        //   username    TEXT NOT NULL,
-        //   file_id     TEXT NOT NULL,                 -- -> books.file_id
-        //   id          INTEGER NOT NULL,              -- unique sequential index for note
-        //   locator     TEXT NOT NULL,                 -- JSON-serialized position (string)
-        //   content     TEXT NOT NULL,                 -- text of the note
-        //   updated_at  INTEGER NOT NULL,              -- epoch millis (UTC)
-        //   deleted_at  INTEGER,                       -- NULL = active; non-NULL = tombstone
-        //
-        //   PRIMARY KEY (username, file_id, id),
-        //
-        //   FOREIGN KEY (username)
-        //     REFERENCES users(username)
-        //     ON DELETE CASCADE
-        //     ON UPDATE NO ACTION,
-        //
-        //   FOREIGN KEY (file_id)
-        //     REFERENCES books(file_id)
-        //     ON DELETE RESTRICT
-        //     ON UPDATE NO ACTION );
-        execOrThrow(db_, R"SQL(
-            CREATE TABLE IF NOT EXISTS user_notes (
-                username    TEXT NOT NULL,
-                file_id     TEXT NOT NULL,
-                id          INTEGER NOT NULL,
-                locator     TEXT NOT NULL,
-                content     TEXT NOT NULL,
-                updated_at  INTEGER NOT NULL,
-                deleted_at  INTEGER,
-                PRIMARY KEY (username, file_id, id),
-                FOREIGN KEY (username) REFERENCES users(username) ON DELETE CASCADE ON UPDATE NO ACTION,
-                FOREIGN KEY (file_id) REFERENCES books(file_id) ON DELETE RESTRICT ON UPDATE NO ACTION
-            );
-            CREATE INDEX IF NOT EXISTS idx_user_notes_user_updated ON user_notes (username, updated_at);
-            CREATE INDEX IF NOT EXISTS idx_user_notes_user_deleted ON user_notes (username, deleted_at);
-        )SQL");
-
-        execOrThrow(db_, "COMMIT;");
+        execOrThrow(writer_.db, "BEGIN IMMEDIATE;");
+        execOrThrow(writer_.db, "DELETE FROM user_books; DELETE FROM user_bookmarks;"
+                                "DELETE FROM user_highlights; DELETE FROM user_notes;");
+        execOrThrow(writer_.db, record.c_str());
+        execOrThrow(writer_.db, "COMMIT;");
     } catch (...) {
-        // Only needed because we started a transaction above.
-        // Safe to call even if no tx is open; SQLite will no-op/return OK.
-        sqlite3_exec(db_, "ROLLBACK;", nullptr, nullptr, nullptr);
+        sqlite3_exec(writer_.db, "ROLLBACK;", nullptr, nullptr, nullptr);
         throw;
     }
+    logMsg(SYSLOG_INFO, "moved %lld row(s) into %zu shards, %lld ms", moved, shards_.size(),
+           static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(Metrics::Clock::now() - start).count()));
+}
+
+//****************************************************************
+// prepared statement cache
+//
+// Every query the daemon runs is listed here against its compile-time id.
+// Statements are prepared on first use and kept for the life of the connection;
+// CachedStmt hands them out and resets them afterwards, so the hot paths never
+// re-parse SQL.  Bound strings use SQLITE_STATIC: the caller's strings outlive
+// the CachedStmt, whose destructor clears the bindings before they go away.
+//
+//****************************************************************
+// a user's greatest (changed_at, file_id, id) in each Tbl, tombstones included: one seek
+// on idx_user_*_user_changed
+static constexpr const char* kLastRowSql[] = {
+    "SELECT changed_at, file_id, NULL FROM user_books "
+    "WHERE username = ?1 ORDER BY changed_at DESC, file_id DESC LIMIT 1",
+    "SELECT changed_at, file_id, id FROM user_bookmarks "
+    "WHERE username = ?1 ORDER BY changed_at DESC, file_id DESC, id DESC LIMIT 1",
+    "SELECT changed_at, file_id, id FROM user_highlights "
+    "WHERE username = ?1 ORDER BY changed_at DESC, file_id DESC, id DESC LIMIT 1",
+    "SELECT changed_at, file_id, id FROM user_notes "
+    "WHERE username = ?1 ORDER BY changed_at DESC, file_id DESC, id DESC LIMIT 1",
+};
+static_assert(std::size(kLastRowSql) == static_cast<size_t>(Database::Tbl::Count), "one per Tbl");
+
+// step a kLastRowSql statement into c (left as it is if there's no row); the step's rc
+static int stepLastRow(sqlite3_stmt* stmt, Database::Cursor& c) {
+    const int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        const char* fid = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+        c.ts     = sqlite3_column_int64(stmt, 0);
+        c.fileId = fid ? fid : "";
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL)
+            c.id = sqlite3_column_int64(stmt, 2);
+    }
+    return rc;
+}
+
+const char* Database::stmtSql(Stmt id) {
+    switch (id) {
+        case Stmt::BookExists:
+            return "SELECT 1 FROM books WHERE file_id=?1 LIMIT 1";
+
+        case Stmt::SelectUserBook:
+            return "SELECT updated_at, deleted_at FROM user_books "
+                   "WHERE username = ?1 AND file_id = ?2 LIMIT 1";
+        case Stmt::SelectUserBookmark:
+            return "SELECT updated_at, deleted_at FROM user_bookmarks "
+                   "WHERE username = ?1 AND file_id = ?2 AND id = ?3 LIMIT 1";
+        case Stmt::SelectUserHighlight:
+            return "SELECT updated_at, deleted_at FROM user_highlights "
+                   "WHERE username = ?1 AND file_id = ?2 AND id = ?3 LIMIT 1";
+        case Stmt::SelectUserNote:
+            return "SELECT updated_at, deleted_at FROM user_notes "
+                   "WHERE username = ?1 AND file_id = ?2 AND id = ?3 LIMIT 1";
+
+        // batched lookups: ?2 is a JSON array of keys [[fileId, id], ...], one primary key probe per key
+        case Stmt::SelectUserBooksByKeys:
+            return "SELECT k.key, t.updated_at, t.deleted_at "
+                   "FROM json_each(?2) AS k CROSS JOIN user_books AS t "
+                   "ON t.username = ?1 AND t.file_id = json_extract(k.value,'$[0]')";
+        case Stmt::SelectUserBookmarksByKeys:
+            return "SELECT k.key, t.updated_at, t.deleted_at "
+                   "FROM json_each(?2) AS k CROSS JOIN user_bookmarks AS t "
+                   "ON t.username = ?1 AND t.file_id = json_extract(k.value,'$[0]') AND t.id = json_extract(k.value,'$[1]')";
+        case Stmt::SelectUserHighlightsByKeys:
+            return "SELECT k.key, t.updated_at, t.deleted_at "
+                   "FROM json_each(?2) AS k CROSS JOIN user_highlights AS t "
+                   "ON t.username = ?1 AND t.file_id = json_extract(k.value,'$[0]') AND t.id = json_extract(k.value,'$[1]')";
+        case Stmt::SelectUserNotesByKeys:
+            return "SELECT k.key, t.updated_at, t.deleted_at "
+                   "FROM json_each(?2) AS k CROSS JOIN user_notes AS t "
+                   "ON t.username = ?1 AND t.file_id = json_extract(k.value,'$[0]') AND t.id = json_extract(k.value,'$[1]')";
+
+        case Stmt::SelectPasswordHash:
+            return "SELECT pwd_hash FROM users WHERE username=?1";
+
+        case Stmt::LookupFileIdByHashSize:
+            return "SELECT file_id FROM books WHERE sha256 = ?1 AND filesize = ?2 LIMIT 1";
+
+        case Stmt::ListUserBook:
+            return "SELECT progress, updated_at, deleted_at "
+                   "FROM user_books WHERE username=?1 AND file_id=?2 LIMIT 1";
+        case Stmt::ListUserBookmarksAll:
+            return "SELECT id, locator, label, updated_at, deleted_at "
+                   "FROM user_bookmarks WHERE username=?1 AND file_id=?2 ORDER BY id ASC";
+        case Stmt::ListUserBookmarksOne:
+            return "SELECT id, locator, label, updated_at, deleted_at "
+                   "FROM user_bookmarks WHERE username=?1 AND file_id=?2 AND id=?3";
+        case Stmt::ListUserHighlightsAll:
+            return "SELECT id, selection, label, colour, updated_at, deleted_at "
+                   "FROM user_highlights WHERE username=?1 AND file_id=?2 ORDER BY id ASC";
+        case Stmt::ListUserHighlightsOne:
+            return "SELECT id, selection, label, colour, updated_at, deleted_at "
+                   "FROM user_highlights WHERE username=?1 AND file_id=?2 AND id=?3";
+        case Stmt::ListUserNotesAll:
+            return "SELECT id, locator, content, updated_at, deleted_at "
+                   "FROM user_notes WHERE username=?1 AND file_id=?2 ORDER BY id ASC";
+        case Stmt::ListUserNotesOne:
+            return "SELECT id, locator, content, updated_at, deleted_at "
+                   "FROM user_notes WHERE username=?1 AND file_id=?2 AND id=?3";
+
+        // batched /get: same keys as above; an id < 0 means every item for that fileId
+        case Stmt::ListUserBooksByKeys:
+            return "SELECT t.file_id, t.progress, t.updated_at, t.deleted_at "
+                   "FROM json_each(?2) AS k CROSS JOIN user_books AS t "
+                   "ON t.username = ?1 AND t.file_id = json_extract(k.value,'$[0]') "
+                   "ORDER BY k.key";
+        case Stmt::ListUserBookmarksByKeys:
+            return "SELECT t.file_id, t.id, t.locator, t.label, t.updated_at, t.deleted_at "
+                   "FROM json_each(?2) AS k CROSS JOIN user_bookmarks AS t "
+                   "ON t.username = ?1 AND t.file_id = json_extract(k.value,'$[0]') "
+                   "AND (json_extract(k.value,'$[1]') < 0 OR t.id = json_extract(k.value,'$[1]')) "
+                   "ORDER BY k.key, t.id";
+        case Stmt::ListUserHighlightsByKeys:
+            return "SELECT t.file_id, t.id, t.selection, t.label, t.colour, t.updated_at, t.deleted_at "
+                   "FROM json_each(?2) AS k CROSS JOIN user_highlights AS t "
+                   "ON t.username = ?1 AND t.file_id = json_extract(k.value,'$[0]') "
+                   "AND (json_extract(k.value,'$[1]') < 0 OR t.id = json_extract(k.value,'$[1]')) "
+                   "ORDER BY k.key, t.id";
+        case Stmt::ListUserNotesByKeys:
+            return "SELECT t.file_id, t.id, t.locator, t.content, t.updated_at, t.deleted_at "
+                   "FROM json_each(?2) AS k CROSS JOIN user_notes AS t "
+                   "ON t.username = ?1 AND t.file_id = json_extract(k.value,'$[0]') "
+                   "AND (json_extract(k.value,'$[1]') < 0 OR t.id = json_extract(k.value,'$[1]')) "
+                   "ORDER BY k.key, t.id";
+
+        // keyset pages: rows strictly after the cursor (?2, ?3, ?4), an index range scan on idx_user_*_user_changed
+        case Stmt::ListUserBooksSince:
+            return "SELECT file_id, progress, deleted_at, changed_at "
+                   "FROM user_books "
+                   "WHERE username = ?1 AND (changed_at, file_id) > (?2, ?3) "
+                   "ORDER BY changed_at ASC, file_id ASC "
+                   "LIMIT ?5";
+        case Stmt::ListUserBookmarksSince:
+            return "SELECT file_id, id, locator, label, deleted_at, changed_at "
+                   "FROM user_bookmarks "
+                   "WHERE username = ?1 AND (changed_at, file_id, id) > (?2, ?3, ?4) "
+                   "ORDER BY changed_at ASC, file_id ASC, id ASC "
+                   "LIMIT ?5";
+        case Stmt::ListUserHighlightsSince:
+            return "SELECT file_id, id, selection, label, colour, deleted_at, changed_at "
+                   "FROM user_highlights "
+                   "WHERE username = ?1 AND (changed_at, file_id, id) > (?2, ?3, ?4) "
+                   "ORDER BY changed_at ASC, file_id ASC, id ASC "
+                   "LIMIT ?5";
+        case Stmt::ListUserNotesSince:
+            return "SELECT file_id, id, locator, content, deleted_at, changed_at "
+                   "FROM user_notes "
+                   "WHERE username = ?1 AND (changed_at, file_id, id) > (?2, ?3, ?4) "
+                   "ORDER BY changed_at ASC, file_id ASC, id ASC "
+                   "LIMIT ?5";
+
+        case Stmt::LastUserBook:      return kLastRowSql[static_cast<size_t>(Tbl::Books)];
+        case Stmt::LastUserBookmark:  return kLastRowSql[static_cast<size_t>(Tbl::Bookmarks)];
+        case Stmt::LastUserHighlight: return kLastRowSql[static_cast<size_t>(Tbl::Highlights)];
+        case Stmt::LastUserNote:      return kLastRowSql[static_cast<size_t>(Tbl::Notes)];
+
+        case Stmt::InsertUserBook:
+            return R"SQL(
+                INSERT INTO user_books (username, file_id, progress, updated_at, deleted_at, changed_at)
+                VALUES (?1, ?2, ?3, ?4, NULL, ?4)
+                ON CONFLICT(username, file_id) DO UPDATE SET
+                    progress   = excluded.progress,
+                    updated_at = excluded.updated_at,
+                    changed_at = excluded.changed_at,
+                    deleted_at = CASE WHEN ?5 THEN NULL ELSE user_books.deleted_at END
+            )SQL";
+        case Stmt::InsertUserBookmark:
+            return R"SQL(
+                INSERT INTO user_bookmarks (username, file_id, id, locator, label, updated_at, deleted_at, changed_at)
+                VALUES (?1, ?2, ?3, ?4, ?5, ?6, NULL, ?6)
+                ON CONFLICT(username, file_id, id) DO UPDATE SET
+                    locator    = excluded.locator,
+                    label      = excluded.label,
+                    updated_at = excluded.updated_at,
+                    changed_at = excluded.changed_at,
+                    deleted_at = CASE WHEN ?7 THEN NULL ELSE user_bookmarks.deleted_at END
+            )SQL";
+        case Stmt::InsertUserHighlight:
+            return R"SQL(
+                INSERT INTO user_highlights (username, file_id, id, selection, label, colour, updated_at, deleted_at, changed_at)
+                VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, NULL, ?7)
+                ON CONFLICT(username, file_id, id) DO UPDATE SET
+                    selection  = excluded.selection,
+                    label      = excluded.label,
+                    colour     = excluded.colour,
+                    updated_at = excluded.updated_at,
+                    changed_at = excluded.changed_at,
+                    deleted_at = CASE WHEN ?8 THEN NULL ELSE user_highlights.deleted_at END
+            )SQL";
+        case Stmt::InsertUserNote:
+            return R"SQL(
+                INSERT INTO user_notes (username, file_id, id, locator, content, updated_at, deleted_at, changed_at)
+                VALUES (?1, ?2, ?3, ?4, ?5, ?6, NULL, ?6)
+                ON CONFLICT(username, file_id, id) DO UPDATE SET
+                    locator    = excluded.locator,
+                    content    = excluded.content,
+                    updated_at = excluded.updated_at,
+                    changed_at = excluded.changed_at,
+                    deleted_at = CASE WHEN ?7 THEN NULL ELSE user_notes.deleted_at END
+            )SQL";
+
+        case Stmt::SoftDeleteUserBook:
+            return "UPDATE user_books SET deleted_at=?3, updated_at=?3, changed_at=?3 WHERE username=?1 AND file_id=?2";
+        case Stmt::SoftDeleteUserBookmark:
+            return "UPDATE user_bookmarks SET deleted_at=?4, updated_at=?4, changed_at=?4 WHERE username=?1 AND file_id=?2 AND id=?3";
+        case Stmt::SoftDeleteUserHighlight:
+            return "UPDATE user_highlights SET deleted_at=?4, updated_at=?4, changed_at=?4 WHERE username=?1 AND file_id=?2 AND id=?3";
+        case Stmt::SoftDeleteUserNote:
+            return "UPDATE user_notes SET deleted_at=?4, updated_at=?4, changed_at=?4 WHERE username=?1 AND file_id=?2 AND id=?3";
+        case Stmt::SoftDeleteUserBookmarkAll:
+            return "UPDATE user_bookmarks SET deleted_at=?3, updated_at=?3, changed_at=?3 WHERE username=?1 AND file_id=?2";
+        case Stmt::SoftDeleteUserHighlightAll:
+            return "UPDATE user_highlights SET deleted_at=?3, updated_at=?3, changed_at=?3 WHERE username=?1 AND file_id=?2";
+        case Stmt::SoftDeleteUserNoteAll:
+            return "UPDATE user_notes SET deleted_at=?3, updated_at=?3, changed_at=?3 WHERE username=?1 AND file_id=?2";
+
+        case Stmt::InsertSession:
+            return "INSERT OR REPLACE INTO sessions (token_hash, username, device, expires_at) VALUES (?1, ?2, ?3, ?4)";
+        case Stmt::DeleteExpiredSessions:
+            return "DELETE FROM sessions WHERE expires_at <= ?1";
+        case Stmt::ListLiveSessions:
+            return "SELECT token_hash, username, device, expires_at FROM sessions WHERE expires_at > ?1";
+
+        // watermarks only move forward, whatever order the upserts land in
+        case Stmt::UpsertDeviceSync:
+            return R"SQL(
+                INSERT INTO device_sync (username, device, books_ts, bookmarks_ts, highlights_ts, notes_ts, seen_at)
+                VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7)
+                ON CONFLICT(username, device) DO UPDATE SET
+                    books_ts      = max(books_ts,      excluded.books_ts),
+                    bookmarks_ts  = max(bookmarks_ts,  excluded.bookmarks_ts),
+                    highlights_ts = max(highlights_ts, excluded.highlights_ts),
+                    notes_ts      = max(notes_ts,      excluded.notes_ts),
+                    seen_at       = max(seen_at,       excluded.seen_at)
+            )SQL";
+        case Stmt::DeleteDeviceSyncBefore:
+            return "DELETE FROM device_sync WHERE seen_at < ?1";
+        case Stmt::ListDeviceSync:
+            return "SELECT username, device, books_ts, bookmarks_ts, highlights_ts, notes_ts, seen_at FROM device_sync";
+        case Stmt::UpsertPurgedThrough:
+            return R"SQL(
+                INSERT INTO tombstone_purges (username, books_ts, bookmarks_ts, highlights_ts, notes_ts)
+                VALUES (?1, ?2, ?3, ?4, ?5)
+                ON CONFLICT(username) DO UPDATE SET
+                    books_ts      = max(books_ts,      excluded.books_ts),
+                    bookmarks_ts  = max(bookmarks_ts,  excluded.bookmarks_ts),
+                    highlights_ts = max(highlights_ts, excluded.highlights_ts),
+                    notes_ts      = max(notes_ts,      excluded.notes_ts)
+            )SQL";
+        case Stmt::ListPurgedThrough:
+            return "SELECT username, books_ts, bookmarks_ts, highlights_ts, notes_ts FROM tombstone_purges";
+
+        // one batch of tombstones (changed_at == deleted_at for these), found on the (username, changed_at) index
+        case Stmt::PurgeUserBooks:
+            return "DELETE FROM user_books WHERE rowid IN (SELECT rowid FROM user_books "
+                   "WHERE username = ?1 AND changed_at < ?2 AND deleted_at IS NOT NULL LIMIT ?3)";
+        case Stmt::PurgeUserBookmarks:
+            return "DELETE FROM user_bookmarks WHERE rowid IN (SELECT rowid FROM user_bookmarks "
+                   "WHERE username = ?1 AND changed_at < ?2 AND deleted_at IS NOT NULL LIMIT ?3)";
+        case Stmt::PurgeUserHighlights:
+            return "DELETE FROM user_highlights WHERE rowid IN (SELECT rowid FROM user_highlights "
+                   "WHERE username = ?1 AND changed_at < ?2 AND deleted_at IS NOT NULL LIMIT ?3)";
+        case Stmt::PurgeUserNotes:
+            return "DELETE FROM user_notes WHERE rowid IN (SELECT rowid FROM user_notes "
+                   "WHERE username = ?1 AND changed_at < ?2 AND deleted_at IS NOT NULL LIMIT ?3)";
+
+        case Stmt::GetBookForDownload:
+            return "SELECT location, filesize, sha256, filename FROM books WHERE file_id=?1 LIMIT 1";
+        case Stmt::InsertBookRecord:
+            return "INSERT INTO books(file_id, sha256, filesize, location, filename, updated_at) "
+                   "VALUES (?1, ?2, ?3, ?4, ?5, ?6)";
+        case Stmt::ListAllBooks:
+            return "SELECT file_id, location, filesize, sha256, filename FROM books";
+
+        case Stmt::UpsertBookMeta:
+            return "INSERT OR REPLACE INTO book_meta(file_id, format, title, author, pages, cover_type, cover_bytes, extracted_at) "
+                   "VALUES (?1, ?2, NULLIF(?3, ''), NULLIF(?4, ''), ?5, NULLIF(?6, ''), ?7, ?8)";
+        case Stmt::GetBookMeta:
+            return "SELECT format, title, author, pages, cover_type, cover_bytes, extracted_at "
+                   "FROM book_meta WHERE file_id=?1";
+
+        case Stmt::Count:
+            break;
+    }
+    return nullptr;
+}
+
+const char* Database::stmtName(Stmt id) {
+    switch (id) {
+        case Stmt::BookExists:                 return "bookExists";
+        case Stmt::SelectUserBook:             return "selectUserBook";
+        case Stmt::SelectUserBookmark:         return "selectUserBookmark";
+        case Stmt::SelectUserHighlight:        return "selectUserHighlight";
+        case Stmt::SelectUserNote:             return "selectUserNote";
+        case Stmt::SelectUserBooksByKeys:      return "selectUserBooksByKeys";
+        case Stmt::SelectUserBookmarksByKeys:  return "selectUserBookmarksByKeys";
+        case Stmt::SelectUserHighlightsByKeys: return "selectUserHighlightsByKeys";
+        case Stmt::SelectUserNotesByKeys:      return "selectUserNotesByKeys";
+        case Stmt::SelectPasswordHash:         return "selectPasswordHash";
+        case Stmt::LookupFileIdByHashSize:     return "lookupFileIdByHashSize";
+        case Stmt::ListUserBook:               return "listUserBook";
+        case Stmt::ListUserBookmarksAll:       return "listUserBookmarksAll";
+        case Stmt::ListUserBookmarksOne:       return "listUserBookmarksOne";
+        case Stmt::ListUserHighlightsAll:      return "listUserHighlightsAll";
+        case Stmt::ListUserHighlightsOne:      return "listUserHighlightsOne";
+        case Stmt::ListUserNotesAll:           return "listUserNotesAll";
+        case Stmt::ListUserNotesOne:           return "listUserNotesOne";
+        case Stmt::ListUserBooksByKeys:        return "listUserBooksByKeys";
+        case Stmt::ListUserBookmarksByKeys:    return "listUserBookmarksByKeys";
+        case Stmt::ListUserHighlightsByKeys:   return "listUserHighlightsByKeys";
+        case Stmt::ListUserNotesByKeys:        return "listUserNotesByKeys";
+        case Stmt::ListUserBooksSince:         return "listUserBooksSince";
+        case Stmt::ListUserBookmarksSince:     return "listUserBookmarksSince";
+        case Stmt::ListUserHighlightsSince:    return "listUserHighlightsSince";
+        case Stmt::ListUserNotesSince:         return "listUserNotesSince";
+        case Stmt::LastUserBook:               return "lastUserBook";
+        case Stmt::LastUserBookmark:           return "lastUserBookmark";
+        case Stmt::LastUserHighlight:          return "lastUserHighlight";
+        case Stmt::LastUserNote:               return "lastUserNote";
+        case Stmt::InsertUserBook:             return "insertUserBook";
+        case Stmt::InsertUserBookmark:         return "insertUserBookmark";
+        case Stmt::InsertUserHighlight:        return "insertUserHighlight";
+        case Stmt::InsertUserNote:             return "insertUserNote";
+        case Stmt::SoftDeleteUserBook:         return "softDeleteUserBook";
+        case Stmt::SoftDeleteUserBookmark:     return "softDeleteUserBookmark";
+        case Stmt::SoftDeleteUserHighlight:    return "softDeleteUserHighlight";
+        case Stmt::SoftDeleteUserNote:         return "softDeleteUserNote";
+        case Stmt::SoftDeleteUserBookmarkAll:  return "softDeleteUserBookmarkAll";
+        case Stmt::SoftDeleteUserHighlightAll: return "softDeleteUserHighlightAll";
+        case Stmt::SoftDeleteUserNoteAll:      return "softDeleteUserNoteAll";
+        case Stmt::InsertSession:              return "insertSession";
+        case Stmt::DeleteExpiredSessions:      return "deleteExpiredSessions";
+        case Stmt::ListLiveSessions:           return "listLiveSessions";
+        case Stmt::UpsertDeviceSync:           return "upsertDeviceSync";
+        case Stmt::DeleteDeviceSyncBefore:     return "deleteDeviceSyncBefore";
+        case Stmt::ListDeviceSync:             return "listDeviceSync";
+        case Stmt::UpsertPurgedThrough:        return "upsertPurgedThrough";
+        case Stmt::ListPurgedThrough:          return "listPurgedThrough";
+        case Stmt::PurgeUserBooks:             return "purgeUserBooks";
+        case Stmt::PurgeUserBookmarks:         return "purgeUserBookmarks";
+        case Stmt::PurgeUserHighlights:        return "purgeUserHighlights";
+        case Stmt::PurgeUserNotes:             return "purgeUserNotes";
+        case Stmt::GetBookForDownload:         return "getBookForDownload";
+        case Stmt::InsertBookRecord:           return "insertBookRecord";
+        case Stmt::ListAllBooks:               return "listAllBooks";
+        case Stmt::UpsertBookMeta:             return "upsertBookMeta";
+        case Stmt::GetBookMeta:                return "getBookMeta";
+        case Stmt::Count:                      break;
+    }
+    return "?";
+}
+
+Database::CachedStmt::CachedStmt(Connection& conn, Stmt id) : id_(id), start_(Metrics::Clock::now()) {
+    sqlite3_stmt*& slot = conn.stmts[static_cast<size_t>(id)];
+    if (!slot) {
+        Metrics::Timer t(prepareLatency_);
+        if (sqlite3_prepare_v3(conn.db, stmtSql(id), -1, SQLITE_PREPARE_PERSISTENT, &slot, nullptr) != SQLITE_OK) {
+            slot = nullptr;
+            throw std::runtime_error(std::string("prepare failed (") + stmtName(id) + "): " + sqlite3_errmsg(conn.db));
+        }
+    }
+    stmt_ = slot;
+}
+
+Database::CachedStmt::~CachedStmt() {
+    sqlite3_reset(stmt_);
+    sqlite3_clear_bindings(stmt_);
+    queryLatency_[static_cast<size_t>(id_)].since(start_);
+}
+
+std::array<Metrics::Histogram, Database::STMT_COUNT> Database::queryLatency_;
+Metrics::Histogram Database::prepareLatency_;
+Metrics::Histogram Database::commitLatency_;
+Metrics::Histogram Database::readerWaitLatency_;
+
+void Database::registerMetrics(void) {
+    Metrics& m = Metrics::get();
+    for (size_t i = 0; i < STMT_COUNT; ++i)
+        queryLatency_[i] = m.histogram("simplereader_sqlite_query_duration_seconds",
+                                       "Time a prepared statement is in use: binding, stepping and reading its rows.",
+                                       std::string("query=\"") + stmtName(static_cast<Stmt>(i)) + "\"");
+    prepareLatency_ = m.histogram("simplereader_sqlite_prepare_duration_seconds",
+                                  "Statement preparation (once per statement per connection).");
+    commitLatency_  = m.histogram("simplereader_sqlite_commit_duration_seconds",
+                                  "COMMIT of a write transaction (one per WriteQueue batch).");
+    readerWaitLatency_ = m.histogram("simplereader_sqlite_reader_wait_seconds",
+                                     "Waits for a free reader connection (only counted when none was free).");
 }
 
 // helper function: does book with fileId exist in the "books" table?
 bool Database::bookExists(const std::string& fileId) {
-    static const char* SQL = "SELECT 1 FROM books WHERE file_id=?1 LIMIT 1";
-    sqlite3_stmt* s=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (bookExists)");
-    sqlite3_bind_text(s, 1, fileId.c_str(), -1, SQLITE_TRANSIENT);
+    BookInfo info;
+    if (findCachedBook(fileId, info))
+        return true;
+
+    ReadLease c(*this);
+    CachedStmt s(*c, Stmt::BookExists);
+    sqlite3_bind_text(s, 1, fileId.c_str(), -1, SQLITE_STATIC);
     int rc = sqlite3_step(s);
-    sqlite3_finalize(s);
     return (rc == SQLITE_ROW);
 }
 
@@ -320,49 +1549,117 @@ static Database::RowState fetchRowState(sqlite3* db, sqlite3_stmt* stmt) {
         return st; // default: exists=false, deleted=false
 
     // rc is an error code
-    syslog(SYSLOG_ERR,"fetchRowState() rc=%d %s", rc, sqlite3_errmsg(db));
+    logMsg(SYSLOG_ERR,"fetchRowState() rc=%d %s", rc, sqlite3_errmsg(db));
 
     throw std::runtime_error(std::string("sqlite step failed: ") + sqlite3_errmsg(db));
 }
 
-static void prepOrThrow(sqlite3* db, const char* sql, sqlite3_stmt** out) {
-    if (sqlite3_prepare_v2(db, sql, -1, out, nullptr) != SQLITE_OK)
-        throw std::runtime_error("sqlite prepare failed");
-}
-
 Database::RowState Database::select_userBooks_byUserAndFileId(
     const std::string& username, const std::string& fileId) {
-    static const char* SQL =
-        "SELECT updated_at, deleted_at FROM user_books "
-        "WHERE username = ?1 AND file_id = ?2 LIMIT 1";
+    if (Database* s = route(username)) return s->select_userBooks_byUserAndFileId(username, fileId);
 
-    sqlite3_stmt* stmt = nullptr;
-    prepOrThrow(db_, SQL, &stmt);
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_TRANSIENT);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::SelectUserBook);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_STATIC);
 
-    auto st = fetchRowState(db_, stmt);
-    sqlite3_finalize(stmt);
-    return st;
+    return fetchRowState(c->db, stmt);
 }
 
 Database::RowState Database::select_byUserFileAndItemId(const std::string& table,
                                                         const std::string& username,
                                                         const std::string& fileId,
                                                         long long itemId) {
-    const std::string sql =
-        "SELECT updated_at, deleted_at FROM " + table +
-        " WHERE username = ?1 AND file_id = ?2 AND id = ?3 LIMIT 1";
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
-       throw std::runtime_error("prepare failed (composite key)");
-    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 2, fileId.c_str(),   -1, SQLITE_TRANSIENT);
+    if (Database* s = route(username)) return s->select_byUserFileAndItemId(table, username, fileId, itemId);
+    Stmt id;
+    if (table == "user_bookmarks")       id = Stmt::SelectUserBookmark;
+    else if (table == "user_highlights") id = Stmt::SelectUserHighlight;
+    else if (table == "user_notes")      id = Stmt::SelectUserNote;
+    else
+        throw std::runtime_error("select_byUserFileAndItemId: unknown table " + table);
+
+    ReadLease c(*this);
+    CachedStmt stmt(*c, id);
+    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, fileId.c_str(),   -1, SQLITE_STATIC);
     sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(itemId));
 
-    auto st = fetchRowState(db_, stmt);
-    sqlite3_finalize(stmt);
-    return st;
+    return fetchRowState(c->db, stmt);
+}
+
+// keys as the JSON array the *ByKeys statements walk with json_each: [[fileId, id], ...]
+static std::string keysToJson(const std::vector<Database::ItemKey>& keys) {
+    Json::Value arr(Json::arrayValue);
+    for (const auto& k : keys) {
+        Json::Value pair(Json::arrayValue);
+        pair.append(k.fileId);
+        pair.append(static_cast<Json::Int64>(k.id));
+        arr.append(pair);
+    }
+    Json::StreamWriterBuilder wb; wb["indentation"] = "";
+    return Json::writeString(wb, arr);
+}
+
+void Database::selectRowStates(const std::string& table, const std::string& username,
+                               const std::vector<ItemKey>& keys, std::vector<RowState>& statesOut) {
+    if (Database* s = route(username)) return s->selectRowStates(table, username, keys, statesOut);
+    Stmt id;
+    if (table == "user_books")           id = Stmt::SelectUserBooksByKeys;
+    else if (table == "user_bookmarks")  id = Stmt::SelectUserBookmarksByKeys;
+    else if (table == "user_highlights") id = Stmt::SelectUserHighlightsByKeys;
+    else if (table == "user_notes")      id = Stmt::SelectUserNotesByKeys;
+    else
+        throw std::runtime_error("selectRowStates: unknown table " + table);
+
+    statesOut.assign(keys.size(), RowState{});   // keys with no row stay "never seen"
+    if (keys.empty()) return;
+
+    const std::string keysJson = keysToJson(keys);
+
+    ReadLease c(*this);
+    CachedStmt stmt(*c, id);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, keysJson.c_str(), -1, SQLITE_STATIC);
+
+    for (;;) {
+        const int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) break;
+        if (rc != SQLITE_ROW) {
+            logMsg(SYSLOG_ERR,"selectRowStates() rc=%d %s", rc, sqlite3_errmsg(c->db));
+            throw std::runtime_error(std::string("sqlite step failed (selectRowStates): ") + sqlite3_errmsg(c->db));
+        }
+
+        const long long idx = sqlite3_column_int64(stmt, 0);   // json_each key: index into keys
+        if (idx < 0 || idx >= static_cast<long long>(keys.size())) continue;
+
+        RowState& st = statesOut[static_cast<size_t>(idx)];
+        const bool hasDel = (sqlite3_column_type(stmt, 2) != SQLITE_NULL);
+        st.exists    = !hasDel;
+        st.deleted   = hasDel;
+        st.updatedAt = sqlite3_column_int64(stmt, 1);
+        st.deletedAt = hasDel ? sqlite3_column_int64(stmt, 2) : 0;
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// POST /login
+//  returns: stored argon2 hash for username, or empty string if not found
+//
+std::string Database::selectPasswordHash(const std::string& username) {
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::SelectPasswordHash);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+
+    std::string stored;
+    const int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        const unsigned char* p = sqlite3_column_text(stmt, 0);
+        if (p) stored.assign(reinterpret_cast<const char*>(p));
+    } else if (rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"selectPasswordHash() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (selectPasswordHash): ") + sqlite3_errmsg(c->db));
+    }
+    return stored;
 }
 
 /////////////////////////////////////////////////////////////
@@ -370,14 +1667,16 @@ Database::RowState Database::select_byUserFileAndItemId(const std::string& table
 //  returns: fileId if found, otherwise null
 //
 std::string Database::lookupFileIdByHashSize(const std::string& sha256, long long filesize) {
-    static const char* SQL =
-        "SELECT file_id FROM books WHERE sha256 = ?1 AND filesize = ?2 LIMIT 1";
-
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (resolve lookup)");
+    {
+        std::shared_lock<std::shared_mutex> lk(bookCacheMu_);
+        auto it = bookByHashSize_.find(hashSizeKey(sha256, filesize));
+        if (it != bookByHashSize_.end())
+            return it->second;
+    }
 
-    sqlite3_bind_text (stmt, 1, sha256.c_str(), -1, SQLITE_TRANSIENT);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::LookupFileIdByHashSize);
+    sqlite3_bind_text (stmt, 1, sha256.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(filesize));
 
     std::string fileId;
@@ -386,351 +1685,458 @@ std::string Database::lookupFileIdByHashSize(const std::string& sha256, long lon
         const unsigned char* txt = sqlite3_column_text(stmt, 0);
         if (txt) fileId.assign(reinterpret_cast<const char*>(txt));
     } else if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"lookupFileIdByHashSize() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(stmt);
-        throw std::runtime_error(std::string("sqlite step failed: ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"lookupFileIdByHashSize() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed: ") + sqlite3_errmsg(c->db));
     }
 
-    sqlite3_finalize(stmt);
     return fileId; // if fileId is empty, means file not found
 }
 
 /////////////////////////////////////////////////////////////
 // POST /get
 //
-void Database::listUserBook(const std::string& username, const std::string& fileId, Json::Value& rowsOut) {
-    static const char* SQL =
-        "SELECT progress, updated_at, deleted_at "
-        "FROM user_books WHERE username=?1 AND file_id=?2 LIMIT 1";
-
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (listUserBook)");
-
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_TRANSIENT);
-
-    const int rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        const char* prog = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-        const long long upd = sqlite3_column_int64(stmt, 1);
-        const bool hasDel   = (sqlite3_column_type(stmt, 2) != SQLITE_NULL);
-        const long long del = hasDel ? sqlite3_column_int64(stmt, 2) : 0;
-
-        Json::Value row(Json::objectValue);
-        row["progress"]  = prog ? prog : "";
-        row["updatedAt"] = static_cast<Json::Int64>(upd);
-        if (del != 0)
-            row["deletedAt"]   = static_cast<Json::Int64>(del);
-        rowsOut.append(row);
-    } else if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"listUserBook() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(stmt);
-        throw std::runtime_error(std::string("sqlite step failed (listUserBook): ") + sqlite3_errmsg(db_));
-    }
-
-    sqlite3_finalize(stmt);
+// one row of a /get result, from columns [col..]: progress, updated_at, deleted_at
+// (batched lists pass the row's fileId, from column 0)
+static void bookRow(sqlite3_stmt* stmt, int col, const char* fileId, RowWriter& out) {
+    const char* prog = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+    const long long upd = sqlite3_column_int64(stmt, col+1);
+    const bool hasDel   = (sqlite3_column_type(stmt, col+2) != SQLITE_NULL);
+    const long long del = hasDel ? sqlite3_column_int64(stmt, col+2) : 0;
+
+    out.beginObject();
+    if (fileId) out.key("fileId").value(fileId);
+    out.key("progress").value(prog);
+    out.key("updatedAt").value(upd);
+    if (del != 0)
+        out.key("deletedAt").value(del);
+    out.endObject();
 }
 
-void Database::listUserBookmarks(const std::string& username, const std::string& fileId, const int& id, Json::Value& rowsOut) {
-    static const char* SQL_ALL = "SELECT id, locator, label, updated_at, deleted_at "
-                                 "FROM user_bookmarks WHERE username=?1 AND file_id=?2 ORDER BY id ASC";
-    static const char* SQL_ONE = "SELECT id, locator, label, updated_at, deleted_at "
-                                 "FROM user_bookmarks WHERE username=?1 AND file_id=?2 AND id=?3";
-
-    const char* SQL = (id<0) ? SQL_ALL : SQL_ONE;
+// columns [col..]: id, locator, label, updated_at, deleted_at
+static void bookmarkRow(sqlite3_stmt* stmt, int col, const char* fileId, RowWriter& out) {
+    const long long id  = sqlite3_column_int64(stmt, col);
+    const char* loc  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col+1));
+    const char* lab  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col+2));
+    const long long upd = sqlite3_column_int64(stmt, col+3);
+    const bool hasDel = (sqlite3_column_type(stmt, col+4) != SQLITE_NULL);
+    const long long del = hasDel ? sqlite3_column_int64(stmt, col+4) : 0;
+
+    out.beginObject();
+    if (fileId) out.key("fileId").value(fileId);
+    out.key("id").value(id);
+    out.key("locator").value(loc);
+    if (lab) out.key("label").value(lab);
+    out.key("updatedAt").value(upd);
+    if (del != 0)
+        out.key("deletedAt").value(del);
+    out.endObject();
+}
 
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (listUserBookmarks)");
+// columns [col..]: id, selection, label, colour, updated_at, deleted_at
+static void highlightRow(sqlite3_stmt* stmt, int col, const char* fileId, RowWriter& out) {
+    const long long id  = sqlite3_column_int64(stmt, col);
+    const char* sel  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col+1));
+    const char* lab  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col+2));
+    const char* clr  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col+3));
+    const long long upd = sqlite3_column_int64(stmt, col+4);
+    const bool hasDel = (sqlite3_column_type(stmt, col+5) != SQLITE_NULL);
+    const long long del = hasDel ? sqlite3_column_int64(stmt, col+5) : 0;
+
+    out.beginObject();
+    if (fileId) out.key("fileId").value(fileId);
+    out.key("id").value(id);
+    out.key("selection").value(sel);
+    if (lab) out.key("label").value(lab);
+    if (clr) out.key("colour").value(clr);
+    out.key("updatedAt").value(upd);
+    if (del != 0)
+        out.key("deletedAt").value(del);
+    out.endObject();
+}
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_TRANSIENT);
-    if (id >= 0)
-        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(id));
+// columns [col..]: id, locator, content, updated_at, deleted_at
+static void noteRow(sqlite3_stmt* stmt, int col, const char* fileId, RowWriter& out) {
+    const long long id  = sqlite3_column_int64(stmt, col);
+    const char* loc  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col+1));
+    const char* txt  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col+2));
+    const long long upd = sqlite3_column_int64(stmt, col+3);
+    const bool hasDel = (sqlite3_column_type(stmt, col+4) != SQLITE_NULL);
+    const long long del = hasDel ? sqlite3_column_int64(stmt, col+4) : 0;
+
+    out.beginObject();
+    if (fileId) out.key("fileId").value(fileId);
+    out.key("id").value(id);
+    out.key("locator").value(loc);
+    if (txt) out.key("content").value(txt);
+    out.key("updatedAt").value(upd);
+    if (del != 0)
+        out.key("deletedAt").value(del);
+    out.endObject();
+}
 
+// step a list statement to the end, writing rowFn(stmt, firstCol) for each row into `out`
+// (an open array). firstCol > 0: batched, column 0 is the file_id.
+static void appendRows(sqlite3* db, sqlite3_stmt* stmt, const char* what,
+                       void (*rowFn)(sqlite3_stmt*, int, const char*, RowWriter&), int firstCol,
+                       RowWriter& out) {
     for (;;) {
         const int rc = sqlite3_step(stmt);
         if (rc == SQLITE_DONE) break;
         if (rc != SQLITE_ROW) {
-            syslog(SYSLOG_ERR,"listUserBookmarks() rc=%d %s", rc, sqlite3_errmsg(db_));
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(std::string("sqlite step failed (listUserBookmarks): ") + sqlite3_errmsg(db_));
+            logMsg(SYSLOG_ERR,"%s() rc=%d %s", what, rc, sqlite3_errmsg(db));
+            throw std::runtime_error(std::string("sqlite step failed (") + what + "): " + sqlite3_errmsg(db));
         }
 
-        Json::Value row(Json::objectValue);
-        row["id"]        = static_cast<Json::Int64>(sqlite3_column_int64(stmt, 0));
-        const char* loc  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        const char* lab  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        const long long upd = sqlite3_column_int64(stmt, 3);
-        const bool hasDel = (sqlite3_column_type(stmt, 4) != SQLITE_NULL);
-        const long long del = hasDel ? sqlite3_column_int64(stmt, 4) : 0;
-
-        row["locator"]   = loc ? loc : "";
-        if (lab) row["label"] = lab;
-        row["updatedAt"] = static_cast<Json::Int64>(upd);
-        if (del != 0)
-            row["deletedAt"]   = static_cast<Json::Int64>(del);
-
-        rowsOut.append(row);
+        const char* fid = nullptr;
+        if (firstCol > 0) {
+            fid = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+            if (!fid) fid = "";
+        }
+        rowFn(stmt, firstCol, fid, out);
     }
+}
 
-    sqlite3_finalize(stmt);
+void Database::listUserBook(const std::string& username, const std::string& fileId, RowWriter& rowsOut) {
+    if (Database* s = route(username)) return s->listUserBook(username, fileId, rowsOut);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListUserBook);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_STATIC);
+
+    appendRows(c->db, stmt, "listUserBook", bookRow, 0, rowsOut);     // [0..1]
 }
 
-void Database::listUserHighlights(const std::string& username, const std::string& fileId, const int& id, Json::Value& rowsOut) {
-    static const char* SQL_ALL = "SELECT id, selection, label, colour, updated_at, deleted_at "
-                                 "FROM user_highlights WHERE username=?1 AND file_id=?2 ORDER BY id ASC";
-    static const char* SQL_ONE = "SELECT id, selection, label, colour, updated_at, deleted_at "
-                                 "FROM user_highlights WHERE username=?1 AND file_id=?2 AND id=?3";
+void Database::listUserBookmarks(const std::string& username, const std::string& fileId, const int& id, RowWriter& rowsOut) {
+    if (Database* s = route(username)) return s->listUserBookmarks(username, fileId, id, rowsOut);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, (id<0) ? Stmt::ListUserBookmarksAll : Stmt::ListUserBookmarksOne);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_STATIC);
+    if (id >= 0)
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(id));
+
+    appendRows(c->db, stmt, "listUserBookmarks", bookmarkRow, 0, rowsOut);
+}
 
-    const char* SQL = (id<0) ? SQL_ALL : SQL_ONE;
+void Database::listUserHighlights(const std::string& username, const std::string& fileId, const int& id, RowWriter& rowsOut) {
+    if (Database* s = route(username)) return s->listUserHighlights(username, fileId, id, rowsOut);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, (id<0) ? Stmt::ListUserHighlightsAll : Stmt::ListUserHighlightsOne);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_STATIC);
+    if (id >= 0)
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(id));
 
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (listUserHighlights)");
+    appendRows(c->db, stmt, "listUserHighlights", highlightRow, 0, rowsOut);
+}
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_TRANSIENT);
+void Database::listUserNotes(const std::string& username, const std::string& fileId, const int& id, RowWriter& rowsOut) {
+    if (Database* s = route(username)) return s->listUserNotes(username, fileId, id, rowsOut);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, (id<0) ? Stmt::ListUserNotesAll : Stmt::ListUserNotesOne);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_STATIC);
     if (id >= 0)
         sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(id));
 
-    for (;;) {
-        const int rc = sqlite3_step(stmt);
-        if (rc == SQLITE_DONE) break;
-        if (rc != SQLITE_ROW) {
-            syslog(SYSLOG_ERR,"listUserHighlights() rc=%d %s", rc, sqlite3_errmsg(db_));
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(std::string("sqlite step failed (listUserHighlights): ") + sqlite3_errmsg(db_));
-        }
+    appendRows(c->db, stmt, "listUserNotes", noteRow, 0, rowsOut);
+}
 
-        Json::Value row(Json::objectValue);
-        row["id"]        = static_cast<Json::Int64>(sqlite3_column_int64(stmt, 0));
-        const char* sel  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        const char* lab  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        const char* col  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-        const long long upd = sqlite3_column_int64(stmt, 4);
-        const bool hasDel = (sqlite3_column_type(stmt, 5) != SQLITE_NULL);
-        const long long del = hasDel ? sqlite3_column_int64(stmt, 5) : 0;
+// batched /get: one query for all keys, rows carry their fileId
+void Database::listUserBooksByKeys(const std::string& username, const std::vector<ItemKey>& keys, RowWriter& rowsOut) {
+    if (Database* s = route(username)) return s->listUserBooksByKeys(username, keys, rowsOut);
+    if (keys.empty()) return;
+    const std::string keysJson = keysToJson(keys);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListUserBooksByKeys);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, keysJson.c_str(), -1, SQLITE_STATIC);
+
+    appendRows(c->db, stmt, "listUserBooksByKeys", bookRow, 1, rowsOut);
+}
 
-        row["selection"] = sel ? sel : "";
-        if (lab) row["label"]   = lab;
-        if (col) row["colour"]  = col;
-        row["updatedAt"] = static_cast<Json::Int64>(upd);
-        if (del != 0)
-            row["deletedAt"]   = static_cast<Json::Int64>(del);
+void Database::listUserBookmarksByKeys(const std::string& username, const std::vector<ItemKey>& keys, RowWriter& rowsOut) {
+    if (Database* s = route(username)) return s->listUserBookmarksByKeys(username, keys, rowsOut);
+    if (keys.empty()) return;
+    const std::string keysJson = keysToJson(keys);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListUserBookmarksByKeys);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, keysJson.c_str(), -1, SQLITE_STATIC);
 
-        rowsOut.append(row);
-    }
+    appendRows(c->db, stmt, "listUserBookmarksByKeys", bookmarkRow, 1, rowsOut);
+}
 
-    sqlite3_finalize(stmt);
+void Database::listUserHighlightsByKeys(const std::string& username, const std::vector<ItemKey>& keys, RowWriter& rowsOut) {
+    if (Database* s = route(username)) return s->listUserHighlightsByKeys(username, keys, rowsOut);
+    if (keys.empty()) return;
+    const std::string keysJson = keysToJson(keys);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListUserHighlightsByKeys);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, keysJson.c_str(), -1, SQLITE_STATIC);
+
+    appendRows(c->db, stmt, "listUserHighlightsByKeys", highlightRow, 1, rowsOut);
 }
 
-void Database::listUserNotes(const std::string& username, const std::string& fileId, const int& id, Json::Value& rowsOut) {
-    static const char* SQL_ALL = "SELECT id, locator, content, updated_at, deleted_at "
-                                 "FROM user_notes WHERE username=?1 AND file_id=?2 ORDER BY id ASC";
-    static const char* SQL_ONE = "SELECT id, locator, content, updated_at, deleted_at "
-                                 "FROM user_notes WHERE username=?1 AND file_id=?2 AND id=?3";
+void Database::listUserNotesByKeys(const std::string& username, const std::vector<ItemKey>& keys, RowWriter& rowsOut) {
+    if (Database* s = route(username)) return s->listUserNotesByKeys(username, keys, rowsOut);
+    if (keys.empty()) return;
+    const std::string keysJson = keysToJson(keys);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListUserNotesByKeys);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, keysJson.c_str(), -1, SQLITE_STATIC);
 
-    const char* SQL = (id<0) ? SQL_ALL : SQL_ONE;
+    appendRows(c->db, stmt, "listUserNotesByKeys", noteRow, 1, rowsOut);
+}
 
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (listUserHighlights)");
+/////////////////////////////////////////////////////////////
+// high-water marks (the /getSince short-circuit)
+//
+static bool cursorLess(const Database::Cursor& a, const Database::Cursor& b) {
+    if (a.ts != b.ts)         return a.ts < b.ts;
+    if (a.fileId != b.fileId) return a.fileId < b.fileId;
+    return a.id < b.id;
+}
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, fileId.c_str(),   -1, SQLITE_TRANSIENT);
-    if (id >= 0)
-        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(id));
+void Database::bumpMark(const std::string& username, Tbl t, long long ts, const std::string& fileId, long long id) {
+    if (sharedWriters_) return;     // not used
+    Cursor c;
+    c.ts     = ts;
+    c.fileId = fileId;
+    c.id     = (t == Tbl::Books) ? LLONG_MIN : id;     // books are keyed (changed_at, file_id)
+
+    std::unique_lock<std::shared_mutex> lk(marksMu_);
+    Cursor& m = marks_[username].at[static_cast<size_t>(t)];   // not loaded: loadMarks() merges
+    if (cursorLess(m, c))
+        m = std::move(c);
+}
 
-    for (;;) {
-        const int rc = sqlite3_step(stmt);
-        if (rc == SQLITE_DONE) break;
-        if (rc != SQLITE_ROW) {
-            syslog(SYSLOG_ERR,"listUserNotes() rc=%d %s", rc, sqlite3_errmsg(db_));
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(std::string("sqlite step failed (listUserNotes): ") + sqlite3_errmsg(db_));
+bool Database::nothingAfter(const std::string& username, Tbl t, const Cursor& after) {
+    if (sharedWriters_)
+        return false;       // another instance may have written since
+    Cursor a;
+    bool loaded = false;
+    {
+        std::shared_lock<std::shared_mutex> lk(marksMu_);
+        auto it = marks_.find(username);
+        if (it != marks_.end() && it->second.loaded) {
+            a = it->second.at[static_cast<size_t>(t)];
+            loaded = true;
         }
+    }
+    if (!loaded)
+        a = loadMarks(username).at[static_cast<size_t>(t)];
+    if (t == Tbl::Books) {
+        Cursor b = after;
+        b.id = LLONG_MIN;
+        return !cursorLess(b, a);
+    }
+    return !cursorLess(after, a);
+}
 
-        Json::Value row(Json::objectValue);
-        row["id"]        = static_cast<Json::Int64>(sqlite3_column_int64(stmt, 0));
-        const char* loc  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        const char* txt  = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        const long long upd = sqlite3_column_int64(stmt, 3);
-        const bool hasDel = (sqlite3_column_type(stmt, 4) != SQLITE_NULL);
-        const long long del = hasDel ? sqlite3_column_int64(stmt, 4) : 0;
+// a user's marks from the db, merged with whatever was bumped meanwhile (a write made while
+// we read may or may not be in what we read; its bump is kept either way)
+Database::Marks Database::loadMarks(const std::string& username) {
+    Marks read;
+    {
+        ReadLease c(*this);
+        for (size_t i = 0; i < read.at.size(); ++i)
+            read.at[i] = lastRow(*c, username, static_cast<Tbl>(i));
+    }
+
+    std::unique_lock<std::shared_mutex> lk(marksMu_);
+    Marks& m = marks_[username];
+    for (size_t i = 0; i < m.at.size(); ++i)
+        if (cursorLess(m.at[i], read.at[i]))
+            m.at[i] = std::move(read.at[i]);
+    m.loaded = true;
+    return m;
+}
 
-        row["locator"] = loc ? loc : "";
-        if (txt) row["content"]   = txt;
-        row["updatedAt"] = static_cast<Json::Int64>(upd);
-        if (del != 0)
-            row["deletedAt"]   = static_cast<Json::Int64>(del);
+Database::Cursor Database::lastRow(Connection& conn, const std::string& username, Tbl t) {
+    static constexpr Stmt kStmts[] = { Stmt::LastUserBook, Stmt::LastUserBookmark, Stmt::LastUserHighlight, Stmt::LastUserNote };
+    CachedStmt stmt(conn, kStmts[static_cast<size_t>(t)]);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
 
-        rowsOut.append(row);
+    Cursor c;
+    const int rc = stepLastRow(stmt, c);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"lastRow() rc=%d %s", rc, sqlite3_errmsg(conn.db));
+        throw std::runtime_error(std::string("sqlite step failed (lastRow): ") + sqlite3_errmsg(conn.db));
     }
-
-    sqlite3_finalize(stmt);
+    return c;
 }
 
 /////////////////////////////////////////////////////////////
 // POST /getSince
 //
-static void computePagingNextSince(long long sinceIn,
-                                   const std::vector<long long>& pageTs,
-                                   bool hitExtra,
-                                   long long& nextSinceOut) {
-    if (hitExtra) {
-        // nextSince = timestamp of the (limit+1)-th row (not returned)
-        nextSinceOut = pageTs.back();
-    } else if (!pageTs.empty()) {
-        // nextSince = max ts we returned
-        nextSinceOut = pageTs.back();
-    } else {
-        // no rows; keep the input since
-        nextSinceOut = sinceIn;
-    }
-}
-
-void Database::listUserBooksSince(const std::string& username, long long since, int limit,
-                                  Json::Value& rowsOut, long long& nextSinceOut) {
-    const int fetch = limit + 1;
-    static const char* SQL =
-        "SELECT file_id, progress, updated_at, deleted_at, "
-        "       COALESCE(deleted_at, updated_at) AS ts "
-        "FROM user_books "
-        "WHERE username = ?1 AND COALESCE(deleted_at, updated_at) >= ?2 "
-        "ORDER BY ts ASC, file_id ASC "
-        "LIMIT ?3";
+//   Each page is a keyset range scan: rows strictly after the cursor
+//   (changed_at, file_id, id), fetching limit+1 rows to learn whether more follow.
+//
+static void bindCursor(sqlite3_stmt* stmt, const std::string& username,
+                       const Database::Cursor& after, int limit) {
+    sqlite3_bind_text (stmt, 1, username.c_str(),     -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(after.ts));
+    sqlite3_bind_text (stmt, 3, after.fileId.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(after.id));
+    sqlite3_bind_int  (stmt, 5, limit + 1);
+}
 
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (scanUserBooksSince)");
-    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(since));
-    sqlite3_bind_int  (stmt, 3, fetch);
+// legacy "nextSince": ts of the (limit+1)-th row if there is one, else the last ts returned
+static long long legacyNextSince(const Database::Cursor& after, const Database::Cursor& last,
+                                 bool hitExtra, long long extraTs, int count) {
+    if (hitExtra) return extraTs;
+    if (count > 0) return last.ts;
+    return after.ts;    // no rows; keep the input since
+}
+
+bool Database::listUserBooksSince(const std::string& username, const Cursor& after, int limit,
+                                  RowWriter& rowsOut, Cursor& nextOut, long long& nextSinceOut) {
+    if (Database* s = route(username)) return s->listUserBooksSince(username, after, limit, rowsOut, nextOut, nextSinceOut);
+    if (nothingAfter(username, Tbl::Books, after)) {     // nothing written since: no need to ask
+        nextOut = after;
+        nextSinceOut = after.ts;
+        return false;
+    }
+
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListUserBooksSince);
+    bindCursor(stmt, username, after, limit);
 
-    std::vector<long long> tsSeen;
+    nextOut = after;
+    long long extraTs = 0;
     int count = 0;
     for (;;) {
         int rc = sqlite3_step(stmt);
         if (rc == SQLITE_DONE) break;
         if (rc != SQLITE_ROW) {
-            syslog(SYSLOG_ERR,"listUserBooksSince() rc=%d %s", rc, sqlite3_errmsg(db_));
-            sqlite3_finalize(stmt);
+            logMsg(SYSLOG_ERR,"listUserBooksSince() rc=%d %s", rc, sqlite3_errmsg(c->db));
             throw std::runtime_error(std::string("sqlite step failed (scanUserBooksSince): ")
-                                     + sqlite3_errmsg(db_));
+                                     + sqlite3_errmsg(c->db));
+        }
+
+        const long long ts  = sqlite3_column_int64(stmt, 3);
+        if (count == limit) {   // the extra row: only tells us there is another page
+            extraTs = ts;
+            ++count;
+            break;
         }
 
         const char* fileId = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
         const char* prog   = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        const long long upd = sqlite3_column_int64(stmt, 2);
-        const bool hasDel   = (sqlite3_column_type(stmt, 3) != SQLITE_NULL);
-        const long long del = hasDel ? sqlite3_column_int64(stmt, 3) : 0;
-        const long long ts  = sqlite3_column_int64(stmt, 4);
-
-        tsSeen.push_back(ts);
-        if (count < limit) {
-            Json::Value row(Json::objectValue);
-            row["fileId"]    = fileId ? fileId : "";
-            row["progress"]  = prog ? prog : "";
-            row["updatedAt"] = static_cast<Json::Int64>(ts);
-            if (hasDel)
-                row["deletedAt"] = static_cast<Json::Int64>(del);
-            rowsOut.append(row);
-        }
+        const bool hasDel   = (sqlite3_column_type(stmt, 2) != SQLITE_NULL);
+        const long long del = hasDel ? sqlite3_column_int64(stmt, 2) : 0;
+
+        rowsOut.beginObject()
+               .key("fileId").value(fileId)
+               .key("progress").value(prog)
+               .key("updatedAt").value(ts);
+        if (hasDel)
+            rowsOut.key("deletedAt").value(del);
+        rowsOut.endObject();
+
+        nextOut.ts     = ts;
+        nextOut.fileId = fileId ? fileId : "";
         ++count;
     }
-    sqlite3_finalize(stmt);
 
-    computePagingNextSince(since, tsSeen, count > limit, nextSinceOut);
+    const bool more = count > limit;
+    nextSinceOut = legacyNextSince(after, nextOut, more, extraTs, count);
+    return more;
 }
 
-void Database::listUserBookmarksSince(const std::string& username, long long since, int limit,
-                                      Json::Value& rowsOut, long long& nextSinceOut) {
-    const int fetch = limit + 1;
-    static const char* SQL =
-        "SELECT file_id, id, locator, label, updated_at, deleted_at, "
-        "       COALESCE(deleted_at, updated_at) AS ts "
-        "FROM user_bookmarks "
-        "WHERE username = ?1 AND COALESCE(deleted_at, updated_at) >= ?2 "
-        "ORDER BY ts ASC, file_id ASC, id ASC "
-        "LIMIT ?3";
+bool Database::listUserBookmarksSince(const std::string& username, const Cursor& after, int limit,
+                                      RowWriter& rowsOut, Cursor& nextOut, long long& nextSinceOut) {
+    if (Database* s = route(username)) return s->listUserBookmarksSince(username, after, limit, rowsOut, nextOut, nextSinceOut);
+    if (nothingAfter(username, Tbl::Bookmarks, after)) {     // nothing written since: no need to ask
+        nextOut = after;
+        nextSinceOut = after.ts;
+        return false;
+    }
 
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (scanUserBookmarksSince)");
-    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(since));
-    sqlite3_bind_int  (stmt, 3, fetch);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListUserBookmarksSince);
+    bindCursor(stmt, username, after, limit);
 
-    std::vector<long long> tsSeen;
+    nextOut = after;
+    long long extraTs = 0;
     int count = 0;
     for (;;) {
         int rc = sqlite3_step(stmt);
         if (rc == SQLITE_DONE) break;
         if (rc != SQLITE_ROW) {
-            syslog(SYSLOG_ERR,"listUserBookmarksSince() rc=%d %s", rc, sqlite3_errmsg(db_));
-            sqlite3_finalize(stmt);
+            logMsg(SYSLOG_ERR,"listUserBookmarksSince() rc=%d %s", rc, sqlite3_errmsg(c->db));
             throw std::runtime_error(std::string("sqlite step failed (scanUserBookmarksSince): ")
-                                     + sqlite3_errmsg(db_));
+                                     + sqlite3_errmsg(c->db));
+        }
+
+        const long long ts  = sqlite3_column_int64(stmt, 5);
+        if (count == limit) {
+            extraTs = ts;
+            ++count;
+            break;
         }
 
         const char* fileId = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
         long long id       = sqlite3_column_int64(stmt, 1);
         const char* loc    = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
         const char* lab    = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-        const long long upd = sqlite3_column_int64(stmt, 4);
-        const bool hasDel   = (sqlite3_column_type(stmt, 5) != SQLITE_NULL);
-        const long long del = hasDel ? sqlite3_column_int64(stmt, 5) : 0;
-        const long long ts  = sqlite3_column_int64(stmt, 6);
+        const bool hasDel   = (sqlite3_column_type(stmt, 4) != SQLITE_NULL);
+        const long long del = hasDel ? sqlite3_column_int64(stmt, 4) : 0;
 
-        tsSeen.push_back(ts);
-        if (count < limit) {
-            Json::Value row(Json::objectValue);
-            row["fileId"]    = fileId ? fileId : "";
-            row["id"]        = static_cast<Json::Int64>(id);
-            row["locator"]   = loc ? loc : "";
-            if (lab) row["label"] = lab;
-            row["updatedAt"] = static_cast<Json::Int64>(ts);
-            if (hasDel)
-                row["deletedAt"] = static_cast<Json::Int64>(del);
-            rowsOut.append(row);
-        }
+        rowsOut.beginObject()
+               .key("fileId").value(fileId)
+               .key("id").value(id)
+               .key("locator").value(loc);
+        if (lab) rowsOut.key("label").value(lab);
+        rowsOut.key("updatedAt").value(ts);
+        if (hasDel)
+            rowsOut.key("deletedAt").value(del);
+        rowsOut.endObject();
+
+        nextOut.ts     = ts;
+        nextOut.fileId = fileId ? fileId : "";
+        nextOut.id     = id;
         ++count;
     }
-    sqlite3_finalize(stmt);
 
-    computePagingNextSince(since, tsSeen, count > limit, nextSinceOut);
+    const bool more = count > limit;
+    nextSinceOut = legacyNextSince(after, nextOut, more, extraTs, count);
+    return more;
 }
 
-void Database::listUserHighlightsSince(const std::string& username, long long since, int limit,
-                                       Json::Value& rowsOut, long long& nextSinceOut) {
-    const int fetch = limit + 1;
-    static const char* SQL =
-        "SELECT file_id, id, selection, label, colour, updated_at, deleted_at, "
-        "       COALESCE(deleted_at, updated_at) AS ts "
-        "FROM user_highlights "
-        "WHERE username = ?1 AND COALESCE(deleted_at, updated_at) >= ?2 "
-        "ORDER BY ts ASC, file_id ASC, id ASC "
-        "LIMIT ?3";
+bool Database::listUserHighlightsSince(const std::string& username, const Cursor& after, int limit,
+                                       RowWriter& rowsOut, Cursor& nextOut, long long& nextSinceOut) {
+    if (Database* s = route(username)) return s->listUserHighlightsSince(username, after, limit, rowsOut, nextOut, nextSinceOut);
+    if (nothingAfter(username, Tbl::Highlights, after)) {     // nothing written since: no need to ask
+        nextOut = after;
+        nextSinceOut = after.ts;
+        return false;
+    }
 
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (scanUserHighlightsSince)");
-    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(since));
-    sqlite3_bind_int  (stmt, 3, limit + 1);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListUserHighlightsSince);
+    bindCursor(stmt, username, after, limit);
 
-    std::vector<long long> tsSeen;
+    nextOut = after;
+    long long extraTs = 0;
     int count = 0;
     for (;;) {
         int rc = sqlite3_step(stmt);
         if (rc == SQLITE_DONE) break;
         if (rc != SQLITE_ROW) {
-            syslog(SYSLOG_ERR,"listUserHighlightsSince() rc=%d %s", rc, sqlite3_errmsg(db_));
-            sqlite3_finalize(stmt);
+            logMsg(SYSLOG_ERR,"listUserHighlightsSince() rc=%d %s", rc, sqlite3_errmsg(c->db));
             throw std::runtime_error(std::string("sqlite step failed (scanUserHighlightsSince): ")
-                                     + sqlite3_errmsg(db_));
+                                     + sqlite3_errmsg(c->db));
+        }
+
+        const long long ts  = sqlite3_column_int64(stmt, 6);
+        if (count == limit) {
+            extraTs = ts;
+            ++count;
+            break;
         }
 
         const char* fileId = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
@@ -738,141 +2144,238 @@ void Database::listUserHighlightsSince(const std::string& username, long long si
         const char* sel    = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
         const char* lab    = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
         const char* col    = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4));
-        const long long upd = sqlite3_column_int64(stmt, 5);
-        const bool hasDel   = (sqlite3_column_type(stmt, 6) != SQLITE_NULL);
-        const long long del = hasDel ? sqlite3_column_int64(stmt, 6) : 0;
-        const long long ts  = sqlite3_column_int64(stmt, 7);
-
-        tsSeen.push_back(ts);
-        if (count < limit) {
-            Json::Value row(Json::objectValue);
-            row["fileId"]    = fileId ? fileId : "";
-            row["id"]        = static_cast<Json::Int64>(id);
-            row["selection"] = sel ? sel : "";
-            if (lab) row["label"]  = lab;
-            if (col) row["colour"] = col;
-            row["updatedAt"] = static_cast<Json::Int64>(ts);
-            if (hasDel)
-                row["deletedAt"] = static_cast<Json::Int64>(del);
-            rowsOut.append(row);
-        }
+        const bool hasDel   = (sqlite3_column_type(stmt, 5) != SQLITE_NULL);
+        const long long del = hasDel ? sqlite3_column_int64(stmt, 5) : 0;
+
+        rowsOut.beginObject()
+               .key("fileId").value(fileId)
+               .key("id").value(id)
+               .key("selection").value(sel);
+        if (lab) rowsOut.key("label").value(lab);
+        if (col) rowsOut.key("colour").value(col);
+        rowsOut.key("updatedAt").value(ts);
+        if (hasDel)
+            rowsOut.key("deletedAt").value(del);
+        rowsOut.endObject();
+
+        nextOut.ts     = ts;
+        nextOut.fileId = fileId ? fileId : "";
+        nextOut.id     = id;
         ++count;
     }
-    sqlite3_finalize(stmt);
 
-    computePagingNextSince(since, tsSeen, count > limit, nextSinceOut);
+    const bool more = count > limit;
+    nextSinceOut = legacyNextSince(after, nextOut, more, extraTs, count);
+    return more;
 }
 
-void Database::listUserNotesSince(const std::string& username, long long since, int limit,
-                                      Json::Value& rowsOut, long long& nextSinceOut) {
-    const int fetch = limit + 1;
-    static const char* SQL =
-        "SELECT file_id, id, locator, content, updated_at, deleted_at, "
-        "       COALESCE(deleted_at, updated_at) AS ts "
-        "FROM user_notes "
-        "WHERE username = ?1 AND COALESCE(deleted_at, updated_at) >= ?2 "
-        "ORDER BY ts ASC, file_id ASC, id ASC "
-        "LIMIT ?3";
+bool Database::listUserNotesSince(const std::string& username, const Cursor& after, int limit,
+                                  RowWriter& rowsOut, Cursor& nextOut, long long& nextSinceOut) {
+    if (Database* s = route(username)) return s->listUserNotesSince(username, after, limit, rowsOut, nextOut, nextSinceOut);
+    if (nothingAfter(username, Tbl::Notes, after)) {     // nothing written since: no need to ask
+        nextOut = after;
+        nextSinceOut = after.ts;
+        return false;
+    }
 
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (listUserNotesSince)");
-    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(since));
-    sqlite3_bind_int  (stmt, 3, fetch);
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListUserNotesSince);
+    bindCursor(stmt, username, after, limit);
 
-    std::vector<long long> tsSeen;
+    nextOut = after;
+    long long extraTs = 0;
     int count = 0;
     for (;;) {
         int rc = sqlite3_step(stmt);
         if (rc == SQLITE_DONE) break;
         if (rc != SQLITE_ROW) {
-            syslog(SYSLOG_ERR,"listUserNotesSince() rc=%d %s", rc, sqlite3_errmsg(db_));
-            sqlite3_finalize(stmt);
+            logMsg(SYSLOG_ERR,"listUserNotesSince() rc=%d %s", rc, sqlite3_errmsg(c->db));
             throw std::runtime_error(std::string("sqlite step failed (scanUserNotesSince): ")
-                                     + sqlite3_errmsg(db_));
+                                     + sqlite3_errmsg(c->db));
+        }
+
+        const long long ts  = sqlite3_column_int64(stmt, 5);
+        if (count == limit) {
+            extraTs = ts;
+            ++count;
+            break;
         }
 
         const char* fileId = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
         long long id       = sqlite3_column_int64(stmt, 1);
         const char* loc    = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
         const char* txt    = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-        const long long upd = sqlite3_column_int64(stmt, 4);
-        const bool hasDel   = (sqlite3_column_type(stmt, 5) != SQLITE_NULL);
-        const long long del = hasDel ? sqlite3_column_int64(stmt, 5) : 0;
-        const long long ts  = sqlite3_column_int64(stmt, 6);
+        const bool hasDel   = (sqlite3_column_type(stmt, 4) != SQLITE_NULL);
+        const long long del = hasDel ? sqlite3_column_int64(stmt, 4) : 0;
 
-        tsSeen.push_back(ts);
-        if (count < limit) {
-            Json::Value row(Json::objectValue);
-            row["fileId"]    = fileId ? fileId : "";
-            row["id"]        = static_cast<Json::Int64>(id);
-            row["locator"]   = loc ? loc : "";
-            if (txt) row["content"] = txt;
-            row["updatedAt"] = static_cast<Json::Int64>(ts);
-            if (hasDel)
-                row["deletedAt"] = static_cast<Json::Int64>(del);
-            rowsOut.append(row);
-        }
+        rowsOut.beginObject()
+               .key("fileId").value(fileId)
+               .key("id").value(id)
+               .key("locator").value(loc);
+        if (txt) rowsOut.key("content").value(txt);
+        rowsOut.key("updatedAt").value(ts);
+        if (hasDel)
+            rowsOut.key("deletedAt").value(del);
+        rowsOut.endObject();
+
+        nextOut.ts     = ts;
+        nextOut.fileId = fileId ? fileId : "";
+        nextOut.id     = id;
         ++count;
     }
-    sqlite3_finalize(stmt);
 
-    computePagingNextSince(since, tsSeen, count > limit, nextSinceOut);
+    const bool more = count > limit;
+    nextSinceOut = legacyNextSince(after, nextOut, more, extraTs, count);
+    return more;
+}
+
+/////////////////////////////////////////////////////////////
+// POST /bootstrap
+//
+//   Like backupTo(), a Dump reads on a connection of its own inside one read transaction,
+//   so its scans can be stepped a row at a time for as long as the response takes to send.
+//   Rows are in primary key order, with the columns of the batched /get lists.
+//
+static const struct {
+    const char* live;       // the user's live rows
+    const char* last;       // their greatest (changed_at, file_id, id), tombstones included
+    void (*rowFn)(sqlite3_stmt*, int, const char*, RowWriter&);
+} kDumpTables[] = {
+    { "SELECT file_id, progress, updated_at, deleted_at FROM user_books "
+      "WHERE username = ?1 AND deleted_at IS NULL ORDER BY file_id",
+      kLastRowSql[static_cast<size_t>(Database::Tbl::Books)],
+      bookRow },
+    { "SELECT file_id, id, locator, label, updated_at, deleted_at FROM user_bookmarks "
+      "WHERE username = ?1 AND deleted_at IS NULL ORDER BY file_id, id",
+      kLastRowSql[static_cast<size_t>(Database::Tbl::Bookmarks)],
+      bookmarkRow },
+    { "SELECT file_id, id, selection, label, colour, updated_at, deleted_at FROM user_highlights "
+      "WHERE username = ?1 AND deleted_at IS NULL ORDER BY file_id, id",
+      kLastRowSql[static_cast<size_t>(Database::Tbl::Highlights)],
+      highlightRow },
+    { "SELECT file_id, id, locator, content, updated_at, deleted_at FROM user_notes "
+      "WHERE username = ?1 AND deleted_at IS NULL ORDER BY file_id, id",
+      kLastRowSql[static_cast<size_t>(Database::Tbl::Notes)],
+      noteRow },
+};
+static_assert(std::size(kDumpTables) == static_cast<size_t>(Database::Tbl::Count), "one per Tbl");
+
+Database::Dump::Dump(Database& db, const std::string& username) : username_(username) {
+    Database& owner = db.forUser(username);     // the shard with their rows
+    if (owner.path_.empty())
+        throw std::runtime_error("database not open");
+
+    owner.openConnection(conn_, owner.path_, true);
+    try {
+        // the snapshot is taken by the first read, and held until the ROLLBACK in ~Dump
+        execOrThrow(conn_.db, "BEGIN; SELECT count(*) FROM sqlite_master;");
+    } catch (...) {
+        closeConnection(conn_);
+        throw;
+    }
+}
+
+Database::Dump::~Dump() {
+    for (auto& s : scans_)
+        sqlite3_finalize(s);    // no-op on nullptr
+    if (conn_.db)
+        sqlite3_exec(conn_.db, "ROLLBACK;", nullptr, nullptr, nullptr);
+    closeConnection(conn_);
+}
+
+bool Database::Dump::next(Tbl t, RowWriter& out) {
+    const size_t i = static_cast<size_t>(t);
+    if (done_[i]) return false;     // stepping a finished statement would start it over
+
+    sqlite3_stmt*& stmt = scans_[i];
+    if (!stmt) {
+        if (sqlite3_prepare_v2(conn_.db, kDumpTables[i].live, -1, &stmt, nullptr) != SQLITE_OK)
+            throw std::runtime_error(std::string("prepare failed (Dump): ") + sqlite3_errmsg(conn_.db));
+        sqlite3_bind_text(stmt, 1, username_.c_str(), -1, SQLITE_STATIC);
+    }
+
+    const int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        done_[i] = true;
+        return false;
+    }
+    if (rc != SQLITE_ROW) {
+        logMsg(SYSLOG_ERR,"Dump::next() rc=%d %s", rc, sqlite3_errmsg(conn_.db));
+        throw std::runtime_error(std::string("sqlite step failed (Dump): ") + sqlite3_errmsg(conn_.db));
+    }
+    const char* fid = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    kDumpTables[i].rowFn(stmt, 1, fid ? fid : "", out);
+    return true;
+}
+
+Database::Cursor Database::Dump::cursor(Tbl t) {
+    const size_t i = static_cast<size_t>(t);
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(conn_.db, kDumpTables[i].last, -1, &stmt, nullptr) != SQLITE_OK)
+        throw std::runtime_error(std::string("prepare failed (Dump): ") + sqlite3_errmsg(conn_.db));
+    sqlite3_bind_text(stmt, 1, username_.c_str(), -1, SQLITE_STATIC);
+
+    Cursor c;
+    const int rc = stepLastRow(stmt, c);
+    const std::string err = (rc == SQLITE_ROW || rc == SQLITE_DONE) ? "" : sqlite3_errmsg(conn_.db);
+    sqlite3_finalize(stmt);
+    if (!err.empty())
+        throw std::runtime_error("sqlite step failed (Dump): " + err);
+    return c;
 }
 
 /////////////////////////////////////////////////////////////
 // POST /update
 //     note: in these insertUser*() funcs, set deleted_at = NULL when resurrect==true
+long long Database::changeStamp(const std::string& username, Tbl t, long long tnow) {
+    if (Database* s = route(username)) return s->changeStamp(username, t, tnow);
+    WriteLease c(*this);
+    const Cursor last = lastRow(*c, username, t);    // no rows: Cursor{}, ts 0
+    return std::max(tnow, last.ts + 1);
+}
+
+// a write to `username`'s rows: tell the ChangeListener, after the commit if in a WriteTxn
+void Database::noteChange(const std::string& username) {
+    if (!changeListener_) return;
+    if (txnConn_ == &writer_)
+        pendingChanges_.push_back(username);
+    else
+        changeListener_(username);
+}
+
 void Database::insertUserBook(const std::string& username, const std::string& fileId,
                               const std::string& progress, bool resurrect, long long tnow) {
-    static const char* SQL = R"SQL(
-        INSERT INTO user_books (username, file_id, progress, updated_at, deleted_at)
-        VALUES (?1, ?2, ?3, ?4, NULL)
-        ON CONFLICT(username, file_id) DO UPDATE SET
-            progress   = excluded.progress,
-            updated_at = excluded.updated_at,
-            deleted_at = CASE WHEN ?5 THEN NULL ELSE user_books.deleted_at END
-    )SQL";
-
-    sqlite3_stmt* stmt=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (insertUserBook)");
-    sqlite3_bind_text (stmt, 1, username.c_str(),    -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 2, fileId.c_str(),  -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 3, progress.c_str(),-1, SQLITE_TRANSIENT);
+    if (Database* s = route(username)) return s->insertUserBook(username, fileId, progress, resurrect, tnow);
+    WriteLease c(*this);
+    CachedStmt stmt(*c, Stmt::InsertUserBook);
+    sqlite3_bind_text (stmt, 1, username.c_str(),    -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, fileId.c_str(),  -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 3, progress.c_str(),-1, SQLITE_STATIC);
     sqlite3_bind_int64(stmt, 4, tnow);
     sqlite3_bind_int (stmt, 5, resurrect ? 1 : 0);
     int rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"insertUserBook() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(stmt);
-        throw std::runtime_error(std::string("sqlite step failed (insertUserBook): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"insertUserBook() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (insertUserBook): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(username, Tbl::Books, tnow, fileId, LLONG_MIN);
+        noteChange(username);
     }
-    sqlite3_finalize(stmt);
 }
 
 void Database::insertUserBookmark(const std::string& username, const std::string& fileId, long long id,
                                   const std::string& locator, const std::string& label,
                                   bool resurrect, long long tnow) {
-    static const char* SQL = R"SQL(
-        INSERT INTO user_bookmarks (username, file_id, id, locator, label, updated_at, deleted_at)
-        VALUES (?1, ?2, ?3, ?4, ?5, ?6, NULL)
-        ON CONFLICT(username, file_id, id) DO UPDATE SET
-            locator    = excluded.locator,
-            label      = excluded.label,
-            updated_at = excluded.updated_at,
-            deleted_at = CASE WHEN ?7 THEN NULL ELSE user_bookmarks.deleted_at END
-    )SQL";
-    sqlite3_stmt* stmt=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (insertUserBookmark)");
-    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 2, fileId.c_str(),   -1, SQLITE_TRANSIENT);
+    if (Database* s = route(username)) return s->insertUserBookmark(username, fileId, id, locator, label, resurrect, tnow);
+    WriteLease c(*this);
+    CachedStmt stmt(*c, Stmt::InsertUserBookmark);
+    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, fileId.c_str(),   -1, SQLITE_STATIC);
     sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(id));
-    sqlite3_bind_text (stmt, 4, locator.c_str(),  -1, SQLITE_TRANSIENT);
-    if (!label.empty()) 
-        sqlite3_bind_text(stmt, 5, label.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 4, locator.c_str(),  -1, SQLITE_STATIC);
+    if (!label.empty())
+        sqlite3_bind_text(stmt, 5, label.c_str(), -1, SQLITE_STATIC);
     else
         sqlite3_bind_null(stmt, 5);
     sqlite3_bind_int64(stmt, 6, static_cast<sqlite3_int64>(tnow));
@@ -880,40 +2383,31 @@ void Database::insertUserBookmark(const std::string& username, const std::string
 
     int rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"insertUserBookmark() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(stmt);
-        throw std::runtime_error(std::string("sqlite step failed (insertUserBookmark): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"insertUserBookmark() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (insertUserBookmark): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(username, Tbl::Bookmarks, tnow, fileId, id);
+        noteChange(username);
     }
-    sqlite3_finalize(stmt);
 }
 
 void Database::insertUserHighlight(const std::string& username, const std::string& fileId, long long id,
                                    const std::string& selection, const std::string& label, const std::string& colour,
                                    bool resurrect, long long tnow) {
-    static const char* SQL = R"SQL(
-        INSERT INTO user_highlights (username, file_id, id, selection, label, colour, updated_at, deleted_at)
-        VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, NULL)
-        ON CONFLICT(username, file_id, id) DO UPDATE SET
-            selection  = excluded.selection,
-            label      = excluded.label,
-            colour     = excluded.colour,
-            updated_at = excluded.updated_at,
-            deleted_at = CASE WHEN ?8 THEN NULL ELSE user_highlights.deleted_at END
-    )SQL";
-
-    sqlite3_stmt* stmt=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (insertUserHighlight)");
-    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 2, fileId.c_str(),   -1, SQLITE_TRANSIENT);
+    if (Database* s = route(username)) return s->insertUserHighlight(username, fileId, id, selection, label, colour, resurrect, tnow);
+    WriteLease c(*this);
+    CachedStmt stmt(*c, Stmt::InsertUserHighlight);
+    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, fileId.c_str(),   -1, SQLITE_STATIC);
     sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(id));
-    sqlite3_bind_text (stmt, 4, selection.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 4, selection.c_str(), -1, SQLITE_STATIC);
     if (!label.empty())
-        sqlite3_bind_text(stmt, 5, label.c_str(),  -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 5, label.c_str(),  -1, SQLITE_STATIC);
     else
         sqlite3_bind_null(stmt, 5);
     if (!colour.empty())
-        sqlite3_bind_text(stmt, 6, colour.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 6, colour.c_str(), -1, SQLITE_STATIC);
     else
         sqlite3_bind_null(stmt, 6);
     sqlite3_bind_int64(stmt, 7, static_cast<sqlite3_int64>(tnow));
@@ -921,34 +2415,27 @@ void Database::insertUserHighlight(const std::string& username, const std::strin
 
     int rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"insertUserHighlight() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(stmt);
-        throw std::runtime_error(std::string("sqlite step failed (insertUserHighlight): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"insertUserHighlight() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (insertUserHighlight): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(username, Tbl::Highlights, tnow, fileId, id);
+        noteChange(username);
     }
-    sqlite3_finalize(stmt);
 }
 
 void Database::insertUserNote(const std::string& username, const std::string& fileId, long long id,
                                   const std::string& locator, const std::string& content,
                                   bool resurrect, long long tnow) {
-    static const char* SQL = R"SQL(
-        INSERT INTO user_notes (username, file_id, id, locator, content, updated_at, deleted_at)
-        VALUES (?1, ?2, ?3, ?4, ?5, ?6, NULL)
-        ON CONFLICT(username, file_id, id) DO UPDATE SET
-            locator    = excluded.locator,
-            content    = excluded.content,
-            updated_at = excluded.updated_at,
-            deleted_at = CASE WHEN ?7 THEN NULL ELSE user_notes.deleted_at END
-    )SQL";
-    sqlite3_stmt* stmt=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (insertUserNote)");
-    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 2, fileId.c_str(),   -1, SQLITE_TRANSIENT);
+    if (Database* s = route(username)) return s->insertUserNote(username, fileId, id, locator, content, resurrect, tnow);
+    WriteLease c(*this);
+    CachedStmt stmt(*c, Stmt::InsertUserNote);
+    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, fileId.c_str(),   -1, SQLITE_STATIC);
     sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(id));
-    sqlite3_bind_text (stmt, 4, locator.c_str(),  -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 4, locator.c_str(),  -1, SQLITE_STATIC);
     if (!content.empty())
-        sqlite3_bind_text(stmt, 5, content.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 5, content.c_str(), -1, SQLITE_STATIC);
     else
         sqlite3_bind_null(stmt, 5);
     sqlite3_bind_int64(stmt, 6, static_cast<sqlite3_int64>(tnow));
@@ -956,146 +2443,200 @@ void Database::insertUserNote(const std::string& username, const std::string& fi
 
     int rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"insertUserNote() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(stmt);
-        throw std::runtime_error(std::string("sqlite step failed (insertUserNote): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"insertUserNote() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (insertUserNote): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(username, Tbl::Notes, tnow, fileId, id);
+        noteChange(username);
     }
-    sqlite3_finalize(stmt);
 }
 
 /////////////////////////////////////////////////////////////
 // POST /delete
 void Database::softDeleteUserBook(const std::string& user, const std::string& fileId, long long tm) {
-    static const char* SQL =
-        "UPDATE user_books SET deleted_at=?3, updated_at=?3 WHERE username=?1 AND file_id=?2";
-
-    sqlite3_stmt* s=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (softDeleteUserBook)");
-    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_TRANSIENT);
+    if (Database* s = route(user)) return s->softDeleteUserBook(user, fileId, tm);
+    WriteLease c(*this);
+    CachedStmt s(*c, Stmt::SoftDeleteUserBook);
+    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(s, 3, static_cast<sqlite3_int64>(tm));
     int rc = sqlite3_step(s);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"softDeleteUserBook() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(s);
-        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserBook): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"softDeleteUserBook() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserBook): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(user, Tbl::Books, tm, fileId, LLONG_MIN);
+        noteChange(user);
     }
-
-    sqlite3_finalize(s);
 }
 
 void Database::softDeleteUserBookmark(const std::string& user, const std::string& fileId, long long id, long long tnow) {
-    static const char* SQL =
-        "UPDATE user_bookmarks SET deleted_at=?4, updated_at=?4 WHERE username=?1 AND file_id=?2 AND id=?3";
-    sqlite3_stmt* s=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (softDeleteUserBookmark)");
-    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_TRANSIENT);
+    if (Database* s = route(user)) return s->softDeleteUserBookmark(user, fileId, id, tnow);
+    WriteLease c(*this);
+    CachedStmt s(*c, Stmt::SoftDeleteUserBookmark);
+    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(s, 3, static_cast<sqlite3_int64>(id));
     sqlite3_bind_int64(s, 4, static_cast<sqlite3_int64>(tnow));
     int rc = sqlite3_step(s);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"softDeleteUserBookmark() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(s);
-        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserBookmark): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"softDeleteUserBookmark() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserBookmark): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(user, Tbl::Bookmarks, tnow, fileId, id);
+        noteChange(user);
     }
-    sqlite3_finalize(s);
 }
 
 void Database::softDeleteUserHighlight(const std::string& user, const std::string& fileId, long long id, long long tnow) {
-    static const char* SQL =
-        "UPDATE user_highlights SET deleted_at=?4, updated_at=?4 WHERE username=?1 AND file_id=?2 AND id=?3";
-    sqlite3_stmt* s=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (softDeleteUserHighlight)");
-    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_TRANSIENT);
+    if (Database* s = route(user)) return s->softDeleteUserHighlight(user, fileId, id, tnow);
+    WriteLease c(*this);
+    CachedStmt s(*c, Stmt::SoftDeleteUserHighlight);
+    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(s, 3, static_cast<sqlite3_int64>(id));
     sqlite3_bind_int64(s, 4, static_cast<sqlite3_int64>(tnow));
     int rc = sqlite3_step(s);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"softDeleteUserHighlight() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(s);
-        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserHighlight): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"softDeleteUserHighlight() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserHighlight): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(user, Tbl::Highlights, tnow, fileId, id);
+        noteChange(user);
     }
-    sqlite3_finalize(s);
 }
 
 void Database::softDeleteUserNote(const std::string& user, const std::string& fileId, long long id, long long tnow) {
-    static const char* SQL =
-        "UPDATE user_notes SET deleted_at=?4, updated_at=?4 WHERE username=?1 AND file_id=?2 AND id=?3";
-    sqlite3_stmt* s=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (softDeleteUserNote)");
-    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_TRANSIENT);
+    if (Database* s = route(user)) return s->softDeleteUserNote(user, fileId, id, tnow);
+    WriteLease c(*this);
+    CachedStmt s(*c, Stmt::SoftDeleteUserNote);
+    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(s, 3, static_cast<sqlite3_int64>(id));
     sqlite3_bind_int64(s, 4, static_cast<sqlite3_int64>(tnow));
     int rc = sqlite3_step(s);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"softDeleteUserNote() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(s);
-        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserNote): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"softDeleteUserNote() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserNote): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(user, Tbl::Notes, tnow, fileId, id);
+        noteChange(user);
     }
-    sqlite3_finalize(s);
 }
 
 void Database::softDeleteUserBookmarkAll(const std::string& user, const std::string& fileId, long long tnow) {
-    static const char* SQL =
-        "UPDATE user_bookmarks SET deleted_at=?3, updated_at=?3 WHERE username=?1 AND file_id=?2";
-    sqlite3_stmt* s=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (softDeleteUserBookmarkAll)");
-    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_TRANSIENT);
+    if (Database* s = route(user)) return s->softDeleteUserBookmarkAll(user, fileId, tnow);
+    WriteLease c(*this);
+    CachedStmt s(*c, Stmt::SoftDeleteUserBookmarkAll);
+    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(s, 3, static_cast<sqlite3_int64>(tnow));
     int rc = sqlite3_step(s);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"softDeleteUserBookmarkAll() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(s);
-        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserBookmarkAll): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"softDeleteUserBookmarkAll() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserBookmarkAll): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(user, Tbl::Bookmarks, tnow, fileId, LLONG_MAX);    // every id of fileId
+        noteChange(user);
     }
-    sqlite3_finalize(s);
 }
 
 void Database::softDeleteUserHighlightAll(const std::string& user, const std::string& fileId, long long tnow) {
-    static const char* SQL =
-        "UPDATE user_highlights SET deleted_at=?3, updated_at=?3 WHERE username=?1 AND file_id=?2";
-    sqlite3_stmt* s=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (softDeleteUserHighlightAll)");
-    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_TRANSIENT);
+    if (Database* s = route(user)) return s->softDeleteUserHighlightAll(user, fileId, tnow);
+    WriteLease c(*this);
+    CachedStmt s(*c, Stmt::SoftDeleteUserHighlightAll);
+    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(s, 3, static_cast<sqlite3_int64>(tnow));
     int rc = sqlite3_step(s);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"softDeleteUserHighlightAll() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(s);
-        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserHighlightAll): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"softDeleteUserHighlightAll() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserHighlightAll): ") + sqlite3_errmsg(c->db));
+    }
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(user, Tbl::Highlights, tnow, fileId, LLONG_MAX);    // every id of fileId
+        noteChange(user);
     }
-    sqlite3_finalize(s);
 }
 
 void Database::softDeleteUserNoteAll(const std::string& user, const std::string& fileId, long long tnow) {
-    static const char* SQL =
-        "UPDATE user_notes SET deleted_at=?3, updated_at=?3 WHERE username=?1 AND file_id=?2";
-    sqlite3_stmt* s=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (softDeleteUserNoteAll)");
-    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_TRANSIENT);
+    if (Database* s = route(user)) return s->softDeleteUserNoteAll(user, fileId, tnow);
+    WriteLease c(*this);
+    CachedStmt s(*c, Stmt::SoftDeleteUserNoteAll);
+    sqlite3_bind_text (s, 1, user.c_str(),   -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 2, fileId.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(s, 3, static_cast<sqlite3_int64>(tnow));
     int rc = sqlite3_step(s);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"softDeleteuserNote() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(s);
-        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserNoteAll): ") + sqlite3_errmsg(db_));
+        logMsg(SYSLOG_ERR,"softDeleteuserNote() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (softDeleteUserNoteAll): ") + sqlite3_errmsg(c->db));
     }
-    sqlite3_finalize(s);
+    if (sqlite3_changes(c->db) > 0) {
+        bumpMark(user, Tbl::Notes, tnow, fileId, LLONG_MAX);    // every id of fileId
+        noteChange(user);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+// books cache
+//
+bool Database::findCachedBook(const std::string& fileId, BookInfo& out) {
+    std::shared_lock<std::shared_mutex> lk(bookCacheMu_);
+    auto it = bookCache_.find(fileId);
+    if (it == bookCache_.end())
+        return false;
+    out = it->second;
+    return true;
+}
+
+void Database::cacheBook(const std::string& fileId, BookInfo info) {
+    std::unique_lock<std::shared_mutex> lk(bookCacheMu_);
+    bookByHashSize_[hashSizeKey(info.sha256, info.filesize)] = fileId;
+    bookCache_[fileId] = std::move(info);
 }
 
+void Database::listLibrary(std::vector<LibraryBook>& rowsOut) {
+    std::shared_lock<std::shared_mutex> lk(bookCacheMu_);
+    rowsOut.reserve(rowsOut.size() + bookCache_.size());
+    for (const auto& [fileId, info] : bookCache_)
+        rowsOut.push_back(LibraryBook{fileId, info.location, info.filesize, info.sha256});
+}
+
+void Database::loadBookCache(void) {
+    ReadLease c(*this);
+    CachedStmt s(*c, Stmt::ListAllBooks);
+
+    int rc;
+    size_t n = 0;
+    while ((rc = sqlite3_step(s)) == SQLITE_ROW) {
+        const char* fid  = reinterpret_cast<const char*>(sqlite3_column_text(s, 0));
+        const char* loc  = reinterpret_cast<const char*>(sqlite3_column_text(s, 1));
+        const char* hash = reinterpret_cast<const char*>(sqlite3_column_text(s, 3));
+        const char* fn   = reinterpret_cast<const char*>(sqlite3_column_text(s, 4));
+        if (!fid || !loc || !hash)
+            continue;
+        BookInfo info;
+        info.location = loc;
+        info.filesize = sqlite3_column_int64(s, 2);
+        info.sha256   = hash;
+        info.filename = fn ? fn : "";
+        cacheBook(fid, std::move(info));
+        ++n;
+    }
+    if (rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"loadBookCache() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (loadBookCache): ")
+                                 + sqlite3_errmsg(c->db));
+    }
+    logMsg(SYSLOG_INFO,"Cached %zu book records", n);
+}
 
 /////////////////////////////////////////////////////////////
 // GET /book
@@ -1106,13 +2647,17 @@ std::string Database::getBookForDownload(const std::string& fileId,
                                   std::string& locationOut,
                                   long long&   filesizeOut,
                                   std::string& sha256Out) {
-    static const char* SQL =
-        "SELECT location, filesize, sha256, filename FROM books WHERE file_id=?1 LIMIT 1";
-    sqlite3_stmt* s = nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (getBookForDownload)");
+    BookInfo info;
+    if (findCachedBook(fileId, info)) {
+        locationOut = std::move(info.location);
+        filesizeOut = info.filesize;
+        sha256Out   = std::move(info.sha256);
+        return info.filename;
+    }
 
-    sqlite3_bind_text(s, 1, fileId.c_str(), -1, SQLITE_TRANSIENT);
+    ReadLease c(*this);
+    CachedStmt s(*c, Stmt::GetBookForDownload);
+    sqlite3_bind_text(s, 1, fileId.c_str(), -1, SQLITE_STATIC);
 
     std::string clientFileName;
     int rc = sqlite3_step(s);
@@ -1125,15 +2670,17 @@ std::string Database::getBookForDownload(const std::string& fileId,
             locationOut = loc;
             filesizeOut = sz;
             sha256Out   = hash;
-            clientFileName = fn;
+            clientFileName = fn ? fn : "";
+
+            // a row read inside a WriteTxn may yet be rolled back
+            if (!txnConn_)
+                cacheBook(fileId, BookInfo{locationOut, filesizeOut, sha256Out, clientFileName});
         }
     } else if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"getBookForDownload() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(s);
+        logMsg(SYSLOG_ERR,"getBookForDownload() rc=%d %s", rc, sqlite3_errmsg(c->db));
         throw std::runtime_error(std::string("sqlite step failed (getBookForDownload): ")
-                                 + sqlite3_errmsg(db_));
+                                 + sqlite3_errmsg(c->db));
     }
-    sqlite3_finalize(s);
     return clientFileName;
 }
 
@@ -1145,25 +2692,239 @@ void Database::insertBookRecord(const std::string& fileId,
                                 const std::string& location,
                                 const std::string& clientFileName,
                                 long long updatedAt) {
-    static const char* SQL =
-        "INSERT INTO books(file_id, sha256, filesize, location, filename, updated_at) "
-        "VALUES (?1, ?2, ?3, ?4, ?5, ?6)";
-    sqlite3_stmt* s=nullptr;
-    if (sqlite3_prepare_v2(db_, SQL, -1, &s, nullptr) != SQLITE_OK)
-        throw std::runtime_error("prepare failed (insertBookRecord)");
-    sqlite3_bind_text (s, 1, fileId.c_str(),    -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (s, 2, sha256.c_str(),    -1, SQLITE_TRANSIENT);
+    WriteLease c(*this);
+    CachedStmt s(*c, Stmt::InsertBookRecord);
+    sqlite3_bind_text (s, 1, fileId.c_str(),    -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 2, sha256.c_str(),    -1, SQLITE_STATIC);
     sqlite3_bind_int64(s, 3, static_cast<sqlite3_int64>(filesize));
-    sqlite3_bind_text (s, 4, location.c_str(),  -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (s, 5, clientFileName.c_str(),  -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (s, 4, location.c_str(),  -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 5, clientFileName.c_str(),  -1, SQLITE_STATIC);
     sqlite3_bind_int64(s, 6, static_cast<sqlite3_int64>(updatedAt));
 
     int rc = sqlite3_step(s);
     if (rc != SQLITE_DONE) {
-        syslog(SYSLOG_ERR,"insertBookRecord() rc=%d %s", rc, sqlite3_errmsg(db_));
-        sqlite3_finalize(s);
+        logMsg(SYSLOG_ERR,"insertBookRecord() rc=%d %s", rc, sqlite3_errmsg(c->db));
         throw std::runtime_error(std::string("sqlite step failed (insertBookRecord): ")
-                                 + sqlite3_errmsg(db_));
+                                 + sqlite3_errmsg(c->db));
     }
-    sqlite3_finalize(s);
+
+    // inside a WriteTxn (the WriteQueue) the row isn't committed yet
+    BookInfo info{location, filesize, sha256, clientFileName};
+    if (txnConn_)
+        pendingBooks_.emplace_back(fileId, std::move(info));
+    else
+        cacheBook(fileId, std::move(info));
+}
+
+/////////////////////////////////////////////////////////////
+// book metadata (BookMeta, /bookMeta)
+//
+void Database::upsertBookMeta(const BookMetaRow& row) {
+    WriteLease c(*this);
+    CachedStmt s(*c, Stmt::UpsertBookMeta);
+    sqlite3_bind_text (s, 1, row.fileId.c_str(),    -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 2, row.format.c_str(),    -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 3, row.title.c_str(),     -1, SQLITE_STATIC);
+    sqlite3_bind_text (s, 4, row.author.c_str(),    -1, SQLITE_STATIC);
+    if (row.pages >= 0)
+        sqlite3_bind_int(s, 5, row.pages);
+    else
+        sqlite3_bind_null(s, 5);
+    sqlite3_bind_text (s, 6, row.coverType.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(s, 7, static_cast<sqlite3_int64>(row.coverBytes));
+    sqlite3_bind_int64(s, 8, static_cast<sqlite3_int64>(row.extractedAt));
+
+    const int rc = sqlite3_step(s);
+    if (rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"upsertBookMeta() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (upsertBookMeta): ") + sqlite3_errmsg(c->db));
+    }
+}
+
+bool Database::getBookMeta(const std::string& fileId, BookMetaRow& out) {
+    ReadLease c(*this);
+    CachedStmt s(*c, Stmt::GetBookMeta);
+    sqlite3_bind_text(s, 1, fileId.c_str(), -1, SQLITE_STATIC);
+
+    auto text = [&](int col) {
+        const char* t = reinterpret_cast<const char*>(sqlite3_column_text(s, col));
+        return std::string(t ? t : "");
+    };
+
+    const int rc = sqlite3_step(s);
+    if (rc == SQLITE_DONE)
+        return false;
+    if (rc != SQLITE_ROW) {
+        logMsg(SYSLOG_ERR,"getBookMeta() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (getBookMeta): ") + sqlite3_errmsg(c->db));
+    }
+    out.fileId      = fileId;
+    out.format      = text(0);
+    out.title       = text(1);
+    out.author      = text(2);
+    out.pages       = sqlite3_column_type(s, 3) == SQLITE_NULL ? -1 : sqlite3_column_int(s, 3);
+    out.coverType   = text(4);
+    out.coverBytes  = sqlite3_column_int64(s, 5);
+    out.extractedAt = sqlite3_column_int64(s, 6);
+    return true;
+}
+
+/////////////////////////////////////////////////////////////
+// sessions (SessionManager persistence)
+//
+void Database::insertSession(const std::string& tokenHash, const std::string& username,
+                             const std::string& device, long long expiresAtMs) {
+    WriteLease c(*this);
+    CachedStmt stmt(*c, Stmt::InsertSession);
+    sqlite3_bind_text (stmt, 1, tokenHash.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, username.c_str(),  -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 3, device.c_str(),    -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(expiresAtMs));
+
+    const int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"insertSession() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (insertSession): ") + sqlite3_errmsg(c->db));
+    }
+}
+
+void Database::deleteExpiredSessions(long long nowMs) {
+    WriteLease c(*this);
+    CachedStmt stmt(*c, Stmt::DeleteExpiredSessions);
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(nowMs));
+
+    const int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"deleteExpiredSessions() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (deleteExpiredSessions): ") + sqlite3_errmsg(c->db));
+    }
+}
+
+void Database::listLiveSessions(long long nowMs, std::vector<SessionRow>& rowsOut) {
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListLiveSessions);
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(nowMs));
+
+    auto text = [&](int col) {
+        const char* t = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+        return std::string(t ? t : "");
+    };
+
+    for (;;) {
+        const int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) break;
+        if (rc != SQLITE_ROW) {
+            logMsg(SYSLOG_ERR,"listLiveSessions() rc=%d %s", rc, sqlite3_errmsg(c->db));
+            throw std::runtime_error(std::string("sqlite step failed (listLiveSessions): ") + sqlite3_errmsg(c->db));
+        }
+        rowsOut.push_back(SessionRow{text(0), text(1), text(2), sqlite3_column_int64(stmt, 3)});
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// device watermarks and tombstone purges (Compactor)
+//
+void Database::upsertDeviceSync(const DeviceSyncRow& row) {
+    WriteLease c(*this);
+    CachedStmt stmt(*c, Stmt::UpsertDeviceSync);
+    sqlite3_bind_text (stmt, 1, row.username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, row.device.c_str(),   -1, SQLITE_STATIC);
+    for (size_t t = 0; t < row.ackedTs.size(); ++t)
+        sqlite3_bind_int64(stmt, 3 + static_cast<int>(t), static_cast<sqlite3_int64>(row.ackedTs[t]));
+    sqlite3_bind_int64(stmt, 7, static_cast<sqlite3_int64>(row.seenAt));
+
+    const int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"upsertDeviceSync() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (upsertDeviceSync): ") + sqlite3_errmsg(c->db));
+    }
+}
+
+void Database::deleteDeviceSyncBefore(long long seenBeforeMs) {
+    WriteLease c(*this);
+    CachedStmt stmt(*c, Stmt::DeleteDeviceSyncBefore);
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(seenBeforeMs));
+
+    const int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"deleteDeviceSyncBefore() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (deleteDeviceSyncBefore): ") + sqlite3_errmsg(c->db));
+    }
+}
+
+void Database::listDeviceSync(std::vector<DeviceSyncRow>& rowsOut) {
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListDeviceSync);
+
+    auto text = [&](int col) {
+        const char* t = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+        return std::string(t ? t : "");
+    };
+
+    for (;;) {
+        const int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) break;
+        if (rc != SQLITE_ROW) {
+            logMsg(SYSLOG_ERR,"listDeviceSync() rc=%d %s", rc, sqlite3_errmsg(c->db));
+            throw std::runtime_error(std::string("sqlite step failed (listDeviceSync): ") + sqlite3_errmsg(c->db));
+        }
+        DeviceSyncRow row;
+        row.username = text(0);
+        row.device   = text(1);
+        for (size_t t = 0; t < row.ackedTs.size(); ++t)
+            row.ackedTs[t] = sqlite3_column_int64(stmt, 2 + static_cast<int>(t));
+        row.seenAt   = sqlite3_column_int64(stmt, 6);
+        rowsOut.push_back(std::move(row));
+    }
+}
+
+void Database::upsertPurgedThrough(const std::string& username, const TblTimes& purgedTs) {
+    WriteLease c(*this);
+    CachedStmt stmt(*c, Stmt::UpsertPurgedThrough);
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    for (size_t t = 0; t < purgedTs.size(); ++t)
+        sqlite3_bind_int64(stmt, 2 + static_cast<int>(t), static_cast<sqlite3_int64>(purgedTs[t]));
+
+    const int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"upsertPurgedThrough() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (upsertPurgedThrough): ") + sqlite3_errmsg(c->db));
+    }
+}
+
+void Database::listPurgedThrough(std::vector<std::pair<std::string, TblTimes>>& rowsOut) {
+    ReadLease c(*this);
+    CachedStmt stmt(*c, Stmt::ListPurgedThrough);
+
+    for (;;) {
+        const int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) break;
+        if (rc != SQLITE_ROW) {
+            logMsg(SYSLOG_ERR,"listPurgedThrough() rc=%d %s", rc, sqlite3_errmsg(c->db));
+            throw std::runtime_error(std::string("sqlite step failed (listPurgedThrough): ") + sqlite3_errmsg(c->db));
+        }
+        const char* u = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        TblTimes ts{};
+        for (size_t t = 0; t < ts.size(); ++t)
+            ts[t] = sqlite3_column_int64(stmt, 1 + static_cast<int>(t));
+        rowsOut.emplace_back(u ? u : "", ts);
+    }
+}
+
+int Database::purgeTombstones(const std::string& username, Tbl t, long long beforeTs, int limit) {
+    if (Database* s = route(username)) return s->purgeTombstones(username, t, beforeTs, limit);
+    static const Stmt kPurge[] = { Stmt::PurgeUserBooks, Stmt::PurgeUserBookmarks,
+                                   Stmt::PurgeUserHighlights, Stmt::PurgeUserNotes };
+    WriteLease c(*this);
+    CachedStmt stmt(*c, kPurge[static_cast<size_t>(t)]);
+    sqlite3_bind_text (stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(beforeTs));
+    sqlite3_bind_int  (stmt, 3, limit);
+
+    const int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        logMsg(SYSLOG_ERR,"purgeTombstones() rc=%d %s", rc, sqlite3_errmsg(c->db));
+        throw std::runtime_error(std::string("sqlite step failed (purgeTombstones): ") + sqlite3_errmsg(c->db));
+    }
+    return sqlite3_changes(c->db);
 }
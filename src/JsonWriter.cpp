@@ -0,0 +1,73 @@
+#include <charconv>
+#include <cmath>
+
+#include "JsonWriter.h"
+
+JsonWriter& JsonWriter::key(std::string_view k) {
+    sep();
+    quoted(k);
+    out_ += ':';
+    comma_ = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(std::string_view s) {
+    sep();
+    quoted(s);
+    comma_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(long long v) {
+    sep();
+    char buf[24];
+    const auto res = std::to_chars(buf, buf + sizeof buf, v);
+    out_.append(buf, res.ptr);
+    comma_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(double v) {
+    sep();
+    if (std::isfinite(v)) {
+        char buf[32];
+        const auto res = std::to_chars(buf, buf + sizeof buf, v);    // shortest round-trip form
+        out_.append(buf, res.ptr);
+    } else {
+        out_ += "null";     // JSON has no NaN/Inf
+    }
+    comma_ = true;
+    return *this;
+}
+
+// RFC 8259 string: escape '"', '\\' and control characters; UTF-8 passes through
+// (the same output jsoncpp gives Drogon's JSON responses)
+void JsonWriter::quoted(std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+
+    out_ += '"';
+    size_t run = 0;     // start of the current run of bytes that need no escaping
+    for (size_t i = 0; i < s.size(); ++i) {
+        const unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        out_.append(s.data() + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"':  out_ += "\\\""; break;
+            case '\\': out_ += "\\\\"; break;
+            case '\b': out_ += "\\b";  break;
+            case '\f': out_ += "\\f";  break;
+            case '\n': out_ += "\\n";  break;
+            case '\r': out_ += "\\r";  break;
+            case '\t': out_ += "\\t";  break;
+            default: {
+                const char u[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+                out_.append(u, sizeof u);
+            }
+        }
+    }
+    out_.append(s.data() + run, s.size() - run);
+    out_ += '"';
+}
@@ -0,0 +1,175 @@
+//**************************************************
+// Log: per-thread rings of formatted messages, drained to syslog by one thread
+//**************************************************
+#include <syslog.h>     // before anything Drogon (it redefines LOG_*)
+#include <chrono>
+#include <cstdio>
+
+#include "Log.h"
+
+Log& Log::get() {
+    static Log inst;            // instantiated once on first-call
+    return inst;
+}
+
+Log::~Log() {
+    stop();                     // exit() with the drain thread still running
+}
+
+int Log::levelFromString(const std::string& s) {
+    if (s == "err")   return LOG_ERR;
+    if (s == "debug") return LOG_DEBUG;
+    return LOG_INFO;
+}
+
+void Log::start(void) {
+    if (running_.load()) return;
+    {
+        std::lock_guard<std::mutex> lk(wakeMtx_);
+        stopping_ = false;
+    }
+    thread_ = std::thread([this]{ run(); });
+    running_.store(true, std::memory_order_release);
+}
+
+void Log::stop(void) {
+    if (!running_.exchange(false)) return;   // from here on, writers go straight to syslog
+    {
+        std::lock_guard<std::mutex> lk(wakeMtx_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+}
+
+Log::ThreadState& Log::local(void) {
+    static thread_local ThreadState ts;
+    return ts;
+}
+
+Log::ThreadState::~ThreadState() {
+    if (ring) Log::get().releaseRing(ring);
+}
+
+// a ring left by a thread that has exited (the lock hands it over), else a new one
+Log::Ring* Log::ringForThisThread(void) {
+    ThreadState& ts = local();
+    if (!ts.ring) {
+        std::lock_guard<std::mutex> lk(ringsMtx_);
+        if (!free_.empty()) {
+            ts.ring = free_.back();
+            free_.pop_back();
+        } else {
+            ts.ring = new Ring;
+            rings_.push_back(ts.ring);
+        }
+    }
+    return ts.ring;
+}
+
+// still drained: what the thread queued before it exited goes out as usual
+void Log::releaseRing(Ring* ring) {
+    std::lock_guard<std::mutex> lk(ringsMtx_);
+    free_.push_back(ring);
+}
+
+bool Log::push(Ring* ring, int level, const char* fmt, va_list ap) {
+    const uint32_t head = ring->head.load(std::memory_order_relaxed);
+    const uint32_t used = head - ring->tail.load(std::memory_order_acquire);
+    if (used >= RING_SIZE) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    Entry& e = ring->slots[head & (RING_SIZE - 1)];
+    e.level = level;
+    std::vsnprintf(e.text, MAX_LINE, fmt, ap);
+    ring->head.store(head + 1, std::memory_order_release);
+
+    if (used + 1 == RING_SIZE / 2)
+        wake_.notify_one();     // filling up: don't wait out the drain thread's sleep
+    return true;
+}
+
+bool Log::pushf(Ring* ring, int level, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    const bool ok = push(ring, level, fmt, ap);
+    va_end(ap);
+    return ok;
+}
+
+void Log::write(int level, const char* fmt, va_list ap) {
+    if (!running_.load(std::memory_order_acquire)) {
+        vsyslog(level, fmt, ap);
+        return;
+    }
+
+    // repeat suppression: find this call site's window, or take over the oldest one
+    using namespace std::chrono;
+    const long long now = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    ThreadState& ts = local();
+    Ring* ring = ringForThisThread();
+
+    Repeat* r = &ts.repeats[0];
+    for (Repeat& cand : ts.repeats) {
+        if (cand.fmt == fmt) { r = &cand; break; }
+        if (cand.windowStart < r->windowStart) r = &cand;
+    }
+    if (r->fmt != fmt || now - r->windowStart >= WINDOW_MS) {
+        if (r->suppressed > 0)
+            pushf(ring, LOG_INFO, "suppressed %d similar message(s): %s", r->suppressed, r->fmt);
+        *r = Repeat{ fmt, now, 0, 0 };
+    }
+    if (++r->count > BURST) {
+        ++r->suppressed;
+        return;
+    }
+
+    push(ring, level, fmt, ap);
+}
+
+bool Log::drainOnce(void) {
+    std::vector<Ring*> rings;
+    {
+        std::lock_guard<std::mutex> lk(ringsMtx_);
+        rings = rings_;
+    }
+
+    bool any = false;
+    for (Ring* ring : rings) {
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        const uint32_t head = ring->head.load(std::memory_order_acquire);
+        while (tail != head) {
+            const Entry& e = ring->slots[tail & (RING_SIZE - 1)];
+            syslog(e.level, "%s", e.text);
+            ring->tail.store(++tail, std::memory_order_release);     // slot is the writer's again
+            any = true;
+        }
+        if (const uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed)) {
+            syslog(LOG_ERR, "Log: %llu message(s) dropped, ring full", static_cast<unsigned long long>(dropped));
+            any = true;
+        }
+    }
+    return any;
+}
+
+void Log::run(void) {
+    for (;;) {
+        const bool any = drainOnce();
+        std::unique_lock<std::mutex> lk(wakeMtx_);
+        if (stopping_) break;
+        if (!any)
+            wake_.wait_for(lk, std::chrono::milliseconds(DRAIN_MS), [this]{ return stopping_; });
+    }
+    drainOnce();    // whatever was queued before stop()
+}
+
+void logMsg(int level, const char* fmt, ...) {
+    Log& log = Log::get();
+    if (!log.enabled(level)) return;    // before any formatting
+
+    va_list ap;
+    va_start(ap, fmt);
+    log.write(level, fmt, ap);
+    va_end(ap);
+}
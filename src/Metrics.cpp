@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+#include "Metrics.h"
+
+const double Metrics::BOUNDS[BUCKETS] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05,   0.1,     0.25,   0.5,   1.0,    2.5,   5.0,  10.0,
+};
+const int64_t Metrics::BOUNDS_NS[BUCKETS] = {
+    100000,    250000,    500000,    1000000,    2500000,    5000000,    10000000,   25000000,
+    50000000,  100000000, 250000000, 500000000,  1000000000, 2500000000, 5000000000, 10000000000,
+};
+
+Metrics& Metrics::get() {
+    static Metrics instance;
+    return instance;
+}
+
+Metrics::Shard& Metrics::localShard(void) {
+    static thread_local Shard* mine = nullptr;
+    if (!mine) {
+        std::lock_guard<std::mutex> lk(mu_);
+        shards_.push_back(std::make_unique<Shard>());
+        mine = shards_.back().get();
+    }
+    return *mine;
+}
+
+// only this thread writes its shard: a plain load/store pair, no locked add
+void Metrics::add(uint32_t slot, uint64_t n) {
+    std::atomic<uint64_t>& v = get().localShard().v[slot];
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void Metrics::Counter::inc(uint64_t n) const {
+    add(slot_, n);
+}
+
+void Metrics::Histogram::observe(Clock::duration d) const {
+    const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    const size_t b = static_cast<size_t>(std::lower_bound(BOUNDS_NS, BOUNDS_NS + BUCKETS, ns) - BOUNDS_NS);
+    add(slot_ + static_cast<uint32_t>(b), 1);                   // b == BUCKETS: +Inf
+    add(slot_ + BUCKETS + 1, static_cast<uint64_t>(std::max<int64_t>(ns, 0)));
+}
+
+Metrics::Family& Metrics::familyLocked(const std::string& name, const std::string& help, Type type) {
+    for (auto& f : families_)
+        if (f.name == name) {
+            if (f.type != type)
+                throw std::runtime_error("Metrics: " + name + " registered with two types");
+            return f;
+        }
+    families_.push_back(Family{name, help, type, {}});
+    return families_.back();
+}
+
+uint32_t Metrics::allocLocked(uint32_t n) {
+    if (nextSlot_ + n > MAX_SLOTS)
+        throw std::runtime_error("Metrics: out of slots (raise MAX_SLOTS)");
+    const uint32_t slot = nextSlot_;
+    nextSlot_ += n;
+    return slot;
+}
+
+Metrics::Counter Metrics::counter(const std::string& name, const std::string& help,
+                                  const std::string& labels, double scale) {
+    std::lock_guard<std::mutex> lk(mu_);
+    Family& f = familyLocked(name, help, Type::Counter);
+    Counter c;
+    for (const auto& s : f.series)
+        if (s.labels == labels) { c.slot_ = s.slot; return c; }
+    c.slot_ = allocLocked(1);
+    f.series.push_back(Series{labels, c.slot_, scale, nullptr});
+    return c;
+}
+
+Metrics::Histogram Metrics::histogram(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lk(mu_);
+    Family& f = familyLocked(name, help, Type::Histogram);
+    Histogram h;
+    for (const auto& s : f.series)
+        if (s.labels == labels) { h.slot_ = s.slot; return h; }
+    h.slot_ = allocLocked(HISTOGRAM_SLOTS);
+    f.series.push_back(Series{labels, h.slot_, 1.0, nullptr});
+    return h;
+}
+
+void Metrics::gauge(const std::string& name, const std::string& help, std::function<double()> read,
+                    const std::string& labels) {
+    std::lock_guard<std::mutex> lk(mu_);
+    Family& f = familyLocked(name, help, Type::Gauge);
+    for (auto& s : f.series)
+        if (s.labels == labels) { s.read = std::move(read); return; }
+    f.series.push_back(Series{labels, 0, 1.0, std::move(read)});
+}
+
+uint64_t Metrics::sumLocked(uint32_t slot) const {
+    uint64_t n = 0;
+    for (const auto& sh : shards_)
+        n += sh->v[slot].load(std::memory_order_relaxed);
+    return n;
+}
+
+static void appendNumber(std::string& out, double v) {
+    char buf[32];
+    std::snprintf(buf, sizeof buf, "%.9g", v);
+    out += buf;
+}
+
+// name{labels,extra} or name{extra} or name
+static void appendName(std::string& out, const std::string& name, const char* suffix,
+                       const std::string& labels, const std::string& extra = "") {
+    out += name;
+    out += suffix;
+    if (labels.empty() && extra.empty()) { out += ' '; return; }
+    out += '{';
+    out += labels;
+    if (!labels.empty() && !extra.empty()) out += ',';
+    out += extra;
+    out += "} ";
+}
+
+std::string Metrics::scrape(void) {
+    // gauges may take their own locks: read them before taking ours
+    std::vector<std::pair<const Series*, double>> gauges;
+    std::vector<Family> families;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        families = families_;
+    }
+    for (const auto& f : families)
+        if (f.type == Type::Gauge)
+            for (const auto& s : f.series)
+                gauges.emplace_back(&s, s.read ? s.read() : 0.0);
+
+    std::string out;
+    out.reserve(16 * 1024);
+    std::lock_guard<std::mutex> lk(mu_);
+    size_t g = 0;
+    for (const auto& f : families) {
+        static const char* const typeName[] = { "counter", "histogram", "gauge" };
+        out += "# HELP " + f.name + " " + f.help + "\n";
+        out += "# TYPE " + f.name + " " + typeName[static_cast<int>(f.type)] + "\n";
+
+        for (const auto& s : f.series) {
+            switch (f.type) {
+                case Type::Counter:
+                    appendName(out, f.name, "", s.labels);
+                    if (s.scale == 1.0) out += std::to_string(sumLocked(s.slot));
+                    else                appendNumber(out, static_cast<double>(sumLocked(s.slot)) * s.scale);
+                    out += '\n';
+                    break;
+
+                case Type::Gauge:
+                    appendName(out, f.name, "", s.labels);
+                    appendNumber(out, gauges[g++].second);
+                    out += '\n';
+                    break;
+
+                case Type::Histogram: {
+                    uint64_t cumulative = 0;
+                    for (size_t b = 0; b <= BUCKETS; ++b) {
+                        cumulative += sumLocked(s.slot + static_cast<uint32_t>(b));
+                        std::string le = "le=\"";
+                        if (b < BUCKETS) { char buf[32]; std::snprintf(buf, sizeof buf, "%g", BOUNDS[b]); le += buf; }
+                        else             le += "+Inf";
+                        le += '"';
+                        appendName(out, f.name, "_bucket", s.labels, le);
+                        out += std::to_string(cumulative);
+                        out += '\n';
+                    }
+                    appendName(out, f.name, "_sum", s.labels);
+                    appendNumber(out, static_cast<double>(sumLocked(s.slot + BUCKETS + 1)) * 1e-9);
+                    out += '\n';
+                    appendName(out, f.name, "_count", s.labels);
+                    out += std::to_string(cumulative);
+                    out += '\n';
+                    break;
+                }
+            }
+        }
+    }
+    return out;
+}
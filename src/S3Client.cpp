@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sodium.h>
+
+#include "S3Client.h"
+#include "Metrics.h"
+
+namespace fs = std::filesystem;
+
+static const Metrics::Histogram s3Latency = Metrics::get().histogram(
+    "simplereader_s3_request_duration_seconds", "Requests to the book store's S3 endpoint.");
+static const Metrics::Counter s3Failures = Metrics::get().counter(
+    "simplereader_s3_request_failures_total", "Requests to the book store's S3 endpoint that failed.");
+
+static const double TIMEOUT_SECS = 120.0;
+static const char*  EMPTY_SHA256 = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+static std::string hexOf(const unsigned char* p, size_t n) {
+    std::string hex(n * 2 + 1, '\0');
+    sodium_bin2hex(&hex[0], hex.size(), p, n);
+    hex.pop_back();
+    return hex;
+}
+
+static std::string sha256Hex(const std::string& s) {
+    unsigned char out[crypto_hash_sha256_BYTES];
+    crypto_hash_sha256(out, reinterpret_cast<const unsigned char*>(s.data()), s.size());
+    return hexOf(out, sizeof out);
+}
+
+static std::string hmac(const std::string& key, const std::string& msg) {
+    unsigned char out[crypto_auth_hmacsha256_BYTES];
+    crypto_auth_hmacsha256_state st;
+    crypto_auth_hmacsha256_init(&st, reinterpret_cast<const unsigned char*>(key.data()), key.size());
+    crypto_auth_hmacsha256_update(&st, reinterpret_cast<const unsigned char*>(msg.data()), msg.size());
+    crypto_auth_hmacsha256_final(&st, out);
+    return std::string(reinterpret_cast<const char*>(out), sizeof out);
+}
+
+// RFC 3986 unreserved characters pass, everything else is %XX ('/' too, unless a path)
+static std::string uriEncode(const std::string& s, bool keepSlash) {
+    static const char* HEX = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(s.size());
+    for (unsigned char c : s) {
+        if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (keepSlash && c == '/')) {
+            out += static_cast<char>(c);
+        } else {
+            out += '%';
+            out += HEX[c >> 4];
+            out += HEX[c & 15];
+        }
+    }
+    return out;
+}
+
+static const char* methodName(drogon::HttpMethod m) {
+    switch (m) {
+        case drogon::Get:    return "GET";
+        case drogon::Put:    return "PUT";
+        case drogon::Post:   return "POST";
+        case drogon::Delete: return "DELETE";
+        case drogon::Head:   return "HEAD";
+        default:             return "GET";
+    }
+}
+
+// "20250101T120000Z" and "20250101"
+static void amzNow(std::string& amzDate, std::string& dateStamp) {
+    char buf[32];
+    const std::time_t now = std::time(nullptr);
+    std::tm tm{};
+    gmtime_r(&now, &tm);
+    std::strftime(buf, sizeof buf, "%Y%m%dT%H%M%SZ", &tm);
+    amzDate   = buf;
+    dateStamp = amzDate.substr(0, 8);
+}
+
+// the text between <tag> and </tag> in an S3 XML reply ("" if none)
+static std::string xmlField(const std::string& xml, const std::string& tag) {
+    const std::string open = "<" + tag + ">", close = "</" + tag + ">";
+    const size_t b = xml.find(open);
+    if (b == std::string::npos) return "";
+    const size_t e = xml.find(close, b + open.size());
+    if (e == std::string::npos) return "";
+    return xml.substr(b + open.size(), e - b - open.size());
+}
+
+static std::runtime_error sysError(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+S3Client::S3Client(Options o) : o_(std::move(o)) {
+    std::string scheme = "https://";
+    std::string rest = o_.endpoint;
+    for (const char* s : {"https://", "http://"}) {
+        if (rest.rfind(s, 0) == 0) {
+            scheme = s;
+            rest.erase(0, std::strlen(s));
+            break;
+        }
+    }
+    host_ = rest.substr(0, rest.find('/'));
+    if (host_.empty() || o_.bucket.empty() || o_.accessKey.empty() || o_.secretKey.empty())
+        throw std::runtime_error("S3Client: s3endpoint, s3bucket, s3accesskey and s3secretkey are all needed");
+    client_ = drogon::HttpClient::newHttpClient(scheme + host_);
+}
+
+std::string S3Client::objectPath(const std::string& key) const {
+    return "/" + uriEncode(o_.bucket, false) + "/" + uriEncode(key, true);
+}
+
+std::string S3Client::signature(const std::string& dateStamp, const std::string& toSign) const {
+    const std::string kDate    = hmac("AWS4" + o_.secretKey, dateStamp);
+    const std::string kSigning = hmac(hmac(hmac(kDate, o_.region), "s3"), "aws4_request");
+    const std::string sig      = hmac(kSigning, toSign);
+    return hexOf(reinterpret_cast<const unsigned char*>(sig.data()), sig.size());
+}
+
+drogon::HttpResponsePtr S3Client::send(drogon::HttpMethod method, const std::string& key, const Query& query,
+                                       std::string body, const std::map<std::string, std::string>& headers) {
+    std::string amzDate, dateStamp;
+    amzNow(amzDate, dateStamp);
+    const std::string payloadHash = body.empty() ? EMPTY_SHA256 : sha256Hex(body);
+
+    std::string qs;
+    for (const auto& [k, v] : query) {
+        if (!qs.empty()) qs += '&';
+        qs += uriEncode(k, false) + "=" + uriEncode(v, false);
+    }
+
+    // everything signed: names lowercase, sorted (std::map)
+    std::map<std::string, std::string> signedHeaders = headers;
+    signedHeaders["host"]                 = host_;
+    signedHeaders["x-amz-content-sha256"] = payloadHash;
+    signedHeaders["x-amz-date"]           = amzDate;
+
+    std::string canonicalHeaders, headerNames;
+    for (const auto& [k, v] : signedHeaders) {
+        canonicalHeaders += k + ":" + v + "\n";
+        if (!headerNames.empty()) headerNames += ';';
+        headerNames += k;
+    }
+
+    const std::string path  = objectPath(key);
+    const std::string scope = dateStamp + "/" + o_.region + "/s3/aws4_request";
+    const std::string canonical = std::string(methodName(method)) + "\n" + path + "\n" + qs + "\n" +
+                                  canonicalHeaders + "\n" + headerNames + "\n" + payloadHash;
+    const std::string toSign = "AWS4-HMAC-SHA256\n" + amzDate + "\n" + scope + "\n" + sha256Hex(canonical);
+
+    auto req = drogon::HttpRequest::newHttpRequest();
+    req->setMethod(method);
+    req->setPathEncode(false);                          // already encoded, exactly as signed
+    req->setPath(qs.empty() ? path : path + "?" + qs);
+    for (const auto& [k, v] : signedHeaders)
+        req->addHeader(k, v);
+    req->addHeader("Authorization", "AWS4-HMAC-SHA256 Credential=" + o_.accessKey + "/" + scope +
+                                    ", SignedHeaders=" + headerNames + ", Signature=" + signature(dateStamp, toSign));
+    if (!body.empty())
+        req->setBody(std::move(body));
+
+    Metrics::Timer t(s3Latency);
+    auto [result, resp] = client_->sendRequest(req, TIMEOUT_SECS);
+    if (result != drogon::ReqResult::Ok || !resp) {
+        s3Failures.inc();
+        throw std::runtime_error(std::string("S3 ") + methodName(method) + " " + key + ": " + drogon::to_string(result));
+    }
+    const int status = static_cast<int>(resp->statusCode());
+    if (status < 200 || status > 299) {
+        s3Failures.inc();
+        const std::string reply(resp->body());
+        const std::string code = xmlField(reply, "Code");
+        throw std::runtime_error(std::string("S3 ") + methodName(method) + " " + key + ": HTTP " +
+                                 std::to_string(status) + (code.empty() ? "" : " " + code));
+    }
+    return resp;
+}
+
+void S3Client::putFile(const std::string& key, const fs::path& file, long long size, long long partBytes) {
+    const int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw sysError("S3Client: open " + file.string());
+    struct Closer { int fd; ~Closer() { ::close(fd); } } closer{fd};
+
+    auto readPart = [&](long long off, long long len) {
+        std::string buf(static_cast<size_t>(len), '\0');
+        size_t got = 0;
+        while (got < buf.size()) {
+            const ssize_t n = ::pread(fd, &buf[got], buf.size() - got, static_cast<off_t>(off + got));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw sysError("S3Client: read " + file.string());
+            got += static_cast<size_t>(n);
+        }
+        return buf;
+    };
+
+    if (size <= partBytes) {
+        send(drogon::Put, key, {}, readPart(0, size));
+        return;
+    }
+
+    const std::string uploadId = xmlField(std::string(send(drogon::Post, key, {{"uploads", ""}}, "")->body()), "UploadId");
+    if (uploadId.empty())
+        throw std::runtime_error("S3 multipart upload of " + key + ": no UploadId");
+
+    try {
+        std::string complete = "<CompleteMultipartUpload>";
+        int part = 1;
+        for (long long off = 0; off < size; off += partBytes, ++part) {
+            auto resp = send(drogon::Put, key, {{"partNumber", std::to_string(part)}, {"uploadId", uploadId}},
+                             readPart(off, std::min(partBytes, size - off)));
+            const std::string etag = resp->getHeader("etag");
+            if (etag.empty())
+                throw std::runtime_error("S3 part " + std::to_string(part) + " of " + key + ": no ETag");
+            complete += "<Part><PartNumber>" + std::to_string(part) + "</PartNumber><ETag>" + etag + "</ETag></Part>";
+        }
+        complete += "</CompleteMultipartUpload>";
+
+        // a 200 can still carry an <Error> (it fails after the headers are sent)
+        const std::string reply(send(drogon::Post, key, {{"uploadId", uploadId}}, complete)->body());
+        if (reply.find("<Error>") != std::string::npos)
+            throw std::runtime_error("S3 multipart upload of " + key + ": " + xmlField(reply, "Code"));
+    } catch (...) {
+        try { send(drogon::Delete, key, {{"uploadId", uploadId}}, ""); } catch (...) {}
+        throw;
+    }
+}
+
+void S3Client::getFile(const std::string& key, long long size, const fs::path& dst, long long partBytes) {
+    const int fd = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd == -1)
+        throw sysError("S3Client: open " + dst.string());
+    struct Closer { int fd; ~Closer() { ::close(fd); } } closer{fd};
+
+    for (long long off = 0; off < size; off += partBytes) {
+        const long long last = std::min(size, off + partBytes) - 1;
+        auto resp = send(drogon::Get, key, {}, "", {{"range", "bytes=" + std::to_string(off) + "-" + std::to_string(last)}});
+        const auto body = resp->body();
+        if (static_cast<long long>(body.size()) != last - off + 1)
+            throw std::runtime_error("S3 GET " + key + ": short read at " + std::to_string(off));
+
+        const char* p = body.data();
+        size_t len = body.size();
+        while (len > 0) {
+            const ssize_t n = ::write(fd, p, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw sysError("S3Client: write " + dst.string());
+            }
+            p   += n;
+            len -= static_cast<size_t>(n);
+        }
+    }
+    if (::fsync(fd) != 0)
+        throw sysError("S3Client: fsync " + dst.string());
+}
+
+std::string S3Client::presign(const std::string& key, int seconds, const std::string& fileName) const {
+    std::string amzDate, dateStamp;
+    amzNow(amzDate, dateStamp);
+    const std::string scope = dateStamp + "/" + o_.region + "/s3/aws4_request";
+    std::string name = fileName;
+    name.erase(std::remove(name.begin(), name.end(), '"'), name.end());
+
+    Query q{
+        {"X-Amz-Algorithm",     "AWS4-HMAC-SHA256"},
+        {"X-Amz-Credential",    o_.accessKey + "/" + scope},
+        {"X-Amz-Date",          amzDate},
+        {"X-Amz-Expires",       std::to_string(seconds)},
+        {"X-Amz-SignedHeaders", "host"},
+        {"response-content-disposition", "attachment; filename=\"" + name + "\""},
+    };
+    std::string qs;
+    for (const auto& [k, v] : q) {
+        if (!qs.empty()) qs += '&';
+        qs += uriEncode(k, false) + "=" + uriEncode(v, false);
+    }
+
+    const std::string path = objectPath(key);
+    const std::string canonical = "GET\n" + path + "\n" + qs + "\nhost:" + host_ + "\n\nhost\nUNSIGNED-PAYLOAD";
+    const std::string toSign = "AWS4-HMAC-SHA256\n" + amzDate + "\n" + scope + "\n" + sha256Hex(canonical);
+
+
+    const std::string scheme = o_.endpoint.rfind("http://", 0) == 0 ? "http://" : "https://";
+    return scheme + host_ + path + "?" + qs + "&X-Amz-Signature=" + signature(dateStamp, toSign);
+}
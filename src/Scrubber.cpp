@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sodium.h>
+
+#include "Scrubber.h"
+#include "Database.h"
+#include "Config.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "utils.h"
+
+static const Metrics::Counter scrubBytes = Metrics::get().counter(
+    "simplereader_scrub_read_bytes_total", "Bytes of books read back and re-hashed by the integrity scrubber.");
+static const Metrics::Counter scrubPasses = Metrics::get().counter(
+    "simplereader_scrub_passes_total", "Full passes of the integrity scrubber over the library.");
+
+Scrubber& Scrubber::get() {
+    static Scrubber instance;
+    return instance;
+}
+
+const char* Scrubber::name(State s) {
+    switch (s) {
+        case State::Unknown:   return "unknown";
+        case State::Present:   return "present";
+        case State::Ok:        return "ok";
+        case State::Missing:   return "missing";
+        case State::WrongSize: return "size_mismatch";
+        case State::Corrupt:   return "corrupt";
+        default:               return "?";
+    }
+}
+
+static bool bad(Scrubber::State s) {
+    return s == Scrubber::State::Missing || s == Scrubber::State::WrongSize || s == Scrubber::State::Corrupt;
+}
+
+// books kept in an object store are only cached here (and the cache refetches on a size mismatch)
+static bool isLocal(const std::string& location) {
+    return !location.empty() && location.rfind("s3://", 0) != 0;
+}
+
+void Scrubber::start(void) {
+    for (size_t i = static_cast<size_t>(State::Present); i < static_cast<size_t>(State::Count); ++i)
+        Metrics::get().gauge("simplereader_library_books", "Books in the local library, by what the integrity scrubber last found.",
+                             [this, i]{ return static_cast<double>(counts_[i].load()); },
+                             std::string("state=\"") + name(static_cast<State>(i)) + "\"");
+
+    std::lock_guard<std::mutex> lk(stopMu_);
+    stopping_ = false;
+    thread_ = std::thread([this]{ run(); });
+    logMsg(SYSLOG_INFO, "Scrubber: %d MB/s, a pass every %d hour(s)", Config::get().scrubMBps(), Config::get().scrubHours());
+}
+
+void Scrubber::stop(void) {
+    std::thread t;
+    {
+        std::lock_guard<std::mutex> lk(stopMu_);
+        stopping_ = true;
+        t = std::move(thread_);
+    }
+    stopCv_.notify_all();
+    if (t.joinable()) t.join();
+}
+
+Scrubber::State Scrubber::state(const std::string& fileId) {
+    std::shared_lock<std::shared_mutex> lk(mu_);
+    auto it = states_.find(fileId);
+    return it == states_.end() ? State::Unknown : it->second;
+}
+
+void Scrubber::verified(const std::string& fileId, const std::string& location) {
+    if (isLocal(location))
+        record(fileId, location, State::Ok);
+}
+
+void Scrubber::mend(const std::string& fileId, const std::string& fresh) {
+    if (!bad(state(fileId)) || !isLocal(fresh)) return;
+
+    std::string location, sha256;
+    long long   size = 0;
+    Database::get().getBookForDownload(fileId, location, size, sha256);
+    if (!isLocal(location) || location == fresh) return;
+
+    std::error_code ec;
+    std::filesystem::rename(fresh, location, ec);
+    if (ec) {
+        logMsg(SYSLOG_ERR, "Scrubber: can't put a fresh copy of book %s at %s: %s", fileId.c_str(), location.c_str(), ec.message().c_str());
+        return;
+    }
+    record(fileId, location, State::Ok);
+}
+
+bool Scrubber::sleepUntil(Clock::time_point t) {
+    std::unique_lock<std::mutex> lk(stopMu_);
+    return !stopCv_.wait_until(lk, t, [this]{ return stopping_; });
+}
+
+// scrub thread: a stat of every book nobody has looked at yet, then every book re-hashed;
+// the next pass scrubhours after this one started
+void Scrubber::run(void) {
+    for (;;) {
+        const auto passStart = Clock::now();
+
+        std::vector<Database::LibraryBook> books;
+        Database::get().listLibrary(books);
+        books.erase(std::remove_if(books.begin(), books.end(),
+                                   [](const Database::LibraryBook& b){ return !isLocal(b.location); }),
+                    books.end());
+        std::sort(books.begin(), books.end(),       // roughly in disk order
+                  [](const Database::LibraryBook& a, const Database::LibraryBook& b){ return a.location < b.location; });
+
+        for (const auto& b : books) {
+            if (state(b.fileId) != State::Unknown) continue;
+            struct stat sb;
+            State s = State::Present;
+            if (::stat(b.location.c_str(), &sb) != 0 || !S_ISREG(sb.st_mode))
+                s = State::Missing;
+            else if (static_cast<long long>(sb.st_size) != b.filesize)
+                s = State::WrongSize;
+            record(b.fileId, b.location, s);
+        }
+
+        Clock::time_point due = Clock::now();
+        for (const auto& b : books) {
+            const State s = check(b.location, b.filesize, b.sha256, due);
+            if (s == State::Unknown) return;        // stopping
+            record(b.fileId, b.location, s);
+        }
+        scrubPasses.inc();
+        logMsg(SYSLOG_INFO, "Scrubber: pass over %zu book(s) done: %lld missing, %lld the wrong size, %lld corrupt",
+               books.size(), counts_[static_cast<size_t>(State::Missing)].load(),
+               counts_[static_cast<size_t>(State::WrongSize)].load(), counts_[static_cast<size_t>(State::Corrupt)].load());
+
+        if (!sleepUntil(passStart + std::chrono::hours(std::max(1, Config::get().scrubHours()))))
+            return;
+    }
+}
+
+// one book read back at most scrubmbps; `due` is when the bytes read so far may have been
+// read by. Unknown: told to stop part way.
+Scrubber::State Scrubber::check(const std::string& location, long long size, const std::string& sha256,
+                                Clock::time_point& due) {
+    const int fd = ::open(location.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return State::Missing;
+    struct stat sb;
+    if (::fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+        ::close(fd);
+        return State::Missing;
+    }
+    if (static_cast<long long>(sb.st_size) != size) {
+        ::close(fd);
+        return State::WrongSize;
+    }
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    crypto_hash_sha256_state st;
+    crypto_hash_sha256_init(&st);
+    std::vector<unsigned char> buf(READ_BYTES);
+    long long got = 0;
+    State s = State::Ok;
+    for (;;) {
+        int mbps;
+        while ((mbps = Config::get().scrubMBps()) <= 0) {
+            if (!sleepUntil(Clock::now() + std::chrono::seconds(PAUSED_SECS))) { s = State::Unknown; break; }
+        }
+        if (s == State::Unknown) break;
+
+        const ssize_t n = ::read(fd, buf.data(), buf.size());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            logMsg(SYSLOG_ERR, "Scrubber: read %s: %s", location.c_str(), std::strerror(errno));
+            s = State::Corrupt;         // unreadable sectors are as bad as wrong bytes
+            break;
+        }
+        if (n == 0) break;
+        crypto_hash_sha256_update(&st, buf.data(), static_cast<unsigned long long>(n));
+        got += n;
+        scrubBytes.inc(static_cast<uint64_t>(n));
+
+        // no catching up on time spent idle: the rate holds from the next read on
+        due = std::max(due, Clock::now()) +
+              std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(static_cast<double>(n) / (mbps * 1048576.0)));
+        if (!sleepUntil(due)) { s = State::Unknown; break; }
+    }
+    ::close(fd);
+    if (s != State::Ok) return s;
+    if (got != size) return State::WrongSize;       // cut short while we read it
+
+    unsigned char out[crypto_hash_sha256_BYTES];
+    crypto_hash_sha256_final(&st, out);
+    char hex[crypto_hash_sha256_BYTES*2+1];
+    sodium_bin2hex(hex, sizeof hex, out, sizeof out);
+    return sha256 == hex ? State::Ok : State::Corrupt;
+}
+
+void Scrubber::record(const std::string& fileId, const std::string& location, State s) {
+    State was;
+    {
+        std::unique_lock<std::shared_mutex> lk(mu_);
+        auto [it, added] = states_.try_emplace(fileId, State::Unknown);
+        was = it->second;
+        it->second = s;
+    }
+    if (was == s) return;
+    if (was != State::Unknown) --counts_[static_cast<size_t>(was)];
+    ++counts_[static_cast<size_t>(s)];
+
+    if (bad(s))
+        logMsg(SYSLOG_ERR, "Scrubber: book %s at %s is %s", fileId.c_str(), location.c_str(), name(s));
+    else if (bad(was))
+        logMsg(SYSLOG_INFO, "Scrubber: book %s at %s is %s again", fileId.c_str(), location.c_str(), name(s));
+}
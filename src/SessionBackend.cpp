@@ -0,0 +1,139 @@
+#include <atomic>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <drogon/drogon.h>
+#ifdef SIMPLEREADER_WITH_REDIS
+#include <drogon/nosql/RedisClient.h>
+#endif
+
+#include "SessionBackend.h"
+#include "Database.h"
+#include "WriteQueue.h"
+#include "Log.h"
+#include "utils.h"
+
+namespace {
+
+// one process: SessionManager's cache is all there is
+class LocalSessionBackend : public SessionBackend {
+public:
+    explicit LocalSessionBackend(bool persist) : persist_(persist) {}
+
+    const char* name(void) const override { return persist_ ? "local, persisted" : "local"; }
+    bool authoritative(void) const override { return true; }
+
+    void store(const std::string& key, const Record& r) override {
+        if (!persist_) return;
+        // best effort: if it never lands, this device just logs in again after a restart
+        WriteQueue::get().submit([key, r]{ Database::get().insertSession(key, r.username, r.device, r.expiresAt); },
+                                 [](bool){});
+    }
+
+    bool fetch(const std::string&, Record&) override { return false; }
+
+    void preload(std::vector<std::pair<std::string, Record>>& out) override {
+        if (!persist_) return;
+        const long long now = nowMs();
+        std::vector<Database::SessionRow> rows;
+        Database::get().listLiveSessions(now, rows);
+        for (auto& row : rows)
+            out.emplace_back(std::move(row.tokenHash), Record{std::move(row.username), std::move(row.device), row.expiresAt});
+
+        expired(now);   // and clear out whatever expired while we were down
+    }
+
+    void expired(long long now) override {
+        if (!persist_) return;
+        WriteQueue::get().submit([now]{ Database::get().deleteExpiredSessions(now); }, [](bool){});
+    }
+
+private:
+    const bool persist_;
+};
+
+#ifdef SIMPLEREADER_WITH_REDIS
+// shared by every instance; Redis expires the keys itself.
+// fetch() runs on an IO loop (a handler's cache miss), so a command gets TIMEOUT_SECS, and
+// after a failure fetches fail at once for BACKOFF_MS rather than each wait out the timeout.
+class RedisSessionBackend : public SessionBackend {
+public:
+    RedisSessionBackend(const std::string& host, int port, const std::string& password)
+        : client_(drogon::nosql::RedisClient::newRedisClient(
+              trantor::InetAddress(host, static_cast<uint16_t>(port)), CONNECTIONS, password)) {
+        client_->setTimeout(TIMEOUT_SECS);
+    }
+
+    const char* name(void) const override { return "redis"; }
+    bool authoritative(void) const override { return false; }
+
+    void store(const std::string& key, const Record& r) override {
+        const long long ttl = r.expiresAt - nowMs();
+        if (ttl <= 0) return;
+        try {
+            client_->execCommandSync<bool>([](const drogon::nosql::RedisResult&) { return true; },
+                                           "SET %s %s PX %lld", redisKey(key).c_str(), encode(r).c_str(), ttl);
+        } catch (const std::exception& ex) {
+            throw std::runtime_error(std::string("redis SET failed: ") + ex.what());
+        }
+    }
+
+    bool fetch(const std::string& key, Record& out) override {
+        if (nowMs() < downUntil_.load(std::memory_order_relaxed))
+            throw std::runtime_error("redis GET skipped: it failed less than a second ago");
+        std::string v;
+        try {
+            v = client_->execCommandSync<std::string>(
+                [](const drogon::nosql::RedisResult& res) { return res.isNil() ? std::string() : res.asString(); },
+                "GET %s", redisKey(key).c_str());
+        } catch (const std::exception& ex) {
+            downUntil_.store(nowMs() + BACKOFF_MS, std::memory_order_relaxed);
+            throw std::runtime_error(std::string("redis GET failed: ") + ex.what());
+        }
+        return !v.empty() && decode(v, out);
+    }
+
+private:
+    static constexpr size_t    CONNECTIONS  = 4;
+    static constexpr double    TIMEOUT_SECS = 0.25;   // a round trip is well under a millisecond
+    static constexpr long long BACKOFF_MS   = 1000;
+
+    static std::string redisKey(const std::string& key) { return "simplereader:session:" + key; }
+
+    // "<expiresAt> <username length> <username><device>": any bytes in either name
+    static std::string encode(const Record& r) {
+        return std::to_string(r.expiresAt) + ' ' + std::to_string(r.username.size()) + ' ' + r.username + r.device;
+    }
+
+    static bool decode(const std::string& v, Record& out) {
+        char* end = nullptr;
+        out.expiresAt = std::strtoll(v.c_str(), &end, 10);
+        if (*end != ' ') return false;
+        const size_t userLen = std::strtoul(end + 1, &end, 10);
+        if (*end != ' ') return false;
+        const size_t at = static_cast<size_t>(end + 1 - v.c_str());
+        if (at + userLen > v.size()) return false;
+        out.username = v.substr(at, userLen);
+        out.device   = v.substr(at + userLen);
+        return !out.username.empty();
+    }
+
+    std::shared_ptr<drogon::nosql::RedisClient> client_;
+    std::atomic<long long>                      downUntil_{0};   // epoch millis: fetch() doesn't try until then
+};
+#endif
+
+} // namespace
+
+std::unique_ptr<SessionBackend> makeLocalSessionBackend(bool persist) {
+    return std::make_unique<LocalSessionBackend>(persist);
+}
+
+std::unique_ptr<SessionBackend> makeRedisSessionBackend(const std::string& host, int port, const std::string& password) {
+#ifdef SIMPLEREADER_WITH_REDIS
+    return std::make_unique<RedisSessionBackend>(host, port, password);
+#else
+    (void)host; (void)port; (void)password;
+    throw std::runtime_error("sessionstore=redis, but simplereaderd was built without Redis support");
+#endif
+}
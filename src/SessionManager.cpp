@@ -1,9 +1,14 @@
+#include <algorithm>
+#include <functional>
+#include <strings.h>
 
-#include <iomanip>
-#include <random>
+#include <sodium.h>
 
 #include "SessionManager.h"
 #include "Config.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "utils.h"
 
 // singleton instance
 SessionManager& SessionManager::instance() {
@@ -11,6 +16,36 @@ SessionManager& SessionManager::instance() {
     return inst;
 }
 
+SessionManager::SessionManager() : backend_(makeLocalSessionBackend(false)) {}
+
+SessionManager::Shard& SessionManager::shardFor(const std::string& key) {
+    return shards_[std::hash<std::string>{}(key) % SHARDS];
+}
+
+// 128-bit BLAKE2b of the token, as hex
+std::string SessionManager::tokenKey(const std::string& token) {
+    unsigned char h[16];
+    crypto_generichash(h, sizeof h, reinterpret_cast<const unsigned char*>(token.data()), token.size(), nullptr, 0);
+    char hex[sizeof h * 2 + 1];
+    sodium_bin2hex(hex, sizeof hex, h, sizeof h);
+    return std::string(hex);
+}
+
+void SessionManager::insert(const std::string& key, IdentityPtr who, std::chrono::time_point<Clock> expires) {
+    // file it under the first tick at/after it expires
+    const size_t slot = static_cast<size_t>((tickOf(expires) + 1) % WHEEL_SLOTS);
+
+    Shard& sh = shardFor(key);
+    std::unique_lock<std::shared_mutex> lk(sh.mu);
+    sh.sessions[key] = Session{std::move(who), expires};
+    sh.wheel[slot].push_back(key);
+}
+
+// wheel tick an instant falls in
+long long SessionManager::tickOf(std::chrono::time_point<Clock> t) {
+    return std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count() / TICK_SECS;
+}
+
 // add a user/device
 // RETURNS: token/expiry
 SessionManager::SessionToken SessionManager::add(const std::string& username, 
@@ -19,25 +54,24 @@ SessionManager::SessionToken SessionManager::add(const std::string& username,
     const auto token = makeToken();
     const auto tokenLife = Config::get().tokenTimeout() * 60; // in secs
     const auto expires = Clock::now() + std::chrono::seconds(tokenLife);
+    const auto key = tokenKey(token);
+    const long long expiresMs = std::chrono::duration_cast<std::chrono::milliseconds>(expires.time_since_epoch()).count();
 
-    std::lock_guard<std::mutex> lk(mu_);
-    pruneExpired(); // do some housekeeping first
-    sessions_[token] = Session{username, device, expires};
+    backend_->store(key, SessionBackend::Record{username, device, expiresMs});
+    insert(key, std::make_shared<const Identity>(Identity{username, device}), expires);
 
     return SessionToken{token,expires};
 }
 
-// create a token
+// create a token: `bytes` random bytes from libsodium's CSPRNG, as hex
 std::string SessionManager::makeToken(size_t bytes) {
-    std::random_device rd;
-    std::mt19937_64 gen(rd());
-    std::uniform_int_distribution<unsigned int> dist(0, 255);
-    std::ostringstream oss;
-    for (size_t i = 0; i < bytes; ++i) {
-        unsigned int b = dist(gen) & 0xFFu;
-        oss << std::hex << std::setfill('0') << std::setw(2) << b;
-    }
-    return oss.str();
+    std::vector<unsigned char> raw(bytes);
+    randombytes_buf(raw.data(), raw.size());
+
+    std::string hex(bytes * 2 + 1, '\0');
+    sodium_bin2hex(&hex[0], hex.size(), raw.data(), raw.size());
+    hex.pop_back();     // drop the terminator
+    return hex;
 }
 
 // extract the token from a HttpRequest header
@@ -49,38 +83,136 @@ std::string SessionManager::bearerToken(const drogon::HttpRequestPtr& req) {
 }
 
 // validate token inside HttpRequest header
-// RETURN: username if token is valid, else empty string
-std::string SessionManager::usernameIfValid(const drogon::HttpRequestPtr& req) {
-    const std::string token = bearerToken(req);
-    return usernameIfValid(token);
+// RETURN: identity if token is valid, else nullptr
+SessionManager::IdentityPtr SessionManager::identify(const drogon::HttpRequestPtr& req) {
+    return identify(bearerToken(req));
 }
- 
+
 // validate token
+// RETURN: identity if token is valid, else nullptr
+SessionManager::IdentityPtr SessionManager::identify(const std::string& token) {
+    if (token.empty()) return nullptr;   // no token
+
+    static const Metrics::Histogram latency = Metrics::get().histogram(
+        "simplereader_session_lookup_duration_seconds", "Token validation: hash, shard lock and lookup.");
+    Metrics::Timer timer(latency);
+
+    const auto key = tokenKey(token);
+    {
+        Shard& sh = shardFor(key);
+        std::shared_lock<std::shared_mutex> lk(sh.mu);
+        auto it = sh.sessions.find(key);
+        if (it != sh.sessions.end()) {
+            if (it->second.expires > Clock::now())
+                return it->second.who;              // (nullptr if known to be unknown)
+            if (it->second.who)
+                return nullptr;                     // expired but not yet swept by the wheel
+        }
+    }
+    if (backend_->authoritative()) return nullptr;  // couldn't find it
+
+    return fetch(key);
+}
+
+// not cached: ask the shared backend, and cache the answer either way
+SessionManager::IdentityPtr SessionManager::fetch(const std::string& key) {
+    static const Metrics::Histogram latency = Metrics::get().histogram(
+        "simplereader_session_fetch_duration_seconds", "Cache misses looked up in the shared session store.");
+
+    SessionBackend::Record r;
+    bool found = false;
+    try {
+        Metrics::Timer timer(latency);
+        found = backend_->fetch(key, r);
+    } catch (const std::exception& ex) {
+        logMsg(SYSLOG_ERR, "SessionManager: %s", ex.what());
+        return nullptr;                             // not cached: the next request asks again
+    }
+
+    const auto now = Clock::now();
+    const auto expires = Clock::time_point(std::chrono::milliseconds(r.expiresAt));
+    if (found && expires > now) {
+        auto who = std::make_shared<const Identity>(Identity{std::move(r.username), std::move(r.device)});
+        insert(key, who, expires);
+        return who;
+    }
+    insert(key, nullptr, now + std::chrono::seconds(NEGATIVE_SECS));
+    return nullptr;
+}
+
 // RETURN: username if token is valid, else empty string
+std::string SessionManager::usernameIfValid(const drogon::HttpRequestPtr& req) {
+    auto who = identify(req);
+    return who ? who->username : std::string();
+}
+
 std::string SessionManager::usernameIfValid(const std::string& token) {
-    if (token.empty()) return {};   // no token
-    
-    const auto now = Clock::now();
+    auto who = identify(token);
+    return who ? who->username : std::string();
+}
 
-    std::lock_guard<std::mutex> lk(mu_);
-    auto it = sessions_.find(token);
-    if (it == sessions_.end()) return {};   // couldn't find it
+void SessionManager::startExpiryTimer(void) {
+    drogon::app().getLoop()->runEvery(TICK_SECS, [this]{ expireTick(); });
+    Metrics::get().gauge("simplereader_sessions_live", "Sessions cached here, and unknown tokens remembered as such (expired ones go within a wheel tick).",
+                         [this]{ return static_cast<double>(liveSessions()); });
+}
+
+size_t SessionManager::liveSessions(void) {
+    size_t n = 0;
+    for (auto& sh : shards_) {
+        std::shared_lock<std::shared_mutex> lk(sh.mu);
+        n += sh.sessions.size();
+    }
+    return n;
+}
+
+// expireTick(): visit the wheel slots for every tick since the last call.
+// Tokens filed there are either expired (erased) or a lap or more away (kept in place).
+void SessionManager::expireTick(void) {
+    const auto now  = Clock::now();
+    const long long tick = tickOf(now);
+    if (lastTick_ < 0) lastTick_ = tick - 1;
 
-    if (it->second.expires <= now) {
-        // this single entry has expired already, so may as well delete it now
-        sessions_.erase(it);
-        return {};
+    // after a long stall, one lap covers every slot
+    const long long from = std::max(lastTick_ + 1, tick - static_cast<long long>(WHEEL_SLOTS) + 1);
+    size_t dropped = 0;
+
+    for (long long t = from; t <= tick; ++t) {
+        const size_t slot = static_cast<size_t>(t % WHEEL_SLOTS);
+        for (auto& sh : shards_) {
+            std::unique_lock<std::shared_mutex> lk(sh.mu);
+            auto& due = sh.wheel[slot];             // session keys
+            size_t keep = 0;
+            for (auto& key : due) {
+                auto it = sh.sessions.find(key);
+                if (it == sh.sessions.end()) continue;          // gone already
+                if (it->second.expires <= now) {
+                    sh.sessions.erase(it);
+                    ++dropped;
+                } else {
+                    due[keep++] = std::move(key);               // due on a later lap
+                }
+            }
+            due.resize(keep);
+        }
     }
+    lastTick_ = tick;
 
-    return it->second.username;
+    if (dropped) {
+        logMsg(SYSLOG_DEBUG, "SessionManager: expired %zu session(s)", dropped);
+        backend_->expired(std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count());
+    }
 }
 
-// pruneExpired(): delete old tokens
-// note: assumes you have already locked the mutex
-void SessionManager::pruneExpired() {
-    const auto now = Clock::now();
-    for (auto it = sessions_.begin(); it != sessions_.end(); ) {
-        if (it->second.expires <= now) it = sessions_.erase(it);
-        else ++it;
+void SessionManager::setBackend(std::unique_ptr<SessionBackend> backend) {
+    backend_ = std::move(backend);
+
+    std::vector<std::pair<std::string, SessionBackend::Record>> rows;
+    backend_->preload(rows);
+    for (auto& [key, r] : rows) {
+        const auto expires = Clock::time_point(std::chrono::milliseconds(r.expiresAt));
+        insert(key, std::make_shared<const Identity>(Identity{std::move(r.username), std::move(r.device)}), expires);
     }
+
+    logMsg(SYSLOG_INFO, "sessions: %s store, restored %zu session(s)", backend_->name(), rows.size());
 }
@@ -0,0 +1,76 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "StagedFile.h"
+
+namespace fs = std::filesystem;
+
+static std::runtime_error sysError(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+StagedFile::StagedFile(const fs::path& dir) {
+    const fs::path staging = dir / ".staging";
+    std::error_code ec;
+    fs::create_directories(staging, ec);
+    if (ec)
+        throw std::runtime_error("StagedFile: " + staging.string() + ": " + ec.message());
+
+    std::string templ = (staging / "upload_XXXXXX").string();
+    fd_ = mkstemp(&templ[0]);
+    if (fd_ == -1)
+        throw sysError("StagedFile: mkstemp " + templ);
+    path_ = templ;
+
+    crypto_hash_sha256_init(&sha_);
+}
+
+StagedFile::~StagedFile() {
+    if (fd_ != -1)
+        ::close(fd_);
+    if (!committed_ && !path_.empty()) {
+        std::error_code ec;
+        fs::remove(path_, ec);
+    }
+}
+
+void StagedFile::append(const char* data, size_t len) {
+    const auto start = std::chrono::steady_clock::now();
+    crypto_hash_sha256_update(&sha_, reinterpret_cast<const unsigned char*>(data), len);
+    hashTime_ += std::chrono::steady_clock::now() - start;
+
+    while (len > 0) {
+        const ssize_t n = ::write(fd_, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw sysError("StagedFile: write " + path_.string());
+        }
+        data  += n;
+        len   -= static_cast<size_t>(n);
+        size_ += n;
+    }
+}
+
+std::string StagedFile::sha256Hex(void) {
+    unsigned char out[crypto_hash_sha256_BYTES];
+    crypto_hash_sha256_final(&sha_, out);
+    char hex[crypto_hash_sha256_BYTES*2+1];
+    sodium_bin2hex(hex, sizeof hex, out, sizeof out);
+    return std::string(hex);
+}
+
+void StagedFile::commit(const fs::path& dst) {
+    if (::fsync(fd_) != 0)
+        throw sysError("StagedFile: fsync " + path_.string());
+    ::close(fd_);
+    fd_ = -1;
+
+    std::error_code ec;
+    fs::rename(path_, dst, ec);     // same filesystem: atomic, replaces any stale file at dst
+    if (ec)
+        throw std::runtime_error("StagedFile: rename " + path_.string() + " -> " + dst.string() + ": " + ec.message());
+    committed_ = true;
+}
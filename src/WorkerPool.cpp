@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <exception>
+
+#include "WorkerPool.h"
+#include "Log.h"
+#include "utils.h"
+
+WorkerPool::WorkerPool(const std::string& name, size_t threads, size_t maxQueued)
+    : name_(name), maxQueued_(maxQueued) {
+    threads = std::max<size_t>(1, threads);
+    threads_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+        threads_.emplace_back(&WorkerPool::run, this);
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+}
+
+bool WorkerPool::trySubmit(Task task) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (stopping_ || queue_.size() >= maxQueued_)
+            return false;
+        queue_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+    return true;
+}
+
+size_t WorkerPool::queued(void) {
+    std::lock_guard<std::mutex> lk(mu_);
+    return queue_.size();
+}
+
+void WorkerPool::run(void) {
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait(lk, [this]{ return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) return;     // stopping, and drained
+            task = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        try {
+            task();
+        } catch (const std::exception& ex) {
+            logMsg(SYSLOG_ERR, "WorkerPool [%s]: task threw: %s", name_.c_str(), ex.what());
+        } catch (...) {
+            logMsg(SYSLOG_ERR, "WorkerPool [%s]: task threw", name_.c_str());
+        }
+    }
+}
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <vector>
+
+#include "WriteQueue.h"
+#include "Database.h"
+#include "Log.h"
+#include "utils.h"
+
+// singleton instance
+WriteQueue& WriteQueue::get() {
+    static WriteQueue inst;     // instantiated once on first-call
+    return inst;
+}
+
+void WriteQueue::start(int windowMs, size_t maxBatch) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (!lanes_.empty() && lanes_[0]->running) return;
+    tune(windowMs, maxBatch);
+
+    Database& db = Database::get();
+    lanes_.clear();
+    for (size_t i = 0; i <= db.shardCount(); ++i) {
+        auto lane = std::make_unique<Lane>();
+        lane->db      = (i == 0) ? &db : &db.shard(i - 1);
+        lane->running = true;
+        lanes_.push_back(std::move(lane));
+    }
+    for (auto& lane : lanes_)
+        lane->thread = std::thread(&WriteQueue::run, this, std::ref(*lane));
+}
+
+void WriteQueue::tune(int windowMs, size_t maxBatch) {
+    windowMs_ = std::max(0, windowMs);
+    maxBatch_ = std::max<size_t>(1, maxBatch);
+}
+
+void WriteQueue::stop(void) {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& lane : lanes_) {
+        std::lock_guard<std::mutex> llk(lane->mu);
+        lane->stopping = true;
+        lane->cv.notify_all();
+    }
+    for (auto& lane : lanes_) {
+        if (lane->thread.joinable()) lane->thread.join();
+        std::lock_guard<std::mutex> llk(lane->mu);
+        lane->running = false;
+    }
+}
+
+void WriteQueue::submit(Job job, Done done) {
+    if (lanes_.empty()) return done(false);     // not started
+    enqueue(*lanes_[0], std::move(job), std::move(done));
+}
+
+void WriteQueue::submitFor(const std::string& username, Job job, Done done) {
+    if (lanes_.empty()) return done(false);
+    const size_t lane = (lanes_.size() > 1) ? 1 + Database::get().shardIndex(username) : 0;
+    enqueue(*lanes_[lane], std::move(job), std::move(done));
+}
+
+void WriteQueue::enqueue(Lane& lane, Job job, Done done) {
+    {
+        std::lock_guard<std::mutex> lk(lane.mu);
+        if (lane.running && !lane.stopping) {
+            lane.queue.push_back(Entry{std::move(job), std::move(done)});
+            queued_.fetch_add(1, std::memory_order_relaxed);
+            lane.cv.notify_one();
+            return;
+        }
+    }
+    done(false);    // not accepting: fail now rather than leave the client hanging
+}
+
+// writer thread: wait for a first job, give others `windowMs_` to join it, commit the lot
+void WriteQueue::run(Lane& lane) {
+    std::deque<Entry> batch;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lk(lane.mu);
+            lane.cv.wait(lk, [&]{ return lane.stopping || !lane.queue.empty(); });
+            if (lane.queue.empty()) return;     // stopping, and drained
+
+            const size_t maxBatch = maxBatch_;
+            if (!lane.stopping && lane.queue.size() < maxBatch) {
+                const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(windowMs_.load());
+                lane.cv.wait_until(lk, deadline, [&]{ return lane.stopping || lane.queue.size() >= maxBatch; });
+            }
+
+            while (!lane.queue.empty() && batch.size() < maxBatch) {
+                batch.push_back(std::move(lane.queue.front()));
+                lane.queue.pop_front();
+            }
+            queued_.fetch_sub(batch.size(), std::memory_order_relaxed);
+        }
+
+        commitBatch(lane, batch);
+        batch.clear();
+    }
+}
+
+void WriteQueue::commitBatch(Lane& lane, std::deque<Entry>& batch) {
+    std::vector<bool> ran(batch.size(), false);
+    bool committed = false;
+
+    try {
+        Database::WriteTxn txn(*lane.db);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            try {
+                Database::Savepoint sp;
+                batch[i].job();
+                sp.release();
+                ran[i] = true;
+            } catch (const std::exception& ex) {
+                logMsg(SYSLOG_ERR, "WriteQueue: job failed: %s", ex.what());
+            } catch (...) {
+                logMsg(SYSLOG_ERR, "WriteQueue: job failed");
+            }
+        }
+        txn.commit();
+        committed = true;
+    } catch (const std::exception& ex) {
+        logMsg(SYSLOG_ERR, "WriteQueue: batch of %zu not committed: %s", batch.size(), ex.what());
+    }
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        try {
+            batch[i].done(committed && ran[i]);
+        } catch (...) {
+            logMsg(SYSLOG_ERR, "WriteQueue: completion callback threw");
+        }
+    }
+}
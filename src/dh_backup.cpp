@@ -0,0 +1,57 @@
+//*******************************************
+// drogon handler for "/backup" requests (admin, from this host only)
+//
+//   POST /backup  -> {"ok":true}  a backup has been started (see Backup)
+//                    {"ok":false,"error":"busy","reason":...}  one is running already
+//   GET  /backup  -> {"ok":true,"running","pagesDone","pagesTotal",
+//                     "lastOkAt","lastSeconds","lastFile","lastError"}
+//*******************************************
+#include <drogon/drogon.h>
+
+#include "Backup.h"
+#include "dhutils.h"
+#include "dh_backup.h"
+
+using drogon::HttpRequestPtr;
+using drogon::HttpResponsePtr;
+
+int registerBackupHandler(void) {
+    drogon::app().registerHandler("/backup",
+        [latency = routeLatency("/backup")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
+            if (!fromLocalAdmin(req)) {
+                auto r = drogon::HttpResponse::newHttpResponse();
+                r->setStatusCode(drogon::k403Forbidden);
+                return cb(r);
+            }
+
+            Json::Value j;
+            if (req->method() == drogon::Post) {
+                std::string reason;
+                if (Backup::get().trigger(reason)) {
+                    j["ok"] = true;
+                } else {
+                    j["ok"]     = false;
+                    j["error"]  = "busy";
+                    j["reason"] = reason;
+                }
+            } else {
+                const Backup::Status s = Backup::get().status();
+                j["ok"]          = true;
+                j["running"]     = s.running;
+                j["pagesDone"]   = s.pagesDone;
+                j["pagesTotal"]  = s.pagesTotal;
+                j["lastOkAt"]    = static_cast<Json::Int64>(s.lastOkAt);
+                j["lastSeconds"] = s.lastSeconds;
+                j["lastFile"]    = s.lastFile;
+                j["lastError"]   = s.lastError;
+            }
+            auto r = drogon::HttpResponse::newHttpJsonResponse(j);
+            r->setStatusCode(drogon::k200OK);
+            return cb(r);
+        },
+        {drogon::Get, drogon::Post}
+    );
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+//**************************************************************************
+// drogon handlers for "GET /bookMeta/{fileId}", "POST /bookMeta" (batched)
+// and "GET /bookCover/{fileId}"
+//
+//   What BookMeta read out of a book: enough for a library view without
+//   downloading the books. A book's entry is
+//     {fileId, format, title, author, pages, cover}       (null: not known)
+//   or, while there's nothing to show yet,
+//     {fileId, pending: true}    being read: ask again shortly
+//     {fileId, pending: false}   this node can't read it
+//   All three are ETag'd; If-None-Match gets 304.
+//**************************************************************************
+#include <sodium.h>
+#include <drogon/drogon.h>
+
+#include "BookMeta.h"
+#include "Database.h"
+#include "Config.h"
+#include "utils.h"
+#include "dhutils.h"
+#include "dh_bookMeta.h"
+#include "SessionManager.h"
+
+using drogon::HttpRequestPtr;
+using drogon::HttpResponsePtr;
+
+static constexpr int MAX_AGE_SECS = 3600;       // ready entries; pending ones aren't cached
+
+// one book's entry; its tag goes into the ETag. False if there's no such book.
+static bool bookEntry(const std::string& fileId, Json::Value& j, std::string& tag, bool& pending) {
+    Database& db = Database::get();
+    Database::BookMetaRow row;
+    j["fileId"] = fileId;
+    if (db.getBookMeta(fileId, row)) {
+        j["format"] = row.format;
+        j["title"]  = row.title.empty()  ? Json::Value(Json::nullValue) : Json::Value(row.title);
+        j["author"] = row.author.empty() ? Json::Value(Json::nullValue) : Json::Value(row.author);
+        j["pages"]  = row.pages < 0      ? Json::Value(Json::nullValue) : Json::Value(row.pages);
+        j["cover"]  = !row.coverType.empty();
+        tag = std::to_string(row.extractedAt);
+        return true;
+    }
+    if (!db.bookExists(fileId))
+        return false;
+    const bool reading = BookMeta::get().want(fileId);
+    j["pending"] = reading;
+    pending = pending || reading;
+    tag = reading ? "p" : "u";
+    return true;
+}
+
+// an ETag that changes whenever any entry does
+static std::string etagOf(const std::string& tags) {
+    unsigned char h[crypto_hash_sha256_BYTES];
+    crypto_hash_sha256(h, reinterpret_cast<const unsigned char*>(tags.data()), tags.size());
+    char hex[33];
+    sodium_bin2hex(hex, sizeof hex, h, 16);
+    return "\"" + std::string(hex) + "\"";
+}
+
+// If-None-Match: one tag, a list of them, or "*"
+static bool etagMatches(const std::string& header, const std::string& etag) {
+    return !header.empty() && (header == "*" || header.find(etag) != std::string::npos);
+}
+
+static void sendCached(const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)>& cb,
+                       HttpResponsePtr r, const std::string& etag, bool pending) {
+    if (etagMatches(req->getHeader("if-none-match"), etag)) {
+        r = drogon::HttpResponse::newHttpResponse();
+        r->setStatusCode(drogon::k304NotModified);
+    }
+    r->addHeader("ETag", etag);
+    r->addHeader("Cache-Control", pending ? "no-store" : "private, max-age=" + std::to_string(MAX_AGE_SECS));
+    cb(r);
+}
+
+int registerBookMetaHandlers(void) {
+    // GET /bookMeta/{fileId}: one book's entry
+    drogon::app().registerHandler("/bookMeta/{1}",
+        [latency = routeLatency("/bookMeta/{1}")](const HttpRequestPtr& req,
+           std::function<void (const HttpResponsePtr &)> &&cb,
+           const std::string& fileId) {
+            timeResponse(latency, cb);
+            auto jsonErr = [&](drogon::HttpStatusCode sc, const char* errMsg) {
+                Json::Value j;
+                j["ok"] = false;
+                j["error"] = errMsg;
+                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
+                r->setStatusCode(sc);
+                cb(r);
+            };
+
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who)
+                return jsonErr(drogon::k401Unauthorized, "unauthorised");
+
+            try {
+                Json::Value j;
+                std::string tag;
+                bool pending = false;
+                if (!bookEntry(fileId, j, tag, pending))
+                    return jsonErr(drogon::k404NotFound, "book record not found");
+                j["ok"] = true;
+                sendCached(req, cb, valueResponse(wantsCbor(req), j), etagOf(fileId + ':' + tag), pending);
+            } catch (...) {
+                return jsonErr(drogon::k500InternalServerError, "server_error");
+            }
+        },
+        {drogon::Get}
+    );
+
+    // POST /bookMeta {"fileIds": [...]}: {ok, books: [entry, ...]} in the same order
+    // (an unknown fileId gets {fileId, error: "not_found"})
+    drogon::app().registerHandler("/bookMeta",
+        [latency = routeLatency("/bookMeta")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
+            const bool cbor = wantsCbor(req);
+            auto err = [&](const char* code,const char* info="") {
+                Json::Value j;
+                j["ok"]    = false;
+                j["error"] = code;
+                if (*info)
+                    j["reason"] = info;
+                cb(valueResponse(cbor, j)); // app-level errors
+            };
+
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+
+            auto bodyPtr = requestBody(req);          // JSON, or CBOR if the client sent that
+            if (!bodyPtr) return err("invalid_request","parsing failed");
+            const Json::Value& ids = (*bodyPtr)["fileIds"];
+            if (!ids.isArray() || ids.empty())
+                return err("invalid_request","no fileIds");
+            if (ids.size() > static_cast<Json::ArrayIndex>(Config::get().maxBatch()))
+                return err("invalid_request","too many fileIds");
+
+            try {
+                Json::Value j;
+                j["ok"] = true;
+                Json::Value& books = j["books"] = Json::Value(Json::arrayValue);
+                std::string tags;
+                bool pending = false;
+                for (const auto& v : ids) {
+                    if (!v.isString()) return err("invalid_request","bad fileId");
+                    Json::Value entry;
+                    std::string tag;
+                    if (!bookEntry(v.asString(), entry, tag, pending)) {
+                        entry = Json::Value();
+                        entry["fileId"] = v.asString();
+                        entry["error"]  = "not_found";
+                        tag = "n";
+                    }
+                    tags += v.asString() + ':' + tag + ';';
+                    books.append(std::move(entry));
+                }
+                sendCached(req, cb, valueResponse(cbor, j), etagOf(tags), pending);
+            } catch (...) {
+                return err("server_error");
+            }
+        },
+        {drogon::Post}
+    );
+
+    // GET /bookCover/{fileId}: the cover image, if the book has one
+    drogon::app().registerHandler("/bookCover/{1}",
+        [latency = routeLatency("/bookCover/{1}")](const HttpRequestPtr& req,
+           std::function<void (const HttpResponsePtr &)> &&cb,
+           const std::string& fileId) {
+            timeResponse(latency, cb);
+            auto jsonErr = [&](drogon::HttpStatusCode sc, const char* errMsg) {
+                Json::Value j;
+                j["ok"] = false;
+                j["error"] = errMsg;
+                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
+                r->setStatusCode(sc);
+                cb(r);
+            };
+
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who)
+                return jsonErr(drogon::k401Unauthorized, "unauthorised");
+
+            Database::BookMetaRow row;
+            try {
+                if (!Database::get().getBookMeta(fileId, row) || row.coverType.empty())
+                    return jsonErr(drogon::k404NotFound, "no cover");
+            } catch (...) {
+                return jsonErr(drogon::k500InternalServerError, "server_error");
+            }
+
+            const std::string etag = etagOf(fileId + ":cover:" + std::to_string(row.extractedAt));
+            auto r = drogon::HttpResponse::newFileResponse(BookMeta::get().coverPath(fileId), "",
+                                                           drogon::CT_CUSTOM, row.coverType);
+            r->addHeader("X-Content-Type-Options", "nosniff");
+            sendCached(req, cb, r, etag, false);
+        },
+        {drogon::Get}
+    );
+
+    return 0;
+}
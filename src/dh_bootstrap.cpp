@@ -0,0 +1,184 @@
+//*******************************************
+// drogon handler for "POST /bootstrap" requests
+//
+// A new device's first sync in one request: everything this user has now, instead of
+// paging /getSince from 0 (tombstones and all) table by table.
+//
+// request:  (no body)
+// response: {"ok":true,
+//            "tables":  {"books":[...], "bookmark":[...], "highlight":[...], "note":[...]},
+//            "cursors": {"books":{...}, "bookmark":{...}, "highlight":{...}, "note":{...}}}
+//
+//   Live rows only, as a batched /get writes them, all from one snapshot. "cursors" is
+//   ready to send as /sync's "cursors" (or each as /getSince's "cursor"): it picks up
+//   whatever changed after the snapshot, deletes included.
+//
+//   The body is streamed (chunked, compressed as the client accepts) a piece at a time
+//   as the client takes it, so it costs the same memory whatever the row count. An error
+//   after the first piece can only cut it short: a body that doesn't parse to the end,
+//   with "cursors", was not all sent and should be thrown away and asked for again.
+//*******************************************
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+#include <drogon/drogon.h>
+
+#include "Database.h"
+#include "Compression.h"
+#include "Log.h"
+#include "utils.h"
+#include "dhutils.h"
+#include "dh_bootstrap.h"
+#include "SessionManager.h"
+
+using drogon::HttpRequestPtr;
+using drogon::HttpResponsePtr;
+
+namespace {
+    const size_t PIECE_BYTES    = 64 * 1024;   // rows encoded per piece, before compression
+    const int    BOOTSTRAP_SECS = 300;         // longest a snapshot is held for one client
+
+    const struct { const char* name; Database::Tbl tbl; } kTables[] = {     // same names as /sync
+        { "books",     Database::Tbl::Books      },
+        { "bookmark",  Database::Tbl::Bookmarks  },
+        { "highlight", Database::Tbl::Highlights },
+        { "note",      Database::Tbl::Notes      },
+    };
+
+    // one response in flight: Drogon pulls it a buffer at a time, on the connection's IO thread
+    class BootstrapStream {
+    public:
+        BootstrapStream(const std::string& username, bool cbor, std::unique_ptr<StreamEncoder> enc)
+            : username_(username), dump_(std::make_unique<Database::Dump>(Database::get(), username)),
+              out_(makeRowWriter(cbor, PIECE_BYTES + 4096)), enc_(std::move(enc)),
+              start_(std::chrono::steady_clock::now()) {
+            out_->beginObject().key("ok").value(true).key("tables").beginObject();
+        }
+
+        // copy up to `len` bytes of the body into `buf`; 0: it's all been sent (or never will be)
+        size_t read(char* buf, size_t len) {
+            try {
+                while (sent_ == pending_.size() && !done_) {
+                    pending_.clear();
+                    sent_ = 0;
+                    produce();
+                }
+            } catch (const std::exception& ex) {
+                logMsg(SYSLOG_ERR, "/bootstrap for user [%s] cut short: %s", username_.c_str(), ex.what());
+                dump_.reset();
+                done_ = true;
+                pending_.clear();
+                sent_ = 0;
+            }
+            const size_t n = std::min(len, pending_.size() - sent_);
+            std::memcpy(buf, pending_.data() + sent_, n);
+            sent_ += n;
+            return n;
+        }
+
+    private:
+        // the next PIECE_BYTES or so of rows, encoded and compressed into pending_
+        void produce(void) {
+            if (std::chrono::steady_clock::now() - start_ > std::chrono::seconds(BOOTSTRAP_SECS))
+                throw std::runtime_error("client too slow");
+
+            RowWriter& out = *out_;
+            while (out.str().size() < PIECE_BYTES && table_ < std::size(kTables)) {
+                if (!inTable_) {
+                    out.key(kTables[table_].name).beginArray();
+                    inTable_ = true;
+                }
+                if (!dump_->next(kTables[table_].tbl, out)) {
+                    out.endArray();
+                    inTable_ = false;
+                    ++table_;
+                }
+            }
+
+            const bool last = (table_ == std::size(kTables));
+            if (last) {
+                out.endObject().key("cursors").beginObject();
+                for (const auto& t : kTables) {
+                    out.key(t.name);
+                    writeCursor(out, dump_->cursor(t.tbl));
+                }
+                out.endObject().endObject();
+                dump_.reset();      // let the snapshot go now, not once the client has the rest
+                done_ = true;
+            }
+
+            raw_.clear();
+            out.drainTo(raw_);
+            if (enc_)
+                enc_->write(raw_, last, pending_);
+            else
+                pending_.swap(raw_);
+        }
+
+        const std::string               username_;
+        std::unique_ptr<Database::Dump> dump_;
+        std::unique_ptr<RowWriter>      out_;
+        std::unique_ptr<StreamEncoder>  enc_;
+        const std::chrono::steady_clock::time_point start_;
+
+        size_t      table_   = 0;       // kTables index being written
+        bool        inTable_ = false;   // its array is open
+        bool        done_    = false;
+        std::string raw_;               // one piece as encoded
+        std::string pending_;           // ... as sent, from sent_ on
+        size_t      sent_    = 0;
+    };
+}
+
+int registerBootstrapHandler(void) {
+    drogon::app().registerHandler("/bootstrap",
+        [latency = routeLatency("/bootstrap")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);      // until the first byte: the rest goes at the client's pace
+            const bool cbor = wantsCbor(req);
+            auto err = [&](const char* code,const char* info="") {
+                Json::Value j;
+                j["ok"]    = false;
+                j["error"] = code;
+                if (*info)
+                    j["reason"] = info;
+                cb(valueResponse(cbor, j)); // app-level errors
+            };
+
+            // check whether token is valid
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+
+            std::shared_ptr<BootstrapStream> stream;
+            std::unique_ptr<StreamEncoder> enc;
+            try {
+                enc = makeStreamEncoder(req->getHeader("accept-encoding"));
+                const char* coding = enc ? enc->name() : nullptr;
+                stream = std::make_shared<BootstrapStream>(who->username, cbor, std::move(enc));
+
+                auto resp = drogon::HttpResponse::newStreamResponse(
+                    [stream](char* buf, std::size_t len) mutable -> std::size_t {
+                        if (!buf) {             // the connection is gone: let go of the snapshot now
+                            stream.reset();
+                            return 0;
+                        }
+                        return stream ? stream->read(buf, len) : 0;
+                    });
+                if (cbor)
+                    resp->setContentTypeString("application/cbor");
+                else
+                    resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+                resp->addHeader("Vary", "Accept-Encoding");
+                if (coding)
+                    resp->addHeader("Content-Encoding", coding);
+                return cb(resp);
+            } catch (const std::exception& ex) {
+                logMsg(SYSLOG_ERR, "/bootstrap for user [%s]: %s", who->username.c_str(), ex.what());
+                return err("server_error");
+            }
+        },
+        {drogon::Post}  // limit to POST
+    );
+
+    return 0;
+}
@@ -21,18 +21,86 @@ static std::string resolveTable(std::string s) {
     return "";
 }
 
+// {exists, deleted, updatedAt?} as returned by /check
+static Json::Value stateToJson(const Database::RowState& st) {
+    Json::Value j(Json::objectValue);
+    j["exists"]  = st.exists;
+    j["deleted"] = st.deleted;
+    const long long ts = st.deleted ? st.deletedAt : st.updatedAt;
+    if ((st.exists || st.deleted) && ts > 0)
+        j["updatedAt"] = static_cast<Json::Int64>(ts);
+    return j;
+}
+
+// batched /check: {"keys":[{"table":..., "fileId":..., "id":...}, ...]}
+//   -> {"ok":true, "states":[{"exists","deleted","updatedAt"} or {"error","reason"}, in key order]}
+// one query per table, however many keys it has
+static Json::Value checkKeys(const std::string& username, const Json::Value& keys) {
+    static const char* const tables[] = { "user_books", "user_bookmarks", "user_highlights", "user_notes" };
+
+    Json::Value states(Json::arrayValue);
+    std::vector<Database::ItemKey> byTable[4];
+    std::vector<Json::ArrayIndex>  slots[4];     // where each table's answers go in "states"
+
+    for (Json::ArrayIndex i = 0; i < keys.size(); ++i) {
+        const Json::Value& k = keys[i];
+        Json::Value bad(Json::objectValue);
+        bad["error"] = "invalid_request";
+
+        if (!k.isObject() || !k.isMember("table") || !k["table"].isString()) {
+            bad["reason"] = "bad tablename"; states.append(bad); continue;
+        }
+        if (!k.isMember("fileId") || !k["fileId"].isString()) {
+            bad["reason"] = "no fileId"; states.append(bad); continue;
+        }
+
+        const std::string table = k["table"].asString();
+        Database::ItemKey key;
+        key.fileId = k["fileId"].asString();
+
+        int t;
+        if (table == "books" || table == "book_data") {
+            t = 0;
+        } else {
+            const std::string tablename = resolveTable(table);
+            if (tablename.empty()) {
+                bad["reason"] = "table unknown"; states.append(bad); continue;
+            }
+            t = (tablename == "user_bookmarks") ? 1 : (tablename == "user_highlights") ? 2 : 3;
+            if (!k.isMember("id") || !parseItemId(k["id"], key.id)) {
+                bad["reason"] = "bad id"; states.append(bad); continue;
+            }
+        }
+
+        byTable[t].push_back(std::move(key));
+        slots[t].push_back(i);
+        states.append(Json::Value(Json::objectValue));  // filled in below
+    }
+
+    Database& db = Database::get().forUser(username);   // the shard with their rows
+    Database::ReadSnapshot snap(db);    // all tables from one view
+    for (int t = 0; t < 4; ++t) {
+        if (byTable[t].empty()) continue;
+        std::vector<Database::RowState> st;
+        db.selectRowStates(tables[t], username, byTable[t], st);
+        for (size_t n = 0; n < st.size(); ++n)
+            states[slots[t][n]] = stateToJson(st[n]);
+    }
+    return states;
+}
+
 int registerCheckHandler(void) {
     drogon::app().registerHandler("/check",
-        [](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+        [latency = routeLatency("/check")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
+            const bool cbor = wantsCbor(req);
             auto ok = [&](bool exists, bool deleted, long long ts = 0) {
                 Json::Value j;
                 j["ok"]      = true;
                 j["exists"]  = exists;
                 j["deleted"] = deleted;
                 if (ts > 0) j["updatedAt"] = static_cast<Json::Int64>(ts);
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK);
-                cb(r);
+                cb(valueResponse(cbor, j));
             };
             auto err = [&](const char* code,const char* info="") {
                 Json::Value j;
@@ -40,20 +108,33 @@ int registerCheckHandler(void) {
                 j["error"] = code;
                 if (*info)
                     j["reason"] = info;
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK); // app-level errors
-                cb(r);
+                cb(valueResponse(cbor, j)); // app-level errors
             };
 
             // check whether token is valid
-            const std::string username = SessionManager::instance().usernameIfValid(req);  // empty if invalid/expired
-            if (username.empty()) return err("unauthorised");
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+            const std::string& username = who->username;
 
             // parse and validate json
-            auto bodyPtr = req->getJsonObject();      // Drogon parses for us
+            auto bodyPtr = requestBody(req);          // JSON, or CBOR if the client sent that
             if (!bodyPtr)    return err("invalid_request","parsing failed");
             const auto& body = *bodyPtr;
 
+            if (body.isMember("keys")) {
+                const Json::Value& keys = body["keys"];
+                if (!keys.isArray() || keys.empty())
+                    return err("invalid_request","no keys");
+                if (keys.size() > static_cast<Json::ArrayIndex>(Config::get().maxBatch()))
+                    return err("invalid_request","too many keys");
+                try {
+                    Json::Value j; j["ok"] = true; j["states"] = checkKeys(username, keys);
+                    return cb(valueResponse(cbor, j));
+                } catch (...) {
+                    return err("server_error");
+                }
+            }
+
             if (!body.isMember("table") || !body["table"].isString())
                 return err("invalid_request","bad tablename");
 
@@ -8,21 +8,114 @@
 #include "dhutils.h"
 #include "dh_login.h"
 #include "SessionManager.h"
+#include "WriteQueue.h"
 
 using drogon::HttpRequestPtr;
 using drogon::HttpResponsePtr;
 
 
+static Json::Value delOk(long long deletedAt) {
+    Json::Value j; j["ok"] = true; 
+    j["deletedAt"] = static_cast<Json::Int64>(deletedAt);
+    return j;
+}
+static Json::Value delErr(const char* code,const char* info="") {
+    Json::Value j;
+    j["ok"]    = false;
+    j["error"] = code;
+    if (*info)
+        j["reason"] = info;
+    return j;
+}
+
+// tombstone one row (or a book and everything in it) unless already gone.
+// Runs on the WriteQueue thread, so the lookup and the deletes are one atomic unit.
+static Json::Value applyDelete(Database& db, const std::string& username, const std::string& table,
+                               const std::string& fileId, bool hasId, const Json::Value& idValue) {
+    if (table == "books" || table == "book_data") {
+        // look up current state
+        auto st = db.select_userBooks_byUserAndFileId(username, fileId);
+        if (!st.exists && !st.deleted) 
+            return delErr("not_found");
+
+        if (st.deleted) 
+            return delOk(st.deletedAt); // already tombstoned
+
+        // one stamp for the book and everything in it, past the latest in each table
+        long long tnow = nowMs();
+        for (Database::Tbl t : { Database::Tbl::Books, Database::Tbl::Bookmarks, Database::Tbl::Highlights, Database::Tbl::Notes })
+            tnow = db.changeStamp(username, t, tnow);
+        db.softDeleteUserBook(username, fileId, tnow);
+
+        // also soft delete bookmarks and highlights for this fileId
+        db.softDeleteUserBookmarkAll(username,fileId,tnow);
+        db.softDeleteUserHighlightAll(username,fileId,tnow);
+        db.softDeleteUserNoteAll(username,fileId,tnow);
+        return delOk(tnow);
+    }
+
+    if (table == "bookmark") {
+        if (!hasId)
+            return delErr("invalid_request","no id");
+        long long itemId = 0; 
+        if (!parseItemId(idValue, itemId)) 
+            return delErr("invalid_request","bad id");
+
+        auto st = db.select_byUserFileAndItemId("user_bookmarks", username, fileId, itemId);
+        if (!st.exists && !st.deleted) 
+            return delErr("not_found");
+
+        if (st.deleted) return delOk(st.deletedAt);
+
+        const long long tnow = db.changeStamp(username, Database::Tbl::Bookmarks, nowMs());
+        db.softDeleteUserBookmark(username, fileId, itemId, tnow);
+        return delOk(tnow);
+    }
+
+    if (table == "highlight") {
+        if (!hasId)
+            return delErr("invalid_request","no id");
+        long long itemId = 0;
+        if (!parseItemId(idValue, itemId))
+            return delErr("invalid_request","bad id");
+
+        auto st = db.select_byUserFileAndItemId("user_highlights", username, fileId, itemId);
+        if (!st.exists && !st.deleted) 
+            return delErr("not_found");
+
+        if (st.deleted)
+            return delOk(st.deletedAt);
+
+        const long long tnow = db.changeStamp(username, Database::Tbl::Highlights, nowMs());
+        db.softDeleteUserHighlight(username, fileId, itemId, tnow);
+        return delOk(tnow);
+    }
+
+    if (table == "note") {
+        if (!hasId)
+            return delErr("invalid_request","no id");
+        long long itemId = 0;
+        if (!parseItemId(idValue, itemId))
+            return delErr("invalid_request","bad id");
+
+        auto st = db.select_byUserFileAndItemId("user_notes", username, fileId, itemId);
+        if (!st.exists && !st.deleted)
+            return delErr("not_found");
+
+        if (st.deleted) return delOk(st.deletedAt);
+
+        const long long tnow = db.changeStamp(username, Database::Tbl::Notes, nowMs());
+        db.softDeleteUserNote(username, fileId, itemId, tnow);
+        return delOk(tnow);
+    }
+
+    return delErr("invalid_request", "unknown table");
+}
+
 int registerDeleteHandler(void) {
     drogon::app().registerHandler("/delete",
-        [](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
-            auto ok = [&](long long deletedAt) {
-                Json::Value j; j["ok"] = true; 
-                j["deletedAt"] = static_cast<Json::Int64>(deletedAt);
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK);
-                cb(r);
-            };            
+        [latency = routeLatency("/delete")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
             auto err = [&](const char* code,const char* info="") {
                 Json::Value j;
                 j["ok"]    = false;
@@ -35,8 +128,9 @@ int registerDeleteHandler(void) {
             };
 
             // check whether token is valid
-            const std::string username = SessionManager::instance().usernameIfValid(req);  // empty if invalid/expired
-            if (username.empty()) return err("unauthorised");
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+            const std::string& username = who->username;
 
             // parse and validate json
             auto bodyPtr = req->getJsonObject();      // Drogon parses for us
@@ -54,88 +148,18 @@ int registerDeleteHandler(void) {
 
             const std::string table  = body["table"].asString();
             const std::string fileId = body["fileId"].asString();
-
-            try {
-                Database& db = Database::get();
-
-                if (table == "books" || table == "book_data") {
-                    // look up current state
-                    auto st = db.select_userBooks_byUserAndFileId(username, fileId);
-                    if (!st.exists && !st.deleted) 
-                        return err("not_found");
-
-                    if (st.deleted) 
-                        return ok(st.deletedAt); // already tombstoned
-
-                    const long long tnow = nowMs();
-                    db.softDeleteUserBook(username, fileId, tnow);
-
-                    // also soft delete bookmarks and highlights for this fileId
-                    db.softDeleteUserBookmarkAll(username,fileId,tnow);
-                    db.softDeleteUserHighlightAll(username,fileId,tnow);
-                    db.softDeleteUserNoteAll(username,fileId,tnow);
-                    return ok(tnow);
-                }
-
-                if (table == "bookmark") {
-                    if (!hasId)
-                        return err("invalid_request","no id");
-                    long long itemId = 0; 
-                    if (!parseItemId(body["id"], itemId)) 
-                        return err("invalid_request","bad id");
-
-                    auto st = db.select_byUserFileAndItemId("user_bookmarks", username, fileId, itemId);
-                    if (!st.exists && !st.deleted) 
-                        return err("not_found");
-
-                    if (st.deleted) return ok(st.deletedAt);
-
-                    const long long tnow = nowMs();
-                    db.softDeleteUserBookmark(username, fileId, itemId, tnow);
-                    return ok(tnow);
-                }
-
-                if (table == "highlight") {
-                    if (!hasId)
-                        return err("invalid_request","no id");
-                    long long itemId = 0;
-                    if (!parseItemId(body["id"], itemId))
-                        return err("invalid_request","bad id");
-
-                    auto st = db.select_byUserFileAndItemId("user_highlights", username, fileId, itemId);
-                    if (!st.exists && !st.deleted) 
-                        return err("not_found");
-
-                    if (st.deleted)
-                        return ok(st.deletedAt);
-
-                    const long long tnow = nowMs();
-                    db.softDeleteUserHighlight(username, fileId, itemId, tnow);
-                    return ok(tnow);
-                }
-
-                if (table == "note") {
-                    if (!hasId)
-                        return err("invalid_request","no id");
-                    long long itemId = 0;
-                    if (!parseItemId(body["id"], itemId))
-                        return err("invalid_request","bad id");
-
-                    auto st = db.select_byUserFileAndItemId("user_notes", username, fileId, itemId);
-                    if (!st.exists && !st.deleted)
-                        return err("not_found");
-
-                    if (st.deleted) return ok(st.deletedAt);
-
-                    const long long tnow = nowMs();
-                    db.softDeleteUserNote(username, fileId, itemId, tnow);
-                    return ok(tnow);
-                }
-
-                return err("invalid_request", "unknown table");
-            } catch (...) {
-                return err("server_error");
-            }        
+            const Json::Value idValue = hasId ? body["id"] : Json::Value();
+
+            auto result = std::make_shared<Json::Value>();
+            WriteQueue::get().submitFor(username,
+                [username, table, fileId, hasId, idValue, result] {
+                    *result = applyDelete(Database::get(), username, table, fileId, hasId, idValue);
+                },
+                [cb = std::move(cb), result](bool committed) {
+                    auto r = drogon::HttpResponse::newHttpJsonResponse(committed ? *result : delErr("server_error"));
+                    r->setStatusCode(drogon::k200OK); // app-level errors
+                    cb(r);
+                });
         },
         {drogon::Post}  // limit to POST
     );
@@ -3,6 +3,7 @@
 //*******************************************
 #include <drogon/drogon.h>
 
+#include "Config.h"
 #include "Database.h"
 #include "utils.h"
 #include "dhutils.h"
@@ -14,34 +15,86 @@ using drogon::HttpResponsePtr;
 
 int registerGetHandler(void) {
     drogon::app().registerHandler("/get",
-        [](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
-            auto ok_rows = [&](const Json::Value& rows) {
-                Json::Value j; j["ok"] = true; j["rows"] = rows;  // [0..n]
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK);
-                cb(r);
-            };
+        [latency = routeLatency("/get")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
+            const bool cbor = wantsCbor(req);
             auto err = [&](const char* code,const char* info="") {
                 Json::Value j;
                 j["ok"]    = false;
                 j["error"] = code;
                 if (*info)
                     j["reason"] = info;
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK); // app-level errors
-                cb(r);
+                cb(valueResponse(cbor, j)); // app-level errors
             };
 
             // check whether token is valid
-            const std::string username = SessionManager::instance().usernameIfValid(req);
-            if (username.empty()) return err("unauthorised");
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+            const std::string& username = who->username;
 
             // parse and validate json
-            auto bodyPtr = req->getJsonObject();      // Drogon parses for us
+            auto bodyPtr = requestBody(req);          // JSON, or CBOR if the client sent that
             if (!bodyPtr)
                 return err("invalid_request","parsing failed");
             const auto& body = *bodyPtr;
 
+            // batched: {"keys":[{"table":..., "fileId":..., "id":... (optional)}, ...]}
+            //   -> {"ok":true, "tables":{"<table>":[rows, each with its "fileId"], ...}}
+            //   one query per table requested, however many keys it has
+            if (body.isMember("keys")) {
+                const Json::Value& keys = body["keys"];
+                if (!keys.isArray() || keys.empty())
+                    return err("invalid_request","no keys");
+                if (keys.size() > static_cast<Json::ArrayIndex>(Config::get().maxBatch()))
+                    return err("invalid_request","too many keys");
+
+                std::vector<Database::ItemKey> books, bookmarks, highlights, notes;
+                for (const auto& k : keys) {
+                    if (!k.isObject() || !k.isMember("table") || !k["table"].isString())
+                        return err("invalid_request","no table");
+                    if (!k.isMember("fileId") || !k["fileId"].isString())
+                        return err("invalid_request", "no fileId");
+                    if (k.isMember("id") && !k["id"].isInt())
+                        return err("invalid_request", "invalid id");
+
+                    const std::string table = k["table"].asString();
+                    Database::ItemKey key;
+                    key.fileId = k["fileId"].asString();
+                    key.id     = k.isMember("id") ? k["id"].asInt() : -1;    // -1: all rows for fileId
+
+                    if (table == "books" || table == "book_data") books.push_back(std::move(key));
+                    else if (table == "bookmark")                 bookmarks.push_back(std::move(key));
+                    else if (table == "highlight")                highlights.push_back(std::move(key));
+                    else if (table == "note")                     notes.push_back(std::move(key));
+                    else return err("invalid_request","unknown table");
+                }
+
+                try {
+                    Database& db = Database::get().forUser(username);   // the shard with their rows
+                    auto writer = makeRowWriter(cbor, keys.size() * 192 + 256);
+                    RowWriter& out = *writer;
+                    out.beginObject().key("ok").value(true).key("tables").beginObject();
+                    Database::ReadSnapshot snap(db);    // all tables from one view
+
+                    auto table = [&](const char* name, const std::vector<Database::ItemKey>& k,
+                                     void (Database::*list)(const std::string&, const std::vector<Database::ItemKey>&, RowWriter&)) {
+                        if (k.empty()) return;
+                        out.key(name).beginArray();
+                        (db.*list)(username, k, out);
+                        out.endArray();
+                    };
+                    table("books",     books,      &Database::listUserBooksByKeys);
+                    table("bookmark",  bookmarks,  &Database::listUserBookmarksByKeys);
+                    table("highlight", highlights, &Database::listUserHighlightsByKeys);
+                    table("note",      notes,      &Database::listUserNotesByKeys);
+
+                    out.endObject().endObject();
+                    return cb(rowResponse(out));
+                } catch (...) {
+                    return err("server_error");
+                }
+            }
+
             if (!body.isMember("table") || !body["table"].isString())
                 return err("invalid_request","no table");
             if (!body.isMember("fileId") || !body["fileId"].isString())
@@ -57,21 +110,24 @@ int registerGetHandler(void) {
 
             try {
                 Database& db = Database::get();
-                Json::Value rows(Json::arrayValue);
+                auto writer = makeRowWriter(cbor, 4096);
+                RowWriter& out = *writer;
+                out.beginObject().key("ok").value(true).key("rows").beginArray();  // [0..n]
 
                 if (table == "books" || table == "book_data") {
-                    db.listUserBook(username, fileId, rows);              // [0..1]
+                    db.listUserBook(username, fileId, out);              // [0..1]
                 } else if (table == "bookmark") {
-                    db.listUserBookmarks(username, fileId, id, rows);         // [0..n]
+                    db.listUserBookmarks(username, fileId, id, out);         // [0..n]
                 } else if (table == "highlight") {
-                    db.listUserHighlights(username, fileId, id, rows);        // [0..n]
+                    db.listUserHighlights(username, fileId, id, out);        // [0..n]
                 } else if (table == "note") {
-                    db.listUserNotes(username, fileId, id, rows);        // [0..n]
+                    db.listUserNotes(username, fileId, id, out);        // [0..n]
                 } else {
                     return err("invalid_request","unknown table");
                 }
 
-                return ok_rows(rows);
+                out.endArray().endObject();
+                return cb(rowResponse(out));
             } catch (...) {
                 return err("server_error");
             }        },
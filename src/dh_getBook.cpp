@@ -1,9 +1,13 @@
 //**************************************************
 // drogon handler for "GET /book/{fileId}" requests 
 //**************************************************
+#include <algorithm>
+#include <sys/stat.h>
 #include <drogon/drogon.h>
 
 #include "Database.h"
+#include "BookStorage.h"
+#include "Scrubber.h"
 #include "utils.h"
 #include "dhutils.h"
 #include "dh_login.h"
@@ -12,11 +16,148 @@
 using drogon::HttpRequestPtr;
 using drogon::HttpResponsePtr;
 
+// If-None-Match: "*" or a comma separated list of (possibly weak) entity tags
+static bool etagMatches(const std::string& header, const std::string& etag) {
+    if (header.empty()) return false;
+    size_t pos = 0;
+    while (pos < header.size()) {
+        size_t comma = header.find(',', pos);
+        if (comma == std::string::npos) comma = header.size();
+        size_t b = header.find_first_not_of(" \t", pos);
+        size_t e = header.find_last_not_of(" \t", comma - 1);
+        if (b != std::string::npos && b < comma && e != std::string::npos && e >= b) {
+            std::string tag = header.substr(b, e - b + 1);
+            if (tag == "*") return true;
+            if (tag.rfind("W/", 0) == 0) tag.erase(0, 2);   // weak comparison is fine for GET
+            if (tag == etag) return true;
+        }
+        pos = comma + 1;
+    }
+    return false;
+}
+
+enum class RangeResult { Whole, Partial, Unsatisfiable };
+
+// single "bytes=first-last" / "bytes=first-" / "bytes=-suffix" range.
+// Anything we don't understand (other units, multiple ranges) gets the whole file.
+static RangeResult parseRange(const std::string& h, long long size, long long& first, long long& last) {
+    if (h.rfind("bytes=", 0) != 0) return RangeResult::Whole;
+    const std::string spec = h.substr(6);
+    if (spec.find(',') != std::string::npos) return RangeResult::Whole;
+    const size_t dash = spec.find('-');
+    if (dash == std::string::npos) return RangeResult::Whole;
+
+    const std::string a = spec.substr(0, dash), b = spec.substr(dash + 1);
+    auto digits = [](const std::string& s) {
+        return !s.empty() && s.size() <= 18 && std::all_of(s.begin(), s.end(), ::isdigit);
+    };
+    if (a.empty()) {
+        if (!digits(b)) return RangeResult::Whole;
+        const long long n = std::stoll(b);
+        if (n == 0 || size == 0) return RangeResult::Unsatisfiable;
+        first = (n >= size) ? 0 : size - n;
+        last  = size - 1;
+    } else {
+        if (!digits(a) || (!b.empty() && !digits(b))) return RangeResult::Whole;
+        first = std::stoll(a);
+        last  = b.empty() ? size - 1 : std::min(std::stoll(b), size - 1);
+        if (first >= size) return RangeResult::Unsatisfiable;
+        if (last < first)  return RangeResult::Whole;
+    }
+    return (first == 0 && last == size - 1) ? RangeResult::Whole : RangeResult::Partial;
+}
+
+// the book is a local file (in the library, or the cache of an object store): stream it
+static void sendBookFile(const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)>& cb,
+                         const std::string& fileId, const std::string& path, long long size, const std::string& etag,
+                         const std::string& sha256, const std::string& clientFileName) {
+    auto jsonErr = [&](drogon::HttpStatusCode sc, const char* errMsg) {
+        Json::Value j;
+        j["ok"] = false;
+        j["error"] = errMsg;
+        auto r = drogon::HttpResponse::newHttpJsonResponse(j);
+        r->setStatusCode(sc);
+        cb(r);
+    };
+
+    // --- basic file checks before streaming: what the scrubber found, else one stat ---
+    long long actualSize = size;
+    switch (Scrubber::get().state(fileId)) {
+        case Scrubber::State::Ok:
+        case Scrubber::State::Present:
+            break;
+        case Scrubber::State::Missing:
+            return jsonErr(drogon::k404NotFound, "file not found");
+        case Scrubber::State::WrongSize:
+            return jsonErr(drogon::k500InternalServerError, "size mismatch");
+        case Scrubber::State::Corrupt:
+            return jsonErr(drogon::k500InternalServerError, "checksum mismatch");
+        default: {
+            struct stat sb;
+            if (::stat(path.c_str(), &sb) != 0 || !S_ISREG(sb.st_mode))
+                return jsonErr(drogon::k404NotFound, "file not found");
+            actualSize = static_cast<long long>(sb.st_size);
+            if ( (size >= 0) && (actualSize != size) ) {
+                // size mismatch: treat as server error (index corrupt)
+                return jsonErr(drogon::k500InternalServerError, "size mismatch");
+            }
+        }
+    }
+
+    // --- Range: honoured unless If-Range names a different version ---
+    long long first = 0, last = actualSize - 1;
+    bool partial = false;
+    const std::string& range = req->getHeader("range");
+    const std::string& ifRange = req->getHeader("if-range");
+    if (!range.empty() && (ifRange.empty() || ifRange == etag)) {
+        switch (parseRange(range, actualSize, first, last)) {
+            case RangeResult::Whole:
+                break;
+            case RangeResult::Partial:
+                partial = true;
+                break;
+            case RangeResult::Unsatisfiable: {
+                auto r = drogon::HttpResponse::newHttpResponse();
+                r->setStatusCode(drogon::k416RequestedRangeNotSatisfiable);
+                r->addHeader("Content-Range", "bytes */" + std::to_string(actualSize));
+                return cb(r);
+            }
+        }
+    }
+
+    // --- stream the file: Drogon sends file bodies with sendfile(2) ---
+    auto resp = partial
+        ? drogon::HttpResponse::newFileResponse(
+              path,
+              static_cast<size_t>(first),
+              static_cast<size_t>(last - first + 1),
+              false,                // we set Content-Range ourselves
+              clientFileName,
+              drogon::CT_APPLICATION_OCTET_STREAM)
+        : drogon::HttpResponse::newFileResponse(
+              path,
+              clientFileName,
+              drogon::CT_APPLICATION_OCTET_STREAM);
+    if (partial) {
+        resp->setStatusCode(drogon::k206PartialContent);
+        resp->addHeader("Content-Range", "bytes " + std::to_string(first) + "-" +
+                        std::to_string(last) + "/" + std::to_string(actualSize));
+    } else {
+        resp->setStatusCode(drogon::k200OK);
+    }
+    resp->addHeader("Accept-Ranges", "bytes");
+    resp->addHeader("ETag", etag);
+    resp->addHeader("X-Checksum-SHA256", sha256);
+    resp->addHeader("X-Filename", clientFileName);
+    cb(resp);
+}
+
 int registerGetBookHandler(void) {
     drogon::app().registerHandler("/book/{1}",
-        [](const HttpRequestPtr& req, 
+        [latency = routeLatency("/book/{1}")](const HttpRequestPtr& req, 
            std::function<void (const HttpResponsePtr &)> &&cb,
            const std::string& fileId) {
+            timeResponse(latency, cb);
 
             auto jsonErr = [&](drogon::HttpStatusCode sc, const char* errMsg) {
                 Json::Value j;
@@ -27,8 +168,8 @@ int registerGetBookHandler(void) {
                 cb(r);
             };
             // check whether token is valid
-            const std::string username = SessionManager::instance().usernameIfValid(req);  // empty if invalid/expired
-            if (username.empty()) 
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) 
                 return jsonErr(drogon::k401Unauthorized, "unauthorised");
 
             // --- lookup book metadata ---
@@ -43,30 +184,37 @@ int registerGetBookHandler(void) {
                 return jsonErr(drogon::k500InternalServerError, "server_error");
             }
 
-            // --- basic file checks before streaming ---
-            namespace fs = std::filesystem;
-            std::error_code ec;
-            if (!fs::exists(path, ec) || ec) {
-                return jsonErr(drogon::k404NotFound, "file not found");
+            // --- conditional GET: the stored sha256 is a strong validator ---
+            const std::string etag = "\"" + sha256 + "\"";
+            if (!sha256.empty() && etagMatches(req->getHeader("if-none-match"), etag)) {
+                auto r = drogon::HttpResponse::newHttpResponse();
+                r->setStatusCode(drogon::k304NotModified);
+                r->addHeader("ETag", etag);
+                return cb(r);
             }
-            auto actualSize = fs::file_size(path, ec);
-            if (ec)
-                return jsonErr(drogon::k500InternalServerError, ec.message().c_str());
-            if ( (size >= 0) && (static_cast<long long>(actualSize) != size) ) {
-                // size mismatch: treat as server error (index corrupt)
-                return jsonErr(drogon::k500InternalServerError, "size mismatch");
-            }        
-
-            // --- stream the file ---
-            auto resp = drogon::HttpResponse::newFileResponse(
-                path,
-                clientFileName,
-                drogon::CT_APPLICATION_OCTET_STREAM
-            );
-            resp->setStatusCode(drogon::k200OK);
-            resp->addHeader("X-Checksum-SHA256", sha256);
-            resp->addHeader("X-Filename", clientFileName);
-            cb(resp);
+
+            // --- where it is: local, in the cache, or fetched (maybe on a storage thread) ---
+            BookStorage::get().fetch(path, size, clientFileName,
+                [req, cb = std::move(cb), fileId, size, etag, sha256, clientFileName](BookStorage::Source src) mutable {
+                    if (!src.url.empty()) {
+                        // straight from the object store: it answers Range requests itself
+                        auto r = drogon::HttpResponse::newRedirectionResponse(src.url, drogon::k302Found);
+                        r->addHeader("ETag", etag);
+                        r->addHeader("X-Checksum-SHA256", sha256);
+                        r->addHeader("X-Filename", clientFileName);
+                        return cb(r);
+                    }
+                    if (src.path.empty()) {
+                        Json::Value j;
+                        j["ok"] = false;
+                        j["error"] = "server_error";
+                        j["reason"] = src.error;
+                        auto r = drogon::HttpResponse::newHttpJsonResponse(j);
+                        r->setStatusCode(drogon::k503ServiceUnavailable);
+                        return cb(r);
+                    }
+                    sendBookFile(req, cb, fileId, src.path, size, etag, sha256, clientFileName);
+                });
         },
         {drogon::Get}  // limit to GET
     );
@@ -3,78 +3,94 @@
 //*******************************************
 #include <drogon/drogon.h>
 
+#include "Config.h"
 #include "Database.h"
 #include "utils.h"
 #include "dhutils.h"
 #include "dh_login.h"
 #include "SessionManager.h"
+#include "Compactor.h"
 
 using drogon::HttpRequestPtr;
 using drogon::HttpResponsePtr;
 
 int registerGetSinceHandler(void) {
     drogon::app().registerHandler("/getSince",
-        [](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
-            auto ok_rows = [&](const Json::Value& rows, long long nextSince) {
-                Json::Value j; j["ok"] = true; j["rows"] = rows;
-                j["nextSince"] = static_cast<Json::Int64>(nextSince);
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK);
-                cb(r);
-            };
+        [latency = routeLatency("/getSince")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
+            const bool cbor = wantsCbor(req);
             auto err = [&](const char* code,const char* info="") {
                 Json::Value j;
                 j["ok"]    = false;
                 j["error"] = code;
                 if (*info)
                     j["reason"] = info;
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK); // app-level errors
-                cb(r);
+                cb(valueResponse(cbor, j)); // app-level errors
             };
 
             // check whether token is valid
-            const std::string username = SessionManager::instance().usernameIfValid(req);  // empty if invalid/expired
-            if (username.empty()) return err("unauthorised");
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+            const std::string& username = who->username;
 
             // parse and validate json
-            auto bodyPtr = req->getJsonObject();      // Drogon parses for us
+            auto bodyPtr = requestBody(req);          // JSON, or CBOR if the client sent that
             if (!bodyPtr)    return err("invalid_request","parsing failed");
             const auto& body = *bodyPtr;
 
             if (!body.isMember("table") || !body["table"].isString())
                 return err("invalid_request", "no tablename");
-            if (!body.isMember("since") || !body["since"].isInt64())
-                return err("invalid_request","no \"since\" value");
+            // where to start: a keyset "cursor" from a previous page, or (legacy) a "since" timestamp
+            Database::Cursor after;
+            if (body.isMember("cursor")) {
+                if (!parseCursor(body["cursor"], after))
+                    return err("invalid_request","invalid cursor");
+            } else {
+                if (!body.isMember("since") || !body["since"].isInt64())
+                    return err("invalid_request","no \"since\" value");
+                after.ts = body["since"].asInt64();     // all rows with changed_at >= since
+            }
 
-            long long since = body["since"].asInt64();
             int limit = 100; // sane default
             if (body.isMember("limit")) {
                 if (!body["limit"].isInt()) 
                     return err("invalid_request","invalid limit");
-                limit = std::max(1, std::min(1000, body["limit"].asInt())); // floor..ceiling [1..1000]
+                limit = std::max(1, std::min(Config::get().pageLimit(), body["limit"].asInt())); // floor..ceiling [1..pagelimit]
             }
 
             const std::string table = body["table"].asString();
+            decltype(&Database::listUserBooksSince) list = nullptr;
+            Database::Tbl tbl;
+            if (table == "books" || table == "book_data") { list = &Database::listUserBooksSince;      tbl = Database::Tbl::Books; }
+            else if (table == "bookmark")                 { list = &Database::listUserBookmarksSince;  tbl = Database::Tbl::Bookmarks; }
+            else if (table == "highlight")                { list = &Database::listUserHighlightsSince; tbl = Database::Tbl::Highlights; }
+            else if (table == "note")                     { list = &Database::listUserNotesSince;      tbl = Database::Tbl::Notes; }
+            else return err("invalid_request","unknown tablename");
+
+            // asking from here means everything before it arrived: tombstones up to it may go
+            Compactor& compactor = Compactor::get();
+            compactor.ack(username, who->device, tbl, after.ts);
 
             try {
                 Database& db = Database::get();
-                Json::Value rows(Json::arrayValue);
-                long long nextSinceOut = since;
+                Database::Cursor next;
+                long long nextSinceOut = after.ts;
 
-                if (table == "books" || table == "book_data") {
-                    db.listUserBooksSince(username, since, limit, rows, nextSinceOut);
-                } else if (table == "bookmark") {
-                    db.listUserBookmarksSince(username, since, limit, rows, nextSinceOut);
-                } else if (table == "highlight") {
-                    db.listUserHighlightsSince(username, since, limit, rows, nextSinceOut);
-                } else if (table == "note") {
-                    db.listUserNotesSince(username, since, limit, rows, nextSinceOut);
-                } else {
-                    return err("invalid_request","unknown tablename");
-                }
+                // rows go from sqlite straight into the body; sized for a typical page
+                auto writer = makeRowWriter(cbor, static_cast<size_t>(limit) * 192 + 256);
+                RowWriter& out = *writer;
+                out.beginObject().key("ok").value(true).key("rows").beginArray();
+                const bool more = (db.*list)(username, after, limit, out, next, nextSinceOut);
+                out.endArray();
 
-                return ok_rows(rows, nextSinceOut);
+                out.key("nextSince").value(nextSinceOut);   // legacy: for clients that only send "since"
+                out.key("cursor");                          // send back as "cursor" to get the next page
+                writeCursor(out, next);
+                out.key("more").value(more);
+                if (compactor.needsResync(username, tbl, after.ts))
+                    out.key("resync").value(true);          // tombstones it never saw are gone: start again from 0
+                out.endObject();
+                return cb(rowResponse(out));
             } catch (...) {
                 return err("server_error");
             }        
@@ -4,7 +4,6 @@
 #include <unordered_map>
 #include <mutex>
 #include <sstream>
-#include <syslog.h>
 
 #include <drogon/drogon.h>
 #include <jsoncpp/json/value.h>
@@ -12,8 +11,11 @@
 
 #include "Config.h"
 #include "Database.h"
+#include "Log.h"
 #include "utils.h"
+#include "dhutils.h"
 #include "SessionManager.h"
+#include "WorkerPool.h"
 
 using drogon::HttpRequestPtr;
 using drogon::HttpResponsePtr;
@@ -21,26 +23,27 @@ using drogon::HttpStatusCode;
 
 // check username/password
 static bool verifyPassword(const std::string& username, const std::string& password) {
-    const char* sql = "SELECT pwd_hash FROM users WHERE username=?;";
-    sqlite3_stmt* st = nullptr;
-    sqlite3* db = Database::get().handle();
-
-    if (sqlite3_prepare_v2(db, sql, -1, &st, nullptr) != SQLITE_OK) return false;
-
-    sqlite3_bind_text(st, 1, username.c_str(), -1, SQLITE_TRANSIENT);
     std::string stored;
-    int rc = sqlite3_step(st);
-    if (rc == SQLITE_ROW) {
-        const unsigned char* p = sqlite3_column_text(st, 0);
-        if (p) stored.assign(reinterpret_cast<const char*>(p));
+    try {
+        stored = Database::get().selectPasswordHash(username);
+    } catch (...) {
+        return false;
     }
-    sqlite3_finalize(st);
 
     if (stored.empty()) return false; // user not found
 
     return crypto_pwhash_str_verify(stored.c_str(), password.c_str(), password.size()) == 0;
 }
 
+// argon2 verification runs here, never on an IO loop.
+//   loginthreads: verifications at once (each one holds add_user's memlimit of RAM)
+//   loginqueue:   logins allowed to wait; past that we answer 503 "busy" straight away
+static WorkerPool& loginPool() {
+    static WorkerPool pool("login", static_cast<size_t>(Config::get().loginThreads()),
+                           static_cast<size_t>(Config::get().loginQueue()));
+    return pool;
+}
+
 static void jsonError(const HttpRequestPtr&,
                       std::function<void (const HttpResponsePtr &)> &&cb,
                       HttpStatusCode code,
@@ -57,8 +60,9 @@ int registerLoginHandler(void) {
 
     drogon::app().registerHandler(
         "/login",
-        [](const HttpRequestPtr &req,
+        [latency = routeLatency("/login")](const HttpRequestPtr &req,
                             std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
 
             if (req->method() != drogon::Post) {
                 return jsonError(req, std::move(cb), drogon::k405MethodNotAllowed, "method_not_allowed");
@@ -81,7 +85,7 @@ int registerLoginHandler(void) {
             // check that we support this client's version#
             const auto compat = Config::get().compat();
             if (version != compat) {
-                syslog(SYSLOG_ERR, "invalid version [%s]: login rejected for user [%s] on device [%s], not the supported version [%s]",
+                logMsg(SYSLOG_ERR, "invalid version [%s]: login rejected for user [%s] on device [%s], not the supported version [%s]",
                         version.c_str(), username.c_str(), device.c_str(), compat.c_str());
 
                 Json::Value j;
@@ -93,26 +97,45 @@ int registerLoginHandler(void) {
                 return cb(resp);
             }
 
-            // Auth check (stub)
-            if (!verifyPassword(username, password)) {
-                syslog(SYSLOG_ERR, "invalid username/password for user [%s] on device [%s]", username.c_str(),device.c_str());
-                return jsonError(req, std::move(cb), drogon::k401Unauthorized, "invalid_credentials");
-            }
+            // Auth check: off the IO loop, the callback resumes on the pool thread.
+            // cb is shared so that we can still answer if the pool refuses the task.
+            auto cbp = std::make_shared<std::function<void (const HttpResponsePtr &)>>(std::move(cb));
+            const bool queued = loginPool().trySubmit([req, cbp, username, password, device] {
+                if (!verifyPassword(username, password)) {
+                    logMsg(SYSLOG_ERR, "invalid username/password for user [%s] on device [%s]", username.c_str(),device.c_str());
+                    return jsonError(req, std::move(*cbp), drogon::k401Unauthorized, "invalid_credentials");
+                }
 
-            syslog(SYSLOG_INFO, "user [%s] logged in on device [%s]", username.c_str(), device.c_str());
+                logMsg(SYSLOG_INFO, "user [%s] logged in on device [%s]", username.c_str(), device.c_str());
 
-            // Issue session token
-            const auto session = SessionManager::instance().add(username,device);
+                // Issue session token
+                Json::Value j;
+                try {
+                    const auto session = SessionManager::instance().add(username,device);
+                    j["ok"] = true;
+                    j["token"] = session.token;
+                    j["expiresAt"] = static_cast<Json::Int64>(
+                        std::chrono::duration_cast<std::chrono::milliseconds>(session.expiry.time_since_epoch()).count()
+                    );
+                } catch (const std::exception& ex) {
+                    logMsg(SYSLOG_ERR, "no session for user [%s] on device [%s]: %s", username.c_str(), device.c_str(), ex.what());
+                    return jsonError(req, std::move(*cbp), drogon::k503ServiceUnavailable, "server_error");
+                }
+                auto resp = drogon::HttpResponse::newHttpJsonResponse(j);
+                resp->setStatusCode(drogon::k200OK);
+                (*cbp)(resp);
+            });
 
-            Json::Value j;
-            j["ok"] = true;
-            j["token"] = session.token;
-            j["expiresAt"] = static_cast<Json::Int64>(
-                std::chrono::duration_cast<std::chrono::milliseconds>(session.expiry.time_since_epoch()).count()
-            );
-            auto resp = drogon::HttpResponse::newHttpJsonResponse(j);
-            resp->setStatusCode(drogon::k200OK);
-            cb(resp);
+            if (!queued) {
+                logMsg(SYSLOG_ERR, "login queue full: shedding login for user [%s] on device [%s]", username.c_str(), device.c_str());
+                Json::Value j;
+                j["ok"] = false;
+                j["error"] = "busy";
+                auto resp = drogon::HttpResponse::newHttpJsonResponse(j);
+                resp->setStatusCode(drogon::k503ServiceUnavailable);
+                resp->addHeader("Retry-After", "1");
+                (*cbp)(resp);
+            }
         },
         {drogon::Post} // limit to POST
     );
@@ -0,0 +1,36 @@
+//*******************************************
+// drogon handler for "GET /metrics" requests
+//
+// Prometheus text format. Only answered to a scraper on this host: the reverse
+// proxy connects from loopback too, so anything it forwards (it adds
+// X-Forwarded-For) is refused like the admin endpoints are.
+//*******************************************
+#include <drogon/drogon.h>
+
+#include "Metrics.h"
+#include "dhutils.h"
+#include "dh_metrics.h"
+
+using drogon::HttpRequestPtr;
+using drogon::HttpResponsePtr;
+
+int registerMetricsHandler(void) {
+    drogon::app().registerHandler("/metrics",
+        [](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            if (!fromLocalAdmin(req)) {
+                auto r = drogon::HttpResponse::newHttpResponse();
+                r->setStatusCode(drogon::k403Forbidden);
+                return cb(r);
+            }
+
+            auto r = drogon::HttpResponse::newHttpResponse();
+            r->setStatusCode(drogon::k200OK);
+            r->setContentTypeCodeAndCustomString(drogon::CT_TEXT_PLAIN, "text/plain; version=0.0.4; charset=utf-8");
+            r->setBody(Metrics::get().scrape());
+            cb(r);
+        },
+        {drogon::Get}   // limit to GET
+    );
+
+    return 0;
+}
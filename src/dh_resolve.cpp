@@ -14,7 +14,8 @@ using drogon::HttpResponsePtr;
 
 int registerResolveHandler(void) {
     drogon::app().registerHandler("/resolve",
-        [](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+        [latency = routeLatency("/resolve")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
             auto ok = [&](bool exists, const std::string& fileId = "") {
                 Json::Value j;
                 j["ok"]     = true;
@@ -36,8 +37,8 @@ int registerResolveHandler(void) {
             };
 
             // check whether token is valid
-            const std::string username = SessionManager::instance().usernameIfValid(req);  // empty if invalid/expired
-            if (username.empty()) return err("unauthorised");
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
 
             // parse and validate json
             auto bodyPtr = req->getJsonObject();      // Drogon parses for us
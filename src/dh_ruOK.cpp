@@ -15,10 +15,11 @@ using drogon::HttpResponsePtr;
 
 int registerRUOKHandler(void) {
     drogon::app().registerHandler("/ruOK/{1}",
-        [](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb,const std::string& token) {
+        [latency = routeLatency("/ruOK/{1}")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb,const std::string& token) {
+            timeResponse(latency, cb);
             Json::Value j;
 
-            if (SessionManager::instance().usernameIfValid(token).empty()) {
+            if (!SessionManager::instance().isValid(token)) {
                 j["ok"] = false;
                 auto r = drogon::HttpResponse::newHttpJsonResponse(j);
                 r->setStatusCode(drogon::k401Unauthorized);
@@ -0,0 +1,142 @@
+//*******************************************
+// drogon handler for "POST /sync" requests
+//
+// One round trip for a whole sync cycle: the /getSince scan for every table,
+// all read from the same snapshot of the db.
+//
+// request:  {"cursors": {"books":{...}, "bookmark":{...}, "highlight":{...}, "note":{...}},
+//            "since": ts,      (optional: start for any table missing from "cursors")
+//            "limit": n}       (optional: per table, [1..pagelimit], default 100)
+// response: {"ok":true, "more":bool,
+//            "tables": {"books": {"rows":[...], "cursor":{...}, "more":bool, "resync":true?}, ...}}
+//           "resync" (only ever true): tombstones this cursor never saw have been purged,
+//           so the table has to be synced again from the beginning
+//*******************************************
+#include <drogon/drogon.h>
+#include <iterator>
+
+#include "Config.h"
+#include "Database.h"
+#include "utils.h"
+#include "dhutils.h"
+#include "dh_login.h"
+#include "SessionManager.h"
+#include "Compactor.h"
+
+using drogon::HttpRequestPtr;
+using drogon::HttpResponsePtr;
+
+namespace {
+    using SinceFn = bool (Database::*)(const std::string&, const Database::Cursor&, int,
+                                       RowWriter&, Database::Cursor&, long long&);
+
+    struct SyncTable {
+        const char*   name;     // same names as /getSince
+        SinceFn       list;
+        Database::Tbl tbl;
+    };
+
+    const SyncTable kSyncTables[] = {
+        { "books",     &Database::listUserBooksSince,      Database::Tbl::Books      },
+        { "bookmark",  &Database::listUserBookmarksSince,  Database::Tbl::Bookmarks  },
+        { "highlight", &Database::listUserHighlightsSince, Database::Tbl::Highlights },
+        { "note",      &Database::listUserNotesSince,      Database::Tbl::Notes      },
+    };
+}
+
+int registerSyncHandler(void) {
+    drogon::app().registerHandler("/sync",
+        [latency = routeLatency("/sync")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
+            const bool cbor = wantsCbor(req);
+            auto err = [&](const char* code,const char* info="") {
+                Json::Value j;
+                j["ok"]    = false;
+                j["error"] = code;
+                if (*info)
+                    j["reason"] = info;
+                cb(valueResponse(cbor, j)); // app-level errors
+            };
+
+            // check whether token is valid
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+            const std::string& username = who->username;
+
+            // parse and validate json
+            auto bodyPtr = requestBody(req);          // JSON, or CBOR if the client sent that
+            if (!bodyPtr)    return err("invalid_request","parsing failed");
+            const auto& body = *bodyPtr;
+
+            long long since = 0;    // everything, for tables without a cursor
+            if (body.isMember("since")) {
+                if (!body["since"].isInt64())
+                    return err("invalid_request","invalid \"since\" value");
+                since = body["since"].asInt64();
+            }
+
+            const Json::Value* cursors = nullptr;
+            if (body.isMember("cursors")) {
+                if (!body["cursors"].isObject())
+                    return err("invalid_request","invalid cursors");
+                cursors = &body["cursors"];
+            }
+
+            int limit = 100; // sane default
+            if (body.isMember("limit")) {
+                if (!body["limit"].isInt())
+                    return err("invalid_request","invalid limit");
+                limit = std::max(1, std::min(Config::get().pageLimit(), body["limit"].asInt())); // floor..ceiling [1..pagelimit]
+            }
+
+            // where each table starts
+            Database::Cursor after[std::size(kSyncTables)];
+            for (size_t i = 0; i < std::size(kSyncTables); ++i) {
+                after[i].ts = since;
+                if (cursors && cursors->isMember(kSyncTables[i].name) &&
+                    !parseCursor((*cursors)[kSyncTables[i].name], after[i]))
+                    return err("invalid_request","invalid cursor");
+            }
+
+            // asking from these cursors means everything before them arrived
+            Compactor& compactor = Compactor::get();
+            for (size_t i = 0; i < std::size(kSyncTables); ++i)
+                compactor.ack(username, who->device, kSyncTables[i].tbl, after[i].ts);
+
+            try {
+                Database& db = Database::get().forUser(username);   // the shard with their rows
+                bool anyMore = false;
+
+                // rows go from sqlite straight into the body; sized for a typical page of every table
+                auto writer = makeRowWriter(cbor, std::size(kSyncTables) * (static_cast<size_t>(limit) * 192 + 128));
+                RowWriter& out = *writer;
+                out.beginObject().key("ok").value(true).key("tables").beginObject();
+
+                Database::ReadSnapshot snap(db);    // all four tables from one consistent view
+                for (size_t i = 0; i < std::size(kSyncTables); ++i) {
+                    Database::Cursor next;
+                    long long nextSince = after[i].ts;
+
+                    out.key(kSyncTables[i].name).beginObject().key("rows").beginArray();
+                    bool more = (db.*kSyncTables[i].list)(username, after[i], limit, out, next, nextSince);
+                    out.endArray();
+                    out.key("cursor");
+                    writeCursor(out, next);
+                    out.key("more").value(more);
+                    if (compactor.needsResync(username, kSyncTables[i].tbl, after[i].ts))
+                        out.key("resync").value(true);
+                    out.endObject();
+                    anyMore = anyMore || more;
+                }
+
+                out.endObject().key("more").value(anyMore).endObject();
+                return cb(rowResponse(out));
+            } catch (...) {
+                return err("server_error");
+            }
+        },
+        {drogon::Post}  // limit to POST
+    );
+
+    return 0;
+}
@@ -4,11 +4,13 @@
 #include <syslog.h>
 #include <drogon/drogon.h>
 
+#include "Config.h"
 #include "Database.h"
 #include "utils.h"
 #include "dhutils.h"
 #include "dh_login.h"
 #include "SessionManager.h"
+#include "WriteQueue.h"
 
 using drogon::HttpRequestPtr;
 using drogon::HttpResponsePtr;
@@ -31,176 +33,234 @@ static std::string toJsonString(const Json::Value& v) {
     return Json::writeString(wb, v);
 }
 
+// per-row results: {"ok":true,"updatedAt":ts}, {"ok":false,"error":"conflict","serverUpdatedAt":ts}
+// or {"ok":false,"error":"invalid_request","reason":...}
+static Json::Value rowOk(long long ts) {
+    Json::Value j; j["ok"] = true; j["updatedAt"] = static_cast<Json::Int64>(ts);
+    return j;
+}
+static Json::Value rowConflict(long long serverTs) {
+    Json::Value j; j["ok"] = false; j["error"] = "conflict";
+    j["serverUpdatedAt"] = static_cast<Json::Int64>(serverTs);
+    return j;
+}
+static Json::Value rowErr(const char* code, const char* info="") {
+    Json::Value j;
+    j["ok"]    = false;
+    j["error"] = code;
+    if (*info)
+        j["reason"] = info;
+    return j;
+}
+
+// check one row against the server copy and write it unless it conflicts.
+// Throws on database errors.
+static Json::Value applyRow(Database& db, const std::string& username,
+                            const std::string& table, const Json::Value& row, bool force) {
+
+    if (!row.isMember("updatedAt") || !row["updatedAt"].isInt64())
+        return rowErr("invalid_request","invalid updatedAt value");
+
+    const long long clientTs = row["updatedAt"].asInt64();
+
+    if (table == "books" || table == "book_data") {
+        if (!row.isMember("fileId") || !row["fileId"].isString())
+            return rowErr("invalid_request","no fileId");
+        const std::string fileId = row["fileId"].asString();
+        if (!db.bookExists(fileId))
+            return rowErr("invalid_request","unknown fileId");
+
+        const std::string progress = row.isMember("progress") ? toJsonString(row["progress"]) : "";
+
+        auto st = db.select_userBooks_byUserAndFileId(username, fileId);
+        const long long serverTs = st.deleted ? st.deletedAt : st.updatedAt;
+
+        if ( !force && (serverTs > 0) && (clientTs < serverTs) )
+            return rowConflict(serverTs);
+
+        const long long tnow = db.changeStamp(username, Database::Tbl::Books, nowMs());
+        // NOTE: always clear tombstone on update, thereby resurrecting the whole record
+        db.insertUserBook(username, fileId, progress, true, tnow);
+        return rowOk(tnow);
+    }
+
+    if (table == "bookmark") {
+        if (!row.isMember("fileId") || !row["fileId"].isString()) 
+            return rowErr("invalid_request","no fileId");
+        if (!row.isMember("id")) 
+            return rowErr("invalid_request","no id");
+
+        const std::string fileId = row["fileId"].asString();
+        if (!db.bookExists(fileId))
+            return rowErr("invalid_request","unknown fileId");
+
+        long long itemId = 0; 
+        if (!parseItemId(row["id"], itemId)) 
+            return rowErr("invalid_request", "bad id");
+        const std::string locator = row.isMember("locator") ? toJsonString(row["locator"]) : "";
+        const std::string label   = row.isMember("label")   ? row["label"].asString()      : "";
+
+        auto st = db.select_byUserFileAndItemId("user_bookmarks", username, fileId, itemId);
+        const long long serverTs = st.deleted ? st.deletedAt : st.updatedAt;
+
+        if ( !force && (serverTs > 0) && (clientTs < serverTs) )
+            return rowConflict(serverTs);
+
+        const long long tnow = db.changeStamp(username, Database::Tbl::Bookmarks, nowMs());
+        // NOTE: always clear tombstone on update, thereby resurrecting the whole record
+        db.insertUserBookmark(username, fileId, itemId, locator, label, true, tnow);
+        return rowOk(tnow);
+    }
+
+    if (table == "highlight") {
+        if (!row.isMember("fileId") || !row["fileId"].isString()) 
+            return rowErr("invalid_request","no fileId");
+        if (!row.isMember("id")) 
+            return rowErr("invalid_request","no id");
+
+        const std::string fileId = row["fileId"].asString();
+        if (!db.bookExists(fileId))
+            return rowErr("invalid_request","unknown fileId");
+
+        long long itemId = 0; 
+        if (!parseItemId(row["id"], itemId)) 
+            return rowErr("invalid_request","bad id");
+
+        const std::string sel    = row.isMember("selection") ? toJsonString(row["selection"]) : "";
+        const std::string label  = row.isMember("label")     ? row["label"].asString()        : "";
+        const std::string colour = row.isMember("colour")    ? row["colour"].asString()       : "";
+
+        auto st = db.select_byUserFileAndItemId("user_highlights", username, fileId, itemId);
+        const long long serverTs = st.deleted ? st.deletedAt : st.updatedAt;
+
+        if (!force && serverTs > 0 && clientTs < serverTs)
+            return rowConflict(serverTs);
+
+        const long long tnow = db.changeStamp(username, Database::Tbl::Highlights, nowMs());
+        // NOTE: always clear tombstone on update, thereby resurrecting the whole record
+        db.insertUserHighlight(username, fileId, itemId, sel, label, colour, true, tnow);
+        return rowOk(tnow);
+    }
+
+    if (table == "note") {
+        if (!row.isMember("fileId") || !row["fileId"].isString())
+            return rowErr("invalid_request","no fileId");
+        if (!row.isMember("id"))
+            return rowErr("invalid_request","no id");
+
+        const std::string fileId = row["fileId"].asString();
+        if (!db.bookExists(fileId))
+            return rowErr("invalid_request","unknown fileId");
+
+        long long itemId = 0;
+        if (!parseItemId(row["id"], itemId))
+            return rowErr("invalid_request", "bad id");
+        const std::string locator = row.isMember("locator") ? toJsonString(row["locator"]) : "";
+        const std::string content   = row.isMember("content")   ? row["content"].asString()      : "";
+
+        auto st = db.select_byUserFileAndItemId("user_notes", username, fileId, itemId);
+        const long long serverTs = st.deleted ? st.deletedAt : st.updatedAt;
+
+        if ( !force && (serverTs > 0) && (clientTs < serverTs) )
+            return rowConflict(serverTs);
+
+        const long long tnow = db.changeStamp(username, Database::Tbl::Notes, nowMs());
+        // NOTE: always clear tombstone on update, thereby resurrecting the whole record
+        db.insertUserNote(username, fileId, itemId, locator, content, true, tnow);
+        return rowOk(tnow);
+    }
+
+    return rowErr("invalid_request","unknown table");
+}
+
+//  single row:  {"table":..., "row":{...}, "force":bool}
+//               -> the row's result (as above)
+//  batch:       {"rows":[{"table":..., "row":{...}, "force":bool}, ...], "force":bool}
+//               -> {"ok":true, "results":[per-row result, in request order]}
+//               tables may be mixed; a row's "force" overrides the top-level one.
+//               All rows are checked and written together, in one transaction.
+//  Writes go through the WriteQueue: the response is sent once they are committed.
 int registerUpdateHandler(void) {
     drogon::app().registerHandler("/update",
-        [](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
-            auto ok = [&](long long ts) {
-                Json::Value j; j["ok"] = true; j["updatedAt"] = static_cast<Json::Int64>(ts);
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK);
-                cb(r);
-            };
-            auto conflict = [&](long long serverTs) {
-                Json::Value j; j["ok"] = false; j["error"] = "conflict";
-                j["serverUpdatedAt"] = static_cast<Json::Int64>(serverTs);
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK);
-                cb(r);
+        [latency = routeLatency("/update")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
+            const bool cbor = wantsCbor(req);
+            auto send = [&](const Json::Value& j) {
+                cb(valueResponse(cbor, j)); // conflicts and app-level errors are 200 too
             };
             auto err = [&](const char* code,const char* info="") {
-                Json::Value j;
-                j["ok"]    = false;
-                j["error"] = code;
-                if (*info)
-                    j["reason"] = info;
-                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
-                r->setStatusCode(drogon::k200OK); // app-level errors
-                cb(r);
+                send(rowErr(code, info));
             };
 
             // check whether token is valid
-            const std::string username = SessionManager::instance().usernameIfValid(req);  // empty if invalid/expired
-            if (username.empty()) return err("unauthorised");
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+            const std::string& username = who->username;
 
             // parse and validate json
-            auto bodyPtr = req->getJsonObject();      // Drogon parses for us
+            auto bodyPtr = requestBody(req);          // JSON, or CBOR if the client sent that
             if (!bodyPtr)    return err("invalid_request","parsing failed");
             const auto& body = *bodyPtr;
 
+            bool force = false;
+            if (body.isMember("force") && !parseBoolFlexible(body["force"], force))
+                return err("invalid_request","invalid value for force tag");
+
+            if (body.isMember("rows")) {
+                const Json::Value& rows = body["rows"];
+                if (!rows.isArray() || rows.empty())
+                    return err("invalid_request","no row data");
+                if (rows.size() > static_cast<Json::ArrayIndex>(Config::get().maxBatch()))
+                    return err("invalid_request","too many rows");
+
+                auto results = std::make_shared<Json::Value>(Json::arrayValue);
+                WriteQueue::get().submitFor(username,
+                    [bodyPtr, username, force, results] {
+                        Database& db = Database::get();
+                        for (const auto& item : (*bodyPtr)["rows"]) {
+                            if (!item.isObject() || !item.isMember("table") || !item["table"].isString()) {
+                                results->append(rowErr("invalid_request","no tablename"));
+                                continue;
+                            }
+                            if (!item.isMember("row") || !item["row"].isObject()) {
+                                results->append(rowErr("invalid_request","no row data"));
+                                continue;
+                            }
+                            bool rowForce = force;
+                            if (item.isMember("force") && !parseBoolFlexible(item["force"], rowForce)) {
+                                results->append(rowErr("invalid_request","invalid value for force tag"));
+                                continue;
+                            }
+                            results->append(applyRow(db, username, item["table"].asString(), item["row"], rowForce));
+                        }
+                    },
+                    [cb = std::move(cb), results, cbor](bool committed) {
+                        Json::Value j;
+                        if (committed) { j["ok"] = true; j["results"] = std::move(*results); }
+                        else           j = rowErr("server_error");
+                        cb(valueResponse(cbor, j));
+                    });
+                return;
+            }
+
             if (!body.isMember("table") || !body["table"].isString()) 
                 return err("invalid_request","no tablename");
 
             if (!body.isMember("row")   || !body["row"].isObject())   
                 return err("invalid_request","no row data");
 
-            const std::string table = body["table"].asString();
-            const Json::Value& row  = body["row"];
-
-            bool force = false;
-            if (body.isMember("force") && !parseBoolFlexible(body["force"], force))
-                return err("invalid_request","invalid value for force tag");
-
-            if (!row.isMember("updatedAt") || !row["updatedAt"].isInt64())
-                return err("invalid_request","invalid updatedAt value");
-
-            const long long clientTs = row["updatedAt"].asInt64();
-
-            try {
-                Database& db = Database::get();
-
-                if (table == "books" || table == "book_data") {
-                    if (!row.isMember("fileId") || !row["fileId"].isString())
-                        return err("invalid_request","no fileId");
-                    const std::string fileId = row["fileId"].asString();
-                    if (!db.bookExists(fileId))
-                        return err("invalid_request","unknown fileId");
-
-                    const std::string progress = row.isMember("progress") ? toJsonString(row["progress"]) : "";
-
-                    auto st = db.select_userBooks_byUserAndFileId(username, fileId);
-                    const long long serverTs = st.deleted ? st.deletedAt : st.updatedAt;
-
-                    if ( !force && (serverTs > 0) && (clientTs < serverTs) )
-                        return conflict(serverTs);
-
-                    const long long tnow = nowMs();
-                    // NOTE: always clear tombstone on update, thereby resurrecting the whole record
-                    db.insertUserBook(username, fileId, progress, true, tnow);
-                    return ok(tnow);
-                }
-
-                if (table == "bookmark") {
-                    if (!row.isMember("fileId") || !row["fileId"].isString()) 
-                        return err("invalid_request","no fileId");
-                    if (!row.isMember("id")) 
-                        return err("invalid_request","no id");
-
-                    const std::string fileId = row["fileId"].asString();
-                    if (!db.bookExists(fileId))
-                        return err("invalid_request","unknown fileId");
-
-                    long long itemId = 0; 
-                    if (!parseItemId(row["id"], itemId)) 
-                        return err("invalid_request", "bad id");
-                    const std::string locator = row.isMember("locator") ? toJsonString(row["locator"]) : "";
-                    const std::string label   = row.isMember("label")   ? row["label"].asString()      : "";
-
-                    auto st = db.select_byUserFileAndItemId("user_bookmarks", username, fileId, itemId);
-                    const long long serverTs = st.deleted ? st.deletedAt : st.updatedAt;
-
-                    if ( !force && (serverTs > 0) && (clientTs < serverTs) )
-                        return conflict(serverTs);
-
-                    const long long tnow = nowMs();
-                    // NOTE: always clear tombstone on update, thereby resurrecting the whole record
-                    db.insertUserBookmark(username, fileId, itemId, locator, label, true, tnow);
-                    return ok(tnow);
-                }
-
-                if (table == "highlight") {
-                    if (!row.isMember("fileId") || !row["fileId"].isString()) 
-                        return err("invalid_request","no fileId");
-                    if (!row.isMember("id")) 
-                        return err("invalid_request","no id");
-
-                    const std::string fileId = row["fileId"].asString();
-                    if (!db.bookExists(fileId))
-                        return err("invalid_request","unknown fileId");
-
-                    long long itemId = 0; 
-                    if (!parseItemId(row["id"], itemId)) 
-                        return err("invalid_request","bad id");
-
-                    const std::string sel    = row.isMember("selection") ? toJsonString(row["selection"]) : "";
-                    const std::string label  = row.isMember("label")     ? row["label"].asString()        : "";
-                    const std::string colour = row.isMember("colour")    ? row["colour"].asString()       : "";
-
-                    auto st = db.select_byUserFileAndItemId("user_highlights", username, fileId, itemId);
-                    const long long serverTs = st.deleted ? st.deletedAt : st.updatedAt;
-
-                    if (!force && serverTs > 0 && clientTs < serverTs)
-                        return conflict(serverTs);
-
-                    const long long tnow = nowMs();
-                    // NOTE: always clear tombstone on update, thereby resurrecting the whole record
-                    db.insertUserHighlight(username, fileId, itemId, sel, label, colour, true, tnow);
-                    return ok(tnow);
-                }
-
-                if (table == "note") {
-                    if (!row.isMember("fileId") || !row["fileId"].isString())
-                        return err("invalid_request","no fileId");
-                    if (!row.isMember("id"))
-                        return err("invalid_request","no id");
-
-                    const std::string fileId = row["fileId"].asString();
-                    if (!db.bookExists(fileId))
-                        return err("invalid_request","unknown fileId");
-
-                    long long itemId = 0;
-                    if (!parseItemId(row["id"], itemId))
-                        return err("invalid_request", "bad id");
-                    const std::string locator = row.isMember("locator") ? toJsonString(row["locator"]) : "";
-                    const std::string content   = row.isMember("content")   ? row["content"].asString()      : "";
-
-                    auto st = db.select_byUserFileAndItemId("user_notes", username, fileId, itemId);
-                    const long long serverTs = st.deleted ? st.deletedAt : st.updatedAt;
-
-                    if ( !force && (serverTs > 0) && (clientTs < serverTs) )
-                        return conflict(serverTs);
-
-                    const long long tnow = nowMs();
-                    // NOTE: always clear tombstone on update, thereby resurrecting the whole record
-                    db.insertUserNote(username, fileId, itemId, locator, content, true, tnow);
-                    return ok(tnow);
-                }
-
-                return err("invalid_request","unknown table");
-            } catch (...) {
-                return err("server_error");
-            }        },
+            auto result = std::make_shared<Json::Value>();
+            WriteQueue::get().submitFor(username,
+                [bodyPtr, username, force, result] {
+                    const auto& body = *bodyPtr;
+                    *result = applyRow(Database::get(), username, body["table"].asString(), body["row"], force);
+                },
+                [cb = std::move(cb), result, cbor](bool committed) {
+                    cb(valueResponse(cbor, committed ? *result : rowErr("server_error")));
+                });
+        },
         {drogon::Post}  // limit to POST
     );
 
     return 0;
-}
\ No newline at end of file
+}
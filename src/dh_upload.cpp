@@ -0,0 +1,483 @@
+//**************************************************
+// drogon handlers for resumable, chunked uploads
+//
+//  POST /uploadInit          {"sha256","size","fileName"}
+//        -> {"ok":true,"exists":true,"fileId"}                  we already have it: nothing to send
+//        -> {"ok":true,"exists":false,"uploadId","offset","chunkSize"}
+//           offset: bytes already received (resume from here; 0 for a new upload)
+//  PUT  /uploadChunk/{uploadId}?offset=N     body: the bytes at N, header X-Chunk-SHA256
+//        -> {"ok":true,"offset":next}
+//        -> {"ok":false,"error":"offset_mismatch","offset":expected}
+//  POST /uploadCommit/{uploadId}             {"fileName"} (optional)
+//        -> as /uploadBook: {"ok":true,"fileId","size","sha256","fileName"}
+//
+//  An upload is keyed by its content (sha256+size), so any device of any user
+//  sending the same book resumes the same partial file. A user may have
+//  MAX_PER_USER uploads started and not committed (past that: "too_many_uploads");
+//  one nobody has sent a byte of is dropped after an hour.
+//**************************************************
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include <drogon/drogon.h>
+#include <sodium.h>
+
+#include "Config.h"
+#include "BookStorage.h"
+#include "Metrics.h"
+#include "SessionManager.h"
+#include "utils.h"
+#include "dhutils.h"
+#include "dh_upload.h"
+
+using drogon::HttpRequestPtr;
+using drogon::HttpResponsePtr;
+namespace fs = std::filesystem;
+
+static const long long CHUNK_SIZE     = 8LL << 20;              // what we suggest to clients (within maxchunkmb)
+static const auto      STALE_AFTER    = std::chrono::hours(24 * 7);   // abandoned partial uploads
+static const long long IDLE_MS        = 3600LL * 1000;          // an upload started but never sent to
+static const size_t    MAX_PER_USER   = 16;                     // uploads one user may have started
+
+// /metrics: bytes accepted, and time spent hashing them (as /uploadBook's)
+static const Metrics::Counter chunkBytes = Metrics::get().counter(
+    "simplereader_upload_bytes_total", "Book bytes received.", "route=\"/uploadChunk\"");
+static const Metrics::Counter chunkHashNs = Metrics::get().counter(
+    "simplereader_upload_hash_seconds_total", "Time spent hashing received book bytes.", "route=\"/uploadChunk\"", 1e-9);
+
+// an upload in progress. `sha` covers the first `hashed` bytes of the partial file;
+// after a restart (or an out of order chunk) it falls behind and commit re-reads the file.
+// `owner` started it (and has it counted against MAX_PER_USER), whoever sends it after.
+// A forgotten one (committed, or dropped) stays in g_uploads while a request still holds it,
+// so the next one for its id waits on the same mutex rather than writing beside it.
+struct Upload {
+    std::mutex               mu;
+    crypto_hash_sha256_state sha;
+    long long                hashed = 0;
+    std::string              fileName;
+    std::string              owner;
+    std::atomic<long long>   touchedAt{0};     // nowMs() of the last init or chunk
+    std::atomic<bool>        forgotten{false};
+};
+
+static std::mutex g_uploadsMu;
+static std::unordered_map<std::string, std::shared_ptr<Upload>> g_uploads;
+static std::unordered_map<std::string, size_t> g_uploadsPerUser;
+
+// the upload, started for `user` if it hasn't been; nullptr if they have too many started
+static std::shared_ptr<Upload> uploadFor(const std::string& id, const std::string& user) {
+    std::lock_guard<std::mutex> lk(g_uploadsMu);
+    auto it = g_uploads.find(id);
+    if (it == g_uploads.end() || (it->second->forgotten && it->second.use_count() == 1)) {
+        size_t& n = g_uploadsPerUser[user];
+        if (n >= MAX_PER_USER) return nullptr;
+        ++n;
+        auto up = std::make_shared<Upload>();
+        crypto_hash_sha256_init(&up->sha);
+        up->owner = user;
+        if (it == g_uploads.end())
+            it = g_uploads.emplace(id, std::move(up)).first;
+        else
+            it->second = std::move(up);
+    }
+    it->second->touchedAt = nowMs();
+    return it->second;
+}
+
+// uploadFor(), locked. One forgotten while we waited for it is let go of, and asked for
+// again (afresh, once nobody else holds the old one).
+static std::shared_ptr<Upload> lockUpload(const std::string& id, const std::string& user,
+                                          std::unique_lock<std::mutex>& lk) {
+    for (;;) {
+        auto up = uploadFor(id, user);
+        if (!up) return nullptr;
+        lk = std::unique_lock<std::mutex>(up->mu);
+        if (!up->forgotten) return up;
+        lk.unlock();
+        std::this_thread::yield();
+    }
+}
+
+// no longer counted against its owner; gone from g_uploads once no request holds it
+static void forgetUpload(const std::string& id) {
+    std::lock_guard<std::mutex> lk(g_uploadsMu);
+    auto it = g_uploads.find(id);
+    if (it == g_uploads.end()) return;
+    if (!it->second->forgotten.exchange(true)) {
+        auto n = g_uploadsPerUser.find(it->second->owner);
+        if (n != g_uploadsPerUser.end() && --n->second == 0)
+            g_uploadsPerUser.erase(n);
+    }
+    if (it->second.use_count() == 1)
+        g_uploads.erase(it);
+}
+
+static std::string toLower(std::string s){ for(char& c:s) c=std::tolower((unsigned char)c); return s; }
+
+// uploadId: "<sha256 hex>-<size>". Also the partial file's name, so validate before use.
+static bool parseUploadId(const std::string& id, std::string& shaOut, long long& sizeOut) {
+    const auto dash = id.find('-');
+    if (dash != 64 || id.size() < 66) return false;
+    std::string sha = id.substr(0, 64);
+    const std::string size = id.substr(65);
+    if (!isHex64(sha) || id.compare(0, 64, sha) != 0) return false;    // isHex64 lowercases: one spelling per upload
+    if (!std::all_of(size.begin(), size.end(), ::isdigit) || size.size() > 18) return false;
+    shaOut  = sha;
+    sizeOut = std::stoll(size);
+    return sizeOut > 0;
+}
+
+static fs::path partPath(const std::string& id) {
+    return BookStorage::get().incomingDir() / ".staging" / (id + ".part");
+}
+
+static long long partSize(const fs::path& p) {
+    std::error_code ec;
+    const auto n = fs::file_size(p, ec);
+    return ec ? 0 : static_cast<long long>(n);
+}
+
+// drop partial uploads nobody has touched for a week, and uploads started but not sent
+// to for an hour
+static void sweepStaleParts(void) {
+    std::error_code ec;
+    const auto cutoff = fs::file_time_type::clock::now() - STALE_AFTER;
+    for (const auto& e : fs::directory_iterator(BookStorage::get().incomingDir() / ".staging", ec)) {
+        if (e.path().extension() != ".part") continue;
+        std::error_code ec2;
+        if (e.last_write_time(ec2) < cutoff && !ec2) {
+            fs::remove(e.path(), ec2);
+            forgetUpload(e.path().stem().string());
+        }
+    }
+
+    std::vector<std::pair<std::string, bool>> idle;     // and whether it's forgotten already
+    {
+        const long long idleBefore = nowMs() - IDLE_MS;
+        std::lock_guard<std::mutex> lk(g_uploadsMu);
+        for (const auto& [id, up] : g_uploads)
+            if (up->forgotten || up->touchedAt < idleBefore) idle.emplace_back(id, up->forgotten.load());
+    }
+    for (const auto& [id, forgotten] : idle)
+        if (forgotten || !fs::exists(partPath(id), ec))
+            forgetUpload(id);
+}
+
+// SHA-256 of an entire file (only when the running hash fell behind)
+static std::string sha256FileHex(const fs::path& p) {
+    const int fd = ::open(p.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("open " + p.string());
+
+    crypto_hash_sha256_state st;
+    crypto_hash_sha256_init(&st);
+    std::vector<unsigned char> buf(1 << 20);
+    for (;;) {
+        const ssize_t n = ::read(fd, buf.data(), buf.size());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ::close(fd);
+            throw std::runtime_error("read " + p.string());
+        }
+        if (n == 0) break;
+        crypto_hash_sha256_update(&st, buf.data(), static_cast<unsigned long long>(n));
+    }
+    ::close(fd);
+
+    unsigned char out[crypto_hash_sha256_BYTES];
+    crypto_hash_sha256_final(&st, out);
+    char hex[crypto_hash_sha256_BYTES*2+1];
+    sodium_bin2hex(hex, sizeof hex, out, sizeof out);
+    return std::string(hex);
+}
+
+// of a copy: the upload's own state stays good for another commit attempt
+static std::string finalHex(crypto_hash_sha256_state st) {
+    unsigned char out[crypto_hash_sha256_BYTES];
+    crypto_hash_sha256_final(&st, out);
+    char hex[crypto_hash_sha256_BYTES*2+1];
+    sodium_bin2hex(hex, sizeof hex, out, sizeof out);
+    return std::string(hex);
+}
+
+int registerUploadHandlers(void) {
+    ////////////////////////////////////////////////////////////////////////
+    // POST /uploadInit
+    //
+    drogon::app().registerHandler("/uploadInit",
+        [latency = routeLatency("/uploadInit")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
+            auto send = [&](const Json::Value& j) {
+                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
+                r->setStatusCode(drogon::k200OK);
+                cb(r);
+            };
+            auto err = [&](const char* code,const char* info="") {
+                Json::Value j;
+                j["ok"]    = false;
+                j["error"] = code;
+                if (*info)
+                    j["reason"] = info;
+                send(j);
+            };
+
+            // check whether token is valid
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+
+            auto bodyPtr = req->getJsonObject();      // Drogon parses for us
+            if (!bodyPtr)    return err("invalid_request","parsing failed");
+            const auto& body = *bodyPtr;
+
+            if (!body.isMember("sha256") || !body["sha256"].isString())
+                return err("invalid_request","bad checksum");
+            std::string shaHex = toLower(body["sha256"].asString());
+            if (!isHex64(shaHex))
+                return err("invalid_request","bad checksum");
+            if (!body.isMember("size") || !body["size"].isInt64() || body["size"].asInt64() <= 0)
+                return err("invalid_request","bad filesize");
+            const long long size = body["size"].asInt64();
+
+            const long long maxSize = Config::get().maxFileSize();
+            if ( (maxSize > 0) && (size > maxSize) )
+                return err("too_large");
+
+            try {
+                // dedupe: any user may already have sent us this book
+                const std::string fid = findStoredBook(shaHex, size);
+                if (!fid.empty()) {
+                    Json::Value j; j["ok"] = true; j["exists"] = true; j["fileId"] = fid;
+                    return send(j);
+                }
+
+                std::error_code ec;
+                fs::create_directories(BookStorage::get().incomingDir() / ".staging", ec);
+                if (ec) return err("server_error", ec.message().c_str());
+                sweepStaleParts();
+
+                const std::string id = shaHex + "-" + std::to_string(size);
+                std::unique_lock<std::mutex> lk;
+                auto up = lockUpload(id, who->username, lk);
+                if (!up) return err("too_many_uploads");
+                if (body.isMember("fileName") && body["fileName"].isString())
+                    up->fileName = body["fileName"].asString();
+
+                Json::Value j;
+                j["ok"]        = true;
+                j["exists"]    = false;
+                j["uploadId"]  = id;
+                j["offset"]    = static_cast<Json::Int64>(partSize(partPath(id)));
+                j["chunkSize"] = static_cast<Json::Int64>(std::min(CHUNK_SIZE, Config::get().maxChunkBytes()));
+                return send(j);
+            } catch (...) {
+                return err("server_error");
+            }
+        },
+        {drogon::Post}  // limit to POST
+    );
+
+    ////////////////////////////////////////////////////////////////////////
+    // PUT /uploadChunk/{uploadId}?offset=N
+    //
+    drogon::app().registerHandler("/uploadChunk/{1}",
+        [latency = routeLatency("/uploadChunk/{1}")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb, const std::string& id) {
+            timeResponse(latency, cb);
+            auto send = [&](const Json::Value& j) {
+                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
+                r->setStatusCode(drogon::k200OK);
+                cb(r);
+            };
+            auto err = [&](const char* code,const char* info="") {
+                Json::Value j;
+                j["ok"]    = false;
+                j["error"] = code;
+                if (*info)
+                    j["reason"] = info;
+                send(j);
+            };
+
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+
+            std::string shaHex; long long size = 0;
+            if (!parseUploadId(id, shaHex, size))
+                return err("invalid_request","bad uploadId");
+            const long long maxSize = Config::get().maxFileSize();
+            if ( (maxSize > 0) && (size > maxSize) )
+                return err("too_large");
+
+            const std::string offStr = req->getParameter("offset");
+            if (offStr.empty() || offStr.size() > 18 || !std::all_of(offStr.begin(), offStr.end(), ::isdigit))
+                return err("invalid_request","bad offset");
+            const long long offset = std::stoll(offStr);
+
+            const std::string_view chunk = req->getBody();
+            const long long len = static_cast<long long>(chunk.size());
+            if (len <= 0 || len > Config::get().maxChunkBytes())
+                return err("invalid_request","bad chunk length");
+            if (offset + len > size)
+                return err("invalid_request","chunk past end of file");
+
+            // per-chunk integrity: a damaged chunk is refused, not discovered at commit
+            std::string chunkSha = toLower(req->getHeader("x-chunk-sha256"));
+            if (!isHex64(chunkSha))
+                return err("invalid_request","no X-Chunk-SHA256");
+            const auto hashStart = Metrics::Clock::now();
+            {
+                unsigned char h[crypto_hash_sha256_BYTES];
+                crypto_hash_sha256(h, reinterpret_cast<const unsigned char*>(chunk.data()), chunk.size());
+                char hex[crypto_hash_sha256_BYTES*2+1];
+                sodium_bin2hex(hex, sizeof hex, h, sizeof h);
+                if (chunkSha != hex)
+                    return err("checksum_mismatch");
+            }
+            auto hashTime = Metrics::Clock::now() - hashStart;
+
+            try {
+                std::unique_lock<std::mutex> lk;            // one writer per upload, whoever is sending it
+                auto up = lockUpload(id, who->username, lk);
+                if (!up) return err("too_many_uploads");
+
+                const fs::path part = partPath(id);
+                const long long have = partSize(part);
+                if (offset != have) {
+                    Json::Value j;
+                    j["ok"] = false; j["error"] = "offset_mismatch";
+                    j["offset"] = static_cast<Json::Int64>(have);
+                    return send(j);
+                }
+
+                const int fd = ::open(part.c_str(), O_WRONLY | O_CREAT, 0600);
+                if (fd == -1)
+                    return err("server_error","could not open partial upload");
+                const char* p = chunk.data();
+                long long left = len, at = offset;
+                while (left > 0) {
+                    const ssize_t n = ::pwrite(fd, p, static_cast<size_t>(left), at);
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        ::close(fd);
+                        return err("server_error","write failed");
+                    }
+                    p += n; at += n; left -= n;
+                }
+                // durable before we ack: a resumed upload must never skip bytes we lost
+                const bool synced = (::fdatasync(fd) == 0);
+                ::close(fd);
+                if (!synced)
+                    return err("server_error","sync failed");
+
+                if (up->hashed == offset) {
+                    const auto start = Metrics::Clock::now();
+                    crypto_hash_sha256_update(&up->sha, reinterpret_cast<const unsigned char*>(chunk.data()), chunk.size());
+                    hashTime += Metrics::Clock::now() - start;
+                    up->hashed += len;
+                }
+                chunkBytes.inc(static_cast<uint64_t>(len));
+                chunkHashNs.inc(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(hashTime).count()));
+
+                Json::Value j; j["ok"] = true; j["offset"] = static_cast<Json::Int64>(offset + len);
+                return send(j);
+            } catch (...) {
+                return err("server_error");
+            }
+        },
+        {drogon::Put}  // limit to PUT
+    );
+
+    ////////////////////////////////////////////////////////////////////////
+    // POST /uploadCommit/{uploadId}
+    //
+    drogon::app().registerHandler("/uploadCommit/{1}",
+        [latency = routeLatency("/uploadCommit/{1}")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb, const std::string& id) {
+            timeResponse(latency, cb);
+            auto send = [&](const Json::Value& j) {
+                auto r = drogon::HttpResponse::newHttpJsonResponse(j);
+                r->setStatusCode(drogon::k200OK);
+                cb(r);
+            };
+            auto err = [&](const char* code,const char* info="") {
+                Json::Value j;
+                j["ok"]    = false;
+                j["error"] = code;
+                if (*info)
+                    j["reason"] = info;
+                send(j);
+            };
+
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+
+            std::string shaHex; long long size = 0;
+            if (!parseUploadId(id, shaHex, size))
+                return err("invalid_request","bad uploadId");
+
+            auto bodyPtr = req->getJsonObject();      // optional
+            try {
+                std::unique_lock<std::mutex> lk;
+                auto up = lockUpload(id, who->username, lk);
+                if (!up) return err("too_many_uploads");
+
+                std::string clientFileName = up->fileName;
+                if (bodyPtr && bodyPtr->isMember("fileName") && (*bodyPtr)["fileName"].isString())
+                    clientFileName = (*bodyPtr)["fileName"].asString();
+                if (clientFileName.empty())
+                    clientFileName = shaHex;    // no better name to offer
+
+                const fs::path part = partPath(id);
+                const long long have = partSize(part);
+                if (have != size) {
+                    Json::Value j;
+                    j["ok"] = false; j["error"] = "incomplete";
+                    j["offset"] = static_cast<Json::Int64>(have);
+                    return send(j);
+                }
+
+                const std::string actualSha = (up->hashed == size) ? finalHex(up->sha) : sha256FileHex(part);
+                std::error_code ec;
+                if (actualSha != shaHex) {
+                    fs::remove(part, ec);
+                    forgetUpload(id);
+                    return err("checksum_mismatch");
+                }
+
+                // someone may have finished the same book another way meanwhile
+                const std::string fid = findStoredBook(shaHex, size);
+                if (!fid.empty()) {
+                    fs::remove(part, ec);
+                    forgetUpload(id);
+                    Json::Value j;
+                    j["ok"]=true; j["fileId"]=fid; j["size"]=Json::Int64(size);
+                    j["sha256"]=shaHex; j["fileName"]=clientFileName;
+                    return send(j);
+                }
+
+                // into the library: same filesystem, so a rename (for s3: uploaded from there)
+                const std::string newId = drogon::utils::getUuid();
+                fs::rename(part, BookStorage::get().incoming(newId), ec);
+                if (ec)
+                    return err("server_error", ec.message().c_str());
+                forgetUpload(id);
+                lk.unlock();
+
+                return storeBook(newId, shaHex, size, clientFileName, std::move(cb));
+            } catch (const std::exception& e) {
+                return err("server_error", e.what());
+            } catch (...) {
+                return err("server_error");
+            }
+        },
+        {drogon::Post}  // limit to POST
+    );
+
+    return 0;
+}
@@ -2,8 +2,7 @@
 // drogon handler for "POST uploadBook" requests 
 //**************************************************
 #include <filesystem>
-#include <fstream>
-#include <unistd.h>
+#include <algorithm>
 #include <syslog.h>
 
 #include <drogon/drogon.h>
@@ -12,6 +11,10 @@
 #include "Database.h"
 #include "Config.h"
 #include "SessionManager.h"
+#include "WriteQueue.h"
+#include "StagedFile.h"
+#include "BookStorage.h"
+#include "Metrics.h"
 #include "utils.h"
 #include "dhutils.h"
 #include "dh_login.h"
@@ -22,31 +25,17 @@ namespace fs = std::filesystem;
 
 static std::string toLower(std::string s){ for(char& c:s) c=std::tolower((unsigned char)c); return s; }
 
-static std::string sha256_file_hex(const std::string& path) {
-    crypto_hash_sha256_state st; 
-    crypto_hash_sha256_init(&st);
-    std::ifstream in(path, std::ios::binary); 
-    if (!in) 
-        throw std::runtime_error("hash open");
-
-    std::vector<char> buf(1<<20);
-    while (in) { 
-        in.read(buf.data(), buf.size()); 
-        std::streamsize n=in.gcount();
-        if (n>0) 
-            crypto_hash_sha256_update(&st,(const unsigned char*)buf.data(),(size_t)n);
-    }
-    unsigned char out[crypto_hash_sha256_BYTES]; 
-    crypto_hash_sha256_final(&st,out);
-    char hex[crypto_hash_sha256_BYTES*2+1]; 
-    sodium_bin2hex(hex,sizeof hex,out,sizeof out);
-    return std::string(hex);
-}
+// /metrics: bytes taken in, and time spent hashing them (bytes / seconds = hashing throughput)
+static const Metrics::Counter uploadBytes = Metrics::get().counter(
+    "simplereader_upload_bytes_total", "Book bytes received.", "route=\"/uploadBook\"");
+static const Metrics::Counter uploadHashNs = Metrics::get().counter(
+    "simplereader_upload_hash_seconds_total", "Time spent hashing received book bytes.", "route=\"/uploadBook\"", 1e-9);
 
 int registerUploadBookHandler(void) {
     drogon::app().registerHandler("/uploadBook",
-        [](const HttpRequestPtr& req, 
+        [latency = routeLatency("/uploadBook")](const HttpRequestPtr& req, 
            std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
             auto ok = [&](const std::string& fileId, long long size, const std::string& sha, const std::string& filename){
                 Json::Value j; j["ok"]=true; 
                 j["fileId"]=fileId;
@@ -74,8 +63,8 @@ int registerUploadBookHandler(void) {
             };
 
             // check whether token is valid
-            const std::string username = SessionManager::instance().usernameIfValid(req);  // empty if invalid/expired
-            if (username.empty()) 
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) 
                 return httpErr(drogon::k401Unauthorized, "unauthorised");
 
             // parse multipart
@@ -115,19 +104,12 @@ int registerUploadBookHandler(void) {
                 return err("too_large");
 
             // check whether we already have this file
-            Database& db = Database::get();
-
-            std::string fid = db.lookupFileIdByHashSize(shaHex, sizeClaim);
+            // (by the location recorded for that book, not the client's fileId)
+            const std::string fid = findStoredBook(shaHex, sizeClaim);
             if (!fid.empty()) {
-                // doublecheck we physically have it on the disk.  If we do, we can stop processing.
-                fs::path p = fs::path("/var/lib/simplereader/library") / fs::path(fileId).filename();
-                std::error_code ec;
-                bool exists = fs::is_regular_file(p,ec);
-                if (exists) {
-                    // we already have this file, so tell the client it's all good, 
-                    // and stop processing the file
-                    return ok(fid, sizeClaim, shaHex,clientFileName);
-                }
+                // we already have this file, so tell the client it's all good,
+                // and stop processing the file
+                return ok(fid, sizeClaim, shaHex,clientFileName);
             }
 
             // have file part?
@@ -135,83 +117,43 @@ int registerUploadBookHandler(void) {
             if (files.empty()) 
                 return err("invalid_request","getFiles() failed to parse");
 
-            // save uploaded file to temp
-            fs::path tmpPath;
-            try {
-                char templ[] = "/tmp/simplereader_upload_XXXXXX";
-                int fd = mkstemp(templ); 
-                if (fd == -1) 
-                    return err("server_error","could not make tmp file");
-                close(fd);
-                tmpPath = templ;
-                files.front().saveAs(tmpPath.string());
-            } catch (const std::exception& e) { 
-                return err("server_error",e.what()); 
-            } catch(...) {
-                return err("server_error"); 
-            }
+            BookStorage& storage = BookStorage::get();
+            const auto& part = files.front();
 
-            auto cleanupTmp = [&](void){
-                std::error_code ec; fs::remove(tmpPath, ec);
-            };
+            // cheap checks first: the part's length is known before we touch the disk
+            const long long actualSize = static_cast<long long>(part.fileLength());
+            if (actualSize != sizeClaim)
+                return err("server_error","filesize mismatch");
 
             try {
-                // verify size + sha
-                std::error_code ec;
-                auto actualSize = (long long)fs::file_size(tmpPath, ec);
-                if (ec) { 
-                    cleanupTmp(); 
-                    std::string msg = ec.message() + " (" + ec.category().name() + ":" + std::to_string(ec.value()) + ")";
-                    return err("server_error",msg.c_str());
-                }
-                if (actualSize != sizeClaim) { 
-                    cleanupTmp(); 
-                    return err("server_error","filesize mismatch"); 
-                } // size mismatch
-
-                const std::string actualSha = sha256_file_hex(tmpPath.string());
-                if (actualSha != shaHex) { 
-                    cleanupTmp(); 
-                    return err("checksum_mismatch"); 
+                // one pass over the body: write it into the library's staging dir,
+                // hashing each slice as it goes (no /tmp copy, no re-read, no cross-fs copy)
+                StagedFile staged(storage.incomingDir());
+                // in slices of uploadbufferkb, so each one is hashed while still in cache
+                const char* data = part.fileData();
+                const long long slice = Config::get().uploadBufferBytes();
+                for (long long off = 0; off < actualSize; off += slice) {
+                    const size_t n = static_cast<size_t>(std::min<long long>(slice, actualSize - off));
+                    staged.append(data + off, n);
                 }
+                uploadBytes.inc(static_cast<uint64_t>(actualSize));
+                uploadHashNs.inc(static_cast<uint64_t>(staged.hashTime().count()));
+
+                const std::string actualSha = staged.sha256Hex();
+                if (actualSha != shaHex)
+                    return err("checksum_mismatch");    // staged file removed on scope exit
 
                 // we need to allocate a fileId (uuid), as this is a new file
                 std::string newId = drogon::utils::getUuid();
 
-                // move into library
-                const fs::path libraryRoot = "/var/lib/simplereader/library";
-                fs::create_directories(libraryRoot, ec); 
-                if (ec) { 
-                    cleanupTmp(); 
-                    std::string msg = ec.message() + " (" + ec.category().name() + ":" + std::to_string(ec.value()) + ")";
-                    return err("server_error",msg.c_str()); 
-                }
-
-                const fs::path dstPath = libraryRoot / newId;
-                fs::rename(tmpPath, dstPath, ec);
-                if (ec) { // failed to rename, so file must exist and so try to copy over it
-                    fs::copy_file(tmpPath, dstPath, fs::copy_options::overwrite_existing, ec);
-                    if (ec) { cleanupTmp(); 
-                        std::string msg = ec.message() + " (" + ec.category().name() + ":" + std::to_string(ec.value()) + ")";
-                        return err("server_error",msg.c_str()); 
-                    }
-                    fs::remove(tmpPath, ec);
-                }
-
-                // update the "books" db table with this book
-                const long long tnow = nowMs();
-                try {
-                    db.insertBookRecord(newId, actualSha, actualSize, dstPath.string(), clientFileName, tnow);
-                } catch (...) {
-                    // race: someone inserted first; look up by content and return that id
-                    auto fid = db.lookupFileIdByHashSize(actualSha, actualSize);
-                    if (fid.empty())
-                        return err("server_error","could not update 'books' table");
-                }
+                // a rename within one filesystem, then into the library (for s3: uploaded from there)
+                staged.commit(storage.incoming(newId));
 
-                return ok(newId, actualSize, actualSha, clientFileName);
+                // update the "books" db table with this book (respond once it is committed)
+                return storeBook(newId, actualSha, actualSize, clientFileName, std::move(cb));
+            } catch (const std::exception& e) {
+                return err("server_error",e.what());
             } catch (...) {
-                cleanupTmp();
                 return err("server_error");
             }
         },
@@ -0,0 +1,79 @@
+//*******************************************
+// drogon handler for "POST /watch" requests
+//
+// Long-poll for changes to this user's data, instead of polling /getSince.
+//
+// request:  {"version": v,     (optional: the last version this device saw)
+//            "timeout": secs}  (optional: [1..55], default 25)
+// response: {"ok":true, "changed":bool, "version":v}
+//
+//   Without "version" the current one comes back at once: take it, /sync, then
+//   /watch with it. The reply is held until a write to this user's rows commits
+//   ("changed":true) or the timeout passes ("changed":false); either way, watch
+//   again with the version returned.
+//*******************************************
+#include <drogon/drogon.h>
+
+#include "utils.h"
+#include "dhutils.h"
+#include "dh_watch.h"
+#include "ChangeFeed.h"
+#include "SessionManager.h"
+
+using drogon::HttpRequestPtr;
+using drogon::HttpResponsePtr;
+
+static const int DEFAULT_WATCH_SECS = 25;
+static const int MAX_WATCH_SECS     = 55;      // stay inside the proxy's 60s timeout
+
+int registerWatchHandler(void) {
+    drogon::app().registerHandler("/watch",
+        [latency = routeLatency("/watch")](const HttpRequestPtr& req, std::function<void (const HttpResponsePtr &)> &&cb) {
+            timeResponse(latency, cb);
+            const bool cbor = wantsCbor(req);
+            auto err = [&](const char* code,const char* info="") {
+                Json::Value j;
+                j["ok"]    = false;
+                j["error"] = code;
+                if (*info)
+                    j["reason"] = info;
+                cb(valueResponse(cbor, j)); // app-level errors
+            };
+
+            // check whether token is valid
+            const auto who = SessionManager::instance().identify(req);   // nullptr if invalid/expired
+            if (!who) return err("unauthorised");
+            const std::string& username = who->username;
+
+            // parse and validate json
+            auto bodyPtr = requestBody(req);          // JSON, or CBOR if the client sent that
+            if (!bodyPtr)    return err("invalid_request","parsing failed");
+            const auto& body = *bodyPtr;
+
+            int timeout = DEFAULT_WATCH_SECS;
+            if (body.isMember("timeout")) {
+                if (!body["timeout"].isInt())
+                    return err("invalid_request","invalid timeout");
+                timeout = std::max(1, std::min(MAX_WATCH_SECS, body["timeout"].asInt())); // floor..ceiling
+            }
+
+            auto reply = [cb = std::move(cb), cbor](long long version, bool changed) {
+                Json::Value j;
+                j["ok"]      = true;
+                j["changed"] = changed;
+                j["version"] = static_cast<Json::Int64>(version);
+                cb(valueResponse(cbor, j));
+            };
+
+            if (!body.isMember("version")) 
+                return reply(ChangeFeed::get().version(username), false);
+            if (!body["version"].isInt64())
+                return err("invalid_request","invalid version");
+
+            ChangeFeed::get().wait(username, body["version"].asInt64(), timeout, std::move(reply));
+        },
+        {drogon::Post}  // limit to POST
+    );
+
+    return 0;
+}
@@ -1,4 +1,11 @@
 #include "dhutils.h"
+#include "BookStorage.h"
+#include "BookMeta.h"
+#include "Cbor.h"
+#include "Scrubber.h"
+#include "JsonWriter.h"
+#include "WriteQueue.h"
+#include "utils.h"
 
 // Accept integer in JSON either as number or stringified digits
 bool parseItemId(const Json::Value& v, long long& out) {
@@ -11,4 +18,217 @@ bool parseItemId(const Json::Value& v, long long& out) {
         }
     }
     return false;
-}
\ No newline at end of file
+}
+
+// Parse a /getSince cursor: {"ts": int, "fileId": string (optional), "id": int (optional)}
+bool parseCursor(const Json::Value& v, Database::Cursor& out) {
+    if (!v.isObject() || !v.isMember("ts") || !v["ts"].isInt64())
+        return false;
+
+    Database::Cursor c;
+    c.ts = v["ts"].asInt64();
+    if (v.isMember("fileId")) {
+        if (!v["fileId"].isString()) return false;
+        c.fileId = v["fileId"].asString();
+    }
+    if (v.isMember("id") && !parseItemId(v["id"], c.id))
+        return false;
+
+    out = c;
+    return true;
+}
+
+void writeCursor(RowWriter& out, const Database::Cursor& c) {
+    out.beginObject()
+       .key("ts").value(c.ts)
+       .key("fileId").value(c.fileId);
+    if (c.id != LLONG_MIN)
+        out.key("id").value(c.id);
+    out.endObject();
+}
+
+//
+// wire encoding: JSON unless the client asks for CBOR
+//
+static bool isCbor(const std::string& mediaType) {
+    return mediaType.compare(0, 16, "application/cbor") == 0;
+}
+
+bool wantsCbor(const drogon::HttpRequestPtr& req) {
+    return req->getHeader("accept").find("application/cbor") != std::string::npos;
+}
+
+std::shared_ptr<Json::Value> requestBody(const drogon::HttpRequestPtr& req) {
+    if (!isCbor(req->getHeader("content-type")))
+        return req->getJsonObject();      // Drogon parses for us
+
+    auto v = std::make_shared<Json::Value>();
+    if (!cborToJson(req->getBody(), *v))
+        return nullptr;
+    return v;
+}
+
+std::unique_ptr<RowWriter> makeRowWriter(bool cbor, size_t reserveBytes) {
+    if (cbor)
+        return std::make_unique<CborWriter>(reserveBytes);
+    return std::make_unique<JsonWriter>(reserveBytes);
+}
+
+drogon::HttpResponsePtr rowResponse(RowWriter& out) {
+    auto r = drogon::HttpResponse::newHttpResponse();
+    r->setStatusCode(drogon::k200OK);
+    if (isCbor(out.mimeType()))
+        r->setContentTypeString(out.mimeType());
+    else
+        r->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+    r->setBody(out.take());
+    return r;
+}
+
+void writeValue(RowWriter& out, const Json::Value& v) {
+    switch (v.type()) {
+        case Json::nullValue:    out.null(); break;
+        case Json::intValue:     out.value(static_cast<long long>(v.asInt64())); break;
+        case Json::uintValue:
+            if (v.isInt64()) out.value(static_cast<long long>(v.asInt64()));
+            else             out.value(v.asDouble());      // beyond int64: never in our documents
+            break;
+        case Json::realValue:    out.value(v.asDouble()); break;
+        case Json::stringValue: {
+            const char* b = nullptr; const char* e = nullptr;
+            v.getString(&b, &e);
+            out.value(std::string_view(b, static_cast<size_t>(e - b)));
+            break;
+        }
+        case Json::booleanValue: out.value(v.asBool()); break;
+        case Json::arrayValue:
+            out.beginArray();
+            for (const auto& e : v) writeValue(out, e);
+            out.endArray();
+            break;
+        case Json::objectValue:
+            out.beginObject();
+            for (auto it = v.begin(); it != v.end(); ++it) {
+                out.key(it.name());
+                writeValue(out, *it);
+            }
+            out.endObject();
+            break;
+    }
+}
+
+drogon::HttpResponsePtr valueResponse(bool cbor, const Json::Value& j) {
+    if (!cbor) {
+        auto r = drogon::HttpResponse::newHttpJsonResponse(j);
+        r->setStatusCode(drogon::k200OK);
+        return r;
+    }
+    CborWriter out(256);
+    writeValue(out, j);
+    return rowResponse(out);
+}
+
+// fileId of a book we already hold: a "books" row for sha256+size AND its file in the library.
+// Empty if it would have to be uploaded.
+std::string findStoredBook(const std::string& sha256, long long size) {
+    Database& db = Database::get();
+    const std::string fid = db.lookupFileIdByHashSize(sha256, size);
+    if (fid.empty()) return fid;
+
+    std::string location, sha;
+    long long   storedSize = -1;
+    db.getBookForDownload(fid, location, storedSize, sha);
+
+    // what the scrubber last found; a damaged copy is replaced by the upload (Scrubber::mend)
+    switch (Scrubber::get().state(fid)) {
+        case Scrubber::State::Ok:
+        case Scrubber::State::Present:
+            return fid;
+        case Scrubber::State::Unknown:
+            break;
+        default:
+            return "";
+    }
+    if (!BookStorage::get().holds(location, storedSize))
+        return "";
+    return fid;
+}
+
+// the verified book at BookStorage's incoming(newId) joins the library, then gets its row
+void storeBook(const std::string& newId, const std::string& sha256, long long size,
+               const std::string& clientFileName,
+               std::function<void (const drogon::HttpResponsePtr &)> &&cb) {
+    BookStorage::get().put(newId, size,
+        [=, cb = std::move(cb)](const std::string& location, const std::string& error) mutable {
+            if (location.empty()) {
+                Json::Value j;
+                j["ok"]=false; j["error"]="server_error"; j["reason"]=error;
+                auto r=drogon::HttpResponse::newHttpJsonResponse(j);
+                r->setStatusCode(drogon::k200OK);
+                return cb(r);
+            }
+            // s3: its cached copy stays until BookMeta has read it
+            submitBookRecord(newId, sha256, size, location, clientFileName, BookStorage::get().hold(newId), std::move(cb));
+        });
+}
+
+// record a book that is now in the library (via the WriteQueue) and answer the upload
+// once the row is committed: {ok, fileId, size, sha256, fileName}
+void submitBookRecord(const std::string& newId, const std::string& sha256, long long size,
+                      const std::string& location, const std::string& clientFileName,
+                      std::shared_ptr<void> held,
+                      std::function<void (const drogon::HttpResponsePtr &)> &&cb) {
+    const long long tnow = nowMs();
+    auto storedId = std::make_shared<std::string>();
+    WriteQueue::get().submit(
+        [=] {
+            Database& db = Database::get();
+            try {
+                db.insertBookRecord(newId, sha256, size, location, clientFileName, tnow);
+                *storedId = newId;
+            } catch (...) {
+                // race: someone inserted first; look up by content and return that id
+                *storedId = db.lookupFileIdByHashSize(sha256, size);
+            }
+        },
+        [cb = std::move(cb), storedId, newId, size, sha256, location, clientFileName, held](bool committed) {
+            Json::Value j;
+            if (committed && !storedId->empty()) {
+                if (*storedId == newId) {
+                    Scrubber::get().verified(newId, location);
+                    // still on local disk, whatever the BookStorage (s3: in its cache, held there)
+                    BookMeta::get().extract(newId, BookStorage::get().incoming(newId).string(), held);
+                } else {
+                    Scrubber::get().mend(*storedId, location);
+                }
+
+                j["ok"]=true;
+                j["fileId"]=*storedId;
+                j["size"]=Json::Int64(size);
+                j["sha256"]=sha256;
+                j["fileName"]=clientFileName;
+            } else {
+                j["ok"]=false; j["error"]="server_error"; j["reason"]="could not update 'books' table";
+            }
+            auto r=drogon::HttpResponse::newHttpJsonResponse(j);
+            r->setStatusCode(drogon::k200OK); cb(r);
+        });
+}
+
+Metrics::Histogram routeLatency(const char* route) {
+    return Metrics::get().histogram("simplereader_http_request_duration_seconds",
+                                    "Time from a request reaching its handler to its response being sent.",
+                                    std::string("route=\"") + route + "\"");
+}
+
+void timeResponse(const Metrics::Histogram& latency, std::function<void (const drogon::HttpResponsePtr &)>& cb) {
+    auto inner = std::move(cb);
+    cb = [latency, start = Metrics::Clock::now(), inner = std::move(inner)](const drogon::HttpResponsePtr& r) {
+        latency.since(start);
+        inner(r);
+    };
+}
+
+bool fromLocalAdmin(const drogon::HttpRequestPtr& req) {
+    return req->peerAddr().isLoopbackIp() && req->getHeader("x-forwarded-for").empty();
+}
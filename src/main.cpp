@@ -3,20 +3,43 @@
 #include <syslog.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <sodium.h>
 
 #include "Config.h"
 #include "Database.h"
+#include "SessionManager.h"
+#include "WriteQueue.h"
+#include "Admission.h"
+#include "ChangeFeed.h"
+#include "Compactor.h"
+#include "Backup.h"
+#include "Scrubber.h"
+#include "BookMeta.h"
+#include "BookStorage.h"
+#include "Compression.h"
+#include "Log.h"
 #include "dh_root.h"
 #include "dh_login.h"
 #include "dh_check.h"
 #include "dh_resolve.h"
 #include "dh_get.h"
 #include "dh_getSince.h"
+#include "dh_sync.h"
+#include "dh_bootstrap.h"
+#include "dh_watch.h"
 #include "dh_getBook.h"
+#include "dh_bookMeta.h"
 #include "dh_uploadBook.h"
+#include "dh_upload.h"
 #include "dh_update.h"
 #include "dh_delete.h"
 #include "dh_ruOK.h"
+#include "dh_metrics.h"
+#include "dh_backup.h"
 #include "utils.h"
 
 void handleSignal(int sig) {
@@ -25,6 +48,20 @@ void handleSignal(int sig) {
     exit(1);
 }
 
+// SIGHUP re-reads simplereader.conf: the handler only raises a flag, the main loop reloads
+static std::atomic<bool> reloadRequested{false};
+void handleHangup(int) {
+    reloadRequested = true;
+}
+
+// push the reloadable tunables that aren't read straight from Config
+static void applyTunables(void) {
+    const Config& c = Config::get();
+    Log::get().setLevel(Log::levelFromString(c.logLevel()));
+    Database::get().setCacheSizes(c.dbCacheKB(), c.dbMmapBytes());
+    WriteQueue::get().tune(c.writeWindowMs(), static_cast<size_t>(c.writeMaxBatch()));
+}
+
 int main() {
 
     // open syslog
@@ -34,6 +71,7 @@ int main() {
     signal(SIGINT,  handleSignal);
     signal(SIGTERM, handleSignal);
     signal(SIGSEGV, handleSignal); // crash (segfault)
+    signal(SIGHUP,  handleHangup);  // reload config
 
     try {
         ////////////////////////////////////////////////////////////////////////
@@ -41,13 +79,46 @@ int main() {
         //
         Config::get().load(); // load singleton Config
 
+        // syslog from a background thread, not the IO threads
+        Log::get().setLevel(Log::levelFromString(Config::get().logLevel()));
+        Log::get().start();
+
+        if (sodium_init() < 0)  // session tokens and password checks rely on it
+            throw std::runtime_error("libsodium failed to initialise");
+
         std::string msg = std::string("starting simplereaderd ") + Config::get().toString();
-        syslog(LOG_INFO,"%s",msg.c_str());
+        logMsg(SYSLOG_INFO,"%s",msg.c_str());
 
         ////////////////////////////////////////////////////////////////////////
         // start sqlite server
-        //   
-        Database::get().open("/var/lib/simplereader/app.db");
+        //   one reader connection per IO thread (unless dbreaders says otherwise), so reads never queue behind each other
+        //
+        const Config& cfg = Config::get();
+        const size_t ioThreads = cfg.ioThreads() > 0 ? static_cast<size_t>(cfg.ioThreads())
+                                                     : std::max(1u, std::thread::hardware_concurrency());
+        drogon::app().setThreadNum(ioThreads);
+        Database::get().setCacheSizes(cfg.dbCacheKB(), cfg.dbMmapBytes());
+        Database::get().setSharedWriters(cfg.sessionStore() == "redis");     // several instances on this app.db
+        Database::get().open("/var/lib/simplereader/app.db",
+                             cfg.dbReaders() > 0 ? cfg.dbReaders() : static_cast<int>(drogon::app().getThreadNum()),
+                             cfg.dbShards());
+
+        // all writes go through one queue (a lane per shard), committed in groups; /watch hears of each commit
+        ChangeFeed::get().start();
+        WriteQueue::get().start(cfg.writeWindowMs(), static_cast<size_t>(cfg.writeMaxBatch()));
+
+        // sessions: this process only (persistsessions=1: picks up where we left off, no
+        // re-login storm after a restart), or shared with the other instances through Redis
+        if (cfg.sessionStore() == "redis")
+            SessionManager::instance().setBackend(makeRedisSessionBackend(cfg.redisHost(), cfg.redisPort(), cfg.redisPassword()));
+        else
+            SessionManager::instance().setBackend(makeLocalSessionBackend(cfg.persistSessions()));
+
+        // books: a local directory, or an S3 bucket with a local cache of the books in use
+        if (cfg.bookStore() == "s3")
+            BookStorage::install(makeS3BookStorage());
+        else
+            BookStorage::install(makeLocalBookStorage(cfg.libraryDir()));
 
         ////////////////////////////////////////////////////////////////////////
         // start the server (app) and wait for http events/requests to roll in
@@ -58,16 +129,34 @@ int main() {
         registerResolveHandler();
         registerGetHandler();
         registerGetSinceHandler();
+        registerSyncHandler();
+        registerBootstrapHandler();
+        registerWatchHandler();
         registerGetBookHandler();
+        registerBookMetaHandlers();
         registerUploadBookHandler();
+        registerUploadHandlers();
         registerUpdateHandler();
         registerDeleteHandler();
         registerRUOKHandler();
+        registerMetricsHandler();
+        registerBackupHandler();
+        SessionManager::instance().startExpiryTimer();
+        Compactor::get().start();       // tombstones every device has seen are purged in the background
+        Backup::get().start();          // online backups, on a schedule and on request
+        Scrubber::get().start();        // every book re-hashed in the background, at scrubmbps
+        BookMeta::get().start();        // titles, authors, pages and covers read out of uploads
+        Admission::get().start();       // per-user rate limits, and shedding when overloaded
+        enableResponseCompression();
+        drogon::app().getLoop()->runEvery(1.0, []{
+            if (reloadRequested.exchange(false) && Config::get().reload())
+                applyTunables();
+        });
         std::cout << "Running..." << std::endl;
         
         drogon::app()
             .setClientMaxBodySize(Config::get().maxFileSize())             // limit upload requests to maxFileSize
-            .setClientMaxMemoryBodySize(2 * 1024 * 1024)                   // keep 2 MB in RAM, then packetize
+            .setClientMaxMemoryBodySize(cfg.memoryBodyBytes())             // keep this much in RAM, then packetize
             .setUploadPath("/var/lib/simplereader/tmp");                   // temp dir for large files
 
         drogon::app()
@@ -78,8 +167,14 @@ int main() {
         logFatal(ex,1);
     }
 
-    syslog(LOG_INFO, "simplereaderd shutting down");
+    logMsg(SYSLOG_INFO, "simplereaderd shutting down");
+    Backup::get().stop();
+    Scrubber::get().stop();
+    BookMeta::get().stop();
+    BookStorage::close();
+    WriteQueue::get().stop();
     Database::get().close();
+    Log::get().stop();
     closelog();
     return 0;
 }
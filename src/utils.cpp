@@ -13,10 +13,13 @@ const int SYSLOG_DEBUG = LOG_DEBUG;
 
 #include <jsoncpp/json/writer.h>
 
+#include "Log.h"
+
 // for logging fatal exceptions to syslog
 [[noreturn]] void logFatal(const std::exception &ex, int exitCode) {
   std::string msg = std::string("Fatal: ") + ex.what();
   std::cerr << msg << std::endl;
+  Log::get().stop();    // what's queued first, then this, synchronously
   syslog(SYSLOG_ERR, "%s", msg.c_str());
   closelog();   // flush
   exit(exitCode);
@@ -39,10 +42,11 @@ bool isHex64(std::string& s) {
 }
 
 void prettyJSON(const Json::Value& json, const std::string hdr) {
+  if (!Log::get().enabled(SYSLOG_DEBUG)) return;   // don't serialise what won't be logged
 
   Json::StreamWriterBuilder wb;
   wb["indentation"] = "";            // one-line
   std::string s = Json::writeString(wb, json);
-  syslog(SYSLOG_DEBUG, "%s%s", hdr.c_str(), s.c_str());
+  logMsg(SYSLOG_DEBUG, "%s%s", hdr.c_str(), s.c_str());
 
 }
\ No newline at end of file
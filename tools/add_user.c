@@ -1,11 +1,32 @@
 // add_user.c
+//
+//   add_user <username> <password>          add (or reset) one user
+//   add_user --bulk <file> [--threads N]    add many: CSV "username,password" or JSON lines
+//                                           {"username":...,"password":...}, one per line
+//   add_user --export <username>...         everything of those users, as JSON lines on stdout
+//   add_user --import <file>                ... and back in, here or on another instance
+//
+//   <file> may be "-" for stdin.  --export/--import move a user between instances (or
+//   between shard layouts: rows go to whichever shard the username hashes to here) without
+//   going through the HTTP API.  Restart simplereaderd after an import: it caches per-user
+//   state at startup and wouldn't see the new rows until then.
+//
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sqlite3.h>
 #include <sodium.h>
 
+#ifndef DB_PATH
 #define DB_PATH "/var/lib/simplereader/app.db"
+#endif
+
+#define BATCH_ROWS   5000   // rows per transaction in --bulk and --import
+#define MAX_THREADS  16     // argon2 "interactive" takes 64 MB per hash in flight
+#define MAX_SHARDS   64     // as dbshards
 
 static int ensure_schema(sqlite3 *db) {
     const char *ddl =
@@ -23,49 +44,151 @@ static int ensure_schema(sqlite3 *db) {
     return rc;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <username> <password>\n", argv[0]);
-        return 1;
+static sqlite3 *open_db(const char *path) {
+    sqlite3 *db = NULL;
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "sqlite open failed: %s: %s\n", path, sqlite3_errmsg(db));
+        if (db) sqlite3_close(db);
+        return NULL;
     }
-    const char *username = argv[1];
-    const char *password = argv[2];
+    sqlite3_busy_timeout(db, 5000);     // the daemon may be writing
+    return db;
+}
 
-    if (sodium_init() < 0) {
-        fprintf(stderr, "libsodium init failed\n");
-        return 1;
+static int exec(sqlite3 *db, const char *sql) {
+    char *err = NULL;
+    int rc = sqlite3_exec(db, sql, NULL, NULL, &err);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, err ? err : sqlite3_errmsg(db));
+        sqlite3_free(err);
     }
+    return rc;
+}
 
-    // Open DB
-    sqlite3 *db = NULL;
-    if (sqlite3_open(DB_PATH, &db) != SQLITE_OK) {
-        fprintf(stderr, "sqlite open failed: %s\n", sqlite3_errmsg(db));
-        if (db) sqlite3_close(db);
-        return 1;
+static int hash_password(const char *password, char hash[crypto_pwhash_STRBYTES]) {
+    // Argon2id, interactive params
+    return crypto_pwhash_str(hash, password, strlen(password),
+                             crypto_pwhash_OPSLIMIT_INTERACTIVE,
+                             crypto_pwhash_MEMLIMIT_INTERACTIVE);
+}
+
+static const char *INSERT_USER_SQL =
+    "INSERT OR REPLACE INTO users(username, pwd_hash, created_at) "
+    "VALUES(?, ?, strftime('%s','now'));";
+
+static FILE *open_input(const char *path) {
+    if (strcmp(path, "-") == 0) return stdin;
+    FILE *f = fopen(path, "r");
+    if (!f) perror(path);
+    return f;
+}
+
+// one line, without its newline (and \r); NULL at end of file. Free with free().
+static char *read_line(FILE *f) {
+    char   *line = NULL;
+    size_t  cap  = 0;
+    ssize_t n    = getline(&line, &cap, f);
+    if (n < 0) {
+        free(line);
+        return NULL;
+    }
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+        line[--n] = '\0';
+    return line;
+}
+
+//****************************************************************
+//  shards: the same layout as Database::open (dbshards)
+//****************************************************************
+
+// FNV-1a, as Database::shardIndex
+static unsigned shard_of(const char *username, unsigned n) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)username; *p; ++p) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h % n;
+}
+
+// app.db -> app.shard-03.db
+static void shard_path(char *out, size_t size, int i) {
+    const char *dot = strrchr(DB_PATH, '.');
+    if (!dot || strchr(dot, '/'))
+        dot = DB_PATH + strlen(DB_PATH);
+    snprintf(out, size, "%.*s.shard-%02d%s", (int)(dot - DB_PATH), DB_PATH, i, dot);
+}
+
+// shards recorded in app.db (0: not sharded)
+static int shard_layout(sqlite3 *db) {
+    sqlite3_stmt *st = NULL;
+    int n = 0;
+    if (sqlite3_prepare_v2(db, "SELECT shards FROM shard_layout WHERE id = 1;", -1, &st, NULL) == SQLITE_OK &&
+        sqlite3_step(st) == SQLITE_ROW)
+        n = sqlite3_column_int(st, 0);
+    sqlite3_finalize(st);       // no table: made before sharding existed
+    return (n > 0 && n <= MAX_SHARDS) ? n : 0;
+}
+
+// app.db and its shards, opened as they're needed
+struct store {
+    sqlite3 *main;
+    int      shards;
+    sqlite3 *shard[MAX_SHARDS];
+};
+
+static int store_open(struct store *s) {
+    memset(s, 0, sizeof *s);
+    s->main = open_db(DB_PATH);
+    if (!s->main) return -1;
+    s->shards = shard_layout(s->main);
+    return 0;
+}
+
+// the file with this user's user_* rows
+static sqlite3 *store_for(struct store *s, const char *username) {
+    if (s->shards == 0) return s->main;
+    const unsigned i = shard_of(username, (unsigned)s->shards);
+    if (!s->shard[i]) {
+        char path[4096];
+        shard_path(path, sizeof path, (int)i);
+        if (access(path, F_OK) != 0) {
+            fprintf(stderr, "%s is missing\n", path);
+            return NULL;
+        }
+        s->shard[i] = open_db(path);
     }
+    return s->shard[i];
+}
+
+static void store_close(struct store *s) {
+    for (int i = 0; i < MAX_SHARDS; ++i)
+        if (s->shard[i]) sqlite3_close(s->shard[i]);
+    sqlite3_close(s->main);
+}
+
+//****************************************************************
+//  one user
+//****************************************************************
+static int add_one(const char *username, const char *password) {
+    sqlite3 *db = open_db(DB_PATH);
+    if (!db) return 1;
 
     if (ensure_schema(db) != SQLITE_OK) {
         sqlite3_close(db);
         return 1;
     }
 
-    // Hash password (Argon2id, interactive params)
     char hash[crypto_pwhash_STRBYTES];
-    if (crypto_pwhash_str(hash, password, strlen(password),
-                          crypto_pwhash_OPSLIMIT_INTERACTIVE,
-                          crypto_pwhash_MEMLIMIT_INTERACTIVE) != 0) {
+    if (hash_password(password, hash) != 0) {
         fprintf(stderr, "crypto_pwhash_str failed (OOM?)\n");
         sqlite3_close(db);
         return 1;
     }
 
     // Insert or replace user
-    const char *sql =
-        "INSERT OR REPLACE INTO users(username, pwd_hash, created_at) "
-        "VALUES(?, ?, strftime('%s','now'));";
-
     sqlite3_stmt *st = NULL;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &st, NULL);
+    int rc = sqlite3_prepare_v2(db, INSERT_USER_SQL, -1, &st, NULL);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "prepare failed: %s\n", sqlite3_errmsg(db));
         sqlite3_close(db);
@@ -89,3 +212,543 @@ int main(int argc, char *argv[]) {
     printf("User '%s' added/updated in %s\n", username, DB_PATH);
     return 0;
 }
+
+//****************************************************************
+//  --bulk: parse every line, hash on all cores, insert in big transactions
+//****************************************************************
+struct account {
+    char *username;
+    char *password;
+    char  hash[crypto_pwhash_STRBYTES];
+    int   hashed;
+};
+
+struct hash_job {
+    struct account  *accounts;
+    size_t           count;
+    size_t           next;      // the next account to hash, under mu
+    pthread_mutex_t  mu;
+};
+
+static void *hash_worker(void *arg) {
+    struct hash_job *job = arg;
+    for (;;) {
+        pthread_mutex_lock(&job->mu);
+        const size_t i = job->next++;
+        pthread_mutex_unlock(&job->mu);
+        if (i >= job->count) return NULL;
+
+        struct account *a = &job->accounts[i];
+        a->hashed = (hash_password(a->password, a->hash) == 0);
+        sodium_memzero(a->password, strlen(a->password));
+    }
+}
+
+// one CSV field from *p (RFC 4180 quoting), advancing past its comma (*comma: there was one).
+// NULL if malformed.
+static char *csv_field(char **p, int *comma) {
+    char *in = *p, *out, *start;
+    if (*in == '"') {
+        start = out = ++in;
+        for (;;) {
+            if (*in == '\0') return NULL;                   // unterminated
+            if (*in == '"') {
+                if (in[1] != '"') break;
+                ++in;                                       // "" -> "
+            }
+            *out++ = *in++;
+        }
+        ++in;
+        if (*in != ',' && *in != '\0') return NULL;
+    } else {
+        start = in;
+        while (*in != ',' && *in != '\0') ++in;
+        out = in;
+    }
+    *comma = (*in == ',');
+    *p = *comma ? in + 1 : in;
+    *out = '\0';
+    return start;
+}
+
+// 1: parsed, 0: skip (blank, comment or header), -1: malformed
+static int parse_account(sqlite3_stmt *json, char *line, struct account *a) {
+    while (*line == ' ' || *line == '\t') ++line;
+    if (*line == '\0' || *line == '#') return 0;
+
+    if (*line == '{') {
+        sqlite3_bind_text(json, 1, line, -1, SQLITE_STATIC);
+        int ok = (sqlite3_step(json) == SQLITE_ROW && sqlite3_column_int(json, 0) &&
+                  sqlite3_column_type(json, 1) == SQLITE_TEXT && sqlite3_column_type(json, 2) == SQLITE_TEXT);
+        if (ok) {
+            a->username = strdup((const char *)sqlite3_column_text(json, 1));
+            a->password = strdup((const char *)sqlite3_column_text(json, 2));
+        }
+        sqlite3_reset(json);
+        return ok ? 1 : -1;
+    }
+
+    char *p = line;
+    int comma = 0, more = 0;
+    char *user = csv_field(&p, &comma);
+    char *pass = (user && comma) ? csv_field(&p, &more) : NULL;
+    if (!user || !pass || more || *user == '\0' || *pass == '\0') return -1;
+    if (strcmp(user, "username") == 0 && strcmp(pass, "password") == 0) return 0;
+    a->username = strdup(user);
+    a->password = strdup(pass);
+    return 1;
+}
+
+static int bulk_add(const char *path, int threads) {
+    FILE *in = open_input(path);
+    if (!in) return 1;
+
+    sqlite3 *db = open_db(DB_PATH);
+    if (!db || ensure_schema(db) != SQLITE_OK) {
+        if (db) sqlite3_close(db);
+        if (in != stdin) fclose(in);
+        return 1;
+    }
+
+    // JSON lines are taken apart by sqlite's own JSON functions
+    sqlite3_stmt *json = NULL;
+    sqlite3_prepare_v2(db, "SELECT json_valid(?1), json_extract(?1,'$.username'), json_extract(?1,'$.password');",
+                       -1, &json, NULL);
+
+    struct account *accounts = NULL;
+    size_t count = 0, cap = 0, lineno = 0, bad = 0;
+    char *line;
+    while ((line = read_line(in)) != NULL) {
+        ++lineno;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            accounts = realloc(accounts, cap * sizeof *accounts);
+            if (!accounts) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        memset(&accounts[count], 0, sizeof accounts[count]);
+        const int r = parse_account(json, line, &accounts[count]);
+        if (r < 0) {
+            fprintf(stderr, "%s:%zu: not \"username,password\" nor {\"username\":...,\"password\":...}\n", path, lineno);
+            ++bad;
+        } else if (r > 0) {
+            ++count;
+        }
+        sodium_memzero(line, strlen(line));
+        free(line);
+    }
+    sqlite3_finalize(json);
+    if (in != stdin) fclose(in);
+
+    // hashing is nearly all the time: spread it over the cores
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = (cores > 0) ? (int)cores : 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if ((size_t)threads > count) threads = count ? (int)count : 1;
+
+    struct hash_job job = { accounts, count, 0, PTHREAD_MUTEX_INITIALIZER };
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (; started < threads; ++started)
+        if (pthread_create(&tids[started], NULL, hash_worker, &job) != 0) break;
+    if (started == 0)
+        hash_worker(&job);
+    for (int i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+
+    // then one statement, BATCH_ROWS to a transaction
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(db, INSERT_USER_SQL, -1, &st, NULL) != SQLITE_OK) {
+        fprintf(stderr, "prepare failed: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return 1;
+    }
+    size_t added = 0, failed = 0, batch = 0;
+    int rc = exec(db, "BEGIN IMMEDIATE;");
+    for (size_t i = 0; i < count && rc == SQLITE_OK; ++i) {
+        struct account *a = &accounts[i];
+        if (!a->hashed) {
+            fprintf(stderr, "crypto_pwhash_str failed for '%s' (OOM?)\n", a->username);
+            ++failed;
+            continue;
+        }
+        sqlite3_bind_text(st, 1, a->username, -1, SQLITE_STATIC);
+        sqlite3_bind_text(st, 2, a->hash, -1, SQLITE_STATIC);
+        if (sqlite3_step(st) != SQLITE_DONE) {
+            fprintf(stderr, "insert of '%s' failed: %s\n", a->username, sqlite3_errmsg(db));
+            ++failed;
+        } else {
+            ++added;
+        }
+        sqlite3_reset(st);
+        if (++batch == BATCH_ROWS && (rc = exec(db, "COMMIT;")) == SQLITE_OK) {
+            rc = exec(db, "BEGIN IMMEDIATE;");
+            batch = 0;
+        }
+    }
+    if (rc == SQLITE_OK)
+        rc = exec(db, "COMMIT;");
+    sqlite3_finalize(st);
+    sqlite3_close(db);
+
+    for (size_t i = 0; i < count; ++i) {
+        free(accounts[i].username);
+        free(accounts[i].password);
+    }
+    free(accounts);
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "not all added: the last batch was rolled back\n");
+        return 1;
+    }
+    printf("%zu user(s) added/updated in %s (%d thread%s)", added, DB_PATH, threads, threads == 1 ? "" : "s");
+    if (bad || failed) printf(", %zu line(s) skipped", bad + failed);
+    printf("\n");
+    return (bad || failed) ? 1 : 0;
+}
+
+//****************************************************************
+//  --export / --import: one JSON object per row, {"table":..., <column>:<value>...}
+//
+//    Exported in the order they have to go back in: the books the user's rows refer
+//    to, the user, then their rows (tombstones too, so other devices' cursors stay
+//    good) and their sync watermarks.
+//****************************************************************
+enum where { MAIN, USER_ROWS };     // app.db, or the user's shard
+
+static const struct table {
+    const char *name;
+    const char *cols;               // the first is the key exported by
+    enum where  where;
+} TABLES[] = {
+    { "books",            "file_id, sha256, filesize, location, filename, updated_at", MAIN },
+    { "users",            "username, pwd_hash, created_at", MAIN },
+    { "user_books",       "username, file_id, progress, updated_at, deleted_at, changed_at", USER_ROWS },
+    { "user_bookmarks",   "username, file_id, id, locator, label, updated_at, deleted_at, changed_at", USER_ROWS },
+    { "user_highlights",  "username, file_id, id, selection, label, colour, updated_at, deleted_at, changed_at", USER_ROWS },
+    { "user_notes",       "username, file_id, id, locator, content, updated_at, deleted_at, changed_at", USER_ROWS },
+    { "tombstone_purges", "username, books_ts, bookmarks_ts, highlights_ts, notes_ts", MAIN },
+    { "device_sync",      "username, device, books_ts, bookmarks_ts, highlights_ts, notes_ts, seen_at", MAIN },
+};
+#define TABLE_COUNT (sizeof TABLES / sizeof TABLES[0])
+
+// "a, b" -> each column name in turn
+static const char *next_col(const char *p, char *col, size_t size) {
+    while (*p == ' ' || *p == ',') ++p;
+    if (*p == '\0') return NULL;
+    size_t n = strcspn(p, ",");
+    while (n > 0 && p[n - 1] == ' ') --n;
+    snprintf(col, size, "%.*s", (int)n, p);
+    return p + n;
+}
+
+// SELECT json_object('table','t','a',a,...) FROM t WHERE <first column> = ?1
+static void export_sql(const struct table *t, char *sql, size_t size) {
+    char col[64], first[64] = "";
+    int n = snprintf(sql, size, "SELECT json_object('table','%s'", t->name);
+    for (const char *p = t->cols; (p = next_col(p, col, sizeof col)) != NULL; ) {
+        if (!*first) snprintf(first, sizeof first, "%s", col);
+        n += snprintf(sql + n, size - n, ",'%s',%s", col, col);
+    }
+    snprintf(sql + n, size - n, ") FROM %s WHERE %s = ?1;", t->name, first);
+}
+
+// INSERT OR REPLACE INTO t (a, ...) VALUES (json_extract(?1,'$.a'), ...); file_id is ?2
+static void import_sql(const struct table *t, char *sql, size_t size) {
+    char col[64];
+    int n = snprintf(sql, size, "INSERT OR %s INTO %s (%s) VALUES (",
+                     strcmp(t->name, "books") == 0 ? "IGNORE" : "REPLACE", t->name, t->cols);
+    int i = 0;
+    for (const char *p = t->cols; (p = next_col(p, col, sizeof col)) != NULL; ++i) {
+        if (strcmp(col, "file_id") == 0)
+            n += snprintf(sql + n, size - n, "%s?2", i ? "," : "");
+        else
+            n += snprintf(sql + n, size - n, "%sjson_extract(?1,'$.%s')", i ? "," : "", col);
+    }
+    snprintf(sql + n, size - n, ");");
+}
+
+// write every row of `t` keyed by `key`; -1 on error
+static int export_rows(sqlite3 *db, const struct table *t, const char *key, FILE *out) {
+    char sql[1024];
+    export_sql(t, sql, sizeof sql);
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &st, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", t->name, sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_bind_text(st, 1, key, -1, SQLITE_STATIC);
+    int rc, n = 0;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        fputs((const char *)sqlite3_column_text(st, 0), out);
+        fputc('\n', out);
+        ++n;
+    }
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "%s: %s\n", t->name, sqlite3_errmsg(db));
+        n = -1;
+    }
+    sqlite3_finalize(st);
+    return n;
+}
+
+static int export_user(struct store *s, const char *username, FILE *out) {
+    sqlite3 *rows = store_for(s, username);
+    if (!rows) return -1;
+
+    // one snapshot of each file, so the rows agree with one another
+    if (exec(s->main, "BEGIN;") != SQLITE_OK) return -1;
+    if (rows != s->main && exec(rows, "BEGIN;") != SQLITE_OK) {
+        exec(s->main, "ROLLBACK;");
+        return -1;
+    }
+
+    int n = 0, rc = 0;
+    sqlite3_stmt *ids = NULL;
+    if (sqlite3_prepare_v2(rows,
+            "SELECT file_id FROM user_books WHERE username = ?1 UNION "
+            "SELECT file_id FROM user_bookmarks WHERE username = ?1 UNION "
+            "SELECT file_id FROM user_highlights WHERE username = ?1 UNION "
+            "SELECT file_id FROM user_notes WHERE username = ?1;", -1, &ids, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(rows));
+        rc = -1;
+    } else {
+        sqlite3_bind_text(ids, 1, username, -1, SQLITE_STATIC);
+        while (rc >= 0 && sqlite3_step(ids) == SQLITE_ROW) {
+            rc = export_rows(s->main, &TABLES[0], (const char *)sqlite3_column_text(ids, 0), out);
+            n += rc;
+        }
+        sqlite3_finalize(ids);
+    }
+    for (size_t t = 1; t < TABLE_COUNT && rc >= 0; ++t) {
+        rc = export_rows(TABLES[t].where == MAIN ? s->main : rows, &TABLES[t], username, out);
+        if (t == 1 && rc == 0) {
+            fprintf(stderr, "no user '%s'\n", username);
+            rc = -1;
+        }
+        n += rc;
+    }
+
+    exec(s->main, "COMMIT;");
+    if (rows != s->main) exec(rows, "COMMIT;");
+    return rc < 0 ? -1 : n;
+}
+
+static int export_users(int count, char **usernames) {
+    struct store s;
+    if (store_open(&s) != 0) return 1;
+    int status = 0;
+    for (int i = 0; i < count; ++i) {
+        const int n = export_user(&s, usernames[i], stdout);
+        if (n < 0)
+            status = 1;
+        else
+            fprintf(stderr, "%s: %d row(s)\n", usernames[i], n);
+    }
+    store_close(&s);
+    if (fflush(stdout) != 0) {
+        perror("stdout");
+        status = 1;
+    }
+    return status;
+}
+
+// books already here under another file_id (same sha256 and size): their rows follow them
+struct remap {
+    char  (*from)[64];
+    char  (*to)[64];
+    size_t count;
+};
+
+static const char *remapped(const struct remap *m, const char *fileId) {
+    for (size_t i = 0; i < m->count; ++i)
+        if (strcmp(m->from[i], fileId) == 0) return m->to[i];
+    return fileId;
+}
+
+// a book row went in, or was here already: note it if it's known here by another id
+static void note_book(sqlite3 *db, const char *line, const char *fileId, struct remap *m) {
+    if (remapped(m, fileId) != fileId) return;      // another user's export brought it too
+    sqlite3_stmt *st = NULL;
+    sqlite3_prepare_v2(db, "SELECT file_id FROM books WHERE sha256 = json_extract(?1,'$.sha256') "
+                           "AND filesize = json_extract(?1,'$.filesize');", -1, &st, NULL);
+    sqlite3_bind_text(st, 1, line, -1, SQLITE_STATIC);
+    if (sqlite3_step(st) == SQLITE_ROW) {
+        const char *here = (const char *)sqlite3_column_text(st, 0);
+        if (here && strcmp(here, fileId) != 0) {
+            m->from = realloc(m->from, (m->count + 1) * sizeof *m->from);
+            m->to   = realloc(m->to,   (m->count + 1) * sizeof *m->to);
+            snprintf(m->from[m->count], sizeof m->from[0], "%s", fileId);
+            snprintf(m->to[m->count],   sizeof m->to[0],   "%s", here);
+            ++m->count;
+            fprintf(stderr, "book %s is here already as %s: its rows are imported under that id\n", fileId, here);
+        }
+    }
+    sqlite3_finalize(st);
+}
+
+static int import_rows(const char *path) {
+    FILE *in = open_input(path);
+    if (!in) return 1;
+    struct store s;
+    if (store_open(&s) != 0) {
+        if (in != stdin) fclose(in);
+        return 1;
+    }
+
+    // statements per file and table, prepared (and the file's transaction begun) on first use
+    sqlite3      *files[MAX_SHARDS + 1] = { NULL };
+    sqlite3_stmt *stmts[MAX_SHARDS + 1][TABLE_COUNT];
+    memset(stmts, 0, sizeof stmts);
+    size_t nfiles = 0;
+
+    sqlite3_stmt *head = NULL;      // which table, and whose
+    sqlite3_prepare_v2(s.main, "SELECT json_valid(?1), json_extract(?1,'$.table'), "
+                               "json_extract(?1,'$.username'), json_extract(?1,'$.file_id');", -1, &head, NULL);
+
+    struct remap m = { NULL, NULL, 0 };
+    size_t lineno = 0, imported = 0, failed = 0, pending = 0;
+    int rc = SQLITE_OK;
+    char *line;
+    while (rc == SQLITE_OK && (line = read_line(in)) != NULL) {
+        ++lineno;
+        if (*line == '\0') {
+            free(line);
+            continue;
+        }
+
+        sqlite3_bind_text(head, 1, line, -1, SQLITE_STATIC);
+        const struct table *t = NULL;
+        size_t ti = 0;
+        char username[512] = "", fileId[64] = "";
+        if (sqlite3_step(head) == SQLITE_ROW && sqlite3_column_int(head, 0)) {
+            const char *name = (const char *)sqlite3_column_text(head, 1);
+            for (ti = 0; name && ti < TABLE_COUNT; ++ti)
+                if (strcmp(TABLES[ti].name, name) == 0) {
+                    t = &TABLES[ti];
+                    break;
+                }
+            if (sqlite3_column_text(head, 2))
+                snprintf(username, sizeof username, "%s", (const char *)sqlite3_column_text(head, 2));
+            if (sqlite3_column_text(head, 3))
+                snprintf(fileId, sizeof fileId, "%s", (const char *)sqlite3_column_text(head, 3));
+        }
+        sqlite3_reset(head);
+        if (!t || (t->where == USER_ROWS && !*username)) {
+            fprintf(stderr, "%s:%zu: not an exported row\n", path, lineno);
+            ++failed;
+            free(line);
+            continue;
+        }
+
+        sqlite3 *db = (t->where == MAIN) ? s.main : store_for(&s, username);
+        if (!db) {
+            rc = SQLITE_ERROR;
+            free(line);
+            break;
+        }
+        size_t f = 0;
+        while (f < nfiles && files[f] != db) ++f;
+        if (f == nfiles) {
+            files[nfiles++] = db;
+            if ((rc = exec(db, "BEGIN IMMEDIATE;")) != SQLITE_OK) {
+                free(line);
+                break;
+            }
+        }
+        if (!stmts[f][ti]) {
+            char sql[1024];
+            import_sql(t, sql, sizeof sql);
+            if (sqlite3_prepare_v2(db, sql, -1, &stmts[f][ti], NULL) != SQLITE_OK) {
+                fprintf(stderr, "%s: %s (has simplereaderd set this database up?)\n", t->name, sqlite3_errmsg(db));
+                rc = SQLITE_ERROR;
+                free(line);
+                break;
+            }
+        }
+
+        sqlite3_stmt *st = stmts[f][ti];
+        sqlite3_bind_text(st, 1, line, -1, SQLITE_STATIC);
+        sqlite3_bind_text(st, 2, remapped(&m, fileId), -1, SQLITE_STATIC);
+        if (sqlite3_step(st) != SQLITE_DONE) {
+            fprintf(stderr, "%s:%zu: %s\n", path, lineno, sqlite3_errmsg(db));
+            ++failed;
+        } else {
+            ++imported;
+            if (ti == 0 && sqlite3_changes(db) == 0)
+                note_book(db, line, fileId, &m);
+        }
+        sqlite3_reset(st);
+        free(line);
+
+        if (++pending == BATCH_ROWS) {
+            for (size_t i = 0; i < nfiles && rc == SQLITE_OK; ++i)
+                if ((rc = exec(files[i], "COMMIT;")) == SQLITE_OK)
+                    rc = exec(files[i], "BEGIN IMMEDIATE;");
+            pending = 0;
+        }
+    }
+
+    for (size_t i = 0; i < nfiles; ++i) {
+        for (size_t t = 0; t < TABLE_COUNT; ++t)
+            sqlite3_finalize(stmts[i][t]);
+        if (rc == SQLITE_OK)
+            rc = exec(files[i], "COMMIT;");
+        else
+            sqlite3_exec(files[i], "ROLLBACK;", NULL, NULL, NULL);
+    }
+    sqlite3_finalize(head);
+    store_close(&s);
+    free(m.from);
+    free(m.to);
+    if (in != stdin) fclose(in);
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "import stopped at line %zu: the last batch was rolled back\n", lineno);
+        return 1;
+    }
+    printf("%zu row(s) imported into %s", imported, DB_PATH);
+    if (s.shards) printf(" and its %d shards", s.shards);
+    if (failed) printf(", %zu line(s) skipped", failed);
+    printf("; restart simplereaderd to pick them up\n");
+    return failed ? 1 : 0;
+}
+
+static int usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s <username> <password>\n"
+            "       %s --bulk <file|-> [--threads N]    (lines of username,password or {\"username\":...,\"password\":...})\n"
+            "       %s --export <username>... > users.jsonl\n"
+            "       %s --import <file|->\n",
+            argv0, argv0, argv0, argv0);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3)
+        return usage(argv[0]);
+
+    if (sodium_init() < 0) {
+        fprintf(stderr, "libsodium init failed\n");
+        return 1;
+    }
+
+    if (strcmp(argv[1], "--bulk") == 0) {
+        int threads = 0;
+        if (argc == 5 && strcmp(argv[3], "--threads") == 0)
+            threads = atoi(argv[4]);
+        else if (argc != 3)
+            return usage(argv[0]);
+        return bulk_add(argv[2], threads);
+    }
+    if (strcmp(argv[1], "--export") == 0)
+        return export_users(argc - 2, argv + 2);
+    if (strcmp(argv[1], "--import") == 0)
+        return argc == 3 ? import_rows(argv[2]) : usage(argv[0]);
+
+    if (argc != 3 || argv[1][0] == '-')
+        return usage(argv[0]);
+    return add_one(argv[1], argv[2]);
+}